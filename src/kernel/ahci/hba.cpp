@@ -1,48 +1,54 @@
+#include <stddef.h>
 #include <stdint.h>
+#include "kutil/register.h"
 #include "ahci/hba.h"
 #include "log.h"
 #include "page_manager.h"
 #include "pci.h"
 
-
-IS_BITFIELD(ahci::hba_cap);
-IS_BITFIELD(ahci::hba_cap2);
-
 namespace ahci {
 
-
-enum class hba_cap : uint32_t
-{
-	ccc			= 0x00000080,	// Command completion coalescing
-	ahci_only	= 0x00040000,	// ACHI-only mode
-	clo			= 0x01000000,	// Command list override
-	snotify		= 0x40000000,	// SNotification register
-	ncq			= 0x40000000,	// Native command queuing
-	addr64		= 0x80000000	// 64bit addressing
-};
+using kutil::mmio_reg;
+using kutil::reg_field;
+using kutil::reg_flag;
+
+
+/// Fields of the HBA capabilities register (CAP)
+namespace hba_cap {
+	constexpr reg_field<uint32_t, 0, 5> ports {};       // Number of ports - 1
+	constexpr reg_flag<uint32_t, 7> ccc {};             // Command completion coalescing
+	constexpr reg_field<uint32_t, 8, 5> slots {};       // Command slots per port - 1
+	constexpr reg_flag<uint32_t, 18> ahci_only {};      // ACHI-only mode
+	constexpr reg_flag<uint32_t, 24> clo {};            // Command list override
+	constexpr reg_flag<uint32_t, 29> snotify {};        // SNotification register
+	constexpr reg_flag<uint32_t, 30> ncq {};            // Native command queuing
+	constexpr reg_flag<uint32_t, 31> addr64 {};         // 64bit addressing
+}
 
 
-enum class hba_cap2 : uint32_t
-{
-	handoff		= 0x00000001	// BIOS OS hand-off
-};
+/// Fields of the extended HBA capabilities register (CAP2)
+namespace hba_cap2 {
+	constexpr reg_flag<uint32_t, 0> handoff {};         // BIOS OS hand-off
+}
 
 
 struct hba_data
 {
-	hba_cap cap;
-	uint32_t host_control;
-	uint32_t int_status;
-	uint32_t port_impl;
-	uint32_t version;
-	uint32_t ccc_control;
-	uint32_t ccc_ports;
-	uint32_t em_location;
-	uint32_t em_control;
-	hba_cap2 cap2;
-	uint32_t handoff_control;
+	mmio_reg<uint32_t> cap;
+	mmio_reg<uint32_t> host_control;
+	mmio_reg<uint32_t> int_status;
+	mmio_reg<uint32_t> port_impl;
+	mmio_reg<uint32_t> version;
+	mmio_reg<uint32_t> ccc_control;
+	mmio_reg<uint32_t> ccc_ports;
+	mmio_reg<uint32_t> em_location;
+	mmio_reg<uint32_t> em_control;
+	mmio_reg<uint32_t> cap2;
+	mmio_reg<uint32_t> handoff_control;
+};
 
-} __attribute__ ((packed));
+static_assert(offsetof(hba_data, handoff_control) == 0x28,
+		"AHCI HBA registers are at the wrong offsets");
 
 
 hba::hba(pci_device *device)
@@ -53,10 +59,9 @@ hba::hba(pci_device *device)
 	m_data = reinterpret_cast<hba_data *>(bar5 & ~0xfffull);
 	pm->map_offset_pointer(reinterpret_cast<void **>(&m_data), 0x2000);
 
-	uint32_t icap = static_cast<uint32_t>(m_data->cap);
-
-	unsigned ports = (icap & 0xf) + 1;
-	unsigned slots = ((icap >> 8) & 0x1f) + 1;
+	uint32_t cap = m_data->cap.read();
+	unsigned ports = hba_cap::ports.decode(cap) + 1;
+	unsigned slots = hba_cap::slots.decode(cap) + 1;
 
 	log::debug(logs::driver, "  %d ports", ports);
 	log::debug(logs::driver, "  %d command slots", slots);
@@ -64,9 +69,11 @@ hba::hba(pci_device *device)
 	port_data *pd = reinterpret_cast<port_data *>(
 			kutil::offset_pointer(m_data, 0x100));
 
+	uint32_t port_impl = m_data->port_impl.read();
+
 	m_ports.ensure_capacity(ports);
 	for (unsigned i = 0; i < ports; ++i) {
-		bool impl = ((m_data->port_impl & (1 << i)) != 0);
+		bool impl = ((port_impl & (1 << i)) != 0);
 		port &p = m_ports.emplace(i, kutil::offset_pointer(pd, 0x80 * i), impl);
 		if (p.get_state() == port::state::active)
 			p.read(1, 0x1000);
@@ -9,8 +9,6 @@ class pci_device;
 
 namespace ahci {
 
-enum class hba_cap : uint32_t;
-enum class hba_cap2 : uint32_t;
 struct hba_data;
 
 
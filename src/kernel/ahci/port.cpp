@@ -1,6 +1,6 @@
 #include <algorithm>
 #include "kutil/assert.h"
-#include "kutil/enum_bitfields.h"
+#include "kutil/register.h"
 #include "ahci/ata.h"
 #include "ahci/fis.h"
 #include "ahci/port.h"
@@ -9,10 +9,12 @@
 #include "log.h"
 #include "page_manager.h"
 
-IS_BITFIELD(ahci::port_cmd);
-
 namespace ahci {
 
+using kutil::mmio_reg;
+using kutil::reg_field;
+using kutil::reg_flag;
+
 const unsigned max_prd_count = 16;
 
 
@@ -63,18 +65,35 @@ struct cmd_table
 } __attribute__ ((packed));
 
 
-enum class port_cmd : uint32_t
-{
-	start			= 0x00000001,
-	spinup			= 0x00000002,
-	poweron			= 0x00000004,
-	clo				= 0x00000008,
-	fis_recv		= 0x00000010,
-	fisr_running	= 0x00004000,
-	cmds_running	= 0x00008000,
-
-	none			= 0x00000000
-};
+/// Fields of the port command and status register (PxCMD)
+namespace port_cmd {
+	constexpr reg_flag<uint32_t, 0> start {};
+	constexpr reg_flag<uint32_t, 1> spinup {};
+	constexpr reg_flag<uint32_t, 2> poweron {};
+	constexpr reg_flag<uint32_t, 3> clo {};
+	constexpr reg_flag<uint32_t, 4> fis_recv {};
+	constexpr reg_flag<uint32_t, 14> fisr_running {};
+	constexpr reg_flag<uint32_t, 15> cmds_running {};
+}
+
+/// Fields of the task file data register (PxTFD)
+namespace port_tfd {
+	constexpr reg_flag<uint32_t, 0> error {};
+	constexpr reg_flag<uint32_t, 3> drq {};
+	constexpr reg_flag<uint32_t, 7> busy {};
+	constexpr reg_field<uint32_t, 8, 8, uint8_t> error_code {};
+}
+
+/// Fields of the SATA status register (PxSSTS)
+namespace port_ssts {
+	constexpr reg_field<uint32_t, 0, 4, uint8_t> detect {};
+	constexpr reg_field<uint32_t, 8, 4, uint8_t> power {};
+}
+
+/// Fields of the interrupt status register (PxIS)
+namespace port_is {
+	constexpr reg_flag<uint32_t, 30> task_file_error {};
+}
 
 enum class sata_signature : uint32_t
 {
@@ -87,36 +106,35 @@ enum class sata_signature : uint32_t
 
 struct port_data
 {
-	uint32_t cmd_base_low;
-	uint32_t cmd_base_high;
-	uint32_t fis_base_low;
-	uint32_t fis_base_high;
+	mmio_reg<uint32_t> cmd_base_low;
+	mmio_reg<uint32_t> cmd_base_high;
+	mmio_reg<uint32_t> fis_base_low;
+	mmio_reg<uint32_t> fis_base_high;
 
-	uint32_t interrupt_status;
-	uint32_t interrupt_enable;
+	mmio_reg<uint32_t> interrupt_status;
+	mmio_reg<uint32_t> interrupt_enable;
 
-	port_cmd command;
+	mmio_reg<uint32_t> command;
 
 	uint32_t reserved0;
 
-	uint8_t task_file_status;
-	uint8_t task_file_error;
-	uint16_t reserved1;
-
-	sata_signature signature;
+	mmio_reg<uint32_t> task_file;
+	mmio_reg<uint32_t> signature;
 
-	uint32_t serial_status;
-	uint32_t serial_control;
-	uint32_t serial_error;
-	uint32_t serial_active;
-	uint32_t cmd_issue;
-	uint32_t serial_notify;
-	uint32_t fis_switching;
-	uint32_t dev_sleep;
+	mmio_reg<uint32_t> serial_status;
+	mmio_reg<uint32_t> serial_control;
+	mmio_reg<uint32_t> serial_error;
+	mmio_reg<uint32_t> serial_active;
+	mmio_reg<uint32_t> cmd_issue;
+	mmio_reg<uint32_t> serial_notify;
+	mmio_reg<uint32_t> fis_switching;
+	mmio_reg<uint32_t> dev_sleep;
 
 	uint8_t reserved2[40];
 	uint8_t vendor[16];
-} __attribute__ ((packed));
+};
+
+static_assert(sizeof(port_data) == 0x80, "AHCI port registers are the wrong size");
 
 
 port::port(uint8_t index, port_data *data, bool impl) :
@@ -148,15 +166,17 @@ port::update()
 {
 	if (m_state == state::unimpl) return;
 
-	uint32_t detected = m_data->serial_status & 0x0f;
-	uint32_t power = (m_data->serial_status >> 8) & 0x0f;
+	uint32_t status = m_data->serial_status.read();
+	uint8_t detected = port_ssts::detect.decode(status);
+	uint8_t power = port_ssts::power.decode(status);
 
 	if (detected == 0x3 && power == 0x1) {
 		m_state = state::active;
 
+		sata_signature sig = static_cast<sata_signature>(m_data->signature.read());
 		const char *name =
-			m_data->signature == sata_signature::sata_drive ? "SATA" :
-			m_data->signature == sata_signature::satapi_drive ? "SATAPI" :
+			sig == sata_signature::sata_drive ? "SATA" :
+			sig == sata_signature::satapi_drive ? "SATAPI" :
 			"Other";
 
 		log::info(logs::driver, "Found device type %s at port %d", name, m_index);
@@ -168,36 +188,37 @@ port::update()
 bool
 port::busy()
 {
-	return (m_data->task_file_status & 0x88) != 0;
+	return !m_data->task_file.test(port_tfd::busy(false) | port_tfd::drq(false));
 }
 
 void
 port::start_commands()
 {
-	while (bitfield_has(m_data->command, port_cmd::cmds_running))
+	while (m_data->command.get(port_cmd::cmds_running))
 		io_wait();
 
-	m_data->command |= port_cmd::fis_recv;
-	m_data->command |= port_cmd::start;
+	// FIS receive must be enabled before the port is started
+	m_data->command.set(port_cmd::fis_recv, true);
+	m_data->command.set(port_cmd::start, true);
 }
 
 void
 port::stop_commands()
 {
-	m_data->command &= ~port_cmd::start;
+	m_data->command.set(port_cmd::start, false);
 
-	while (
-		bitfield_has(m_data->command, port_cmd::cmds_running) ||
-		bitfield_has(m_data->command, port_cmd::fisr_running))
+	while (!m_data->command.test(
+			port_cmd::cmds_running(false) |
+			port_cmd::fisr_running(false)))
 		io_wait();
 
-	m_data->command &= ~port_cmd::fis_recv;
+	m_data->command.set(port_cmd::fis_recv, false);
 }
 
 bool
 port::read(uint64_t sector, size_t length)
 {
-	m_data->interrupt_status = ~0u;
+	m_data->interrupt_status.write(~0u);
 
 	int slot = get_cmd_slot();
 	if (slot < 0) {
@@ -255,7 +276,7 @@ port::read(uint64_t sector, size_t length)
 	fis->count0 = (count     ) & 0xff;
 	fis->count1 = (count >> 8) & 0xff;
 
-	log::debug(logs::driver, "Reading %d sectors, starting from %d (0x%lx), using %d PRD entries.",
+	log::debug(logs::driver, "Reading %lu sectors, starting from %lu (0x%lx), using %d PRD entries.",
 			count, sector, sector*512, ent.prd_table_length);
 	log::debug(logs::driver, "  lba: %02x %02x %02x %02x %02x %02x",
 			fis->lba0, fis->lba1, fis->lba2, fis->lba3, fis->lba4, fis->lba5);
@@ -277,12 +298,12 @@ port::read(uint64_t sector, size_t length)
 
 	// Set bit in CI. Note that only new bits should be written, not
 	// previous state.
-	m_data->cmd_issue = (1 << slot);
+	m_data->cmd_issue.write(1 << slot);
 
 	// TODO: interrupt-based
 	while (true) {
-		if ((m_data->cmd_issue & (1 << slot)) == 0) break;
-		if (m_data->interrupt_status & 0x40000000) {
+		if ((m_data->cmd_issue.read() & (1 << slot)) == 0) break;
+		if (m_data->interrupt_status.get(port_is::task_file_error)) {
 			log::error(logs::driver, "AHCI task file error");
 			// TODO: clean up!
 			return false;
@@ -290,14 +311,14 @@ port::read(uint64_t sector, size_t length)
 		io_wait();
 	}
 
-	if (m_data->interrupt_status & 0x40000000) {
+	if (m_data->interrupt_status.get(port_is::task_file_error)) {
 		log::error(logs::driver, "AHCI task file error");
 		// TODO: clean up!
 		return false;
 	}
 
-	log::warn(logs::driver, "AHCI read status: %08lx  %08lx",
-			m_data->interrupt_status, m_data->serial_error);
+	log::warn(logs::driver, "AHCI read status: %08x  %08x",
+			m_data->interrupt_status.read(), m_data->serial_error.read());
 
 	console *cons = console::get();
 	uint8_t *p = (uint8_t *)buffers[0];
@@ -325,14 +346,14 @@ port::rebase()
 	void *mem = pm->map_offset_pages(pages);
 	addr_t phys = pm->offset_phys(mem);
 
-	log::debug(logs::driver, "Rebasing address for AHCI port %d to %lx [%d]", m_index, mem, pages);
+	log::debug(logs::driver, "Rebasing address for AHCI port %d to %p [%lu]", m_index, mem, pages);
 
 	stop_commands();
 
 	// Command list
 	m_cmd_list = reinterpret_cast<cmd_list_entry *>(mem);
-	m_data->cmd_base_low = phys & 0xffffffff;
-	m_data->cmd_base_high = phys >> 32;
+	m_data->cmd_base_low.write(phys & 0xffffffff);
+	m_data->cmd_base_high.write(phys >> 32);
 	kutil::memset(mem, 0, 1024);
 
 	mem = kutil::offset_pointer(mem, 32 * sizeof(cmd_list_entry));
@@ -340,8 +361,8 @@ port::rebase()
 
 	// FIS
 	m_fis = mem;
-	m_data->fis_base_low = phys & 0xffffffff;
-	m_data->fis_base_high = phys >> 32;
+	m_data->fis_base_low.write(phys & 0xffffffff);
+	m_data->fis_base_high.write(phys >> 32);
 	kutil::memset(mem, 0, 256);
 
 	mem = page_align(kutil::offset_pointer(mem, 256));
@@ -371,7 +392,7 @@ port::rebase()
 int
 port::get_cmd_slot()
 {
-	uint32_t used = (m_data->serial_active | m_data->cmd_issue);
+	uint32_t used = m_data->serial_active.read() | m_data->cmd_issue.read();
 	for (int i = 0; i < 32; ++i)
 		if ((used & (1 << i)) == 0) return i;
 
@@ -8,7 +8,6 @@ namespace ahci {
 
 struct cmd_list_entry;
 struct cmd_table;
-enum class port_cmd : uint32_t;
 struct port_data;
 
 
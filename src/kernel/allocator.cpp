@@ -1,9 +1,135 @@
+#include "kutil/heap_cache.h"
+#include "kutil/heap_stats.h"
 #include "kutil/memory_manager.h"
+#include "kutil/spinlock.h"
+#include "allocator.h"
+#include "cpu.h"
+#include "log.h"
 
 kutil::memory_manager g_kernel_memory_manager;
+kutil::heap_cache g_kernel_heap_caches[max_cpus];
 
-// kutil malloc/free implementation
+#ifdef KUTIL_HEAP_DEBUG
+kutil::spinlock g_kernel_heap_tracker_lock;
+kutil::heap_tracker g_kernel_heap_tracker;
+#endif
+
+void
+heap_caches_init(kutil::memory_manager *mm)
+{
+	for (kutil::heap_cache &cache : g_kernel_heap_caches)
+		new (&cache) kutil::heap_cache(mm);
+}
+
+kutil::heap_cache &
+current_heap_cache()
+{
+	return g_kernel_heap_caches[current_cpu()];
+}
+
+// kutil malloc/free/realloc implementation
 namespace kutil {
-	void * malloc(size_t n) { return g_kernel_memory_manager.allocate(n); }
-	void free(void *p) { g_kernel_memory_manager.free(p); }
+	void * malloc(size_t n)
+	{
+		void *p = nullptr;
+		{
+			// Stay on this CPU's cache, and keep interrupt handlers on
+			// this CPU out of it, until the allocation is done
+			irq_guard irqs;
+			p = current_heap_cache().allocate(n);
+		}
+#ifdef KUTIL_HEAP_DEBUG
+		spinlock_irq_guard guard(g_kernel_heap_tracker_lock);
+		g_kernel_heap_tracker.add(p, n,
+				__builtin_return_address(0),
+				__builtin_return_address(1));
+#endif
+		return p;
+	}
+
+	void free(void *p)
+	{
+#ifdef KUTIL_HEAP_DEBUG
+		{
+			spinlock_irq_guard guard(g_kernel_heap_tracker_lock);
+			g_kernel_heap_tracker.remove(p);
+		}
+#endif
+		irq_guard irqs;
+		current_heap_cache().free(p);
+	}
+
+	void * realloc(void *p, size_t n)
+	{
+		void *moved = g_kernel_memory_manager.reallocate(p, n);
+#ifdef KUTIL_HEAP_DEBUG
+		spinlock_irq_guard guard(g_kernel_heap_tracker_lock);
+		g_kernel_heap_tracker.remove(p);
+		g_kernel_heap_tracker.add(moved, n,
+				__builtin_return_address(0),
+				__builtin_return_address(1));
+#endif
+		return moved;
+	}
+}
+
+void
+heap_trim()
+{
+	size_t released = g_kernel_memory_manager.trim_if_wanted();
+	if (released)
+		log::info(logs::memory, "Gave back %lu KiB of kernel heap.", released / 1024);
+}
+
+void
+heap_dump()
+{
+#ifdef KUTIL_HEAP_STATS
+	// The counters may move while they're copied, but each is read whole
+	kutil::heap_stats stats = g_kernel_memory_manager.stats();
+
+	// These are the shared memory_manager's numbers. Small blocks reach it
+	// in batches as the per-CPU caches refill and drain, and blocks parked
+	// in the caches count as in use.
+	size_t cached = 0;
+	for (const kutil::heap_cache &cache : g_kernel_heap_caches)
+		cached += cache.cached();
+
+	log::info(logs::memory, "Kernel heap backend: %zu KiB in use, %zu KiB peak, %zu blocks in CPU caches",
+			stats.bytes_in_use / 1024, stats.peak_bytes / 1024, cached);
+	log::info(logs::memory, "  grown %zu times (%zu KiB), shrunk %zu times (%zu KiB), %zu failures",
+			stats.grows, stats.grown_bytes / 1024,
+			stats.shrinks, stats.shrunk_bytes / 1024,
+			stats.failures);
+
+	for (unsigned i = 0; i < kutil::heap_stats::num_orders; ++i) {
+		if (!stats.allocs[i]) continue;
+		log::info(logs::memory, "  %6d byte blocks: %8zu allocs %8zu frees",
+				1 << i, stats.allocs[i], stats.frees[i]);
+	}
+	log::info(logs::memory, "  large allocations: %8zu allocs %8zu frees",
+			stats.large_allocs, stats.large_frees);
+#endif
+
+#ifdef KUTIL_LOCK_STATS
+	auto lock_dump = [](const char *name, const kutil::lock_stats &locks) {
+		log::info(logs::memory, "  %s: %lu acquires, %lu contended, %lu spins, %lu cycles held (max %lu)",
+				name, locks.acquires, locks.contended, locks.spins,
+				locks.hold_cycles, locks.max_hold);
+	};
+	log::info(logs::memory, "Kernel heap locks:");
+	lock_dump("free lists", g_kernel_memory_manager.list_lock_stats());
+	lock_dump("heap", g_kernel_memory_manager.heap_lock_stats());
+#endif
+
+#ifdef KUTIL_HEAP_DEBUG
+	kutil::spinlock_irq_guard guard(g_kernel_heap_tracker_lock);
+	log::info(logs::memory, "Kernel heap: %zu live allocations tracked, %zu untracked",
+			g_kernel_heap_tracker.count(), g_kernel_heap_tracker.dropped());
+
+	g_kernel_heap_tracker.for_each([](const kutil::heap_tracker::entry &e) {
+		log::info(logs::memory, "  %p %6zu bytes from %p <- %p",
+				e.pointer, e.length, e.callers[0], e.callers[1]);
+	});
+#endif
 }
@@ -0,0 +1,28 @@
+#pragma once
+/// \file allocator.h
+/// The kernel heap that backs kutil::malloc and friends.
+
+namespace kutil {
+	class heap_cache;
+	class memory_manager;
+}
+
+/// Set up each CPU's heap cache in front of the kernel heap.
+/// \arg mm  The kernel heap's memory manager
+void heap_caches_init(kutil::memory_manager *mm);
+
+/// Get the heap cache of the CPU this is running on. Interrupts must stay
+/// disabled while it is used, so nothing else on this CPU can use it too.
+/// \returns  The current CPU's heap cache
+kutil::heap_cache & current_heap_cache();
+
+/// Give free kernel heap memory back to the page manager, if frees have
+/// left more of it than the trim threshold. Freeing never does this by
+/// itself, as it may happen in an interrupt handler or during a page table
+/// edit. Only call this where the page manager is not in use.
+void heap_trim();
+
+/// Log the kernel heap's counters when built with `KUTIL_HEAP_STATS`, and
+/// its live allocations with their call sites when built with
+/// `KUTIL_HEAP_DEBUG`.
+void heap_dump();
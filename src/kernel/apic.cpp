@@ -1,52 +1,96 @@
 #include "kutil/assert.h"
+#include "kutil/register.h"
 #include "apic.h"
 #include "interrupts.h"
 #include "log.h"
 #include "page_manager.h"
 
+using kutil::reg_field;
+using kutil::reg_flag;
 
-static uint32_t
-apic_read(uint32_t volatile *apic, uint16_t offset)
+
+/// Offsets of local APIC registers
+enum class lapic_reg : uint16_t
 {
-	return *(apic + offset/sizeof(uint32_t));
+	spurious    = 0x0f0,
+	lvt_timer   = 0x320,
+	lvt_lint0   = 0x350,
+	lvt_lint1   = 0x360,
+	timer_count = 0x380,
+	timer_div   = 0x3e0
+};
+
+/// Fields of the spurious interrupt vector register
+namespace spurious {
+	constexpr reg_field<uint32_t, 0, 8, uint8_t> vector {};
+	constexpr reg_flag<uint32_t, 8> enable {};
 }
 
-static void
-apic_write(uint32_t volatile *apic, uint16_t offset, uint32_t value)
+/// Fields of local vector table entries, which are also the low half of
+/// I/O APIC redirection entries
+namespace lvt {
+	constexpr reg_field<uint32_t, 0, 8, uint8_t> vector {};
+	constexpr reg_flag<uint32_t, 11> logical {};
+	constexpr reg_flag<uint32_t, 13> active_low {};
+	constexpr reg_flag<uint32_t, 15> level {};
+	constexpr reg_flag<uint32_t, 16> masked {};
+	constexpr reg_flag<uint32_t, 17> periodic {};
+}
+
+/// Fields of the high half of I/O APIC redirection entries
+namespace redir_high {
+	constexpr reg_field<uint32_t, 24, 8, uint8_t> dest {};
+}
+
+/// The I/O APIC's indirect register window
+struct ioapic_regs
 {
-	*(apic + offset/sizeof(uint32_t)) = value;
+	kutil::mmio_reg<uint32_t> select;
+	uint32_t reserved[3];
+	kutil::mmio_reg<uint32_t> window;
+};
+
+static kutil::mmio_reg<uint32_t> &
+apic_reg(uint32_t *apic, lapic_reg reg)
+{
+	return kutil::mmio_at<uint32_t>(apic, static_cast<uint16_t>(reg));
 }
 
 static uint32_t
-ioapic_read(uint32_t volatile *base, uint8_t reg)
+ioapic_read(uint32_t *base, uint8_t reg)
 {
-	*base = reg;
-	return *(base + 4);
+	ioapic_regs *regs = reinterpret_cast<ioapic_regs *>(base);
+	regs->select.write(reg);
+	return regs->window.read();
 }
 
 static void
-ioapic_write(uint32_t volatile *base, uint8_t reg, uint32_t value)
+ioapic_write(uint32_t *base, uint8_t reg, uint32_t value)
 {
-	*base = reg;
-	*(base + 4) = value;
+	ioapic_regs *regs = reinterpret_cast<ioapic_regs *>(base);
+	regs->select.write(reg);
+	regs->window.write(value);
 }
 
 apic::apic(uint32_t *base) :
 	m_base(base)
 {
 	// Map 1MiB of space for the APIC registers and
-	// MSI area
+	// MSI area, as one large page
 	page_manager::get()->map_offset_pointer(
 			reinterpret_cast<void **>(&m_base),
-			0x100000);
+			0x100000,
+			page_flags::kernel_mmio,
+			page_size_policy::force_large);
 }
 
 
 lapic::lapic(uint32_t *base, isr spurious) :
 	apic(base)
 {
-	apic_write(m_base, 0xf0, static_cast<uint32_t>(spurious));
-	log::info(logs::apic, "LAPIC created, base %lx", m_base);
+	apic_reg(m_base, lapic_reg::spurious).write(
+			spurious::vector(static_cast<uint8_t>(spurious)));
+	log::info(logs::apic, "LAPIC created, base %p", m_base);
 }
 
 void
@@ -65,15 +109,13 @@ lapic::enable_timer(isr vector, uint8_t divisor, uint32_t count, bool repeat)
 		kassert(0, "Invalid divisor passed to lapic::enable_timer");
 	}
 
-	apic_write(m_base, 0x3e0, divisor);
-	apic_write(m_base, 0x380, count);
+	apic_reg(m_base, lapic_reg::timer_div).write(divisor);
+	apic_reg(m_base, lapic_reg::timer_count).write(count);
 
-	uint32_t lvte = static_cast<uint8_t>(vector);
-	if (repeat)
-		lvte |= 0x20000;
-
-	log::debug(logs::apic, "Enabling APIC timer with isr %d.", vector);
-	apic_write(m_base, 0x320, lvte);
+	log::debug(logs::apic, "Enabling APIC timer with isr %d.", static_cast<int>(vector));
+	apic_reg(m_base, lapic_reg::lvt_timer).write(
+			lvt::vector(static_cast<uint8_t>(vector)) |
+			lvt::periodic(repeat));
 }
 
 void
@@ -81,20 +123,17 @@ lapic::enable_lint(uint8_t num, isr vector, bool nmi, uint16_t flags)
 {
 	kassert(num == 0 || num == 1, "Invalid LINT passed to lapic::enable_lint.");
 
-	uint16_t off = num ? 0x360 : 0x350;
-	uint32_t lvte = static_cast<uint8_t>(vector);
+	lapic_reg reg = num ? lapic_reg::lvt_lint1 : lapic_reg::lvt_lint0;
 
 	uint16_t polarity = flags & 0x3;
-	if (polarity == 3)
-		lvte |= (1 << 13);
-
 	uint16_t trigger = (flags >> 2) & 0x3;
-	if (trigger == 3)
-		lvte |= (1 << 15);
 
-	apic_write(m_base, off, lvte);
+	apic_reg(m_base, reg).write(
+			lvt::vector(static_cast<uint8_t>(vector)) |
+			lvt::active_low(polarity == 3) |
+			lvt::level(trigger == 3));
 	log::debug(logs::apic, "APIC LINT%d enabled as %s %d %s-triggered, active %s.",
-			num, nmi ? "NMI" : "ISR", vector,
+			num, nmi ? "NMI" : "ISR", static_cast<int>(vector),
 			polarity == 3 ? "level" : "edge",
 			trigger == 3 ? "low" : "high");
 }
@@ -102,16 +141,14 @@ lapic::enable_lint(uint8_t num, isr vector, bool nmi, uint16_t flags)
 void
 lapic::enable()
 {
-	apic_write(m_base, 0xf0,
-			apic_read(m_base, 0xf0) | 0x100);
+	apic_reg(m_base, lapic_reg::spurious).set(spurious::enable, true);
 	log::debug(logs::apic, "LAPIC enabled!");
 }
 
 void
 lapic::disable()
 {
-	apic_write(m_base, 0xf0,
-			apic_read(m_base, 0xf0) & ~0x100);
+	apic_reg(m_base, lapic_reg::spurious).set(spurious::enable, false);
 	log::debug(logs::apic, "LAPIC disabled.");
 }
 
@@ -139,32 +176,24 @@ ioapic::ioapic(uint32_t *base, uint32_t base_gsi) :
 void
 ioapic::redirect(uint8_t irq, isr vector, uint16_t flags, bool masked)
 {
-	uint64_t entry = static_cast<uint64_t>(vector);
-
 	uint16_t polarity = flags & 0x3;
-	if (polarity == 3)
-		entry |= (1 << 13);
-
 	uint16_t trigger = (flags >> 2) & 0x3;
-	if (trigger == 3)
-		entry |= (1 << 15);
 
-	if (masked)
-		entry |= (1 << 16);
+	auto entry =
+		lvt::vector(static_cast<uint8_t>(vector)) |
+		lvt::active_low(polarity == 3) |
+		lvt::level(trigger == 3) |
+		lvt::masked(masked);
 
-	ioapic_write(m_base, (2 * irq) + 0x10, static_cast<uint32_t>(entry & 0xffffffff));
-	ioapic_write(m_base, (2 * irq) + 0x11, static_cast<uint32_t>(entry >> 32));
+	ioapic_write(m_base, (2 * irq) + 0x10, entry.bits);
+	ioapic_write(m_base, (2 * irq) + 0x11, 0);
 }
 
 void
 ioapic::mask(uint8_t irq, bool masked)
 {
 	uint32_t entry = ioapic_read(m_base, (2 * irq) + 0x10);
-	if (masked)
-		entry |= (1 << 16);
-	else
-		entry &= ~(1 << 16);
-
+	entry = (entry & ~lvt::masked.mask) | lvt::masked.encode(masked);
 	ioapic_write(m_base, (2 * irq) + 0x10, entry);
 }
 
@@ -174,18 +203,16 @@ ioapic::dump_redirs() const
 	log::debug(logs::apic, "IOAPIC %d redirections:", m_id);
 
 	for (uint8_t i = 0; i < m_num_gsi; ++i) {
-		uint64_t low = ioapic_read(m_base, 0x10 + (2 *i));
-		uint64_t high = ioapic_read(m_base, 0x10 + (2 *i));
-		uint64_t redir = low | (high << 32);
-		if (redir == 0) continue;
-
-		uint8_t vector = redir & 0xff;
-		uint8_t mode = (redir >> 8) & 0x7;
-		uint8_t dest_mode = (redir >> 11) & 0x1;
-		uint8_t polarity = (redir >> 13) & 0x1;
-		uint8_t trigger = (redir >> 15) & 0x1;
-		uint8_t mask = (redir >> 16) & 0x1;
-		uint8_t dest = (redir >> 56) & 0xff;
+		uint32_t low = ioapic_read(m_base, 0x10 + (2 *i));
+		uint32_t high = ioapic_read(m_base, 0x11 + (2 *i));
+		if (low == 0 && high == 0) continue;
+
+		uint8_t vector = lvt::vector.decode(low);
+		uint8_t dest_mode = lvt::logical.decode(low);
+		uint8_t polarity = lvt::active_low.decode(low);
+		uint8_t trigger = lvt::level.decode(low);
+		uint8_t mask = lvt::masked.decode(low);
+		uint8_t dest = redir_high::dest.decode(high);
 
 		log::debug(logs::apic, "  %2d: vec %3d %s active, %s-triggered %s dest %d: %x",
 				m_base_gsi + i, vector,
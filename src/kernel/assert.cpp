@@ -7,12 +7,7 @@ __kernel_assert(const char *file, unsigned line, const char *message)
 	console *cons = console::get();
 	if (cons) {
 		cons->set_color(9 , 0);
-		cons->puts("\n\n  ERROR: ");
-		cons->puts(file);
-		cons->puts(":");
-		cons->put_dec(line);
-		cons->puts(":  ");
-		cons->puts(message);
+		cons->printf("\n\n  ERROR: %s:%u:  %s", file, line, message);
 	}
 
 	__asm__ __volatile__( 
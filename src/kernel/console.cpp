@@ -1,4 +1,5 @@
 #include "kutil/coord.h"
+#include "kutil/format.h"
 #include "kutil/memory.h"
 #include "console.h"
 #include "font.h"
@@ -7,7 +8,6 @@
 #include "serial.h"
 
 
-const char digits[] = "0123456789abcdef";
 console g_console;
 
 
@@ -113,21 +113,21 @@ public:
 		}
 	}
 
+	/// Scroll the text buffer. The screen itself is left for the caller
+	/// to repaint, unless there is no buffer to repaint it from.
 	void scroll(unsigned lines)
 	{
 		if (!m_data) {
 			m_pos.x = 0;
 			m_pos.y = 0;
+			m_screen->fill(m_bg);
 		} else {
 			unsigned bytes = lines * m_size.x;
-			char *line = line_pointer(0);
-			for (unsigned i = 0; i < bytes; ++i)
-				*line++ = 0;
+			kutil::memset(line_pointer(0), 0, bytes);
 
 			m_first = (m_first + lines) % m_size.y;
 			m_pos.y -= lines;
 		}
-		repaint();
 	}
 
 	void set_color(uint8_t fg, uint8_t bg)
@@ -137,47 +137,59 @@ public:
 		m_attr = (bg << 8) | fg;
 	}
 
-	void putc(char c)
-	{
-		char *line = line_pointer(m_pos.y);
-		uint16_t *attrs = attr_pointer(m_pos.y);
-
+	void putc(char c) { write(&c, 1); }
 
-		switch (c) {
-		case '\t':
-			m_pos.x = (m_pos.x + 4) / 4 * 4;
-			break;
-
-		case '\r':
-			m_pos.x = 0;
-			break;
+	/// Write a run of characters. Once the text scrolls, glyphs are only
+	/// stored in the buffer, and the screen is repainted once at the end.
+	void write(const char *text, size_t length)
+	{
+		bool scrolled = false;
 
-		case '\n':
-			m_pos.x = 0;
-			m_pos.y++;
-			break;
+		while (length--) {
+			const char c = *text++;
+			char *line = line_pointer(m_pos.y);
+			uint16_t *attrs = attr_pointer(m_pos.y);
 
-		default: {
-				if (line) line[m_pos.x] = c;
-				if (attrs) attrs[m_pos.x] = m_attr;
+			switch (c) {
+			case '\t':
+				m_pos.x = (m_pos.x + 4) / 4 * 4;
+				break;
+
+			case '\r':
+				m_pos.x = 0;
+				break;
+
+			case '\n':
+				m_pos.x = 0;
+				m_pos.y++;
+				break;
+
+			default: {
+					if (line) line[m_pos.x] = c;
+					if (attrs) attrs[m_pos.x] = m_attr;
+
+					if (!scrolled) {
+						const unsigned x = m_pos.x * m_font->width();
+						const unsigned y = m_pos.y * m_font->height();
+						m_font->draw_glyph(m_screen, c, m_fg, m_bg, x, y);
+					}
 
-				const unsigned x = m_pos.x * m_font->width();
-				const unsigned y = m_pos.y * m_font->height();
-				m_font->draw_glyph(m_screen, c, m_fg, m_bg, x, y);
+					m_pos.x++;
+				}
+			}
 
-				m_pos.x++;
+			if (m_pos.x >= m_size.x) {
+				m_pos.x = m_pos.x % m_size.x;
+				m_pos.y++;
 			}
-		}
 
-		if (m_pos.x >= m_size.x) {
-			m_pos.x = m_pos.x % m_size.x;
-			m_pos.y++;
+			if (m_pos.y >= m_size.y) {
+				scroll(1);
+				scrolled = m_data != nullptr;
+			}
 		}
 
-		if (m_pos.y >= m_size.y) {
-			scroll(1);
-			line = line_pointer(m_pos.y);
-		}
+		if (scrolled) repaint();
 	}
 
 private:
@@ -275,86 +287,36 @@ console::putc(char c)
 	}
 }
 
-void console::vprintf(const char *fmt, va_list args)
+void
+console::write(const char *text, size_t length)
 {
-	static const unsigned buf_size = 256;
-	char buffer[256];
+	if (m_screen) m_screen->write(text, length);
 
-	const char *r = fmt;
-	char *w = buffer;
-	char *wend = buffer + buf_size;
-
-#define flush() do { *w = 0; puts(buffer); w = buffer; } while(0)
-
-	while (r && *r) {
-		if (w == wend) flush();
-
-		if (*r != '%') {
-			*w++ = *r++;
-			continue;
-		}
-
-		r++; // chomp the %
-		flush();
-
-		bool done = false;
-		bool right = true;
-		int width = 0;
-		char pad = ' ';
-
-		while (!done) {
-			char c = *r++;
-			switch (c) {
-				case '%': *w = '%'; done = true; break;
-
-				case '0':
-					if (width == 0) pad = '0';
-					// else fall through
-				case '1':
-				case '2':
-				case '3':
-				case '4':
-				case '5':
-				case '6':
-				case '7':
-				case '8':
-				case '9': width = width * 10 + (c - '0'); break;
-
-				case '-': right = !right; break;
-
-				case 'x': put_hex<uint32_t>(va_arg(args, uint32_t), right ? width : -width, pad); done = true; break;
-
-				case 'd':
-				case 'u': put_dec<uint32_t>(va_arg(args, uint32_t), right ? width : -width, pad); done = true; break;
-
-				case 's': {
-						const char *s = va_arg(args, const char*);
-						if (s) puts(s);
-					}
-					done = true;
-					break;
-
-				case 'l':
-					switch (*r++) {
-						case 'x': put_hex<uint64_t>(va_arg(args, uint64_t), right ? width : -width, pad); done = true; break;
-
-						case 'd':
-						case 'u': put_dec<uint32_t>(va_arg(args, uint64_t), right ? width : -width, pad); done = true; break;
-
-						default:
-							done = true;
-							break;
-					}
-					break;
-
-				default:
-					done = true;
-					break;
-			}
+	if (m_serial) {
+		// Send the text in runs, adding a newline after each carriage
+		// return as putc() does.
+		const char *end = text + length;
+		while (text < end) {
+			const char *run = text;
+			while (text < end && *text != '\r') ++text;
+			if (text < end) ++text;
+
+			m_serial->write(run, text - run);
+			if (text[-1] == '\r') m_serial->write('\n');
 		}
 	}
+}
 
-	flush();
+static void
+console_sink(void *context, const char *text, size_t length)
+{
+	reinterpret_cast<console *>(context)->write(text, length);
+}
+
+void
+console::vprintf(const char *fmt, va_list args)
+{
+	kutil::vformat(console_sink, this, fmt, args);
 }
 
 void
@@ -1,6 +1,6 @@
 #pragma once
-#include <algorithm>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 
 class font;
@@ -18,9 +18,11 @@ public:
 
 	void putc(char c);
 	void puts(const char *message);
+	void write(const char *text, size_t length);
 	void vprintf(const char *fmt, va_list args);
 
 	inline void printf(const char *fmt, ...)
+		__attribute__ ((format (printf, 2, 3)))
 	{
 		va_list args;
 		va_start(args, fmt);
@@ -28,12 +30,6 @@ public:
 		va_end(args);
 	}
 
-	template <typename T>
-	void put_hex(T x, int width = 0, char pad = ' ');
-
-	template <typename T>
-	void put_dec(T x, int width = 0, char pad = ' ');
-
 	void echo();
 
 	void init_screen(screen *s, font *f);
@@ -49,43 +45,3 @@ private:
 extern console g_console;
 inline console * console::get() { return &g_console; }
 
-
-extern const char digits[];
-
-template <typename T>
-void console::put_hex(T x, int width, char pad)
-{
-	static const int chars = sizeof(x) * 2;
-	char message[chars + 1];
-
-	int len = 1;
-	for (int i = chars - 1; i >= 0; --i) {
-		uint8_t nibble = (x >> (i*4)) & 0xf;
-		if (nibble) len = std::max(i + 1, len);
-		message[chars - i - 1] = digits[nibble];
-	}
-	message[chars] = 0;
-
-	if (width > len) for(int i=0; i<(width-len); ++i) putc(pad);
-	puts(message + (chars - len));
-	if (-width > len) for(int i=0; i<(-width-len); ++i) putc(' ');
-}
-
-template <typename T>
-void console::put_dec(T x, int width, char pad)
-{
-	static const int chars = sizeof(x) * 3;
-	char message[chars + 1];
-	char *p = message + chars;
-	int length = 0;
-	*p-- = 0;
-	do {
-		*p-- = digits[x % 10];
-		x /= 10;
-		length += 1;
-	} while (x != 0);
-
-	if (width > length) for(int i=0; i<(width-length); ++i) putc(pad);
-	puts(++p);
-	if (-width > length) for(int i=0; i<(-width-length); ++i) putc(' ');
-}
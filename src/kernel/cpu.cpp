@@ -32,6 +32,8 @@ cpu_id::cpu_id()
 		reinterpret_cast<uint32_t *>(&m_vendor_id[8]),
 		reinterpret_cast<uint32_t *>(&m_vendor_id[4]));
 
+	__cpuid(0x80000000, 0, &m_high_ext_leaf);
+
 	uint32_t eax = 0;
 	__cpuid(0, 1, &eax);
 
@@ -55,7 +57,8 @@ cpu_id::cpu_id()
 cpu_id::regs
 cpu_id::get(uint32_t leaf, uint32_t sub) const
 {
-	if (leaf > m_high_leaf) return {};
+	uint32_t high = (leaf & 0x80000000) ? m_high_ext_leaf : m_high_leaf;
+	if (leaf > high) return {};
 
 	regs ret;
 	__cpuid(leaf, sub, &ret.eax, &ret.ebx, &ret.ecx, &ret.edx);
@@ -1,5 +1,13 @@
 #pragma once
 
+/// Number of CPUs the kernel keeps per-CPU state for.
+const unsigned max_cpus = 1;
+
+/// Get the index of the CPU this code is running on, for indexing
+/// per-CPU tables. Only the BSP runs so far, so it is always 0.
+/// \returns  The CPU's index, less than `max_cpus`
+inline unsigned current_cpu() { return 0; }
+
 
 class cpu_id
 {
@@ -31,6 +39,7 @@ private:
 	void read();
 
 	uint32_t m_high_leaf;
+	uint32_t m_high_ext_leaf;
 	char m_vendor_id[13];
 
 	uint8_t m_cpu_type;
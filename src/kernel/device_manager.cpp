@@ -170,7 +170,7 @@ device_manager::load_apic(const acpi_apic *apic)
 				uint16_t flags = kutil::read_from<uint16_t>(p+8);
 
 				log::debug(logs::device, "    Intr source override IRQ %d -> %d Pol %d Tri %d",
-						source, gsi, (flags & 0x3), ((flags >> 2) & 0x3));
+						source, static_cast<int>(gsi), (flags & 0x3), ((flags >> 2) & 0x3));
 
 				// TODO: in a multiple-IOAPIC system this might be elsewhere
 				m_ioapics[0]->redirect(source, static_cast<isr>(gsi), flags, true);
@@ -246,7 +246,8 @@ void
 device_manager::probe_pci()
 {
 	for (auto &pci : m_pci) {
-		log::debug(logs::device, "Probing PCI group at base %016lx", pci.base);
+		log::debug(logs::device, "Probing PCI group at base %016lx",
+				reinterpret_cast<uint64_t>(pci.base));
 
 		for (int bus = pci.bus_start; bus <= pci.bus_end; ++bus) {
 			for (int dev = 0; dev < 32; ++dev) {
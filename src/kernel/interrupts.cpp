@@ -3,6 +3,7 @@
 
 #include "kutil/enum_bitfields.h"
 #include "kutil/memory.h"
+#include "kutil/spinlock.h"
 #include "console.h"
 #include "interrupts.h"
 #include "io.h"
@@ -161,6 +162,21 @@ enable_serial_interrupts()
 	outb(COM1+1, ier | 0x1);
 }
 
+static bool
+irq_save()
+{
+	uint64_t flags;
+	__asm__ __volatile__ ( "pushfq; pop %0; cli" : "=r"(flags) :: "memory" );
+	return flags & 0x200; // IF
+}
+
+static void
+irq_restore(bool enabled)
+{
+	if (enabled)
+		__asm__ __volatile__ ( "sti" ::: "memory" );
+}
+
 void
 interrupts_init()
 {
@@ -192,6 +208,7 @@ interrupts_init()
 #undef ISR
 
 	idt_write();
+	kutil::irq_set_callbacks(irq_save, irq_restore);
 	disable_legacy_pic();
 	enable_serial_interrupts();
 
@@ -334,7 +351,7 @@ irq_handler(registers regs)
 
 	default:
 		cons->set_color(11);
-		cons->printf("\nReceived IRQ interrupt: %d (vec %d)\n",
+		cons->printf("\nReceived IRQ interrupt: %d (vec %ld)\n",
 				irq, regs.interrupt);
 		cons->set_color();
 
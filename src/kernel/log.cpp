@@ -1,5 +1,6 @@
 #include <type_traits>
 #include "kutil/assert.h"
+#include "kutil/format.h"
 #include "kutil/memory.h"
 #include "console.h"
 #include "log.h"
@@ -87,14 +88,21 @@ log::trylog(logs area, const char *fmt, ...)
 void
 log::output(level severity, logs area, const char *fmt, va_list args)
 {
-	m_cons->set_color(level_colors[static_cast<int>(severity)]);
+	// Render the whole line first, so it goes to the console in one write
+	// instead of a call per character and conversion. Long lines are cut.
+	static const size_t line_size = 256;
+	char line[line_size];
 
-	m_cons->printf("%s %s: ",
+	size_t length = kutil::snprintf(line, line_size, "%s %s: ",
 			areas[static_cast<int>(area)],
 			levels[static_cast<int>(severity)]);
-	m_cons->vprintf(fmt, args);
+	length += kutil::vsnprintf(line + length, line_size - length, fmt, args);
+	if (length > line_size - 2) length = line_size - 2;
+	line[length++] = '\n';
+
+	m_cons->set_color(level_colors[static_cast<int>(severity)]);
+	m_cons->write(line, length);
 	m_cons->set_color();
-	m_cons->puts("\n");
 }
 
 const log::trylog_p log::debug = &trylog<level::debug>;
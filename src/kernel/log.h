@@ -26,8 +26,10 @@ public:
 	static void enable(logs type, level at_level);
 
 	template <level L>
-	static void trylog(logs area, const char *fmt, ...);
-	using trylog_p = void (*)(logs area, const char *fmt, ...);
+	static void trylog(logs area, const char *fmt, ...)
+		__attribute__ ((format (printf, 2, 3)));
+	typedef void (*trylog_p)(logs area, const char *fmt, ...)
+		__attribute__ ((format (printf, 2, 3)));
 
 	static const trylog_p debug;
 	static const trylog_p info;
@@ -47,3 +49,8 @@ private:
 	log(console *cons);
 	static log s_log;
 };
+
+/// Fatal messages are always logged, and then halt.
+template <>
+void log::trylog<log::level::fatal>(logs area, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
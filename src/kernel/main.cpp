@@ -3,6 +3,7 @@
 
 #include "kutil/assert.h"
 #include "kutil/memory.h"
+#include "allocator.h"
 #include "console.h"
 #include "cpu.h"
 #include "device_manager.h"
@@ -15,6 +16,7 @@
 #include "page_manager.h"
 #include "screen.h"
 #include "serial.h"
+#include "tlb.h"
 
 extern "C" {
 	void do_the_set_registers(popcorn_data *header);
@@ -70,10 +72,13 @@ kernel_main(popcorn_data *header)
 			header->memory_map,
 			header->memory_map_length,
 			header->memory_map_desc_size);
+	tlb_init();
 
+	// Write-combine the framebuffer, so console repaints go out in bursts
 	pager->map_offset_pointer(
 			&header->frame_buffer,
-			header->frame_buffer_length);
+			header->frame_buffer_length,
+			page_flags::kernel_data | page_flags::cache_write_combining);
 
 	init_console(header);
 	// pager->dump_blocks();
@@ -83,11 +88,18 @@ kernel_main(popcorn_data *header)
 	interrupts_enable();
 
 	cpu_id cpu;
+	cpu_id::regs ext = cpu.get(7);
+	kutil::memory_set_features(
+			ext.ebx_bit(9),  // ERMS
+			ext.edx_bit(4)); // FSRM
+
 	log::info(logs::boot, "CPU Vendor: %s", cpu.vendor_id());
 	log::info(logs::boot, "CPU Family %x Model %x Stepping %x",
 			cpu.family(), cpu.model(), cpu.stepping());
 
 	devices.init_drivers();
+	heap_trim();
+	heap_dump();
 
 	// do_error_1();
 	// __asm__ __volatile__("int $15");
@@ -1,3 +1,6 @@
+#include <algorithm>
+
+#include "kutil/arena.h"
 #include "kutil/assert.h"
 #include "kutil/memory.h"
 #include "memory.h"
@@ -205,25 +208,25 @@ remove_block_for(page_block **list, uint64_t phys_start, uint64_t pages, page_bl
 	return cur;
 }
 
-uint64_t
+void
 gather_block_lists(
-		uint64_t scratch_virt,
+		kutil::arena &scratch,
 		const void *memory_map,
 		size_t map_length,
 		size_t desc_length,
 		page_block **free_head,
 		page_block **used_head)
 {
-	int i = 0;
 	page_block *free = nullptr;
 	page_block *used = nullptr;
 
-	page_block *block_list = reinterpret_cast<page_block *>(scratch_virt);
 	efi_memory_descriptor const *desc = reinterpret_cast<efi_memory_descriptor const *>(memory_map);
 	efi_memory_descriptor const *end = desc_incr(desc, map_length);
 
 	while (desc < end) {
-		page_block *block = &block_list[i++];
+		page_block *block = scratch.create<page_block>();
+		kassert(block, "Ran out of bootstrap scratch space for page blocks.");
+
 		block->physical_address = desc->physical_start;
 		block->virtual_address = desc->virtual_start;
 		block->count = desc->pages;
@@ -273,17 +276,18 @@ gather_block_lists(
 
 	*free_head = free;
 	*used_head = used;
-	return reinterpret_cast<uint64_t>(&block_list[i]);
 }
 
 page_block *
-fill_page_with_blocks(uint64_t start)
+fill_page_with_blocks(kutil::arena &scratch)
 {
-	uint64_t end = page_align(start);
-	uint64_t count = (end - start) / sizeof(page_block);
+	uint64_t start = reinterpret_cast<uint64_t>(scratch.current());
+	uint64_t count = (page_align(start) - start) / sizeof(page_block);
 	if (count == 0) return nullptr;
 
-	page_block *blocks = reinterpret_cast<page_block *>(start);
+	page_block *blocks = scratch.create_array<page_block>(count);
+	kassert(blocks, "Bootstrap scratch space did not fit the rest of its page.");
+
 	for (unsigned i = 0; i < count; ++i)
 		blocks[i].zero(&blocks[i+1]);
 	blocks[count - 1].next = nullptr;
@@ -301,9 +305,9 @@ copy_new_table(page_table *base, unsigned index, page_table *new_table)
 	if (entry & 0x1) {
 		page_table *old_next = reinterpret_cast<page_table *>(
 				base->entries[index] & ~0xffful);
-		for (int i = 0; i < 512; ++i) new_table->entries[i] = old_next->entries[i];
+		kutil::stream_copy(new_table, old_next, sizeof(page_table));
 	} else {
-		for (int i = 0; i < 512; ++i) new_table->entries[i] = 0;
+		kutil::stream_zero(new_table, sizeof(page_table));
 	}
 
 	base->entries[index] = reinterpret_cast<uint64_t>(new_table) | 0xb;
@@ -362,7 +366,7 @@ check_needs_page_ident(page_table *table, unsigned index, page_table **free_page
 	kassert(*free_pages, "check_needs_page_ident needed to allocate but had no free pages");
 
 	page_table *new_table = (*free_pages)++;
-	for (int i=0; i<512; ++i) new_table->entries[i] = 0;
+	kutil::stream_zero(new_table, sizeof(page_table));
 	table->entries[index] = reinterpret_cast<uint64_t>(new_table) | 0xb;
 	return 1;
 }
@@ -407,6 +411,38 @@ page_in_ident(
 	return 0; // Cannot reach
 }
 
+static void
+page_out_ident(
+		page_table *pml4,
+		uint64_t virt_addr,
+		uint64_t count)
+{
+	page_table_indices idx{virt_addr};
+	page_table *tables[4] = {pml4, nullptr, nullptr, nullptr};
+
+	for (; idx[0] < 512; idx[0] += 1, idx[1] = 0, idx[2] = 0, idx[3] = 0) {
+		tables[1] = reinterpret_cast<page_table *>(
+				tables[0]->entries[idx[0]] & ~0xfffull);
+
+		for (; idx[1] < 512; idx[1] += 1, idx[2] = 0, idx[3] = 0) {
+			tables[2] = reinterpret_cast<page_table *>(
+					tables[1]->entries[idx[1]] & ~0xfffull);
+
+			for (; idx[2] < 512; idx[2] += 1, idx[3] = 0) {
+				tables[3] = reinterpret_cast<page_table *>(
+						tables[2]->entries[idx[2]] & ~0xfffull);
+
+				for (; idx[3] < 512; idx[3] += 1) {
+					tables[3]->entries[idx[3]] = 0;
+					if (--count == 0) return;
+				}
+			}
+		}
+	}
+
+	kassert(0, "Ran to end of page_out_ident");
+}
+
 void
 memory_initialize(const void *memory_map, size_t map_length, size_t desc_length)
 {
@@ -425,8 +461,6 @@ memory_initialize(const void *memory_map, size_t map_length, size_t desc_length)
 	uint64_t free_region_start_virt =
 		free_region_start_phys + page_manager::high_offset;
 
-	uint64_t free_next = free_region_start_virt;
-
 	// We'll need to copy any existing tables (except the PML4 which the
 	// bootloader gave us) into our 4 reserved pages so we can edit them.
 	page_table_indices fr_idx{free_region_start_virt};
@@ -436,17 +470,22 @@ memory_initialize(const void *memory_map, size_t map_length, size_t desc_length)
 	copy_new_table(&tables[2], fr_idx[2], &tables[3]);
 	page_in_ident(&tables[0], free_region_start_phys, free_region_start_virt, want_pages, nullptr);
 
-	// We now have pages starting at "free_next" to bootstrap ourselves. Start by
-	// taking inventory of free pages.
+	// We now have pages starting at "free_region_start_virt" to bootstrap
+	// ourselves. Carve them up with an arena, starting by taking inventory
+	// of free pages.
+	kutil::arena scratch(
+			reinterpret_cast<void *>(free_region_start_virt),
+			want_pages * page_manager::page_size);
+
 	page_block *free_head = nullptr;
 	page_block *used_head = nullptr;
-	free_next = gather_block_lists(
-			free_next, memory_map, map_length, desc_length,
+	gather_block_lists(
+			scratch, memory_map, map_length, desc_length,
 			&free_head, &used_head);
 
 	// Unused page_block structs go here - finish out the current page with them
-	page_block *cache_head = fill_page_with_blocks(free_next);
-	free_next = page_align(free_next);
+	page_block *cache_head = fill_page_with_blocks(scratch);
+	uint64_t free_next = page_align(reinterpret_cast<uint64_t>(scratch.current()));
 
 	// Now go back through these lists and consolidate
 	page_block *freed = page_block::consolidate(free_head);
@@ -497,10 +536,45 @@ memory_initialize(const void *memory_map, size_t map_length, size_t desc_length)
 	removed->flags = page_block_flags::used | page_block_flags::mapped;
 	used_head = page_block::insert(used_head, removed);
 
+	// Size the frame allocator's bitmaps to the span of free memory, and take
+	// pages for them from the first free block big enough. They get
+	// offset-mapped along with the rest of the used blocks below.
+	const uint64_t frame_block_size =
+		page_manager::page_size << kutil::frame_allocator::max_order;
+
+	uint64_t frames_start = ~0ull;
+	uint64_t frames_end = 0;
+	for (page_block *cur = free_head; cur; cur = cur->next) {
+		frames_start = std::min(frames_start, cur->physical_address);
+		frames_end = std::max(frames_end, cur->physical_end());
+	}
+	frames_start &= ~(frame_block_size - 1);
+
+	size_t frame_count = (frames_end - frames_start) / page_manager::page_size;
+	size_t meta_pages = page_count(kutil::frame_allocator::metadata_size(frame_count));
+
+	page_block *meta_block = free_head;
+	while (meta_block && meta_block->count < meta_pages)
+		meta_block = meta_block->next;
+	kassert(meta_block, "No free block is big enough for the frame allocator.");
+
+	removed = remove_block_for(
+			&free_head,
+			meta_block->physical_address,
+			meta_pages,
+			&cache_head);
+
+	kassert(removed, "remove_block_for didn't find the frame allocator region.");
+
+	uint64_t meta_virt = removed->physical_address + page_manager::page_offset;
+	removed->virtual_address = meta_virt;
+	removed->flags = page_block_flags::used | page_block_flags::mapped;
+	used_head = page_block::insert(used_head, removed);
+
 	page_manager *pm = &g_page_manager;
 
 	// Actually remap them into page table space
-	pm->page_out(&tables[0], free_next, remaining_pages);
+	page_out_ident(&tables[0], free_next, remaining_pages);
 
 	page_table_indices pg_idx{pt_start_virt};
 	copy_new_table(&tables[0], pg_idx[0], &tables[4]);
@@ -513,7 +587,7 @@ memory_initialize(const void *memory_map, size_t map_length, size_t desc_length)
 	// what the kernel actually has mapped, but making everything writable
 	// (especially the page tables themselves)
 	page_table *pml4 = reinterpret_cast<page_table *>(pt_start_virt);
-	for (int i=0; i<512; ++i) pml4->entries[i] = 0;
+	kutil::stream_zero(pml4, sizeof(page_table));
 
 	// Give the rest to the page_manager's cache for use in page_in
 	pm->free_table_pages(pml4 + 1, remaining_pages - 1);
@@ -528,5 +602,7 @@ memory_initialize(const void *memory_map, size_t map_length, size_t desc_length)
 
 	// We now have all used memory mapped ourselves. Let the page_manager take
 	// over from here.
+	new (&pm->m_frames) kutil::frame_allocator(
+			frames_start, frame_count, reinterpret_cast<void *>(meta_virt));
 	g_page_manager.init(free_head, used_head, cache_head);
 }
@@ -1,13 +1,32 @@
-#include <algorithm>
-
 #include "kutil/assert.h"
 #include "kutil/memory_manager.h"
+#include "allocator.h"
+#include "cpu.h"
+#include "io.h"
 #include "log.h"
 #include "page_manager.h"
+#include "tlb.h"
 
 page_manager g_page_manager;
 
 
+static const uint64_t present_flag = 0x01;
+static const uint64_t large_flag = 0x80;
+static const uint64_t large_pat_flag = 0x1000;
+static const uint64_t address_mask = 0x000ffffffffff000ull;
+
+static const uint64_t table_flags = 0x03;
+
+static const uint64_t msr_efer = 0xc0000080;
+static const uint64_t efer_nxe = 1ull << 11;
+
+/// The PAT: entries 0-3 are the power-on defaults (WB, WT, UC-, UC), so
+/// entries without the PAT bit mean what they always did. Entry 4 is
+/// write-combining, and entries 5-7 keep their defaults (WT, UC-, UC).
+static const uint64_t msr_pat = 0x277;
+static const uint64_t pat_value = 0x0007040100070406ull;
+
+
 static addr_t
 pt_to_phys(page_table *pt)
 {
@@ -21,6 +40,14 @@ pt_from_phys(addr_t p)
 	return reinterpret_cast<page_table *>((p + page_manager::page_offset) & ~0xfffull);
 }
 
+/// Check if a page table entry can be replaced with a large page without
+/// losing a table of mappings below it.
+static inline bool
+can_map_large(uint64_t entry)
+{
+	return (entry & present_flag) == 0 || (entry & large_flag) == large_flag;
+}
+
 
 struct free_page_header
 {
@@ -35,10 +62,20 @@ void mm_grow_callback(void *next, size_t length)
 			"Heap manager requested a fractional page.");
 
 	size_t pages = length / page_manager::page_size;
-	log::info(logs::memory, "Heap manager growing heap by %d pages.", pages);
+	log::info(logs::memory, "Heap manager growing heap by %lu pages.", pages);
 	g_page_manager.map_pages(reinterpret_cast<addr_t>(next), pages);
 }
 
+void mm_shrink_callback(void *start, size_t length)
+{
+	kassert(length % page_manager::page_size == 0,
+			"Heap manager released a fractional page.");
+
+	size_t pages = length / page_manager::page_size;
+	log::info(logs::memory, "Heap manager shrinking heap by %lu pages.", pages);
+	g_page_manager.unmap_pages(start, pages);
+}
+
 
 size_t
 page_block::length(page_block *list)
@@ -140,9 +177,9 @@ page_block::dump(page_block *list, const char *name, bool show_unmapped)
 
 		if (cur->virtual_address) {
 			page_table_indices start{cur->virtual_address};
-			log::info(logs::memory, "  %lx %x [%6d] %lx (%d,%d,%d,%d)",
+			log::info(logs::memory, "  %lx %x [%6d] %lx (%lu,%lu,%lu,%lu)",
 					cur->physical_address,
-					cur->flags,
+					static_cast<uint32_t>(cur->flags),
 					cur->count,
 					cur->virtual_address,
 					start[0], start[1], start[2], start[3]);
@@ -150,7 +187,7 @@ page_block::dump(page_block *list, const char *name, bool show_unmapped)
 			page_table_indices start{cur->virtual_address};
 			log::info(logs::memory, "  %lx %x [%6d]",
 					cur->physical_address,
-					cur->flags,
+					static_cast<uint32_t>(cur->flags),
 					cur->count);
 		}
 	}
@@ -180,12 +217,25 @@ page_block::copy(page_block *other)
 
 
 page_manager::page_manager() :
-	m_free(nullptr),
 	m_used(nullptr),
 	m_block_cache(nullptr),
 	m_page_cache(nullptr)
 {
 	kassert(this == &g_page_manager, "Attempt to create another page_manager.");
+
+	cpu_id cpu;
+	cpu_id::regs ext = cpu.get(0x80000001);
+	m_huge_pages = ext.edx_bit(26);
+	m_no_execute = ext.edx_bit(20);
+	m_pat = cpu.get(1).edx_bit(16);
+
+	if (m_no_execute)
+		wrmsr(msr_efer, rdmsr(msr_efer) | efer_nxe);
+
+	// Only entries nothing is mapped with yet change, so no cache or TLB
+	// flush is needed
+	if (m_pat)
+		wrmsr(msr_pat, pat_value);
 }
 
 void
@@ -194,10 +244,25 @@ page_manager::init(
 	page_block *used,
 	page_block *block_cache)
 {
-	m_free = free;
 	m_used = used;
 	m_block_cache = block_cache;
 
+	// Hand the free memory to the frame allocator. Physical page 0 is kept
+	// back, so that no page ever has a physical address of 0.
+	for (page_block *cur = free; cur; cur = cur->next) {
+		addr_t start = cur->physical_address;
+		size_t count = cur->count;
+		if (start == 0) {
+			start += page_size;
+			--count;
+		}
+		if (count)
+			m_frames.free(start, count);
+	}
+	free_blocks(free);
+
+	log::info(logs::memory, "Frame allocator has %lu free pages.", m_frames.free_frames());
+
 	// For now we're ignoring that we've got the scratch pages
 	// allocated, full of page_block structs. Eventually hand
 	// control of that to a slab allocator.
@@ -217,22 +282,38 @@ page_manager::init(
 	extern kutil::memory_manager g_kernel_memory_manager;
 	new (&g_kernel_memory_manager) kutil::memory_manager(
 			reinterpret_cast<void *>(end),
-			mm_grow_callback);
+			mm_grow_callback,
+			mm_shrink_callback);
+
+	// Ask for heap memory to be given back once more than 1MiB sits free.
+	// heap_trim() does the giving back, outside of any kfree.
+	g_kernel_memory_manager.set_trim_threshold(16);
+
+	heap_caches_init(&g_kernel_memory_manager);
 }
 
 void
-page_manager::map_offset_pointer(void **pointer, size_t length)
+page_manager::map_offset_pointer(
+	void **pointer,
+	size_t length,
+	page_flags flags,
+	page_size_policy policy)
 {
 	addr_t *p = reinterpret_cast<addr_t *>(pointer);
-	addr_t v = *p + page_offset;
-	addr_t c = ((length - 1) / page_size) + 1;
+
+	size_t align = page_size;
+	if (policy == page_size_policy::force_large)
+		align = large_page_size;
+
+	addr_t start = *p & ~(align - 1);
+	addr_t end = ((*p + length - 1) & ~(align - 1)) + align;
+	addr_t c = (end - start) / page_size;
 
 	// TODO: cleanly search/split this as a block out of used/free if possible
 	page_block *block = get_block();
 
-	// TODO: page-align
-	block->physical_address = *p;
-	block->virtual_address = v;
+	block->physical_address = start;
+	block->virtual_address = start + page_offset;
 	block->count = c;
 	block->flags =
 		page_block_flags::used |
@@ -242,15 +323,15 @@ page_manager::map_offset_pointer(void **pointer, size_t length)
 	m_used = page_block::insert(m_used, block);
 
 	page_table *pml4 = get_pml4();
-	page_in(pml4, *p, v, c);
-	*p = v;
+	page_in(pml4, block->physical_address, block->virtual_address, c, flags, policy);
+	*p += page_offset;
 }
 
 void
 page_manager::dump_blocks()
 {
 	page_block::dump(m_used, "used", true);
-	page_block::dump(m_free, "free", true);
+	log::info(logs::memory, "Free pages: %lu", m_frames.free_frames());
 }
 
 page_block *
@@ -296,7 +377,7 @@ page_manager::get_table_page()
 		block->count = n;
 		page_block::insert(m_used, block);
 
-		page_in(get_pml4(), phys, virt, n);
+		page_in(get_pml4(), phys, virt, n, page_flags::kernel_data);
 
 		m_page_cache = reinterpret_cast<free_page_header *>(virt);
 
@@ -309,7 +390,7 @@ page_manager::get_table_page()
 		}
 		reinterpret_cast<free_page_header *>(virt)->next = nullptr;
 
-		log::info(logs::memory, "Mappd %d new page table pages at %lx", n, phys);
+		log::info(logs::memory, "Mappd %lu new page table pages at %lx", n, phys);
 	}
 
 	free_page_header *page = m_page_cache;
@@ -333,19 +414,16 @@ page_manager::free_table_pages(void *pages, size_t count)
 void
 page_manager::consolidate_blocks()
 {
-	m_block_cache = page_block::append(m_block_cache, page_block::consolidate(m_free));
 	m_block_cache = page_block::append(m_block_cache, page_block::consolidate(m_used));
 }
 
 void *
-page_manager::map_pages(addr_t address, size_t count)
+page_manager::map_pages(addr_t address, size_t count, page_flags flags)
 {
 	void *ret = reinterpret_cast<void *>(address);
 	page_table *pml4 = get_pml4();
 
 	while (count) {
-		kassert(m_free, "page_manager::map_pages ran out of free pages!");
-
 		addr_t phys = 0;
 		size_t n = pop_pages(count, &phys);
 
@@ -358,7 +436,7 @@ page_manager::map_pages(addr_t address, size_t count)
 				page_block_flags::mapped;
 		page_block::insert(m_used, block);
 
-		page_in(pml4, phys, address, n);
+		page_in(pml4, phys, address, n, flags);
 
 		address += n * page_size;
 		count -= n;
@@ -368,48 +446,25 @@ page_manager::map_pages(addr_t address, size_t count)
 }
 
 void *
-page_manager::map_offset_pages(size_t count)
+page_manager::map_offset_pages(size_t count, page_flags flags)
 {
-	page_table *pml4 = get_pml4();
-	page_block *free = m_free;
-	page_block *prev = nullptr;
-
-	log::debug(logs::memory, "Got request to offset map %d pages", count);
-
-	while (free) {
-		if (free->count < count) {
-			prev = free;
-			free = free->next;
-			continue;
-		}
+	log::debug(logs::memory, "Got request to offset map %lu pages", count);
 
-		page_block *used = get_block();
-		used->count = count;
-		used->physical_address = free->physical_address;
-		used->virtual_address = used->physical_address + page_offset;
-		used->flags =
-			page_block_flags::used |
-			page_block_flags::mapped;
-		page_block::insert(m_used, used);
-
-		free->physical_address += count * page_size;
-		free->count -= count;
-
-		if (free->count == 0) {
-			if (prev)
-				prev->next = free->next;
-			else
-				m_free = free->next;
-
-			free->zero(m_block_cache);
-			m_block_cache = free;
-		}
+	addr_t phys = 0;
+	if (!m_frames.allocate(count, &phys))
+		return nullptr;
 
-		page_in(pml4, used->physical_address, used->virtual_address, count);
-		return reinterpret_cast<void *>(used->virtual_address);
-	}
+	page_block *used = get_block();
+	used->count = count;
+	used->physical_address = phys;
+	used->virtual_address = phys + page_offset;
+	used->flags =
+		page_block_flags::used |
+		page_block_flags::mapped;
+	m_used = page_block::insert(m_used, used);
 
-	return nullptr;
+	page_in(get_pml4(), used->physical_address, used->virtual_address, count, flags);
+	return reinterpret_cast<void *>(used->virtual_address);
 }
 
 void
@@ -426,6 +481,12 @@ page_manager::unmap_pages(void* address, size_t count)
 
 	kassert(cur, "Couldn't find existing mapped pages to unmap");
 
+	// Take the pages out of the tables first, so nothing can still reach
+	// them through a stale translation once they are given back
+	tlb_batch tlb;
+	page_out(get_pml4(), addr, count, tlb);
+	tlb.flush();
+
 	size_t size = page_size * count;
 	addr_t end = addr + size;
 
@@ -471,44 +532,125 @@ page_manager::unmap_pages(void* address, size_t count)
 
 		*prev = cur->next;
 		cur->next = nullptr;
-		cur->virtual_address = 0;
-		cur->flags = cur->flags & ~(page_block_flags::used | page_block_flags::mapped);
-		m_free = page_block::insert(m_free, cur);
+
+		// MMIO and other memory outside the allocator's span is not ours
+		// to give out again
+		if (!cur->has_flag(page_block_flags::mmio) &&
+			m_frames.contains(cur->physical_address))
+			m_frames.free(cur->physical_address, cur->count);
+		free_blocks(cur);
 
 		cur = next;
 	}
 }
 
 void
-page_manager::check_needs_page(page_table *table, unsigned index)
+page_manager::check_needs_page(page_table *table, unsigned index, unsigned level)
 {
-	if ((table->entries[index] & 0x1) == 1) return;
+	uint64_t entry = table->entries[index];
+	if ((entry & (present_flag | large_flag)) == present_flag) return;
 
 	page_table *new_table = get_table_page();
-	for (int i=0; i<512; ++i) new_table->entries[i] = 0;
-	table->entries[index] = pt_to_phys(new_table) | 0xb;
+
+	if ((entry & present_flag) == 0) {
+		kutil::stream_zero(new_table, sizeof(page_table));
+	} else {
+		// Split the large page into pages of the next size down, keeping its
+		// flags. 4KiB entries have no size bit, and their PAT bit is bit 7
+		// instead of bit 12.
+		size_t size = level == 3 ? huge_page_size : large_page_size;
+		addr_t phys = entry & address_mask & ~(size - 1);
+		uint64_t flags = entry & ~address_mask;
+
+		if (level == 2)
+			flags = (flags & ~large_flag) | ((entry & large_pat_flag) ? large_flag : 0);
+		else
+			flags |= entry & large_pat_flag;
+
+		size /= 512;
+		for (unsigned i = 0; i < 512; ++i)
+			new_table->entries[i] = (phys + i * size) | flags;
+	}
+
+	table->entries[index] = pt_to_phys(new_table) | table_flags;
 }
 
 void
-page_manager::page_in(page_table *pml4, addr_t phys_addr, addr_t virt_addr, size_t count)
+page_manager::page_in(
+	page_table *pml4,
+	addr_t phys_addr,
+	addr_t virt_addr,
+	size_t count,
+	page_flags flags,
+	page_size_policy policy)
 {
+	const size_t large_pages = large_page_size / page_size;
+	const size_t huge_pages = huge_page_size / page_size;
+
+	if (!m_no_execute)
+		flags &= ~page_flags::no_execute;
+
+	if (!m_pat && (flags & page_flags::cache_mask) == page_flags::cache_write_combining)
+		flags = (flags & ~page_flags::cache_mask) | page_flags::cache_uncached;
+
+	// Leaf entries get all the flags. Tables above them only need to let
+	// user mode through; their other flags stay the most permissive.
+	uint64_t bits = static_cast<uint64_t>(flags | page_flags::present);
+	uint64_t table_bits = static_cast<uint64_t>(flags & page_flags::user);
+
+	// Large pages have the size bit where 4KiB pages have the PAT bit
+	uint64_t large_bits = bits | large_flag;
+	if (bits & large_flag)
+		large_bits |= large_pat_flag;
+
+	bool large = policy != page_size_policy::small_only;
+	bool huge = large && m_huge_pages;
+
+	kassert(policy != page_size_policy::force_large ||
+			(((phys_addr | virt_addr) & (large_page_size - 1)) == 0 &&
+			 count % large_pages == 0),
+			"page_in forced large pages for an unaligned mapping");
+
 	page_table_indices idx{virt_addr};
 	page_table *tables[4] = {pml4, nullptr, nullptr, nullptr};
 
-	for (; idx[0] < 512; idx[0] += 1) {
-		check_needs_page(tables[0], idx[0]);
+	for (; idx[0] < 512; idx[0] += 1, idx[1] = 0, idx[2] = 0, idx[3] = 0) {
+		check_needs_page(tables[0], idx[0], 4);
+		tables[0]->entries[idx[0]] |= table_bits;
 		tables[1] = tables[0]->get(idx[0]);
 
 		for (; idx[1] < 512; idx[1] += 1, idx[2] = 0, idx[3] = 0) {
-			check_needs_page(tables[1], idx[1]);
+			if (huge && idx[2] == 0 && idx[3] == 0 && count >= huge_pages &&
+				(phys_addr & (huge_page_size - 1)) == 0 &&
+				can_map_large(tables[1]->entries[idx[1]])) {
+				tables[1]->entries[idx[1]] = phys_addr | large_bits;
+				phys_addr += huge_page_size;
+				count -= huge_pages;
+				if (count == 0) return;
+				continue;
+			}
+
+			check_needs_page(tables[1], idx[1], 3);
+			tables[1]->entries[idx[1]] |= table_bits;
 			tables[2] = tables[1]->get(idx[1]);
 
 			for (; idx[2] < 512; idx[2] += 1, idx[3] = 0) {
-				check_needs_page(tables[2], idx[2]);
+				if (large && idx[3] == 0 && count >= large_pages &&
+					(phys_addr & (large_page_size - 1)) == 0 &&
+					can_map_large(tables[2]->entries[idx[2]])) {
+					tables[2]->entries[idx[2]] = phys_addr | large_bits;
+					phys_addr += large_page_size;
+					count -= large_pages;
+					if (count == 0) return;
+					continue;
+				}
+
+				check_needs_page(tables[2], idx[2], 2);
+				tables[2]->entries[idx[2]] |= table_bits;
 				tables[3] = tables[2]->get(idx[2]);
 
 				for (; idx[3] < 512; idx[3] += 1) {
-					tables[3]->entries[idx[3]] = phys_addr | 0xb;
+					tables[3]->entries[idx[3]] = phys_addr | bits;
 					phys_addr += page_manager::page_size;
 					if (--count == 0) return;
 				}
@@ -520,52 +662,53 @@ page_manager::page_in(page_table *pml4, addr_t phys_addr, addr_t virt_addr, size
 }
 
 void
-page_manager::page_out(page_table *pml4, addr_t virt_addr, size_t count)
+page_manager::page_out(page_table *pml4, addr_t virt_addr, size_t count, tlb_batch &tlb)
 {
-	page_table_indices idx{virt_addr};
-	page_table *tables[4] = {pml4, nullptr, nullptr, nullptr};
-
-	for (; idx[0] < 512; idx[0] += 1) {
-		tables[1] = reinterpret_cast<page_table *>(
-				tables[0]->entries[idx[0]] & ~0xfffull);
-
-		for (; idx[1] < 512; idx[1] += 1) {
-			tables[2] = reinterpret_cast<page_table *>(
-					tables[1]->entries[idx[1]] & ~0xfffull);
-
-			for (; idx[2] < 512; idx[2] += 1) {
-				tables[3] = reinterpret_cast<page_table *>(
-						tables[2]->entries[idx[2]] & ~0xfffull);
+	size_t done = page_out_table(pml4, 4, virt_addr, count, tlb);
+	kassert(done == count, "Ran to end of page_out");
+}
 
-				for (; idx[3] < 512; idx[3] += 1) {
-					tables[3]->entries[idx[3]] = 0;
-					if (--count == 0) return;
-				}
-			}
+size_t
+page_manager::page_out_table(
+	page_table *table,
+	unsigned level,
+	addr_t virt_addr,
+	size_t count,
+	tlb_batch &tlb)
+{
+	const unsigned shift = 9 * (level - 1);
+	const size_t entry_pages = 1ull << shift;
+
+	size_t page = virt_addr / page_size;
+	size_t done = 0;
+
+	for (unsigned i = (page >> shift) & 0x1ff; i < 512 && done < count; ++i) {
+		size_t offset = (page + done) & (entry_pages - 1);
+		size_t n = entry_pages - offset;
+		if (n > count - done) n = count - done;
+
+		uint64_t entry = table->entries[i];
+		if ((entry & present_flag) == 0) {
+			// Nothing mapped here
+		} else if (level == 1 || ((entry & large_flag) && n == entry_pages)) {
+			table->entries[i] = 0;
+			tlb.add((page + done) * page_size, 12 + shift);
+		} else {
+			check_needs_page(table, i, level);
+			page_out_table(table->get(i), level - 1, (page + done) * page_size, n, tlb);
 		}
+
+		done += n;
 	}
 
-	kassert(0, "Ran to end of page_out");
+	return done;
 }
 
 size_t
 page_manager::pop_pages(size_t count, addr_t *address)
 {
-	kassert(m_free, "page_manager::pop_pages ran out of free pages!");
-
-	unsigned n = std::min(count, static_cast<size_t>(m_free->count));
-	*address = m_free->physical_address;
-
-	m_free->physical_address += n * page_size;
-	m_free->count -= n;
-	if (m_free->count == 0) {
-		page_block *block = m_free;
-		m_free = m_free->next;
-
-		block->zero(m_block_cache);
-		m_block_cache = block;
-	}
-
+	size_t n = m_frames.allocate_some(count, address);
+	kassert(n, "page_manager::pop_pages ran out of free pages!");
 	return n;
 }
 
@@ -573,7 +716,7 @@ page_manager::pop_pages(size_t count, addr_t *address)
 void
 page_table::dump(int level, uint64_t offset)
 {
-	log::info(logs::memory, "Level %d page table @ %lx (off %lx):", level, this, offset);
+	log::info(logs::memory, "Level %d page table @ %p (off %lx):", level, this, offset);
 	for (int i=0; i<512; ++i) {
 		uint64_t ent = entries[i];
 		if (ent == 0) continue;
@@ -584,14 +727,14 @@ page_table::dump(int level, uint64_t offset)
 		}
 
 		if ((level == 2 || level == 3) && (ent & 0x80) == 0x80) {
-			log::info(logs::memory, "  %3d: %lx   -> Large page at     %lx",
+			log::info(logs::memory, "  %3d: %lx   -> Large page at     %llx",
 					i, ent, ent & ~0xfffull);
 			continue;
 		} else if (level == 1) {
-			log::info(logs::memory, "  %3d: %lx   -> Page at           %lx",
+			log::info(logs::memory, "  %3d: %lx   -> Page at           %llx",
 					i, ent, ent & ~0xfffull);
 		} else {
-			log::info(logs::memory, "  %3d: %lx   -> Level %d table at %lx",
+			log::info(logs::memory, "  %3d: %lx   -> Level %d table at %llx",
 					i, ent, level - 1, (ent & ~0xfffull) + offset);
 			continue;
 		}
@@ -5,21 +5,74 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#include "kutil/memory.h"
 #include "kutil/enum_bitfields.h"
+#include "kutil/frame_allocator.h"
+#include "kutil/memory.h"
 
 struct page_block;
 struct page_table;
 struct free_page_header;
+class tlb_batch;
+
+
+/// Attributes of a page mapping. These are the bits of its page table entries.
+enum class page_flags : uint64_t
+{
+	none          = 0x0000000000000000,
+	present       = 0x0000000000000001,  ///< Mapping is valid
+	write         = 0x0000000000000002,  ///< Memory may be written
+	user          = 0x0000000000000004,  ///< Memory may be used from user mode
+	write_through = 0x0000000000000008,  ///< PAT index bit 0
+	cache_disable = 0x0000000000000010,  ///< PAT index bit 1
+	pat           = 0x0000000000000080,  ///< PAT index bit 2, moved for large pages
+	global        = 0x0000000000000100,  ///< Keep in the TLB across address spaces
+	no_execute    = 0x8000000000000000,  ///< Memory may not be executed
+
+	/// \name Caching types
+	/// Combinations of the PAT index bits, for the PAT the page_manager sets up
+	/// @{
+	cache_write_back      = none,
+	cache_write_through   = write_through,
+	cache_uncached        = cache_disable | write_through,
+	cache_write_combining = pat,
+	cache_mask            = write_through | cache_disable | pat,
+	/// @}
+
+	/// Kernel memory that may hold code
+	kernel_code   = present | write | global | cache_write_back,
+
+	/// Kernel memory that only holds data
+	kernel_data   = kernel_code | no_execute,
+
+	/// Device registers
+	kernel_mmio   = present | write | global | no_execute | cache_uncached
+};
+IS_BITFIELD(page_flags);
+
+
+/// Which page sizes a mapping may use.
+enum class page_size_policy
+{
+	automatic,   ///< Use 2MiB and 1GiB pages where alignment and length allow
+	small_only,  ///< Only use 4KiB pages
+	force_large  ///< Map whole 2MiB pages, rounding the mapping out to them
+};
 
 
-/// Manager for allocation of physical pages.
+/// Manager for allocation of physical pages. Free physical memory is kept
+/// by a frame allocator; mapped memory is tracked as a list of `page_block`s.
 class page_manager
 {
 public:
 	/// Size of a single page.
 	static const size_t page_size = 0x1000;
 
+	/// Size of a large (2MiB) page.
+	static const size_t large_page_size = 0x200000;
+
+	/// Size of a huge (1GiB) page.
+	static const size_t huge_page_size = 0x40000000;
+
 	/// Start of the higher half.
 	static const addr_t high_offset = 0xffff800000000000;
 
@@ -31,15 +84,22 @@ public:
 	/// Allocate and map pages into virtual memory.
 	/// \arg address  The virtual address at which to map the pages
 	/// \arg count    The number of pages to map
+	/// \arg flags    Attributes of the mapping
 	/// \returns      A pointer to the start of the mapped region
-	void * map_pages(addr_t address, size_t count);
+	void * map_pages(
+			addr_t address,
+			size_t count,
+			page_flags flags = page_flags::kernel_data);
 
 	/// Allocate and map contiguous pages into virtual memory, with
 	/// a constant offset from their physical address.
 	/// \arg count    The number of pages to map
+	/// \arg flags    Attributes of the mapping
 	/// \returns      A pointer to the start of the mapped region, or
 	/// nullptr if no region could be found to fit the request.
-	void * map_offset_pages(size_t count);
+	void * map_offset_pages(
+			size_t count,
+			page_flags flags = page_flags::kernel_data);
 
 	/// Unmap existing pages from memory.
 	/// \arg address  The virtual address of the memory to unmap
@@ -49,7 +109,13 @@ public:
 	/// Offset-map a pointer. No physical pages will be mapped.
 	/// \arg pointer  Pointer to a pointer to the memory area to be mapped
 	/// \arg length   Length of the memory area to be mapped
-	void map_offset_pointer(void **pointer, size_t length);
+	/// \arg flags    Attributes of the mapping, including its caching type
+	/// \arg policy   Which page sizes the mapping may use
+	void map_offset_pointer(
+			void **pointer,
+			size_t length,
+			page_flags flags = page_flags::kernel_mmio,
+			page_size_policy policy = page_size_policy::automatic);
 
 	/// Get the physical address of an offset-mapped pointer
 	/// \arg p   Virtual address of memory that has been offset-mapped
@@ -67,7 +133,7 @@ public:
 		return kutil::offset_pointer(reinterpret_cast<void *>(a), page_offset);
 	}
 
-	/// Log the current free/used block lists.
+	/// Log the current used block list and free frame count.
 	void dump_blocks();
 
 	/// Get the system page manager.
@@ -75,7 +141,11 @@ public:
 	static page_manager * get();
 
 private:
-	/// Set up the memory manager from bootstraped memory
+	/// Set up the memory manager from bootstraped memory. The frame
+	/// allocator must already be set up over the free memory's span.
+	/// \arg free         Blocks of free memory, to give to the frame allocator
+	/// \arg used         Blocks of used memory
+	/// \arg block_cache  Unused `page_block` structs
 	void init(
 			page_block *free,
 			page_block *used,
@@ -124,45 +194,79 @@ private:
 
 	/// Helper function to allocate a new page table. If table entry `i` in
 	/// table `base` is empty, allocate a new page table and point `base[i]` at
-	/// it.
-	/// \arg base  Existing page table being indexed into
-	/// \arg i     Index into the existing table to check
-	void check_needs_page(page_table *base, unsigned i);
+	/// it. If the entry is a large page, it is split into a new table of the
+	/// next smaller size of pages, mapping the same memory.
+	/// \arg base   Existing page table being indexed into
+	/// \arg i      Index into the existing table to check
+	/// \arg level  Level of `base`, from 4 for a PML4 to 2 for a PD
+	void check_needs_page(page_table *base, unsigned i, unsigned level);
 
 	/// Low-level routine for mapping a number of pages into the given page table.
+	/// 2MiB and 1GiB pages are used for the parts of the mapping that are
+	/// aligned to them in both address spaces, unless `policy` says not to.
 	/// \arg pml4       The root page table to map into
 	/// \arg phys_addr  The starting physical address of the pages to be mapped
 	/// \arg virt_addr  The starting virtual address ot the memory to be mapped
-	/// \arg count      The number of pages to map
+	/// \arg count      The number of (4KiB) pages to map
+	/// \arg flags      Attributes of the mapping. `no_execute` is dropped if
+	///                 the CPU does not support it, and write-combining
+	///                 becomes uncached without a PAT.
+	/// \arg policy     Which page sizes the mapping may use. With `force_large`,
+	///                 the mapping must already be 2MiB-aligned.
 	void page_in(
 			page_table *pml4,
 			addr_t phys_addr,
 			addr_t virt_addr,
-			size_t count);
+			size_t count,
+			page_flags flags = page_flags::kernel_code,
+			page_size_policy policy = page_size_policy::automatic);
 
 	/// Low-level routine for unmapping a number of pages from the given page table.
 	/// \arg pml4       The root page table for this mapping
 	/// \arg virt_addr  The starting virtual address ot the memory to be unmapped
 	/// \arg count      The number of pages to unmap
+	/// \arg tlb        [out] Batch to add the cleared entries to, for the
+	///                 caller to flush
 	void page_out(
 			page_table *pml4,
 			addr_t virt_addr,
-			size_t count);
+			size_t count,
+			tlb_batch &tlb);
+
+	/// Unmap pages from one page table and the tables below it. Large pages
+	/// only partly in the range are split first.
+	/// \arg table      The page table
+	/// \arg level      Level of `table`, from 4 for a PML4 to 1 for a PT
+	/// \arg virt_addr  The starting virtual address of the memory to be unmapped
+	/// \arg count      The number of pages to unmap
+	/// \arg tlb        [out] Batch to add the cleared entries to
+	/// \returns        The number of pages covered by this table's entries
+	size_t page_out_table(
+			page_table *table,
+			unsigned level,
+			addr_t virt_addr,
+			size_t count,
+			tlb_batch &tlb);
 
-	/// Get free pages from the free list. Only pages from the first free block
-	/// are returned, so the number may be less than requested, but they will
-	/// be contiguous. Pages will not be mapped into virtual memory.
+	/// Get free pages from the frame allocator. If there is no free run of
+	/// the whole count, the biggest run available is returned instead, so the
+	/// number may be less than requested, but they will be contiguous. Pages
+	/// will not be mapped into virtual memory.
 	/// \arg count    The maximum number of pages to get
 	/// \arg address  [out] The address of the first page
 	/// \returns      The number of pages retrieved
 	size_t pop_pages(size_t count, addr_t *address);
 
-	page_block *m_free; ///< Free pages list
+	kutil::frame_allocator m_frames; ///< Free physical pages
 	page_block *m_used; ///< In-use pages list
 
 	page_block *m_block_cache; ///< Cache of unused page_block structs
 	free_page_header *m_page_cache; ///< Cache of free pages to use for tables
 
+	bool m_huge_pages; ///< The CPU supports 1GiB pages
+	bool m_no_execute; ///< The CPU supports the NX bit, and it is enabled
+	bool m_pat;        ///< The CPU has a PAT, and it is programmed
+
 	friend void memory_initialize(const void *, size_t, size_t);
 	page_manager(const page_manager &) = delete;
 };
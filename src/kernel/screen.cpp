@@ -1,3 +1,4 @@
+#include "kutil/memory.h"
 #include "screen.h"
 
 template <typename T>
@@ -58,9 +59,9 @@ screen::color(uint8_t r, uint8_t g, uint8_t b) const
 void
 screen::fill(pixel_t color)
 {
-	const size_t len = m_resolution.size();
-	for (size_t i = 0; i < len; ++i)
-		m_framebuffer[i] = color;
+	// The framebuffer is only ever written, so keep it out of the cache
+	const uint64_t pair = (static_cast<uint64_t>(color) << 32) | color;
+	kutil::stream_fill(m_framebuffer, pair, m_resolution.size() * sizeof(pixel_t));
 }
 
 void
@@ -5,13 +5,20 @@ serial_port g_com1;
 
 
 serial_port::serial_port() :
-	m_port(0)
+	m_port(0),
+	m_fifo(1)
 {
 }
 
 serial_port::serial_port(uint16_t port) :
-	m_port(port)
+	m_port(port),
+	m_fifo(1)
 {
+	// Enable and clear the FIFOs. Only a 16550A or later reports them as
+	// working, and its transmit FIFO holds 16 characters.
+	outb(m_port + 2, 0xc7);
+	if ((inb(m_port + 2) & 0xc0) == 0xc0)
+		m_fifo = 16;
 }
 
 bool serial_port::read_ready() { return (inb(m_port + 5) & 0x01) != 0; }
@@ -29,3 +36,17 @@ serial_port::write(char c) {
 	outb(m_port, c);
 }
 
+
+void
+serial_port::write(const char *text, size_t length)
+{
+	while (length) {
+		// The transmitter being ready means its FIFO is empty
+		while (!write_ready());
+
+		size_t n = length < m_fifo ? length : m_fifo;
+		length -= n;
+		while (n--)
+			outb(m_port, *text++);
+	}
+}
@@ -1,6 +1,7 @@
 #pragma once
 /// \file serial.h
 /// Declarations related to serial ports.
+#include <stddef.h>
 #include <stdint.h>
 
 class serial_port
@@ -13,10 +14,18 @@ public:
 	serial_port();
 
 	void write(char c);
+
+	/// Write a run of characters. Waits for the transmitter once per
+	/// FIFO's worth of characters, instead of once per character.
+	/// \arg text    The characters to write
+	/// \arg length  Number of characters in `text`
+	void write(const char *text, size_t length);
+
 	char read();
 
 private:
 	uint16_t m_port;
+	uint8_t m_fifo;
 
 	bool read_ready();
 	bool write_ready();
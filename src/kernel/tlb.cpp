@@ -0,0 +1,140 @@
+#include <stdint.h>
+
+#include "cpu.h"
+#include "log.h"
+#include "tlb.h"
+
+const size_t tlb_batch::full_flush_threshold;
+const size_t tlb_batch::max_ranges;
+
+static const uint64_t cr4_pge = 1ull << 7;
+
+static bool g_tlb_invpcid = false;
+
+
+static inline uint64_t
+read_cr4()
+{
+	uint64_t cr4 = 0;
+	__asm__ __volatile__ ( "mov %%cr4, %0" : "=r" (cr4) );
+	return cr4;
+}
+
+static inline void
+write_cr4(uint64_t cr4)
+{
+	__asm__ __volatile__ ( "mov %0, %%cr4" :: "r" (cr4) : "memory" );
+}
+
+
+void
+tlb_init()
+{
+	cpu_id cpu;
+	cpu_id::regs features = cpu.get(1);
+	bool pge = features.edx_bit(13);
+	bool pcid = features.ecx_bit(17);
+	g_tlb_invpcid = cpu.get(7).ebx_bit(10);
+
+	uint64_t cr4 = read_cr4();
+
+	// Kernel mappings are global, so they stay in the TLB when CR3 changes
+	if (pge)
+		cr4 |= cr4_pge;
+
+	// PCIDs only pay off once address spaces are tagged with their own,
+	// and CR3 is loaded with the no-flush bit. Until then they stay off.
+	// INVPCID works without them.
+	write_cr4(cr4);
+
+	log::info(logs::memory, "TLB: global pages %s, PCID %s, INVPCID %s",
+			pge ? "on" : "unsupported",
+			pcid ? "available, unused" : "unsupported",
+			g_tlb_invpcid ? "yes" : "no");
+}
+
+void
+tlb_flush_all()
+{
+	if (g_tlb_invpcid) {
+		// Type 2: all PCIDs, including global translations
+		struct { uint64_t pcid, address; } desc = {0, 0};
+		__asm__ __volatile__ ( "invpcid %0, %1"
+				:: "m" (desc), "r" (2ull) : "memory" );
+		return;
+	}
+
+	uint64_t cr4 = read_cr4();
+	if (cr4 & cr4_pge) {
+		// Toggling global pages off and on flushes everything
+		write_cr4(cr4 & ~cr4_pge);
+		write_cr4(cr4);
+	} else {
+		uint64_t cr3 = 0;
+		__asm__ __volatile__ ( "mov %%cr3, %0" : "=r" (cr3) );
+		__asm__ __volatile__ ( "mov %0, %%cr3" :: "r" (cr3) : "memory" );
+	}
+}
+
+
+tlb_batch::tlb_batch() :
+	m_range_count(0),
+	m_entries(0),
+	m_full(false)
+{
+}
+
+tlb_batch::~tlb_batch()
+{
+	flush();
+}
+
+void
+tlb_batch::add(addr_t address, unsigned shift)
+{
+	++m_entries;
+	if (m_full || m_entries > full_flush_threshold) {
+		m_full = true;
+		return;
+	}
+
+	address &= ~((1ull << shift) - 1);
+
+	if (m_range_count) {
+		range &last = m_ranges[m_range_count - 1];
+		if (last.shift == shift &&
+			last.start + (last.count << shift) == address) {
+			++last.count;
+			return;
+		}
+	}
+
+	if (m_range_count == max_ranges) {
+		m_full = true;
+		return;
+	}
+
+	m_ranges[m_range_count++] = {address, 1, shift};
+}
+
+void
+tlb_batch::flush()
+{
+	if (!m_entries) return;
+
+	// Only the BSP is running so far. Once other CPUs are up, they need
+	// this same batch in one shootdown IPI from here.
+	if (m_full) {
+		tlb_flush_all();
+	} else {
+		for (size_t i = 0; i < m_range_count; ++i) {
+			const range &r = m_ranges[i];
+			for (size_t j = 0; j < r.count; ++j)
+				tlb_invalidate(r.start + (j << r.shift));
+		}
+	}
+
+	m_range_count = 0;
+	m_entries = 0;
+	m_full = false;
+}
@@ -0,0 +1,69 @@
+#pragma once
+/// \file tlb.h
+/// Invalidation of stale TLB entries after page mappings change.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kutil/memory.h"
+
+
+/// A batch of page table entries that have been changed or cleared, whose
+/// translations must be invalidated. Entries are collected into ranges while
+/// the tables are edited, and invalidated together by flush(): one `invlpg`
+/// per entry, or the whole TLB at once if there are too many for that to be
+/// cheaper.
+class tlb_batch
+{
+public:
+	tlb_batch();
+
+	/// Destructor. Flushes anything left in the batch.
+	~tlb_batch();
+
+	/// Add a changed page table entry to the batch.
+	/// \arg address  A virtual address mapped by the entry
+	/// \arg shift    Log2 of the size of memory the entry maps
+	void add(addr_t address, unsigned shift = 12);
+
+	/// Invalidate everything in the batch, and empty it.
+	void flush();
+
+	/// Number of entries above which flush() invalidates the whole TLB
+	static const size_t full_flush_threshold = 32;
+
+	/// Number of separate ranges kept before falling back to a full flush
+	static const size_t max_ranges = 8;
+
+private:
+	struct range
+	{
+		addr_t start;
+		size_t count;
+		unsigned shift;
+	};
+
+	range m_ranges[max_ranges];
+	size_t m_range_count;
+	size_t m_entries;
+	bool m_full;
+
+	tlb_batch(const tlb_batch &) = delete;
+};
+
+
+/// Find out which TLB features the CPU has, and enable global pages if it
+/// has them. PCIDs are left off while the kernel has only one address
+/// space, as there is nothing to tag.
+void tlb_init();
+
+/// Invalidate the translation of one virtual address on this CPU.
+/// \arg address  The virtual address
+inline void
+tlb_invalidate(addr_t address)
+{
+	__asm__ __volatile__ ( "invlpg (%0)" :: "r" (address) : "memory" );
+}
+
+/// Invalidate every translation on this CPU, including global pages.
+void tlb_flush_all();
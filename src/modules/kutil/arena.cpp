@@ -0,0 +1,111 @@
+#include "arena.h"
+#include "assert.h"
+
+namespace kutil {
+
+const size_t arena::default_chunk_size;
+const size_t arena::default_align;
+
+/// The header at the start of each chained chunk
+struct arena::chunk
+{
+	chunk *prev;
+	size_t length;
+
+	inline uint8_t * start() { return reinterpret_cast<uint8_t *>(this + 1); }
+	inline uint8_t * end() { return reinterpret_cast<uint8_t *>(this) + length; }
+};
+
+
+arena::arena() :
+	arena(nullptr, nullptr, 0, nullptr, 0)
+{
+}
+
+arena::arena(void *buffer, size_t length) :
+	arena(nullptr, nullptr, 0, buffer, length)
+{
+}
+
+arena::arena(chunk_alloc alloc_cb, chunk_free free_cb, size_t chunk_size, void *buffer, size_t length) :
+	m_alloc(alloc_cb),
+	m_free(free_cb),
+	m_chunk_size(chunk_size),
+	m_base(reinterpret_cast<uint8_t *>(buffer)),
+	m_base_end(m_base + length),
+	m_current(nullptr),
+	m_spare(nullptr),
+	m_next(m_base),
+	m_end(m_base_end),
+	m_used(0),
+	m_chunks(0)
+{
+	kassert(!alloc_cb || chunk_size > sizeof(chunk),
+			"Arena chunk size too small");
+}
+
+arena::~arena()
+{
+	reset();
+	if (m_spare)
+		m_free(m_spare, m_spare->length);
+}
+
+void *
+arena::grow(size_t length, size_t align)
+{
+	if (!m_alloc) return nullptr;
+
+	// Room for the header, the allocation and the worst case alignment
+	size_t need = sizeof(chunk) + length + align - 1;
+	if (need < length) return nullptr;
+
+	chunk *c = nullptr;
+	if (need <= m_chunk_size && m_spare) {
+		c = m_spare;
+		m_spare = nullptr;
+	} else {
+		size_t size = ((need + m_chunk_size - 1) / m_chunk_size) * m_chunk_size;
+		void *mem = m_alloc(size);
+		if (!mem) return nullptr;
+
+		c = reinterpret_cast<chunk *>(mem);
+		c->length = size;
+	}
+
+	c->prev = m_current;
+	m_current = c;
+	m_next = c->start();
+	m_end = c->end();
+	++m_chunks;
+
+	return allocate(length, align);
+}
+
+void
+arena::release(chunk *c)
+{
+	--m_chunks;
+	if (!m_spare && c->length == m_chunk_size) {
+		m_spare = c;
+	} else {
+		m_free(c, c->length);
+	}
+}
+
+void
+arena::reset(const mark &m)
+{
+	while (m_current != m.current) {
+		kassert(m_current, "Arena reset to a mark that is no longer valid");
+		chunk *c = m_current;
+		m_current = c->prev;
+		release(c);
+	}
+
+	m_next = m.next;
+	m_end = m_current ? m_current->end() : m_base_end;
+	m_used = m.used;
+}
+
+} // namespace kutil
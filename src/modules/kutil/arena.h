@@ -0,0 +1,170 @@
+#pragma once
+/// \file arena.h
+/// A bump allocator for short-lived objects that all die together.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+#include "kutil/memory.h"
+
+namespace kutil {
+
+
+/// A bump (arena) allocator. Allocation just moves a pointer forward, and
+/// memory is only given back all at once, by resetting the arena to an
+/// earlier mark. Objects created in an arena are never destroyed, so it is
+/// meant for plain data, or objects whose destructors don't matter.
+///
+/// An arena starts out with an optional fixed buffer. If it is given chunk
+/// callbacks, it chains on more chunks as it fills up, and gives them back
+/// when it is reset. The most recently released chunk is kept as a spare,
+/// so an arena that is reset after each request stops calling out for
+/// memory once it has warmed up. Arenas are not locked.
+class arena
+{
+public:
+	using chunk_alloc = void * (*)(size_t length);
+	using chunk_free = void (*)(void *start, size_t length);
+
+	/// Default size of chained chunks.
+	static const size_t default_chunk_size = 0x4000;
+
+	/// Alignment of allocations unless another is asked for.
+	static const size_t default_align = 16;
+
+	struct chunk;
+
+	/// A point in the arena's allocations to reset back to.
+	struct mark
+	{
+		chunk *current;
+		uint8_t *next;
+		size_t used;
+	};
+
+	/// Default constructor. Creates an arena that cannot allocate.
+	arena();
+
+	/// Constructor for an arena over a fixed buffer, which never grows.
+	/// \arg buffer  The memory to allocate from
+	/// \arg length  The size of the buffer in bytes
+	arena(void *buffer, size_t length);
+
+	/// Constructor for an arena that grows in chunks.
+	/// \arg alloc_cb    Function to get a new chunk of memory
+	/// \arg free_cb     Function to give back a chunk
+	/// \arg chunk_size  Size of chunks to ask for. Bigger allocations get
+	///                  chunks of a multiple of this size.
+	/// \arg buffer      Optional memory to allocate from before the first chunk
+	/// \arg length      The size of the buffer in bytes
+	arena(chunk_alloc alloc_cb, chunk_free free_cb,
+			size_t chunk_size = default_chunk_size,
+			void *buffer = nullptr, size_t length = 0);
+
+	/// Destructor. Gives back all chunks.
+	~arena();
+
+	/// Allocate memory from the arena.
+	/// \arg length  The amount of memory to allocate, in bytes
+	/// \arg align   Alignment wanted, a power of two
+	/// \returns     A pointer to the memory, or nullptr if the arena is
+	///              out of memory and could not get another chunk
+	inline void * allocate(size_t length, size_t align = default_align)
+	{
+		size_t pad = (0 - reinterpret_cast<uintptr_t>(m_next)) & (align - 1);
+		if (!m_next || static_cast<size_t>(m_end - m_next) < pad + length)
+			return grow(length, align);
+
+		void *p = m_next + pad;
+		m_next += pad + length;
+		m_used += pad + length;
+		return p;
+	}
+
+	/// Allocate and construct an object.
+	/// \returns  The new object, or nullptr if allocation failed
+	template <typename T, typename... Args>
+	T * create(Args&&... args)
+	{
+		void *p = allocate(sizeof(T), alignof(T));
+		return p ? new (p) T(std::forward<Args>(args)...) : nullptr;
+	}
+
+	/// Allocate and default-construct an array of objects.
+	/// \arg count  The number of objects
+	/// \returns    The first object, or nullptr if allocation failed
+	template <typename T>
+	T * create_array(size_t count)
+	{
+		if (count > SIZE_MAX / sizeof(T)) return nullptr;
+		T *p = reinterpret_cast<T *>(allocate(sizeof(T) * count, alignof(T)));
+		if (p)
+			for (size_t i = 0; i < count; ++i) new (&p[i]) T;
+		return p;
+	}
+
+	/// Get a mark of the arena's current state, to reset back to later.
+	inline mark get_mark() const { return {m_current, m_next, m_used}; }
+
+	/// Free everything allocated since a mark was taken. Marks taken after
+	/// this one become invalid.
+	/// \arg m  A mark previously returned by get_mark()
+	void reset(const mark &m);
+
+	/// Free everything allocated from the arena.
+	inline void reset() { reset({nullptr, m_base, 0}); }
+
+	/// Get the number of bytes allocated, including alignment padding.
+	inline size_t used() const { return m_used; }
+
+	/// Get the next free byte in the current chunk or buffer.
+	inline void * current() const { return m_next; }
+
+	/// Get the number of bytes left in the current chunk or buffer.
+	inline size_t remaining() const { return m_end - m_next; }
+
+	/// Get the number of chained chunks in use, not counting the spare.
+	inline size_t chunk_count() const { return m_chunks; }
+
+private:
+	/// Chain on a new chunk, and allocate from it.
+	void * grow(size_t length, size_t align);
+
+	/// Give back a chunk, or keep it as the spare.
+	void release(chunk *c);
+
+	chunk_alloc m_alloc;
+	chunk_free m_free;
+	size_t m_chunk_size;
+
+	uint8_t *m_base;     ///< The fixed buffer, if any
+	uint8_t *m_base_end;
+
+	chunk *m_current;    ///< The newest chunk, or nullptr if using the buffer
+	chunk *m_spare;      ///< A released chunk kept for reuse
+	uint8_t *m_next;
+	uint8_t *m_end;
+
+	size_t m_used;
+	size_t m_chunks;
+
+	arena(const arena &) = delete;
+};
+
+
+/// Resets an arena to where it was when the scope was entered, freeing
+/// everything allocated in the scope.
+class arena_scope
+{
+public:
+	arena_scope(arena &a) : m_arena(a), m_mark(a.get_mark()) {}
+	~arena_scope() { m_arena.reset(m_mark); }
+
+private:
+	arena &m_arena;
+	arena::mark m_mark;
+
+	arena_scope(const arena_scope &) = delete;
+};
+
+} // namespace kutil
@@ -0,0 +1,173 @@
+#include "assert.h"
+#include "bitmap_memory_manager.h"
+#include "memory.h"
+
+namespace kutil {
+
+
+static inline size_t
+bitmap_words(size_t max_length, unsigned order)
+{
+	size_t bits = max_length >> order;
+	return (bits + 63) / 64;
+}
+
+
+bitmap_memory_manager::bitmap_memory_manager() :
+	m_start(nullptr),
+	m_length(0),
+	m_max_length(0),
+	m_grow(nullptr)
+{
+	kutil::memset(m_free, 0, sizeof(m_free));
+	kutil::memset(m_split, 0, sizeof(m_split));
+	kutil::memset(m_free_count, 0, sizeof(m_free_count));
+	kutil::memset(m_hint, 0, sizeof(m_hint));
+}
+
+bitmap_memory_manager::bitmap_memory_manager(
+		void *start,
+		size_t max_length,
+		void *metadata,
+		grow_callback grow_cb) :
+	m_start(start),
+	m_length(0),
+	m_max_length(max_length),
+	m_grow(grow_cb)
+{
+	kassert(max_length % (1ull << max_size) == 0,
+			"Bitmap heap length must be a multiple of the max block size");
+
+	kutil::memset(metadata, 0, metadata_size(max_length));
+	kutil::memset(m_free_count, 0, sizeof(m_free_count));
+	kutil::memset(m_hint, 0, sizeof(m_hint));
+
+	uint64_t *words = reinterpret_cast<uint64_t *>(metadata);
+	for (unsigned order = min_size; order <= max_size; ++order) {
+		size_t n = bitmap_words(max_length, order);
+		m_free[order - min_size] = words;
+		m_split[order - min_size] = words + n;
+		words += 2 * n;
+	}
+
+	grow_memory();
+}
+
+size_t
+bitmap_memory_manager::metadata_size(size_t max_length)
+{
+	size_t words = 0;
+	for (unsigned order = min_size; order <= max_size; ++order)
+		words += 2 * bitmap_words(max_length, order);
+	return words * sizeof(uint64_t);
+}
+
+void *
+bitmap_memory_manager::allocate(size_t length)
+{
+	if (length > (1ull << max_size)) return nullptr;
+
+	unsigned order = min_size;
+	while (length > (1ull << order)) order++;
+
+	unsigned j = order;
+	while (j <= max_size && !m_free_count[j - min_size]) ++j;
+
+	if (j > max_size) {
+		if (!grow_memory()) return nullptr;
+		j = max_size;
+	}
+
+	size_t i = find_free(j);
+	clear_free(j, i);
+
+	// Split down to the wanted size, leaving the upper halves free
+	while (j > order) {
+		set_split(j, i, true);
+		--j;
+		i *= 2;
+		set_free(j, i + 1);
+	}
+
+	return kutil::offset_pointer(m_start, i << order);
+}
+
+void
+bitmap_memory_manager::free(void *p)
+{
+	if (!p) return;
+
+	size_t offset = reinterpret_cast<addr_t>(p) - reinterpret_cast<addr_t>(m_start);
+	kassert(offset < m_length, "Freed a pointer outside of the heap");
+
+	// Walk down the split blocks to find the block that was allocated
+	unsigned j = max_size;
+	size_t i = offset >> j;
+	while (j > min_size && is_split(j, i)) {
+		--j;
+		i = offset >> j;
+	}
+
+	kassert((offset & ((1ull << j) - 1)) == 0, "Freed a pointer into the middle of a block");
+	kassert(!is_free(j, i), "Freed a block that was already free");
+
+	while (j < max_size && is_free(j, i ^ 1)) {
+		clear_free(j, i ^ 1);
+		++j;
+		i >>= 1;
+		set_split(j, i, false);
+	}
+
+	set_free(j, i);
+}
+
+bool
+bitmap_memory_manager::grow_memory()
+{
+	size_t length = (1ull << max_size);
+	if (m_length + length > m_max_length) return false;
+
+	void *next = kutil::offset_pointer(m_start, m_length);
+	kassert(m_grow, "Tried to grow heap without a growth callback");
+	m_grow(next, length);
+
+	set_free(max_size, m_length >> max_size);
+	m_length += length;
+	return true;
+}
+
+size_t
+bitmap_memory_manager::find_free(unsigned order)
+{
+	const uint64_t *bitmap = m_free[order - min_size];
+	size_t words = bitmap_words(m_length, order);
+
+	size_t &hint = m_hint[order - min_size];
+	for (; hint < words; ++hint) {
+		uint64_t word = bitmap[hint];
+		if (word)
+			return hint * 64 + __builtin_ctzll(word);
+	}
+
+	kassert(0, "Bitmap free count and bitmap disagree");
+	return 0;
+}
+
+void
+bitmap_memory_manager::set_free(unsigned order, size_t i)
+{
+	m_free[order - min_size][i / 64] |= (1ull << (i % 64));
+	m_free_count[order - min_size] += 1;
+
+	size_t &hint = m_hint[order - min_size];
+	if (i / 64 < hint) hint = i / 64;
+}
+
+void
+bitmap_memory_manager::clear_free(unsigned order, size_t i)
+{
+	m_free[order - min_size][i / 64] &= ~(1ull << (i % 64));
+	m_free_count[order - min_size] -= 1;
+}
+
+} // namespace kutil
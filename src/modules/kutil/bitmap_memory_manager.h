@@ -0,0 +1,99 @@
+#pragma once
+/// \file bitmap_memory_manager.h
+/// A buddy allocator that keeps its block state in bitmaps outside the heap.
+
+#include <stddef.h>
+#include <stdint.h>
+#include "kutil/memory.h"
+
+namespace kutil {
+
+
+/// Manager for allocation of virtual memory. This is a buddy allocator with
+/// the same interface as `memory_manager`, but instead of keeping a header
+/// in each block, the free/split state of every block is kept in per-order
+/// bitmaps. Allocations carry no overhead, pointers returned are aligned to
+/// their block size, and freeing never touches the memory of buddy blocks.
+class bitmap_memory_manager
+{
+public:
+	using grow_callback = void (*)(void *start, size_t length);
+
+	/// Default constructor. Creates an invalid manager.
+	bitmap_memory_manager();
+
+	/// Constructor.
+	/// \arg start       Pointer to the start of the heap to be managed
+	/// \arg max_length  Maximum length the heap may grow to. Must be a
+	///                  multiple of (2^max_size).
+	/// \arg metadata    Memory for the block bitmaps, of at least
+	///                  `metadata_size(max_length)` bytes
+	/// \arg grow_cb     Function pointer to grow the heap size
+	bitmap_memory_manager(void *start, size_t max_length, void *metadata, grow_callback grow_cb);
+
+	/// Allocate memory from the area managed.
+	/// \arg length  The amount of memory to allocate, in bytes
+	/// \returns     A pointer to the allocated memory, aligned to the size of
+	///              its block, or nullptr if allocation failed.
+	void * allocate(size_t length);
+
+	/// Free a previous allocation.
+	/// \arg p  A pointer previously retuned by allocate()
+	void free(void *p);
+
+	/// Get the size of metadata needed to manage a heap.
+	/// \arg max_length  Maximum length of the heap
+	/// \returns         The number of bytes of metadata needed
+	static size_t metadata_size(size_t max_length);
+
+	/// Minimum block size is (2^min_size).
+	static const unsigned min_size = 6;
+
+	/// Maximum block size is (2^max_size). Must be less than 64.
+	static const unsigned max_size = 16;
+
+	/// Number of distinct block sizes
+	static const unsigned num_orders = max_size - min_size + 1;
+
+protected:
+	/// Expand the size of memory by one max_size block.
+	/// \returns  False if the heap is already at its maximum length
+	bool grow_memory();
+
+	/// Find a free block of the given order. There must be at least one.
+	/// \arg order  Size category of the block we want
+	/// \returns    The index of the block within its order
+	size_t find_free(unsigned order);
+
+	void set_free(unsigned order, size_t i);
+	void clear_free(unsigned order, size_t i);
+
+	inline bool is_free(unsigned order, size_t i) const {
+		return (m_free[order - min_size][i / 64] >> (i % 64)) & 1;
+	}
+
+	inline bool is_split(unsigned order, size_t i) const {
+		return (m_split[order - min_size][i / 64] >> (i % 64)) & 1;
+	}
+
+	inline void set_split(unsigned order, size_t i, bool split) {
+		uint64_t &word = m_split[order - min_size][i / 64];
+		if (split) word |= (1ull << (i % 64));
+		else word &= ~(1ull << (i % 64));
+	}
+
+	uint64_t *m_free[num_orders];   ///< Bit set if a whole block is free
+	uint64_t *m_split[num_orders];  ///< Bit set if a block is split in two
+	size_t m_free_count[num_orders];
+	size_t m_hint[num_orders];      ///< Lowest bitmap word that may be non-zero
+
+	void *m_start;
+	size_t m_length;
+	size_t m_max_length;
+
+	grow_callback m_grow;
+
+	bitmap_memory_manager(const bitmap_memory_manager &) = delete;
+};
+
+} // namespace kutil
@@ -0,0 +1,343 @@
+#include <stdint.h>
+#include "format.h"
+#include "memory.h"
+
+namespace kutil {
+
+/// Collects output into chunks for a sink, and counts it.
+class format_writer
+{
+public:
+	format_writer(format_sink sink, void *context) :
+		m_sink(sink), m_context(context), m_used(0), m_total(0) {}
+
+	void put(char c)
+	{
+		if (m_used == format_chunk) flush();
+		m_buffer[m_used++] = c;
+		++m_total;
+	}
+
+	void put(const char *s, size_t n)
+	{
+		while (n) {
+			if (m_used == format_chunk) flush();
+			size_t count = format_chunk - m_used;
+			if (count > n) count = n;
+			kutil::memcpy(m_buffer + m_used, s, count);
+			m_used += count;
+			m_total += count;
+			s += count;
+			n -= count;
+		}
+	}
+
+	void pad(char c, size_t n) { while (n--) put(c); }
+
+	void flush()
+	{
+		if (m_used) m_sink(m_context, m_buffer, m_used);
+		m_used = 0;
+	}
+
+	size_t total() const { return m_total; }
+
+private:
+	format_sink m_sink;
+	void *m_context;
+	size_t m_used;
+	size_t m_total;
+	char m_buffer[format_chunk];
+};
+
+/// A parsed conversion specification
+struct format_spec
+{
+	bool left;      ///< '-' flag: pad on the right
+	bool plus;      ///< '+' flag: always show a sign
+	bool space;     ///< ' ' flag: show a space for positive numbers
+	bool alt;       ///< '#' flag: show the base prefix
+	bool zero;      ///< '0' flag: pad numbers with zeros
+	int width;      ///< Minimum width, or 0
+	int precision;  ///< Precision, or -1 if none was given
+};
+
+/// Output a number formatted by a spec.
+/// \arg out       Where to output
+/// \arg spec      The parsed specification
+/// \arg value     The absolute value of the number
+/// \arg negative  The number is negative
+/// \arg base      The base: 2, 8, 10 or 16
+/// \arg upper     Use upper case hex digits and prefix
+/// \arg prefix    Base prefix to show if the value is non-zero, or nullptr
+static void
+put_number(format_writer &out, const format_spec &spec, uint64_t value,
+		bool negative, unsigned base, bool upper, const char *prefix)
+{
+	const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+
+	char buffer[64];
+	char *end = buffer + sizeof(buffer);
+	char *p = end;
+
+	// A precision of 0 prints nothing at all for the value 0
+	if (value || spec.precision != 0) {
+		do {
+			*--p = digits[value % base];
+			value /= base;
+		} while (value);
+	}
+	size_t length = end - p;
+
+	// Octal's alternate form is a leading zero, not a prefix
+	if (base == 8 && spec.alt && (p == end || *p != '0')) {
+		*--p = '0';
+		++length;
+	}
+
+	char sign = negative ? '-' : spec.plus ? '+' : spec.space ? ' ' : 0;
+	size_t prefix_length = 0;
+	if (prefix) while (prefix[prefix_length]) ++prefix_length;
+
+	size_t zeros = 0;
+	if (spec.precision >= 0 && static_cast<size_t>(spec.precision) > length)
+		zeros = spec.precision - length;
+
+	size_t total = (sign ? 1 : 0) + prefix_length + zeros + length;
+	size_t padding = static_cast<size_t>(spec.width) > total ? spec.width - total : 0;
+
+	// The 0 flag is ignored if a precision is given
+	if (spec.zero && !spec.left && spec.precision < 0) {
+		zeros += padding;
+		padding = 0;
+	}
+
+	if (!spec.left) out.pad(' ', padding);
+	if (sign) out.put(sign);
+	if (prefix_length) out.put(prefix, prefix_length);
+	out.pad('0', zeros);
+	out.put(p, length);
+	if (spec.left) out.pad(' ', padding);
+}
+
+/// Output a string formatted by a spec.
+static void
+put_string(format_writer &out, const format_spec &spec, const char *s, size_t max)
+{
+	size_t length = 0;
+	while (length < max && s[length]) ++length;
+
+	size_t padding = static_cast<size_t>(spec.width) > length ? spec.width - length : 0;
+	if (!spec.left) out.pad(' ', padding);
+	out.put(s, length);
+	if (spec.left) out.pad(' ', padding);
+}
+
+enum class format_length { none, hh, h, l, ll, z, j, t };
+
+size_t
+vformat(format_sink sink, void *context, const char *fmt, va_list args)
+{
+	format_writer out(sink, context);
+
+	while (*fmt) {
+		if (*fmt != '%') {
+			// Output literal text in runs
+			const char *start = fmt;
+			while (*fmt && *fmt != '%') ++fmt;
+			out.put(start, fmt - start);
+			continue;
+		}
+
+		const char *start = fmt++;
+		format_spec spec = {false, false, false, false, false, 0, -1};
+
+		for (bool flags = true; flags; ) {
+			switch (*fmt) {
+			case '-': spec.left = true; ++fmt; break;
+			case '+': spec.plus = true; ++fmt; break;
+			case ' ': spec.space = true; ++fmt; break;
+			case '#': spec.alt = true; ++fmt; break;
+			case '0': spec.zero = true; ++fmt; break;
+			default: flags = false;
+			}
+		}
+
+		if (*fmt == '*') {
+			spec.width = va_arg(args, int);
+			if (spec.width < 0) {
+				spec.left = true;
+				spec.width = -spec.width;
+			}
+			++fmt;
+		} else {
+			while (*fmt >= '0' && *fmt <= '9')
+				spec.width = spec.width * 10 + (*fmt++ - '0');
+		}
+
+		if (*fmt == '.') {
+			++fmt;
+			spec.precision = 0;
+			if (*fmt == '*') {
+				spec.precision = va_arg(args, int);
+				if (spec.precision < 0) spec.precision = -1;
+				++fmt;
+			} else {
+				while (*fmt >= '0' && *fmt <= '9')
+					spec.precision = spec.precision * 10 + (*fmt++ - '0');
+			}
+		}
+
+		format_length length = format_length::none;
+		switch (*fmt) {
+		case 'h':
+			++fmt;
+			if (*fmt == 'h') { ++fmt; length = format_length::hh; }
+			else length = format_length::h;
+			break;
+
+		case 'l':
+			++fmt;
+			if (*fmt == 'l') { ++fmt; length = format_length::ll; }
+			else length = format_length::l;
+			break;
+
+		case 'z': ++fmt; length = format_length::z; break;
+		case 'j': ++fmt; length = format_length::j; break;
+		case 't': ++fmt; length = format_length::t; break;
+		default: break;
+		}
+
+		const char conversion = *fmt;
+		if (conversion) ++fmt;
+
+		switch (conversion) {
+		case 'd':
+		case 'i': {
+				int64_t value;
+				switch (length) {
+				case format_length::hh: value = static_cast<signed char>(va_arg(args, int)); break;
+				case format_length::h: value = static_cast<short>(va_arg(args, int)); break;
+				case format_length::none: value = va_arg(args, int); break;
+				default: value = va_arg(args, int64_t); break;
+				}
+
+				// Negate as unsigned, so INT64_MIN works
+				uint64_t magnitude = value < 0 ?
+					0 - static_cast<uint64_t>(value) : static_cast<uint64_t>(value);
+				put_number(out, spec, magnitude, value < 0, 10, false, nullptr);
+			}
+			break;
+
+		case 'u':
+		case 'o':
+		case 'x':
+		case 'X':
+		case 'b': {
+				uint64_t value;
+				switch (length) {
+				case format_length::hh: value = static_cast<unsigned char>(va_arg(args, unsigned)); break;
+				case format_length::h: value = static_cast<unsigned short>(va_arg(args, unsigned)); break;
+				case format_length::none: value = va_arg(args, unsigned); break;
+				default: value = va_arg(args, uint64_t); break;
+				}
+
+				unsigned base = 10;
+				const char *prefix = nullptr;
+				switch (conversion) {
+				case 'o': base = 8; break;
+				case 'x': base = 16; prefix = "0x"; break;
+				case 'X': base = 16; prefix = "0X"; break;
+				case 'b': base = 2; prefix = "0b"; break;
+				}
+
+				spec.plus = spec.space = false;
+				if (!spec.alt || !value) prefix = nullptr;
+				put_number(out, spec, value, false, base, conversion == 'X', prefix);
+			}
+			break;
+
+		case 'p': {
+				const void *p = va_arg(args, const void *);
+				spec.plus = spec.space = false;
+				put_number(out, spec, reinterpret_cast<uint64_t>(p), false, 16, false, "0x");
+			}
+			break;
+
+		case 'c': {
+				char c = static_cast<char>(va_arg(args, int));
+				spec.precision = -1;
+				put_string(out, spec, &c, 1);
+			}
+			break;
+
+		case 's': {
+				const char *s = va_arg(args, const char *);
+				if (!s) s = "(null)";
+				put_string(out, spec, s,
+						spec.precision < 0 ? static_cast<size_t>(-1) : spec.precision);
+			}
+			break;
+
+		case '%':
+			out.put('%');
+			break;
+
+		default:
+			// Not a conversion we know; output it as it was written
+			out.put(start, fmt - start);
+			break;
+		}
+	}
+
+	out.flush();
+	return out.total();
+}
+
+size_t
+format(format_sink sink, void *context, const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	size_t length = vformat(sink, context, fmt, args);
+	va_end(args);
+	return length;
+}
+
+/// Where vsnprintf() is writing to
+struct buffer_sink
+{
+	char *buffer;
+	size_t space;   ///< Bytes left, not counting the null terminator
+};
+
+static void
+write_buffer(void *context, const char *text, size_t length)
+{
+	buffer_sink *dest = reinterpret_cast<buffer_sink *>(context);
+	if (length > dest->space) length = dest->space;
+	kutil::memcpy(dest->buffer, text, length);
+	dest->buffer += length;
+	dest->space -= length;
+}
+
+size_t
+vsnprintf(char *buffer, size_t size, const char *fmt, va_list args)
+{
+	buffer_sink dest = {buffer, size ? size - 1 : 0};
+	size_t length = vformat(write_buffer, &dest, fmt, args);
+	if (size) *dest.buffer = 0;
+	return length;
+}
+
+size_t
+snprintf(char *buffer, size_t size, const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	size_t length = vsnprintf(buffer, size, fmt, args);
+	va_end(args);
+	return length;
+}
+
+} // namespace kutil
@@ -0,0 +1,52 @@
+#pragma once
+/// \file format.h
+/// printf-style formatting into buffers or any other output
+
+#include <stdarg.h>
+#include <stddef.h>
+
+namespace kutil {
+
+/// A function that takes formatted output. It may be called several times
+/// for one message, with pieces of at most `format_chunk` characters.
+/// \arg context  The context pointer given to vformat()
+/// \arg text     The characters to output, not null terminated
+/// \arg length   The number of characters
+using format_sink = void (*)(void *context, const char *text, size_t length);
+
+/// The size of pieces vformat() collects output into before passing them
+/// to its sink. Shorter messages reach the sink in a single call.
+constexpr size_t format_chunk = 256;
+
+/// Format a string and pass it to a sink. Supports the C99 conversions
+/// `d i u o x X c s p %`, with the `- + # 0 space` flags, width and
+/// precision (including `*`), and the `hh h l ll z j t` length modifiers.
+/// Also supports `b` for binary. Anything else is output unchanged.
+/// \arg sink     Function to receive the output
+/// \arg context  Passed to the sink with each piece
+/// \arg fmt      The format string
+/// \arg args     The values to format
+/// \returns      The number of characters output
+size_t vformat(format_sink sink, void *context, const char *fmt, va_list args);
+
+/// Format a string and pass it to a sink. See vformat().
+/// \returns  The number of characters output
+size_t format(format_sink sink, void *context, const char *fmt, ...)
+	__attribute__ ((format (printf, 3, 4)));
+
+/// Format a string into a buffer. The output is always null terminated,
+/// and is cut short if it does not fit. See vformat() for the formats.
+/// \arg buffer  The buffer to write to
+/// \arg size    The size of the buffer in bytes
+/// \arg fmt     The format string
+/// \arg args    The values to format
+/// \returns     The length of the whole formatted string, which is size
+///              or more if it was cut short
+size_t vsnprintf(char *buffer, size_t size, const char *fmt, va_list args);
+
+/// Format a string into a buffer. See vsnprintf().
+/// \returns  The length of the whole formatted string
+size_t snprintf(char *buffer, size_t size, const char *fmt, ...)
+	__attribute__ ((format (printf, 3, 4)));
+
+} // namespace kutil
@@ -0,0 +1,243 @@
+#include "assert.h"
+#include "frame_allocator.h"
+#include "memory.h"
+
+namespace kutil {
+
+const unsigned frame_allocator::frame_shift;
+const unsigned frame_allocator::max_order;
+const unsigned frame_allocator::num_orders;
+
+
+static inline size_t
+bitmap_words(size_t frames, unsigned order)
+{
+	size_t bits = frames >> order;
+	return (bits + 63) / 64;
+}
+
+static inline size_t
+summary_words(size_t frames, unsigned order)
+{
+	return (bitmap_words(frames, order) + 63) / 64;
+}
+
+
+frame_allocator::frame_allocator() :
+	m_base(0),
+	m_frames(0)
+{
+	kutil::memset(m_free, 0, sizeof(m_free));
+	kutil::memset(m_summary, 0, sizeof(m_summary));
+	kutil::memset(m_free_count, 0, sizeof(m_free_count));
+	kutil::memset(m_hint, 0, sizeof(m_hint));
+}
+
+frame_allocator::frame_allocator(addr_t base, size_t frames, void *metadata) :
+	m_base(base),
+	m_frames(round_frames(frames))
+{
+	kassert((base & ((1ull << (max_order + frame_shift)) - 1)) == 0,
+			"Frame allocator base must be aligned to the largest block");
+
+	kutil::memset(metadata, 0, metadata_size(frames));
+	kutil::memset(m_free_count, 0, sizeof(m_free_count));
+	kutil::memset(m_hint, 0, sizeof(m_hint));
+
+	uint64_t *words = reinterpret_cast<uint64_t *>(metadata);
+	for (unsigned order = 0; order <= max_order; ++order) {
+		m_free[order] = words;
+		words += bitmap_words(m_frames, order);
+		m_summary[order] = words;
+		words += summary_words(m_frames, order);
+	}
+}
+
+size_t
+frame_allocator::metadata_size(size_t frames)
+{
+	frames = round_frames(frames);
+
+	size_t words = 0;
+	for (unsigned order = 0; order <= max_order; ++order)
+		words += bitmap_words(frames, order) + summary_words(frames, order);
+	return words * sizeof(uint64_t);
+}
+
+bool
+frame_allocator::allocate(size_t count, addr_t *address)
+{
+	if (!count) return false;
+	if (count > (1ull << max_order))
+		return allocate_run(count, address);
+
+	unsigned order = 0;
+	while (count > (1ull << order)) order++;
+
+	unsigned j = order;
+	while (j <= max_order && !m_free_count[j]) ++j;
+	if (j > max_order) return false;
+
+	size_t i = find_free(j);
+	clear_free(j, i);
+
+	// Split down to the wanted size, leaving the upper halves free
+	while (j > order) {
+		--j;
+		i *= 2;
+		set_free(j, i + 1);
+	}
+
+	size_t frame = i << order;
+	size_t extra = (1ull << order) - count;
+	if (extra)
+		free(m_base + ((frame + count) << frame_shift), extra);
+
+	*address = m_base + (frame << frame_shift);
+	return true;
+}
+
+bool
+frame_allocator::allocate_run(size_t count, addr_t *address)
+{
+	const size_t block = 1ull << max_order;
+	const size_t blocks = (count + block - 1) / block;
+	if (count > m_frames || blocks > m_free_count[max_order])
+		return false;
+
+	// Largest blocks never merge, so only a walk of their bitmap finds
+	// ones next to each other
+	size_t run = 0;
+	for (size_t i = 0; i < (m_frames >> max_order); ++i) {
+		run = is_free(max_order, i) ? run + 1 : 0;
+		if (run < blocks) continue;
+
+		size_t first = i + 1 - blocks;
+		for (size_t j = first; j <= i; ++j)
+			clear_free(max_order, j);
+
+		size_t frame = first << max_order;
+		size_t extra = blocks * block - count;
+		if (extra)
+			free(m_base + ((frame + count) << frame_shift), extra);
+
+		*address = m_base + (frame << frame_shift);
+		return true;
+	}
+
+	return false;
+}
+
+size_t
+frame_allocator::allocate_some(size_t count, addr_t *address)
+{
+	if (count > (1ull << max_order))
+		count = 1ull << max_order;
+
+	if (allocate(count, address))
+		return count;
+
+	// Nothing is free that fits all of count, so take the biggest block
+	for (unsigned j = max_order + 1; j > 0; --j) {
+		if (!m_free_count[j - 1]) continue;
+
+		size_t n = 1ull << (j - 1);
+		if (n > count) continue;
+		return allocate(n, address) ? n : 0;
+	}
+
+	return 0;
+}
+
+void
+frame_allocator::free(addr_t address, size_t count)
+{
+	kassert((address & ((1ull << frame_shift) - 1)) == 0, "Freed an unaligned frame");
+	kassert(contains(address) && count <= m_frames - ((address - m_base) >> frame_shift),
+			"Freed frames outside of the allocator");
+
+	size_t frame = (address - m_base) >> frame_shift;
+	size_t end = frame + count;
+
+	// Free the run as the biggest aligned blocks that fit in it
+	while (frame < end) {
+		unsigned order = 0;
+		while (order < max_order &&
+				(frame & ((2ull << order) - 1)) == 0 &&
+				frame + (2ull << order) <= end)
+			++order;
+
+		free_block(order, frame >> order);
+		frame += 1ull << order;
+	}
+}
+
+size_t
+frame_allocator::free_frames() const
+{
+	size_t frames = 0;
+	for (unsigned order = 0; order <= max_order; ++order)
+		frames += m_free_count[order] << order;
+	return frames;
+}
+
+void
+frame_allocator::free_block(unsigned order, size_t i)
+{
+	// Catch the block, or a bigger block holding it, already being free.
+	// Smaller free blocks inside it are not checked for.
+	for (unsigned o = order; o <= max_order; ++o)
+		kassert(!is_free(o, i >> (o - order)), "Freed a frame that was already free");
+
+	while (order < max_order && is_free(order, i ^ 1)) {
+		clear_free(order, i ^ 1);
+		++order;
+		i >>= 1;
+	}
+
+	set_free(order, i);
+}
+
+size_t
+frame_allocator::find_free(unsigned order)
+{
+	const uint64_t *summary = m_summary[order];
+	size_t words = summary_words(m_frames, order);
+
+	size_t &hint = m_hint[order];
+	for (; hint < words; ++hint) {
+		uint64_t word = summary[hint];
+		if (word) {
+			size_t index = hint * 64 + __builtin_ctzll(word);
+			return index * 64 + __builtin_ctzll(m_free[order][index]);
+		}
+	}
+
+	kassert(0, "Frame free count and bitmap disagree");
+	return 0;
+}
+
+void
+frame_allocator::set_free(unsigned order, size_t i)
+{
+	size_t index = i / 64;
+	m_free[order][index] |= (1ull << (i % 64));
+	m_summary[order][index / 64] |= (1ull << (index % 64));
+	m_free_count[order] += 1;
+
+	size_t &hint = m_hint[order];
+	if (index / 64 < hint) hint = index / 64;
+}
+
+void
+frame_allocator::clear_free(unsigned order, size_t i)
+{
+	size_t index = i / 64;
+	uint64_t &word = m_free[order][index];
+	word &= ~(1ull << (i % 64));
+	if (!word)
+		m_summary[order][index / 64] &= ~(1ull << (index % 64));
+	m_free_count[order] -= 1;
+}
+
+} // namespace kutil
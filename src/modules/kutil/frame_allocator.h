@@ -0,0 +1,123 @@
+#pragma once
+/// \file frame_allocator.h
+/// A buddy allocator of physical page frames, with its state in bitmaps.
+
+#include <stddef.h>
+#include <stdint.h>
+#include "kutil/memory.h"
+
+namespace kutil {
+
+
+/// Allocator of physical page frames. This is a buddy system over a span of
+/// physical memory, which may have holes in it: frames start out allocated,
+/// and the usable regions are given to free(). Free blocks of each order are
+/// kept in a bitmap, with a summary bitmap of its non-zero words above it,
+/// so finding a free block looks at two words in the common case, and
+/// allocating or freeing a run of frames is O(log n). The frames themselves
+/// are never touched, so they do not need to be mapped.
+///
+/// Runs that are not a power of two pages are allocated from the next
+/// bigger block, and the tail is freed again. Runs bigger than the largest
+/// block take adjacent free largest blocks. Blocks are aligned to their
+/// size relative to the physical base, which is aligned to the largest
+/// block size.
+class frame_allocator
+{
+public:
+	/// Default constructor. Creates an allocator with no frames.
+	frame_allocator();
+
+	/// Constructor. All frames start out allocated.
+	/// \arg base      Physical address of the first frame. Must be aligned
+	///                to the largest block size.
+	/// \arg frames    Number of frames in the span
+	/// \arg metadata  Memory for the bitmaps, of at least
+	///                `metadata_size(frames)` bytes
+	frame_allocator(addr_t base, size_t frames, void *metadata);
+
+	/// Allocate a contiguous run of frames.
+	/// \arg count    The number of frames
+	/// \arg address  [out] The physical address of the first frame
+	/// \returns      True if the frames were allocated
+	bool allocate(size_t count, addr_t *address);
+
+	/// Allocate as many contiguous frames as possible, up to a limit.
+	/// \arg count    The maximum number of frames
+	/// \arg address  [out] The physical address of the first frame
+	/// \returns      The number of frames allocated, or 0 if none are free
+	size_t allocate_some(size_t count, addr_t *address);
+
+	/// Free a run of frames. The run does not need to have been allocated
+	/// in one piece.
+	/// \arg address  The physical address of the first frame
+	/// \arg count    The number of frames
+	void free(addr_t address, size_t count);
+
+	/// Check if a physical address is in this allocator's span.
+	inline bool contains(addr_t address) const
+	{
+		return address >= m_base && address - m_base < (m_frames << frame_shift);
+	}
+
+	/// Get the number of free frames.
+	size_t free_frames() const;
+
+	/// Get the size of metadata needed for a span of frames.
+	/// \arg frames  Number of frames in the span
+	/// \returns     The number of bytes of metadata needed
+	static size_t metadata_size(size_t frames);
+
+	/// Round a span of frames up to a whole number of the largest blocks.
+	/// \arg frames  Number of frames
+	/// \returns     The number of frames the allocator will manage
+	static inline size_t round_frames(size_t frames)
+	{
+		const size_t block = 1ull << max_order;
+		return ((frames + block - 1) / block) * block;
+	}
+
+	/// Frames are (2^frame_shift) bytes.
+	static const unsigned frame_shift = 12;
+
+	/// Largest blocks are (2^max_order) frames.
+	static const unsigned max_order = 10;
+
+	/// Number of distinct block sizes
+	static const unsigned num_orders = max_order + 1;
+
+protected:
+	/// Find a free block of the given order. There must be at least one.
+	/// \arg order  Size category of the block we want
+	/// \returns    The index of the block within its order
+	size_t find_free(unsigned order);
+
+	/// Free a single block, and merge it with its free buddies.
+	void free_block(unsigned order, size_t i);
+
+	/// Allocate a run of frames bigger than the largest block, from a run
+	/// of adjacent free largest blocks.
+	/// \arg count    The number of frames, more than (2^max_order)
+	/// \arg address  [out] The physical address of the first frame
+	/// \returns      True if the frames were allocated
+	bool allocate_run(size_t count, addr_t *address);
+
+	void set_free(unsigned order, size_t i);
+	void clear_free(unsigned order, size_t i);
+
+	inline bool is_free(unsigned order, size_t i) const {
+		return (m_free[order][i / 64] >> (i % 64)) & 1;
+	}
+
+	uint64_t *m_free[num_orders];     ///< Bit set if a block is free
+	uint64_t *m_summary[num_orders];  ///< Bit set if a word of m_free is non-zero
+	size_t m_free_count[num_orders];
+	size_t m_hint[num_orders];        ///< Lowest summary word that may be non-zero
+
+	addr_t m_base;
+	size_t m_frames;
+
+	frame_allocator(const frame_allocator &) = delete;
+};
+
+} // namespace kutil
@@ -0,0 +1,422 @@
+#pragma once
+/// \file hash_map.h
+/// Open-addressing hash maps and sets for use in kernel space
+
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+#include "kutil/assert.h"
+#include "kutil/memory.h"
+
+namespace kutil {
+
+/// Default hash function: integers, enums and pointers hash to their own
+/// value. The table mixes the bits itself, so this need not. Other key
+/// types need their own hash function.
+template <typename K>
+struct hash
+{
+	inline uint64_t operator()(const K &key) const { return static_cast<uint64_t>(key); }
+};
+
+template <typename T>
+struct hash<T *>
+{
+	inline uint64_t operator()(T *key) const { return reinterpret_cast<uint64_t>(key); }
+};
+
+
+/// A key and its value, as stored in a hash_map.
+template <typename K, typename V>
+struct hash_entry
+{
+	K key;
+	V value;
+};
+
+
+/// The open-addressing table under hash_map and hash_set. Slots are kept
+/// in Robin Hood order: an item never sits further from its home slot than
+/// the item it would displace, so lookups stop early and the variance of
+/// probe lengths stays low. Each slot's probe distance is kept in its own
+/// byte array, so probing touches few cache lines, and a distance of zero
+/// marks an empty slot.
+///
+/// The table either grows on the heap to stay under 7/8 full, or is given
+/// fixed storage by a derived class and refuses inserts once that is
+/// 7/8 full.
+/// \tparam K     Type of keys
+/// \tparam Item  Type stored in each slot: K, or a hash_entry
+/// \tparam H     Hash function object type
+template <typename K, typename Item, typename H>
+class hash_table
+{
+public:
+	class iterator
+	{
+	public:
+		iterator(hash_table *t, size_t i) : m_table(t), m_index(i) { skip(); }
+		inline Item & operator*() const { return m_table->m_items[m_index]; }
+		inline Item * operator->() const { return &m_table->m_items[m_index]; }
+		inline iterator & operator++() { ++m_index; skip(); return *this; }
+		inline bool operator!=(const iterator &o) const { return m_index != o.m_index; }
+
+	private:
+		void skip() { while (m_index < m_table->m_slots && !m_table->m_dist[m_index]) ++m_index; }
+		hash_table *m_table;
+		size_t m_index;
+	};
+
+	/// Default constructor. Creates an empty table that grows on the heap.
+	hash_table() :
+		m_dist(nullptr),
+		m_items(nullptr),
+		m_slots(0),
+		m_shift(64),
+		m_count(0),
+		m_fixed(false)
+	{}
+
+	/// Constructor. Creates an empty table that grows on the heap.
+	/// \arg capacity  Number of items to make room for
+	hash_table(size_t capacity) : hash_table()
+	{
+		reserve(capacity);
+	}
+
+	/// Destructor. Destroys any remaining items.
+	~hash_table()
+	{
+		clear();
+		if (!m_fixed)
+			kutil::free(m_dist);
+	}
+
+	/// Get the number of items in the table.
+	inline size_t count() const { return m_count; }
+
+	/// Get the number of items the table can hold without growing.
+	inline size_t capacity() const { return m_slots - m_slots / 8; }
+
+	/// Remove all items from the table, keeping its storage.
+	void clear()
+	{
+		for (size_t i = 0; i < m_slots; ++i) {
+			if (m_dist[i]) {
+				m_items[i].~Item();
+				m_dist[i] = 0;
+			}
+		}
+		m_count = 0;
+	}
+
+	/// Make sure the table can hold a number of items without growing.
+	/// Fixed tables can't grow, and ignore this.
+	/// \arg capacity  Number of items to make room for
+	void reserve(size_t capacity)
+	{
+		if (m_fixed || capacity <= this->capacity()) return;
+
+		size_t slots = m_slots ? m_slots : 8;
+		while (slots - slots / 8 < capacity) slots *= 2;
+		rehash(slots);
+	}
+
+	iterator begin() { return iterator(this, 0); }
+	iterator end() { return iterator(this, m_slots); }
+
+protected:
+	/// Constructor for tables with fixed storage.
+	/// \arg dist   Storage for `slots` probe distances, zero filled
+	/// \arg items  Storage for `slots` items
+	/// \arg slots  Number of slots, a power of two
+	hash_table(uint8_t *dist, Item *items, size_t slots) :
+		m_dist(dist),
+		m_items(items),
+		m_slots(slots),
+		m_shift(64 - __builtin_ctzll(slots)),
+		m_count(0),
+		m_fixed(true)
+	{}
+
+	static inline const K & key_of(const K &item) { return item; }
+
+	template <typename V>
+	static inline const K & key_of(const hash_entry<K, V> &item) { return item.key; }
+
+	/// Find the slot holding a key.
+	/// \returns  The item, or nullptr if the key is not in the table
+	Item * lookup(const K &key) const
+	{
+		if (!m_count) return nullptr;
+
+		const size_t mask = m_slots - 1;
+		size_t i = home(key);
+		for (unsigned dist = 1; dist <= m_dist[i]; ++dist) {
+			if (m_dist[i] == dist && key_of(m_items[i]) == key)
+				return &m_items[i];
+			i = (i + 1) & mask;
+		}
+		return nullptr;
+	}
+
+	/// Add an item whose key is not yet in the table.
+	/// \returns  The item in its slot, or nullptr if the table is full
+	Item * add(Item &&item)
+	{
+		if (m_count + 1 > capacity()) {
+			if (m_fixed) return nullptr;
+			rehash(m_slots ? m_slots * 2 : 8);
+		}
+
+		const K key = key_of(item);
+		if (!place(std::move(item))) {
+			// A probe ran too long; spread the items out and try again.
+			// The new item was already placed, only the displaced one is
+			// left to add.
+			kassert(!m_fixed, "Fixed hash table probe too long");
+			rehash(m_slots * 2);
+			place(std::move(item));
+		}
+
+		++m_count;
+		return lookup(key);
+	}
+
+	/// Remove the item in a slot, shifting the items after it back.
+	/// \arg item  An item returned by lookup()
+	void erase(Item *item)
+	{
+		const size_t mask = m_slots - 1;
+		size_t i = item - m_items;
+		m_items[i].~Item();
+
+		for (size_t next = (i + 1) & mask; m_dist[next] > 1; next = (next + 1) & mask) {
+			new (&m_items[i]) Item(std::move(m_items[next]));
+			m_items[next].~Item();
+			m_dist[i] = m_dist[next] - 1;
+			i = next;
+		}
+
+		m_dist[i] = 0;
+		--m_count;
+	}
+
+private:
+	static const unsigned max_dist = 255;
+
+	/// Get the slot a key would be in with no collisions. The hash is
+	/// scrambled by Fibonacci hashing, so keys that differ only in their
+	/// upper bits still land in different slots.
+	inline size_t home(const K &key) const
+	{
+		return (H()(key) * 0x9e3779b97f4a7c15ull) >> m_shift;
+	}
+
+	/// Put an item in its Robin Hood spot, displacing items closer to home.
+	/// \arg item  [in] The item to place, [out] an item still to be
+	///            placed, if this fails
+	/// \returns   False if a probe ran past max_dist
+	bool place(Item &&item)
+	{
+		const size_t mask = m_slots - 1;
+		size_t i = home(key_of(item));
+		unsigned dist = 1;
+
+		while (m_dist[i]) {
+			if (m_dist[i] < dist) {
+				std::swap(item, m_items[i]);
+				unsigned d = m_dist[i];
+				m_dist[i] = dist;
+				dist = d;
+			}
+			i = (i + 1) & mask;
+			if (++dist > max_dist) return false;
+		}
+
+		new (&m_items[i]) Item(std::move(item));
+		m_dist[i] = dist;
+		return true;
+	}
+
+	/// Move all items into new heap storage.
+	/// \arg slots  The new number of slots, a power of two
+	void rehash(size_t slots)
+	{
+		uint8_t *old_dist = m_dist;
+		Item *old_items = m_items;
+		const size_t old_slots = m_slots;
+
+		// One allocation: distances first, then items at their alignment
+		const size_t items_offset = (slots + alignof(Item) - 1) & ~(alignof(Item) - 1);
+		m_dist = reinterpret_cast<uint8_t *>(
+				kutil::malloc(items_offset + slots * sizeof(Item)));
+		m_items = reinterpret_cast<Item *>(m_dist + items_offset);
+		m_slots = slots;
+		m_shift = 64 - __builtin_ctzll(slots);
+		kutil::memset(m_dist, 0, slots);
+
+		for (size_t i = 0; i < old_slots; ++i) {
+			if (!old_dist[i]) continue;
+			bool placed = place(std::move(old_items[i]));
+			kassert(placed, "Hash table probe too long while growing");
+			old_items[i].~Item();
+		}
+
+		kutil::free(old_dist);
+	}
+
+	uint8_t *m_dist;   ///< Probe distance + 1 of each slot's item, 0 if empty
+	Item *m_items;
+	size_t m_slots;    ///< Number of slots, a power of two
+	unsigned m_shift;  ///< 64 - log2(m_slots)
+	size_t m_count;
+	bool m_fixed;      ///< Storage is not from the heap, and can't grow
+
+	hash_table(const hash_table &) = delete;
+};
+
+
+/// An unordered map from keys to values, using open addressing. Pointers
+/// to values stay valid only until the map is next changed.
+/// \tparam K  Type of keys, which must support ==
+/// \tparam V  Type of values
+/// \tparam H  Hash function object type
+template <typename K, typename V, typename H = hash<K>>
+class hash_map :
+	public hash_table<K, hash_entry<K, V>, H>
+{
+	using base = hash_table<K, hash_entry<K, V>, H>;
+
+public:
+	using base::base;
+
+	/// Look up the value for a key.
+	/// \arg key  The key to look up
+	/// \returns  The value, or nullptr if the key is not in the map
+	V * find(const K &key) const
+	{
+		hash_entry<K, V> *e = base::lookup(key);
+		return e ? &e->value : nullptr;
+	}
+
+	/// Set the value for a key, replacing any value it had.
+	/// \arg key    The key to set
+	/// \arg value  The value to store
+	/// \returns    The stored value, or nullptr if the map has fixed
+	///             storage and is full
+	V * insert(const K &key, V value)
+	{
+		hash_entry<K, V> *e = base::lookup(key);
+		if (e) {
+			e->value = std::move(value);
+		} else {
+			hash_entry<K, V> entry {key, std::move(value)};
+			e = base::add(std::move(entry));
+		}
+		return e ? &e->value : nullptr;
+	}
+
+	/// Remove a key and its value from the map.
+	/// \arg key  The key to remove
+	/// \returns  True if the key was in the map
+	bool remove(const K &key)
+	{
+		hash_entry<K, V> *e = base::lookup(key);
+		if (e) base::erase(e);
+		return e != nullptr;
+	}
+};
+
+
+/// A hash_map that holds at least N items in storage inside the object,
+/// and never allocates.
+template <typename K, typename V, size_t N, typename H = hash<K>>
+class fixed_hash_map :
+	public hash_map<K, V, H>
+{
+public:
+	fixed_hash_map() :
+		hash_map<K, V, H>(m_dist_storage, reinterpret_cast<hash_entry<K, V> *>(m_item_storage), slots),
+		m_dist_storage {}
+	{}
+
+private:
+	static constexpr size_t slots_for(size_t n)
+	{
+		size_t s = 8;
+		while (s - s / 8 < n) s *= 2;
+		return s;
+	}
+
+	static constexpr size_t slots = slots_for(N);
+
+	uint8_t m_dist_storage[slots];
+	alignas(hash_entry<K, V>) uint8_t m_item_storage[slots * sizeof(hash_entry<K, V>)];
+};
+
+
+/// An unordered set of keys, using open addressing.
+/// \tparam K  Type of keys, which must support ==
+/// \tparam H  Hash function object type
+template <typename K, typename H = hash<K>>
+class hash_set :
+	public hash_table<K, K, H>
+{
+	using base = hash_table<K, K, H>;
+
+public:
+	using base::base;
+
+	/// Check if a key is in the set.
+	inline bool contains(const K &key) const { return base::lookup(key) != nullptr; }
+
+	/// Add a key to the set.
+	/// \arg key  The key to add
+	/// \returns  False if the set has fixed storage and is full
+	bool insert(const K &key)
+	{
+		if (base::lookup(key)) return true;
+		K item {key};
+		return base::add(std::move(item)) != nullptr;
+	}
+
+	/// Remove a key from the set.
+	/// \arg key  The key to remove
+	/// \returns  True if the key was in the set
+	bool remove(const K &key)
+	{
+		K *item = base::lookup(key);
+		if (item) base::erase(item);
+		return item != nullptr;
+	}
+};
+
+
+/// A hash_set that holds at least N keys in storage inside the object,
+/// and never allocates.
+template <typename K, size_t N, typename H = hash<K>>
+class fixed_hash_set :
+	public hash_set<K, H>
+{
+public:
+	fixed_hash_set() :
+		hash_set<K, H>(m_dist_storage, reinterpret_cast<K *>(m_item_storage), slots),
+		m_dist_storage {}
+	{}
+
+private:
+	static constexpr size_t slots_for(size_t n)
+	{
+		size_t s = 8;
+		while (s - s / 8 < n) s *= 2;
+		return s;
+	}
+
+	static constexpr size_t slots = slots_for(N);
+
+	uint8_t m_dist_storage[slots];
+	alignas(K) uint8_t m_item_storage[slots * sizeof(K)];
+};
+
+} // namespace kutil
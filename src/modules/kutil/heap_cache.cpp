@@ -0,0 +1,111 @@
+#include "assert.h"
+#include "heap_cache.h"
+#include "memory.h"
+#include "spinlock.h"
+
+namespace kutil {
+
+const unsigned heap_cache::min_order;
+const unsigned heap_cache::max_order;
+const size_t heap_cache::magazine_size;
+const size_t heap_cache::batch_size;
+
+
+heap_cache::heap_cache() :
+	m_mm(nullptr)
+{
+	kutil::memset(m_magazines, 0, sizeof(m_magazines));
+}
+
+heap_cache::heap_cache(memory_manager *mm) :
+	m_mm(mm)
+{
+	kutil::memset(m_magazines, 0, sizeof(m_magazines));
+}
+
+void *
+heap_cache::allocate(size_t length)
+{
+	size_t total = length + memory_manager::block_overhead;
+	if (total > (1 << max_order))
+		return m_mm->allocate(length);
+
+	unsigned order = memory_manager::size_for(total);
+
+	irq_guard irqs;
+	magazine &mag = m_magazines[order - min_order];
+	if (!mag.count) {
+		refill(order);
+		if (!mag.count) return nullptr;
+	}
+
+	return mag.blocks[--mag.count];
+}
+
+void
+heap_cache::free(void *p)
+{
+	if (!p) return;
+
+	// Nothing else touches the header of a block in use, so this is safe
+	// to read while other CPUs use the shared manager. Aligned allocations
+	// don't start right after their header, so they never come out to a
+	// whole block.
+	size_t block = 0;
+	if (!memory_manager::is_large(p))
+		block = m_mm->usable_size(p) + memory_manager::block_overhead;
+
+	if (!block || block > (1 << max_order) || (block & (block - 1))) {
+		m_mm->free(p);
+		return;
+	}
+
+	unsigned order = __builtin_ctzll(block);
+
+	irq_guard irqs;
+	magazine &mag = m_magazines[order - min_order];
+	if (mag.count == magazine_size)
+		drain(mag, batch_size);
+
+	mag.blocks[mag.count++] = p;
+}
+
+void
+heap_cache::drain()
+{
+	irq_guard irqs;
+	for (magazine &mag : m_magazines)
+		drain(mag, mag.count);
+}
+
+size_t
+heap_cache::cached() const
+{
+	size_t count = 0;
+	for (const magazine &mag : m_magazines)
+		count += mag.count;
+	return count;
+}
+
+void
+heap_cache::refill(unsigned order)
+{
+	magazine &mag = m_magazines[order - min_order];
+	size_t length = (1 << order) - memory_manager::block_overhead;
+
+	// Only the blocks actually allocated are kept, if the manager runs out
+	mag.count += m_mm->allocate_batch(length,
+			&mag.blocks[mag.count], batch_size - mag.count);
+}
+
+void
+heap_cache::drain(magazine &mag, size_t count)
+{
+	kassert(count <= mag.count, "Draining more blocks than a magazine holds");
+	if (!count) return;
+
+	mag.count -= count;
+	m_mm->free_batch(&mag.blocks[mag.count], count);
+}
+
+} // namespace kutil
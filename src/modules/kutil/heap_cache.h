@@ -0,0 +1,81 @@
+#pragma once
+/// \file heap_cache.h
+/// Per-CPU caches of free blocks in front of a shared memory_manager.
+
+#include <stddef.h>
+#include "kutil/memory_manager.h"
+
+namespace kutil {
+
+
+/// A cache of free blocks for one CPU. Small blocks are kept in one
+/// magazine per block size, so most allocations and frees never touch the
+/// shared memory_manager or its locks. Empty magazines are refilled, and
+/// full ones drained, by `batch_size` blocks at a time.
+///
+/// Each CPU must have its own cache. The cache disables interrupts while
+/// it changes a magazine, so interrupt handlers may allocate from their
+/// CPU's cache. Blocks may be freed to a different CPU's cache than the one
+/// they were allocated from.
+class heap_cache
+{
+public:
+	/// Default constructor. Creates an invalid cache.
+	heap_cache();
+
+	/// Constructor.
+	/// \arg mm  The shared memory manager
+	heap_cache(memory_manager *mm);
+
+	/// Allocate memory, from the cache if it is small enough.
+	/// \arg length  The amount of memory to allocate, in bytes
+	/// \returns     A pointer to the allocated memory, or nullptr if
+	///              allocation failed
+	void * allocate(size_t length);
+
+	/// Free memory, keeping it in the cache if it is small enough.
+	/// \arg p  A pointer previously returned by allocate(), or from the
+	///         shared memory manager
+	void free(void *p);
+
+	/// Return all cached blocks to the shared memory manager.
+	void drain();
+
+	/// Get the number of free blocks held in the cache.
+	size_t cached() const;
+
+	/// Smallest cached block size is (2^min_order).
+	static const unsigned min_order = memory_manager::min_size;
+
+	/// Largest cached block size is (2^max_order).
+	static const unsigned max_order = 11;
+
+	/// Number of blocks each magazine holds.
+	static const size_t magazine_size = 32;
+
+	/// Number of blocks moved to or from the shared manager at once.
+	static const size_t batch_size = magazine_size / 2;
+
+private:
+	struct magazine
+	{
+		size_t count;
+		void *blocks[magazine_size];
+	};
+
+	/// Fill a magazine with a batch of blocks from the shared manager
+	/// \arg order  The block size of the magazine
+	void refill(unsigned order);
+
+	/// Free blocks from a magazine back to the shared manager
+	/// \arg mag    The magazine to drain
+	/// \arg count  The number of blocks to free
+	void drain(magazine &mag, size_t count);
+
+	magazine m_magazines[max_order - min_order + 1];
+	memory_manager *m_mm;
+
+	heap_cache(const heap_cache &) = delete;
+};
+
+} // namespace kutil
@@ -0,0 +1,85 @@
+#include "heap_stats.h"
+#include "memory.h"
+
+namespace kutil {
+
+const unsigned heap_stats::num_orders;
+const unsigned heap_tracker::call_depth;
+const size_t heap_tracker::capacity;
+
+
+heap_tracker::heap_tracker() :
+	m_count(0),
+	m_dropped(0)
+{
+	static_assert((capacity & (capacity - 1)) == 0,
+			"heap_tracker::capacity must be a power of two");
+	kutil::memset(m_entries, 0, sizeof(m_entries));
+}
+
+size_t
+heap_tracker::slot_for(const void *p) const
+{
+	// Allocations are at least 16-byte aligned, so drop those bits
+	// before mixing
+	uint64_t key = reinterpret_cast<addr_t>(p) >> 4;
+	key *= 0x9e3779b97f4a7c15ull;
+	return (key >> 32) & (capacity - 1);
+}
+
+void
+heap_tracker::add(const void *p, size_t length, const void *caller, const void *caller2)
+{
+	if (!p) return;
+
+	// Keep one slot empty so lookups always terminate
+	if (m_count == capacity - 1) {
+		++m_dropped;
+		return;
+	}
+
+	size_t i = slot_for(p);
+	while (m_entries[i].pointer)
+		i = (i + 1) & (capacity - 1);
+
+	entry &e = m_entries[i];
+	e.pointer = p;
+	e.length = length;
+	e.callers[0] = caller;
+	e.callers[1] = caller2;
+	++m_count;
+}
+
+void
+heap_tracker::remove(const void *p)
+{
+	if (!p) return;
+
+	size_t i = slot_for(p);
+	while (m_entries[i].pointer && m_entries[i].pointer != p)
+		i = (i + 1) & (capacity - 1);
+
+	if (!m_entries[i].pointer) return;
+	--m_count;
+
+	// Shift back any following entries that would no longer be found past
+	// the new hole, so no tombstones are needed
+	size_t hole = i;
+	for (size_t j = (i + 1) & (capacity - 1);
+			m_entries[j].pointer;
+			j = (j + 1) & (capacity - 1)) {
+		size_t home = slot_for(m_entries[j].pointer);
+		bool stays = hole <= j ?
+			(hole < home && home <= j) :
+			(hole < home || home <= j);
+
+		if (!stays) {
+			m_entries[hole] = m_entries[j];
+			hole = j;
+		}
+	}
+
+	kutil::memset(&m_entries[hole], 0, sizeof(entry));
+}
+
+} // namespace kutil
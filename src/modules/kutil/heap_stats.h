@@ -0,0 +1,147 @@
+#pragma once
+/// \file heap_stats.h
+/// Optional heap instrumentation: allocation counters and a table of live
+/// allocations for finding leaks.
+///
+/// `memory_manager` only keeps counters when kutil is built with
+/// `KUTIL_HEAP_STATS` defined. They count what reaches the memory_manager
+/// itself: with `heap_cache`s in front of it, small blocks are counted as
+/// the caches refill and drain in batches, and blocks held in a cache count
+/// as in use. Call sites are tracked by whoever provides
+/// `kutil::malloc`, as the kernel does when built with `KUTIL_HEAP_DEBUG`.
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace kutil {
+
+
+/// Counters of heap activity
+struct heap_stats
+{
+	/// Number of block sizes counted. Block sizes are (2^order), and
+	/// the order is used as the index into `allocs` and `frees`.
+	static const unsigned num_orders = 17;
+
+	size_t allocs[num_orders];  ///< Blocks allocated, by order
+	size_t frees[num_orders];   ///< Blocks freed, by order
+	size_t large_allocs;        ///< Allocations made on the large path
+	size_t large_frees;         ///< Large allocations freed
+
+	size_t bytes_in_use;        ///< Bytes of blocks and pages in use
+	size_t peak_bytes;          ///< Highest bytes_in_use has been
+
+	size_t grows;               ///< Times the heap asked for more memory
+	size_t grown_bytes;         ///< Total bytes asked for
+	size_t shrinks;             ///< Times the heap gave memory back
+	size_t shrunk_bytes;        ///< Total bytes given back
+	size_t failures;            ///< Allocations that returned nullptr
+
+	// The counters are updated atomically, as the memory_manager may be
+	// in use on several CPUs at once.
+
+	/// Count an allocation.
+	/// \arg order  The block's order, or 0 for a large allocation
+	/// \arg bytes  Size of the block or pages allocated
+	inline void allocated(unsigned order, size_t bytes)
+	{
+		add(order ? allocs[order] : large_allocs, 1);
+		resized(0, bytes);
+	}
+
+	/// Count a free.
+	/// \arg order  The block's order, or 0 for a large allocation
+	/// \arg bytes  Size of the block or pages freed
+	inline void freed(unsigned order, size_t bytes)
+	{
+		add(order ? frees[order] : large_frees, 1);
+		add(bytes_in_use, -bytes);
+	}
+
+	/// Count an allocation being resized in place.
+	/// \arg old_bytes  Size of the block or pages before
+	/// \arg new_bytes  Size of the block or pages after
+	inline void resized(size_t old_bytes, size_t new_bytes)
+	{
+		size_t now = add(bytes_in_use, new_bytes - old_bytes);
+		size_t peak = __atomic_load_n(&peak_bytes, __ATOMIC_RELAXED);
+		while (now > peak &&
+				!__atomic_compare_exchange_n(&peak_bytes, &peak, now, true,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	}
+
+	/// Count memory being mapped into the heap.
+	inline void grew(size_t bytes) { add(grows, 1); add(grown_bytes, bytes); }
+
+	/// Count memory being given back from the heap.
+	inline void shrank(size_t bytes) { add(shrinks, 1); add(shrunk_bytes, bytes); }
+
+	/// Count an allocation that could not be made.
+	inline void failed() { add(failures, 1); }
+
+private:
+	static inline size_t add(size_t &counter, size_t n)
+	{
+		return __atomic_add_fetch(&counter, n, __ATOMIC_RELAXED);
+	}
+};
+
+
+/// A table of live allocations and where they were made. The table has a
+/// fixed size so it never allocates itself; allocations made while it is
+/// full are counted but not tracked.
+class heap_tracker
+{
+public:
+	/// Number of return addresses kept for each allocation
+	static const unsigned call_depth = 2;
+
+	/// Maximum number of allocations tracked. Must be a power of two.
+	static const size_t capacity = 1024;
+
+	struct entry
+	{
+		const void *pointer;
+		size_t length;
+		const void *callers[call_depth];
+	};
+
+	/// Constructor. A zero-filled tracker is also a valid empty one.
+	heap_tracker();
+
+	/// Track a new allocation.
+	/// \arg p        The allocated memory
+	/// \arg length   The size asked for
+	/// \arg caller   Return address of the allocation's caller
+	/// \arg caller2  Return address of that caller's caller, if known
+	void add(const void *p, size_t length, const void *caller, const void *caller2 = nullptr);
+
+	/// Stop tracking an allocation that was freed. Pointers that are not
+	/// tracked are ignored.
+	/// \arg p  The freed memory
+	void remove(const void *p);
+
+	/// Call a function for every live allocation.
+	/// \arg f  A callable taking a `const entry &`
+	template <typename F>
+	void for_each(F f) const
+	{
+		for (size_t i = 0; i < capacity; ++i)
+			if (m_entries[i].pointer) f(m_entries[i]);
+	}
+
+	/// Get the number of allocations tracked.
+	inline size_t count() const { return m_count; }
+
+	/// Get the number of allocations not tracked because the table was full.
+	inline size_t dropped() const { return m_dropped; }
+
+private:
+	size_t slot_for(const void *p) const;
+
+	entry m_entries[capacity];
+	size_t m_count;
+	size_t m_dropped;
+};
+
+} // namespace kutil
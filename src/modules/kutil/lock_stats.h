@@ -0,0 +1,73 @@
+#pragma once
+/// \file lock_stats.h
+/// Optional lock instrumentation: counters of how often a lock is taken,
+/// how often and how long CPUs wait for it, and how long it is held.
+///
+/// Locks only keep these counters when kutil is built with
+/// `KUTIL_LOCK_STATS` defined.
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace kutil {
+
+
+/// Counters of lock activity. Times are in TSC cycles.
+struct lock_stats
+{
+	uint64_t acquires;      ///< Times the lock was taken
+	uint64_t contended;     ///< Times the lock was taken after waiting
+	uint64_t spins;         ///< Total pause loops spent waiting
+	uint64_t hold_cycles;   ///< Total time the lock was held exclusively
+	uint64_t max_hold;      ///< Longest time the lock was held exclusively
+	uint64_t acquired_at;   ///< When the current holder took the lock
+
+	constexpr lock_stats() :
+		acquires(0), contended(0), spins(0),
+		hold_cycles(0), max_hold(0), acquired_at(0)
+	{}
+
+	/// Count the lock being taken.
+	/// \arg waited  Number of pause loops spent waiting for it
+	/// \arg timed   Whether to start timing the hold, for exclusive holders
+	inline void acquired(uint64_t waited, bool timed = true)
+	{
+		add(acquires, 1);
+		if (waited) {
+			add(contended, 1);
+			add(spins, waited);
+		}
+		if (timed)
+			__atomic_store_n(&acquired_at, now(), __ATOMIC_RELAXED);
+	}
+
+	/// Count the lock being released by an exclusive holder.
+	inline void released()
+	{
+		uint64_t held = now() - __atomic_load_n(&acquired_at, __ATOMIC_RELAXED);
+		add(hold_cycles, held);
+		if (held > __atomic_load_n(&max_hold, __ATOMIC_RELAXED))
+			__atomic_store_n(&max_hold, held, __ATOMIC_RELAXED);
+	}
+
+	/// Add another lock's counters to these, to total a group of locks.
+	void merge(const lock_stats &other)
+	{
+		acquires += __atomic_load_n(&other.acquires, __ATOMIC_RELAXED);
+		contended += __atomic_load_n(&other.contended, __ATOMIC_RELAXED);
+		spins += __atomic_load_n(&other.spins, __ATOMIC_RELAXED);
+		hold_cycles += __atomic_load_n(&other.hold_cycles, __ATOMIC_RELAXED);
+		uint64_t hold = __atomic_load_n(&other.max_hold, __ATOMIC_RELAXED);
+		if (hold > max_hold) max_hold = hold;
+	}
+
+private:
+	static inline uint64_t now() { return __builtin_ia32_rdtsc(); }
+
+	static inline void add(uint64_t &counter, uint64_t n)
+	{
+		__atomic_add_fetch(&counter, n, __ATOMIC_RELAXED);
+	}
+};
+
+} // namespace kutil
@@ -0,0 +1,97 @@
+#pragma once
+/// \file lockfree_stack.h
+/// An intrusive stack any CPU can push to and pop from.
+
+#include <stdint.h>
+
+namespace kutil {
+
+
+/// Link embedded in items that go on a lockfree_stack.
+struct stack_node
+{
+	stack_node *stack_next;
+};
+
+
+/// An intrusive, lock-free LIFO stack (a Treiber stack). The top pointer
+/// carries a tag in its unused upper 16 bits that changes on every pop, so
+/// a pop that was preempted can't succeed just because the same item is
+/// back on top (the ABA problem).
+///
+/// Popping reads the top item's link after other CPUs may have popped it,
+/// so items must stay mapped as long as the stack is in use, like items
+/// from a slab or the kernel heap. They may be reused freely.
+/// \tparam T  Type of items, which must derive from stack_node
+template <typename T>
+class lockfree_stack
+{
+public:
+	lockfree_stack() : m_top(0) {}
+
+	/// Add an item to the top of the stack.
+	/// \arg item  The item to add
+	void push(T *item)
+	{
+		stack_node *node = static_cast<stack_node *>(item);
+		uint64_t top = __atomic_load_n(&m_top, __ATOMIC_RELAXED);
+		do {
+			__atomic_store_n(&node->stack_next, pointer(top), __ATOMIC_RELAXED);
+		} while (!__atomic_compare_exchange_n(&m_top, &top, pack(node, tag(top)),
+					true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+
+	/// Take the item from the top of the stack.
+	/// \returns  The item, or nullptr if the stack is empty
+	T * pop()
+	{
+		uint64_t top = __atomic_load_n(&m_top, __ATOMIC_ACQUIRE);
+		stack_node *node;
+		do {
+			node = pointer(top);
+			if (!node) return nullptr;
+		} while (!__atomic_compare_exchange_n(&m_top, &top,
+					pack(__atomic_load_n(&node->stack_next, __ATOMIC_RELAXED), tag(top) + 1),
+					true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+		return static_cast<T *>(node);
+	}
+
+	/// Take every item off the stack at once.
+	/// \returns  The item that was on top, whose links lead to the rest,
+	///           or nullptr if the stack was empty
+	T * pop_all()
+	{
+		uint64_t top = __atomic_load_n(&m_top, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&m_top, &top, pack(nullptr, tag(top) + 1),
+					true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+		return static_cast<T *>(pointer(top));
+	}
+
+	/// Check if the stack looks empty.
+	bool empty() const { return !pointer(__atomic_load_n(&m_top, __ATOMIC_RELAXED)); }
+
+private:
+	static const unsigned tag_shift = 48;
+	static const uint64_t pointer_mask = (1ull << tag_shift) - 1;
+
+	static inline uint64_t pack(stack_node *node, uint64_t tag)
+	{
+		return (reinterpret_cast<uint64_t>(node) & pointer_mask) | (tag << tag_shift);
+	}
+
+	/// Canonical addresses are sign extended from bit 47
+	static inline stack_node * pointer(uint64_t top)
+	{
+		return reinterpret_cast<stack_node *>(
+				static_cast<int64_t>(top << (64 - tag_shift)) >> (64 - tag_shift));
+	}
+
+	static inline uint64_t tag(uint64_t top) { return top >> tag_shift; }
+
+	uint64_t m_top;
+
+	lockfree_stack(const lockfree_stack &) = delete;
+};
+
+} // namespace kutil
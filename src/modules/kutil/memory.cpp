@@ -8,21 +8,248 @@ void operator delete[] (void *p) noexcept		{ return kutil::free(p); }
 
 namespace kutil {
 
+// Types for moving memory a word or an SSE register at a time, at any
+// alignment. The kernel is built to use SSE registers anywhere already, so
+// these add no FPU state that isn't already in use. Wider AVX registers
+// are not used, as that state is never enabled or saved.
+typedef uint16_t u16 __attribute__ ((may_alias, aligned(1)));
+typedef uint32_t u32 __attribute__ ((may_alias, aligned(1)));
+typedef uint64_t u64 __attribute__ ((may_alias, aligned(1)));
+typedef uint8_t v16 __attribute__ ((vector_size(16), may_alias, aligned(1)));
+
+/// Smallest copy done with `rep movsb`, or 0 to never use it
+static size_t copy_rep_min = 0;
+
+/// Smallest fill done with `rep stosb`, or 0 to never use it
+static size_t fill_rep_min = 0;
+
+void
+memory_set_features(bool erms, bool fsrm)
+{
+	// Without ERMS, `rep movsb` never beats the SSE loops. With it, it
+	// wins once its startup cost is paid, which FSRM makes small.
+	copy_rep_min = fsrm ? 128 : erms ? 1024 : 0;
+	fill_rep_min = erms ? 1024 : 0;
+}
+
+/// Copy up to 16 bytes. Every byte is loaded before any is stored, so the
+/// areas may overlap.
+static inline void
+copy_small(uint8_t *d, const uint8_t *s, size_t n)
+{
+	if (n >= 8) {
+		uint64_t a = *reinterpret_cast<const u64 *>(s);
+		uint64_t b = *reinterpret_cast<const u64 *>(s + n - 8);
+		*reinterpret_cast<u64 *>(d) = a;
+		*reinterpret_cast<u64 *>(d + n - 8) = b;
+	} else if (n >= 4) {
+		uint32_t a = *reinterpret_cast<const u32 *>(s);
+		uint32_t b = *reinterpret_cast<const u32 *>(s + n - 4);
+		*reinterpret_cast<u32 *>(d) = a;
+		*reinterpret_cast<u32 *>(d + n - 4) = b;
+	} else if (n >= 2) {
+		uint16_t a = *reinterpret_cast<const u16 *>(s);
+		uint16_t b = *reinterpret_cast<const u16 *>(s + n - 2);
+		*reinterpret_cast<u16 *>(d) = a;
+		*reinterpret_cast<u16 *>(d + n - 2) = b;
+	} else if (n) {
+		*d = *s;
+	}
+}
+
+/// Copy more than 16 bytes, lowest address first. Safe for overlapping
+/// areas when dest is below src.
+static inline void
+copy_forward(uint8_t *d, const uint8_t *s, size_t n)
+{
+	v16 last = *reinterpret_cast<const v16 *>(s + n - 16);
+	for (size_t i = 0; i < n - 16; i += 16)
+		*reinterpret_cast<v16 *>(d + i) = *reinterpret_cast<const v16 *>(s + i);
+	*reinterpret_cast<v16 *>(d + n - 16) = last;
+}
+
+/// Copy more than 16 bytes, highest address first. Safe for overlapping
+/// areas when dest is above src.
+static inline void
+copy_backward(uint8_t *d, const uint8_t *s, size_t n)
+{
+	v16 first = *reinterpret_cast<const v16 *>(s);
+	for (size_t i = n; i > 16; i -= 16)
+		*reinterpret_cast<v16 *>(d + i - 16) = *reinterpret_cast<const v16 *>(s + i - 16);
+	*reinterpret_cast<v16 *>(d) = first;
+}
+
+static inline void
+copy_rep(uint8_t *d, const uint8_t *s, size_t n)
+{
+	__asm__ __volatile__ ( "rep movsb"
+			: "+D"(d), "+S"(s), "+c"(n)
+			:: "memory" );
+}
+
 void *
 memset(void *s, uint8_t v, size_t n)
 {
 	uint8_t *p = reinterpret_cast<uint8_t *>(s);
-	for (size_t i = 0; i < n; ++i) p[i] = v;
+	uint64_t word = v * 0x0101010101010101ull;
+
+	if (n <= 16) {
+		if (n >= 8) {
+			*reinterpret_cast<u64 *>(p) = word;
+			*reinterpret_cast<u64 *>(p + n - 8) = word;
+		} else if (n >= 4) {
+			*reinterpret_cast<u32 *>(p) = word;
+			*reinterpret_cast<u32 *>(p + n - 4) = word;
+		} else if (n >= 2) {
+			*reinterpret_cast<u16 *>(p) = word;
+			*reinterpret_cast<u16 *>(p + n - 2) = word;
+		} else if (n) {
+			*p = v;
+		}
+	} else if (fill_rep_min && n >= fill_rep_min) {
+		__asm__ __volatile__ ( "rep stosb"
+				: "+D"(p), "+c"(n)
+				: "a"(v)
+				: "memory" );
+	} else {
+		v16 fill = v16{} + v;
+		for (size_t i = 0; i < n - 16; i += 16)
+			*reinterpret_cast<v16 *>(p + i) = fill;
+		*reinterpret_cast<v16 *>(p + n - 16) = fill;
+	}
+
 	return s;
 }
 
 void *
-memcpy(void *dest, void *src, size_t n)
+memcpy(void *dest, const void *src, size_t n)
+{
+	uint8_t *d = reinterpret_cast<uint8_t *>(dest);
+	const uint8_t *s = reinterpret_cast<const uint8_t *>(src);
+
+	if (n <= 16)
+		copy_small(d, s, n);
+	else if (copy_rep_min && n >= copy_rep_min)
+		copy_rep(d, s, n);
+	else
+		copy_forward(d, s, n);
+
+	return dest;
+}
+
+void *
+memmove(void *dest, const void *src, size_t n)
+{
+	uint8_t *d = reinterpret_cast<uint8_t *>(dest);
+	const uint8_t *s = reinterpret_cast<const uint8_t *>(src);
+
+	if (n <= 16)
+		copy_small(d, s, n);
+	else if (d + n <= s || s + n <= d)
+		memcpy(d, s, n);
+	else if (d < s)
+		copy_forward(d, s, n);
+	else if (d > s)
+		copy_backward(d, s, n);
+
+	return dest;
+}
+
+static inline void
+store_nt(uint8_t *p, uint64_t v)
+{
+	__asm__ __volatile__ ( "movnti %1, %0" : "=m"(*reinterpret_cast<uint64_t *>(p)) : "r"(v) );
+}
+
+static inline void
+store_fence()
+{
+	__asm__ __volatile__ ( "sfence" ::: "memory" );
+}
+
+/// Get the number of bytes from p to the next 8 byte boundary
+static inline size_t
+to_word_boundary(const void *p)
+{
+	return -reinterpret_cast<addr_t>(p) & 7;
+}
+
+void
+stream_fill(void *s, uint64_t v, size_t n)
+{
+	uint8_t *p = reinterpret_cast<uint8_t *>(s);
+
+	// Unaligned non-temporal stores are slow, so do the ends normally.
+	// The pattern is rotated to stay in phase with the start.
+	size_t head = to_word_boundary(p);
+	if (head > n) head = n;
+	for (size_t i = 0; i < head; ++i)
+		p[i] = v >> (i * 8);
+
+	const unsigned shift = head * 8;
+	uint64_t word = shift ? (v >> shift) | (v << (64 - shift)) : v;
+
+	size_t i = head;
+	for (; i + 32 <= n; i += 32) {
+		store_nt(p + i, word);
+		store_nt(p + i + 8, word);
+		store_nt(p + i + 16, word);
+		store_nt(p + i + 24, word);
+	}
+	for (; i + 8 <= n; i += 8)
+		store_nt(p + i, word);
+	for (; i < n; ++i)
+		p[i] = v >> (i % 8 * 8);
+
+	store_fence();
+}
+
+void
+stream_copy(void *dest, const void *src, size_t n)
 {
-	uint8_t *s = reinterpret_cast<uint8_t *>(src);
 	uint8_t *d = reinterpret_cast<uint8_t *>(dest);
-	for (size_t i = 0; i < n; ++i) d[i] = s[i];
-	return d;
+	const uint8_t *s = reinterpret_cast<const uint8_t *>(src);
+
+	size_t head = to_word_boundary(d);
+	if (head > n) head = n;
+	memcpy(d, s, head);
+
+	size_t i = head;
+	for (; i + 32 <= n; i += 32) {
+		const u64 *w = reinterpret_cast<const u64 *>(s + i);
+		uint64_t a = w[0], b = w[1], c = w[2], e = w[3];
+		store_nt(d + i, a);
+		store_nt(d + i + 8, b);
+		store_nt(d + i + 16, c);
+		store_nt(d + i + 24, e);
+	}
+	for (; i + 8 <= n; i += 8)
+		store_nt(d + i, *reinterpret_cast<const u64 *>(s + i));
+	memcpy(d + i, s + i, n - i);
+
+	store_fence();
+}
+
+int
+memcmp(const void *a, const void *b, size_t n)
+{
+	const uint8_t *l = reinterpret_cast<const uint8_t *>(a);
+	const uint8_t *r = reinterpret_cast<const uint8_t *>(b);
+
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		uint64_t lw = *reinterpret_cast<const u64 *>(l + i);
+		uint64_t rw = *reinterpret_cast<const u64 *>(r + i);
+		if (lw == rw) continue;
+
+		// Byte swapped, the first differing byte is the most significant
+		return __builtin_bswap64(lw) < __builtin_bswap64(rw) ? -1 : 1;
+	}
+
+	for (; i < n; ++i)
+		if (l[i] != r[i]) return l[i] < r[i] ? -1 : 1;
+
+	return 0;
 }
 
 } // namespace kutil
@@ -23,6 +23,20 @@ void * malloc(size_t n);
 /// \arg p   A pointer previously returned by malloc()
 void free(void *p);
 
+/// Change the size of memory allocated by malloc(), moving it if needed.
+/// Note: this needs to be implemented by the kernel, or other program
+/// using this library.
+/// \arg p   A pointer previously returned by malloc(), or nullptr
+/// \arg n   The new size in bytes
+/// \returns A pointer to the resized memory
+void * realloc(void *p, size_t n);
+
+/// Tell the memory functions which optional CPU features they may use.
+/// Until this is called, they only use SSE2, which every x86_64 CPU has.
+/// \arg erms  The CPU has enhanced `rep movsb` / `rep stosb`
+/// \arg fsrm  The CPU has fast `rep movsb` for short copies
+void memory_set_features(bool erms, bool fsrm);
+
 /// Fill memory with the given value.
 /// \arg p   The beginning of the memory area to fill
 /// \arg v   The byte value to fill memory with
@@ -30,12 +44,49 @@ void free(void *p);
 /// \returns A pointer to the filled memory
 void * memset(void *p, uint8_t v, size_t n);
 
-/// Copy an area of memory to another
-/// \dest    The memory to copy to
-/// \src     The memory to copy from
-/// \n       The number of bytes to copy
+/// Copy an area of memory to another. The areas must not overlap.
+/// \arg dest The memory to copy to
+/// \arg src  The memory to copy from
+/// \arg n    The number of bytes to copy
 /// \returns A pointer to the destination memory
-void * memcpy(void *dest, void *src, size_t n);
+void * memcpy(void *dest, const void *src, size_t n);
+
+/// Copy an area of memory to another, which may overlap it
+/// \arg dest The memory to copy to
+/// \arg src  The memory to copy from
+/// \arg n    The number of bytes to copy
+/// \returns A pointer to the destination memory
+void * memmove(void *dest, const void *src, size_t n);
+
+/// Compare two areas of memory
+/// \arg a   The first memory area
+/// \arg b   The second memory area
+/// \arg n   The number of bytes to compare
+/// \returns Less than, equal to, or greater than 0 if the first byte
+///          that differs is lower, nonexistent, or higher in `a`
+int memcmp(const void *a, const void *b, size_t n);
+
+/// Fill memory with a repeated 64-bit pattern, using non-temporal stores
+/// that bypass the cache. For page-sized and bigger regions that won't be
+/// read again soon, like new page tables or the framebuffer. The stores
+/// are fenced before returning.
+/// \arg p   The beginning of the memory area to fill
+/// \arg v   The pattern to fill memory with, in memory byte order
+/// \arg n   The size in bytes of the memory area
+void stream_fill(void *p, uint64_t v, size_t n);
+
+/// Zero memory using non-temporal stores. See stream_fill().
+/// \arg p   The beginning of the memory area to zero
+/// \arg n   The size in bytes of the memory area
+inline void stream_zero(void *p, size_t n) { stream_fill(p, 0, n); }
+
+/// Copy an area of memory to another using non-temporal stores, so the
+/// destination is not pulled into the cache. The areas must not overlap.
+/// See stream_fill().
+/// \arg dest The memory to copy to
+/// \arg src  The memory to copy from
+/// \arg n    The number of bytes to copy
+void stream_copy(void *dest, const void *src, size_t n);
 
 /// Read a value of type T from a location in memory
 /// \arg p   The location in memory to read
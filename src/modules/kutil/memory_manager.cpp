@@ -2,41 +2,55 @@
 #include "assert.h"
 #include "memory.h"
 #include "memory_manager.h"
+#include "spinlock.h"
+
+#ifdef KUTIL_HEAP_STATS
+#define HEAP_STAT(expr) m_stats.expr
+#else
+#define HEAP_STAT(expr)
+#endif
 
 namespace kutil {
 
+const unsigned memory_manager::min_size;
+const unsigned memory_manager::max_size;
+const size_t memory_manager::block_overhead;
+const size_t memory_manager::page_size;
+const size_t memory_manager::max_released;
+
 
 struct memory_manager::mem_header
 {
-	mem_header(mem_header *prev, mem_header *next, uint8_t size) :
-		m_prev(prev), m_next(next)
+	mem_header(mem_header *prev, mem_header *next, uint8_t size)
 	{
+		store(m_prev, prev);
+		store(m_next, next);
 		set_size(size);
 	}
 
 	inline void set_size(uint8_t size)
 	{
-		m_prev = reinterpret_cast<mem_header *>(
-			reinterpret_cast<addr_t>(prev()) | (size & 0x3f));
+		store(m_prev, reinterpret_cast<mem_header *>(
+			reinterpret_cast<addr_t>(prev()) | (size & 0x3f)));
 	}
 
 	inline void set_used(bool used)
 	{
-		m_next = reinterpret_cast<mem_header *>(
-			reinterpret_cast<addr_t>(next()) | (used ? 1 : 0));
+		store(m_next, reinterpret_cast<mem_header *>(
+			reinterpret_cast<addr_t>(next()) | (used ? 1 : 0)));
 	}
 
 	inline void set_next(mem_header *next)
 	{
 		bool u = used();
-		m_next = next;
+		store(m_next, next);
 		set_used(u);
 	}
 
 	inline void set_prev(mem_header *prev)
 	{
 		uint8_t s = size();
-		m_prev = prev;
+		store(m_prev, prev);
 		set_size(s);
 	}
 
@@ -48,8 +62,8 @@ struct memory_manager::mem_header
 		set_next(nullptr);
 	}
 
-	inline mem_header * next() { return kutil::mask_pointer(m_next, 0x3f); }
-	inline mem_header * prev() { return kutil::mask_pointer(m_prev, 0x3f); }
+	inline mem_header * next() const { return kutil::mask_pointer(load(m_next), 0x3f); }
+	inline mem_header * prev() const { return kutil::mask_pointer(load(m_prev), 0x3f); }
 
 	inline mem_header * buddy() const {
 		return reinterpret_cast<mem_header *>(
@@ -58,111 +72,799 @@ struct memory_manager::mem_header
 
 	inline bool eldest() const { return this < buddy(); }
 
-	inline uint8_t size() const { return reinterpret_cast<addr_t>(m_prev) & 0x3f; }
-	inline bool used() const { return reinterpret_cast<addr_t>(m_next) & 0x1; }
+	inline uint8_t size() const { return reinterpret_cast<addr_t>(load(m_prev)) & 0x3f; }
+	inline bool used() const { return reinterpret_cast<addr_t>(load(m_next)) & 0x1; }
 
 private:
+	// Other CPUs may read a header while checking if it can be merged,
+	// without holding the lock its owner writes it under. Each word is
+	// read and written whole so they never see a torn value.
+	static inline mem_header * load(mem_header * const &field)
+	{
+		return __atomic_load_n(&field, __ATOMIC_RELAXED);
+	}
+
+	static inline void store(mem_header *&field, mem_header *value)
+	{
+		__atomic_store_n(&field, value, __ATOMIC_RELAXED);
+	}
+
 	mem_header *m_prev;
 	mem_header *m_next;
 };
 
 
+struct memory_manager::large_alloc
+{
+	void *start;
+	size_t length;    ///< Length mapped, in bytes
+	size_t reserved;  ///< Length of heap reserved, in bytes
+};
+
+
+/// Nothing bigger than half of the canonical address space can be mapped
+static const size_t max_large_length = 1ull << 47;
+
+static inline size_t
+round_up(size_t length, size_t align)
+{
+	return ((length - 1) & ~(align - 1)) + align;
+}
+
+
 memory_manager::memory_manager() :
 	m_start(nullptr),
 	m_length(0),
-	m_grow(nullptr)
+	m_large(nullptr),
+	m_large_count(0),
+	m_large_capacity(0),
+	m_released_count(0),
+	m_free_max(0),
+	m_nonempty(0),
+	m_trim_threshold(0),
+	m_trim_wanted(false),
+	m_trimming(false),
+	m_grow(nullptr),
+	m_shrink(nullptr)
 {
 	kutil::memset(m_free, 0, sizeof(m_free));
+#ifdef KUTIL_HEAP_STATS
+	kutil::memset(&m_stats, 0, sizeof(m_stats));
+#endif
 }
 
-memory_manager::memory_manager(void *start, grow_callback grow_cb) :
+memory_manager::memory_manager(void *start, grow_callback grow_cb, shrink_callback shrink_cb) :
 	m_start(start),
 	m_length(0),
-	m_grow(grow_cb)
+	m_large(nullptr),
+	m_large_count(0),
+	m_large_capacity(0),
+	m_released_count(0),
+	m_free_max(0),
+	m_nonempty(0),
+	m_trim_threshold(0),
+	m_trim_wanted(false),
+	m_trimming(false),
+	m_grow(grow_cb),
+	m_shrink(shrink_cb)
 {
+	static_assert(sizeof(mem_header) == block_overhead,
+			"memory_manager::block_overhead does not match the block header size");
+	static_assert(max_size - min_size < 64,
+			"memory_manager::m_nonempty has too few bits for every block size");
+
 	kutil::memset(m_free, 0, sizeof(m_free));
-	grow_memory();
+#ifdef KUTIL_HEAP_STATS
+	static_assert(max_size < heap_stats::num_orders,
+			"heap_stats does not count every memory_manager block size");
+	kutil::memset(&m_stats, 0, sizeof(m_stats));
+#endif
+
+	mem_header *block = grow_memory();
+	spinlock_irq_guard guard(get_lock(max_size));
+	push_free(block);
 }
 
 void *
 memory_manager::allocate(size_t length)
 {
 	size_t total = length + sizeof(mem_header);
-	unsigned size = min_size;
-	while (total > (1 << size)) size++;
-	kassert(size <= max_size, "Tried to allocate a block bigger than max_size");
+	if (total > (1 << max_size) || total < length)
+		return allocate_large(length);
 
-	mem_header *header = pop_free(size);
-	header->set_used(true);
+	mem_header *header = pop_free(size_for(total));
+	HEAP_STAT(allocated(header->size(), 1 << header->size()));
 	return header + 1;
 }
 
+void *
+memory_manager::allocate_aligned(size_t length, size_t align)
+{
+	kassert((align & (align - 1)) == 0, "Alignment must be a power of two");
+	kassert(align <= (1 << max_size), "Alignment is larger than a max_size block");
+
+	if (align <= sizeof(mem_header))
+		return allocate(length);
+
+	// Never hand out the end of a block, which may look like a large
+	// allocation
+	if (!length) length = 1;
+
+	// Large allocations always start on a max_size boundary
+	size_t total = length + align;
+	if (total > (1 << max_size) || total < length)
+		return allocate_large(length);
+
+	// Blocks are aligned to their size, so the first aligned address past
+	// the header is `align` bytes in. A marker header with size 0 right
+	// before that points back at the real header.
+	mem_header *header = pop_free(size_for(total));
+	HEAP_STAT(allocated(header->size(), 1 << header->size()));
+
+	mem_header *marker = kutil::offset_pointer(header, align) - 1;
+	new (marker) mem_header(header, nullptr, 0);
+	marker->set_used(true);
+	return marker + 1;
+}
+
+void *
+memory_manager::reallocate(void *p, size_t length)
+{
+	if (!p) return allocate(length);
+	if (!length) {
+		free(p);
+		return nullptr;
+	}
+
+	if (is_large(p)) {
+		if (resize_large(p, length))
+			return p;
+	} else {
+		mem_header *header = header_of(p);
+		size_t total = length +
+			(reinterpret_cast<addr_t>(p) - reinterpret_cast<addr_t>(header));
+
+		if (total <= (1 << max_size) && resize_block(header, size_for(total)))
+			return p;
+	}
+
+	void *moved = allocate(length);
+	if (!moved) return nullptr;
+
+	size_t old_length = usable_size(p);
+	kutil::memcpy(moved, p, old_length < length ? old_length : length);
+	free(p);
+	return moved;
+}
+
+size_t
+memory_manager::usable_size(void *p)
+{
+	if (is_large(p)) {
+		spinlock_irq_guard guard(m_heap_lock);
+		return m_large[find_large(p)].length;
+	}
+
+	mem_header *header = header_of(p);
+	return (1ull << header->size()) -
+		(reinterpret_cast<addr_t>(p) - reinterpret_cast<addr_t>(header));
+}
+
 void
 memory_manager::free(void *p)
 {
-	mem_header *header = reinterpret_cast<mem_header *>(p);
-	header -= 1; // p points after the header
-	header->set_used(false);
+	if (!p) return;
+
+	if (is_large(p)) {
+		free_large(p);
+		return;
+	}
+
+	mem_header *header = header_of(p);
+	HEAP_STAT(freed(header->size(), 1 << header->size()));
+	free_block(header);
+	check_trim();
+}
+
+size_t
+memory_manager::allocate_batch(size_t length, void **blocks, size_t count)
+{
+	size_t total = length + sizeof(mem_header);
+	kassert(total <= (1 << max_size) && total >= length,
+			"Batch allocation does not fit in a block");
+
+	const unsigned size = size_for(total);
+	size_t n = 0;
+
+	{
+		spinlock_irq_guard guard(get_lock(size));
+		mem_header *block = get_free(size);
+		while (block && n < count) {
+			mem_header *next = block->next();
+			remove_free(block);
+			block->set_used(true);
+			HEAP_STAT(allocated(size, 1 << size));
+			blocks[n++] = block + 1;
+			block = next;
+		}
+	}
+
+	// Cut the rest from the front of bigger blocks. None of the pieces are
+	// buddies with anything outside their block, so they can be set up
+	// without any lock, and stay marked used.
+	while (n < count) {
+		mem_header *big = take_free(size);
+		if (!big) break;
+
+		const size_t end = 1ull << big->size();
+		size_t off = 0;
+
+		big->set_size(size);
+		for (; off < end && n < count; off += 1ull << size) {
+			mem_header *block = kutil::offset_pointer(big, off);
+			if (off) {
+				new (block) mem_header(nullptr, nullptr, size);
+				block->set_used(true);
+			}
+			HEAP_STAT(allocated(size, 1 << size));
+			blocks[n++] = block + 1;
+		}
+
+		// Give back what is left as the biggest blocks it splits into
+		while (off < end) {
+			unsigned current = __builtin_ctzll(off);
+			mem_header *block = kutil::offset_pointer(big, off);
+			new (block) mem_header(nullptr, nullptr, current);
+
+			spinlock_irq_guard guard(get_lock(current));
+			push_free(block);
+			off += 1ull << current;
+		}
+	}
+
+	return n;
+}
+
+void
+memory_manager::free_batch(void **blocks, size_t count)
+{
+	if (!count) return;
+
+	const unsigned size = (reinterpret_cast<mem_header *>(blocks[0]) - 1)->size();
+	size_t merged = 0;
+
+	{
+		spinlock_irq_guard guard(get_lock(size));
+		for (size_t i = 0; i < count; ++i) {
+			kassert(!is_large(blocks[i]), "Batch freed a large allocation");
+			mem_header *header = reinterpret_cast<mem_header *>(blocks[i]) - 1;
+			kassert(header->size() == size, "Batch freed blocks of different sizes");
+			HEAP_STAT(freed(size, 1 << size));
+
+			mem_header *buddy = header->buddy();
+			if (size == max_size || buddy->used() || buddy->size() != size) {
+				push_free(header);
+				continue;
+			}
+
+			// Merge once here, and leave the bigger block for later
+			remove_free(buddy);
+			buddy->set_used(true);
+			header = header->eldest() ? header : buddy;
+			header->set_size(size + 1);
+			blocks[merged++] = header;
+		}
+	}
+
+	for (size_t i = 0; i < merged; ++i)
+		free_block(reinterpret_cast<mem_header *>(blocks[i]));
+
+	check_trim();
+}
+
+void
+memory_manager::free_block(mem_header *header)
+{
+	// The block stays marked used until it is on a free list, so other
+	// CPUs never try to merge with it while it is being merged here.
+	for (unsigned size = header->size(); ; ++size) {
+		spinlock_irq_guard guard(get_lock(size));
 
-	while (true) {
 		mem_header *buddy = header->buddy();
-		if (buddy->used() || buddy->size() != header->size()) break;
-		buddy->remove();
+		if (size == max_size || buddy->used() || buddy->size() != size) {
+			push_free(header);
+			break;
+		}
+
+		remove_free(buddy);
+		buddy->set_used(true);
 		header = header->eldest() ? header : buddy;
-		header->set_size(header->size() + 1);
+		header->set_size(size + 1);
 	}
+}
 
-	uint8_t size = header->size();
-	header->set_next(get_free(size));
-	get_free(size) = header;
-	if (header->next())
-		header->next()->set_prev(header);
+void *
+memory_manager::allocate_large(size_t length)
+{
+	if (length > max_large_length) {
+		HEAP_STAT(failed());
+		return nullptr;
+	}
+
+	size_t mapped = round_up(length, page_size);
+	size_t reserved = round_up(length, 1 << max_size);
+
+	while (true) {
+		size_t capacity = 0;
+		{
+			spinlock_irq_guard guard(m_heap_lock);
+			if (m_large_count < m_large_capacity) {
+				// Only map the pages needed, but reserve whole max_size
+				// blocks of address space so the heap stays block-aligned.
+				void *start = kutil::offset_pointer(m_start, m_length);
+				grow(start, mapped);
+				m_length += reserved;
+
+				large_alloc &entry = m_large[m_large_count++];
+				entry.start = start;
+				entry.length = mapped;
+				entry.reserved = reserved;
+				HEAP_STAT(allocated(0, mapped));
+				return start;
+			}
+
+			capacity = m_large_capacity ? m_large_capacity * 2 : 8;
+		}
+
+		grow_large_table(capacity);
+	}
 }
 
 void
+memory_manager::grow_large_table(size_t capacity)
+{
+	kassert(capacity * sizeof(large_alloc) + block_overhead <= (1 << max_size),
+			"Too many large allocations for the large allocation table");
+
+	// Allocating the table may need the heap lock, so do it first
+	large_alloc *table = reinterpret_cast<large_alloc *>(
+			allocate(capacity * sizeof(large_alloc)));
+
+	{
+		spinlock_irq_guard guard(m_heap_lock);
+		if (capacity > m_large_capacity) {
+			if (m_large)
+				kutil::memcpy(table, m_large, m_large_count * sizeof(large_alloc));
+
+			large_alloc *old = m_large;
+			m_large = table;
+			m_large_capacity = capacity;
+			table = old;
+		}
+	}
+
+	// Either the old table, or this one if another CPU grew it first
+	free(table);
+}
+
+size_t
+memory_manager::find_large(const void *p) const
+{
+	size_t i = 0;
+	while (i < m_large_count && m_large[i].start != p) ++i;
+	kassert(i < m_large_count, "Used a large allocation that does not exist");
+	return i;
+}
+
+bool
+memory_manager::resize_large(void *p, size_t length)
+{
+	if (length > max_large_length) return false;
+
+	void *unmap = nullptr;
+	size_t unmap_length = 0;
+
+	{
+		spinlock_irq_guard guard(m_heap_lock);
+		large_alloc &entry = m_large[find_large(p)];
+		size_t mapped = round_up(length, page_size);
+
+		if (mapped > entry.reserved) {
+			// Only the last allocation in the heap can grow past its blocks
+			void *end = kutil::offset_pointer(m_start, m_length);
+			if (kutil::offset_pointer(p, entry.reserved) != end)
+				return false;
+
+			size_t reserved = round_up(length, 1 << max_size);
+			m_length += reserved - entry.reserved;
+			entry.reserved = reserved;
+		}
+
+		if (mapped > entry.length) {
+			grow(kutil::offset_pointer(p, entry.length), mapped - entry.length);
+			HEAP_STAT(resized(entry.length, mapped));
+			entry.length = mapped;
+		} else if (mapped < entry.length && m_shrink) {
+			// The pages stay reserved to this allocation, so they can be
+			// given back once the lock is dropped
+			unmap = kutil::offset_pointer(p, mapped);
+			unmap_length = entry.length - mapped;
+			HEAP_STAT(resized(entry.length, mapped));
+			entry.length = mapped;
+		}
+	}
+
+	if (unmap)
+		shrink(unmap, unmap_length);
+
+	return true;
+}
+
+memory_manager::mem_header *
+memory_manager::header_of(void *p)
+{
+	mem_header *header = reinterpret_cast<mem_header *>(p);
+	header -= 1; // p points after the header
+
+	// Aligned allocations have a marker header pointing to the real one
+	if (header->size() == 0)
+		header = header->prev();
+	return header;
+}
+
+bool
+memory_manager::resize_block(mem_header *header, unsigned size)
+{
+	unsigned old_size = header->size();
+	unsigned current = old_size;
+
+	if (size > current) {
+		// The block can only grow into the buddies after it, which means
+		// it has to be the eldest at every size up to the new one, and
+		// every one of those buddies has to be whole and free.
+		if (reinterpret_cast<addr_t>(header) & ((1ull << size) - 1))
+			return false;
+
+		for (; current < size; ++current) {
+			spinlock_irq_guard guard(get_lock(current));
+			mem_header *buddy = kutil::offset_pointer(header, 1 << current);
+			if (buddy->used() || buddy->size() != current)
+				break;
+
+			remove_free(buddy);
+			buddy->set_used(true);
+			header->set_size(current + 1);
+		}
+
+		if (current < size) {
+			// Put back the buddies already taken
+			while (current > old_size) {
+				--current;
+				header->set_size(current);
+				mem_header *buddy = kutil::offset_pointer(header, 1 << current);
+				spinlock_irq_guard guard(get_lock(current));
+				push_free(new (buddy) mem_header(nullptr, nullptr, current));
+			}
+			return false;
+		}
+	}
+
+	while (current > size) {
+		--current;
+		header->set_size(current);
+		mem_header *upper = kutil::offset_pointer(header, 1 << current);
+		spinlock_irq_guard guard(get_lock(current));
+		push_free(new (upper) mem_header(nullptr, nullptr, current));
+	}
+
+	HEAP_STAT(resized(1 << old_size, 1 << size));
+	return true;
+}
+
+void
+memory_manager::free_large(void *p)
+{
+	size_t mapped = 0;
+	size_t reserved = 0;
+
+	{
+		spinlock_irq_guard guard(m_heap_lock);
+		size_t i = find_large(p);
+		mapped = m_large[i].length;
+		reserved = m_large[i].reserved;
+		m_large[i] = m_large[--m_large_count];
+
+		// Map the rest of the last block, so the whole run can go back to
+		// the buddy allocator as max_size blocks.
+		if (reserved > mapped)
+			grow(kutil::offset_pointer(p, mapped), reserved - mapped);
+	}
+
+	HEAP_STAT(freed(0, mapped));
+
+	const size_t block = 1 << max_size;
+	for (size_t off = 0; off < reserved; off += block) {
+		void *next = kutil::offset_pointer(p, off);
+		mem_header *header = new (next) mem_header(nullptr, nullptr, max_size);
+
+		spinlock_irq_guard guard(get_lock(max_size));
+		push_free(header);
+	}
+
+	check_trim();
+}
+
+#ifdef KUTIL_LOCK_STATS
+lock_stats
+memory_manager::list_lock_stats() const
+{
+	lock_stats total;
+	for (auto &lock : m_locks)
+		total.merge(lock.stats());
+	return total;
+}
+#endif
+
+size_t
+memory_manager::trim(size_t keep)
+{
+	if (!m_shrink) return 0;
+
+	// With only one trim at a time, the room it finds for remembering
+	// blocks is still there once it has given them back.
+	if (__atomic_test_and_set(&m_trimming, __ATOMIC_ACQUIRE))
+		return 0;
+	__atomic_store_n(&m_trim_wanted, false, __ATOMIC_RELAXED);
+
+	const size_t block = 1 << max_size;
+	size_t released = 0;
+
+	// Taken blocks stay marked used, linked through their headers, until
+	// they are given back
+	mem_header *taken = nullptr;
+	mem_header *last = nullptr;
+	auto take = [&](mem_header *b) {
+		remove_free(b);
+		b->set_used(true);
+		if (last) last->set_next(b);
+		else taken = b;
+		last = b;
+		released += block;
+	};
+
+	{
+		spinlock_irq_guard heap_guard(m_heap_lock);
+		spinlock_irq_guard list_guard(get_lock(max_size));
+
+		// Giving back blocks at the end of the heap needs no bookkeeping, so
+		// take those first, highest first. The heap keeps its length until
+		// they are given back, so nothing else is mapped over them.
+		size_t length = m_length;
+		bool found = true;
+		while (found && m_free_max > keep && length) {
+			found = false;
+			void *top = kutil::offset_pointer(m_start, length - block);
+			if (is_released(top)) {
+				length -= block;
+				found = true;
+				continue;
+			}
+
+			for (mem_header *b = get_free(max_size); b; b = b->next()) {
+				if (b != top) continue;
+				take(b);
+				length -= block;
+				found = true;
+				break;
+			}
+		}
+
+		size_t room = max_released - m_released_count;
+		mem_header *b = get_free(max_size);
+		while (b && m_free_max > keep && room) {
+			mem_header *next = b->next();
+			take(b);
+			--room;
+			b = next;
+		}
+	}
+
+	// The shrink callback may be slow or need locks of its own, so it is
+	// only called with none of the allocator's held
+	for (mem_header *b = taken; b; ) {
+		mem_header *next = b->next();
+		shrink(b, block);
+		place_released(b);
+		b = next;
+	}
+
+	__atomic_clear(&m_trimming, __ATOMIC_RELEASE);
+	return released;
+}
+
+size_t
+memory_manager::trim_if_wanted()
+{
+	if (!trim_wanted()) return 0;
+	return trim(m_trim_threshold / 2);
+}
+
+void
+memory_manager::check_trim()
+{
+	if (m_trim_threshold && free_blocks() > m_trim_threshold)
+		__atomic_store_n(&m_trim_wanted, true, __ATOMIC_RELAXED);
+}
+
+bool
+memory_manager::is_released(const void *block) const
+{
+	for (size_t i = 0; i < m_released_count; ++i)
+		if (m_released[i] == block) return true;
+	return false;
+}
+
+void
+memory_manager::place_released(mem_header *block)
+{
+	const size_t length = 1 << max_size;
+	spinlock_irq_guard guard(m_heap_lock);
+
+	void *top = kutil::offset_pointer(m_start, m_length - length);
+	if (block == top) {
+		m_length -= length;
+		shrink_top();
+	} else if (m_released_count < max_released) {
+		m_released[m_released_count++] = block;
+	} else {
+		// The heap grew past it while it was given back, and there is no
+		// room left to remember it
+		grow(block, length);
+		new (block) mem_header(nullptr, nullptr, max_size);
+		spinlock_irq_guard list_guard(get_lock(max_size));
+		push_free(block);
+	}
+}
+
+void
+memory_manager::shrink_top()
+{
+	const size_t block = 1 << max_size;
+	size_t i = 0;
+	while (m_length && i < m_released_count) {
+		void *top = kutil::offset_pointer(m_start, m_length - block);
+		if (m_released[i] != top) {
+			++i;
+			continue;
+		}
+
+		m_released[i] = m_released[--m_released_count];
+		m_length -= block;
+		i = 0;
+	}
+}
+
+void
+memory_manager::grow(void *start, size_t length)
+{
+	kassert(m_grow, "Tried to grow heap without a growth callback");
+	m_grow(start, length);
+	HEAP_STAT(grew(length));
+}
+
+void
+memory_manager::shrink(void *start, size_t length)
+{
+	m_shrink(start, length);
+	HEAP_STAT(shrank(length));
+}
+
+memory_manager::mem_header *
 memory_manager::grow_memory()
 {
+	spinlock_irq_guard guard(m_heap_lock);
 	size_t length = (1 << max_size);
 
-	void *next = kutil::offset_pointer(m_start, m_length);
-	kassert(m_grow, "Tried to grow heap without a growth callback");
-	m_grow(next, length);
+	void *next = nullptr;
+	if (m_released_count) {
+		next = m_released[--m_released_count];
+	} else {
+		next = kutil::offset_pointer(m_start, m_length);
+		m_length += length;
+	}
 
-	mem_header *block = new (next) mem_header(nullptr, get_free(max_size), max_size);
-	get_free(max_size) = block;
-	if (block->next())
-		block->next()->set_prev(block);
-	m_length += length;
+	grow(next, length);
+
+	mem_header *block = new (next) mem_header(nullptr, nullptr, max_size);
+	block->set_used(true);
+	return block;
 }
 
-void
-memory_manager::ensure_block(unsigned size)
+memory_manager::mem_header *
+memory_manager::take_free(unsigned size)
 {
-	if (get_free(size) != nullptr) return;
-	else if (size == max_size) {
-		grow_memory();
-		return;
+	// Most of the time a block of the exact size is free
+	{
+		spinlock_irq_guard guard(get_lock(size));
+		mem_header *block = get_free(size);
+		if (block) {
+			remove_free(block);
+			block->set_used(true);
+			return block;
+		}
 	}
 
-	mem_header *orig = pop_free(size + 1);
+	// Only lists of bigger blocks than this one are searched
+	const uint64_t bigger = ~0ull << (size - min_size + 1);
+
+	// The non-empty flags are only a hint until the list's lock is held,
+	// as other CPUs may have emptied it since.
+	while (true) {
+		uint64_t flags = __atomic_load_n(&m_nonempty, __ATOMIC_RELAXED) & bigger;
+		if (!flags)
+			return grow_memory();
 
-	mem_header *next = kutil::offset_pointer(orig, 1 << size);
-	new (next) mem_header(orig, nullptr, size);
+		unsigned found = __builtin_ctzll(flags) + min_size;
 
-	orig->set_next(next);
-	orig->set_size(size);
-	get_free(size) = orig;
+		spinlock_irq_guard guard(get_lock(found));
+		mem_header *block = get_free(found);
+		if (block) {
+			remove_free(block);
+			block->set_used(true);
+			return block;
+		}
+	}
 }
 
 memory_manager::mem_header *
 memory_manager::pop_free(unsigned size)
 {
-	ensure_block(size);
-	mem_header *block = get_free(size);
-	get_free(size) = block->next();
+	mem_header *block = take_free(size);
+
+	// Split the block down to the size wanted, keeping the lower half.
+	// Other CPUs may look at its header while it is in flight, but it
+	// stays marked used.
+	for (unsigned current = block->size(); current > size; ) {
+		--current;
+		block->set_size(current);
+
+		mem_header *upper = kutil::offset_pointer(block, 1 << current);
+		new (upper) mem_header(nullptr, nullptr, current);
+
+		spinlock_irq_guard guard(get_lock(current));
+		push_free(upper);
+	}
 
-	block->remove();
 	return block;
 }
 
+void
+memory_manager::push_free(mem_header *block)
+{
+	unsigned size = block->size();
+	block->set_prev(nullptr);
+	block->set_next(get_free(size));
+	block->set_used(false);
+	get_free(size) = block;
+	if (block->next())
+		block->next()->set_prev(block);
+	else
+		set_nonempty(size, true);
+	if (size == max_size)
+		__atomic_add_fetch(&m_free_max, 1, __ATOMIC_RELAXED);
+}
+
+void
+memory_manager::remove_free(mem_header *block)
+{
+	unsigned size = block->size();
+	if (get_free(size) == block)
+		get_free(size) = block->next();
+	if (!get_free(size))
+		set_nonempty(size, false);
+	block->remove();
+	if (size == max_size)
+		__atomic_sub_fetch(&m_free_max, 1, __ATOMIC_RELAXED);
+}
+
 } // namespace kutil
@@ -3,65 +3,318 @@
 /// A buddy allocator and related definitions.
 
 #include <stddef.h>
+#include "kutil/heap_stats.h"
+#include "kutil/memory.h"
+#include "kutil/spinlock.h"
 
 namespace kutil {
 
 
-/// Manager for allocation of virtual memory.
+/// Manager for allocation of virtual memory. The manager is safe to use
+/// from several CPUs at once, and from interrupt handlers. Each free list
+/// has its own lock, and a block is kept marked used while it moves between
+/// lists, so no other CPU tries to merge with it. The end of the heap, the
+/// large allocation table, and the grow callback are covered by one more
+/// lock. No more than one of these is held at a time, except that trim()
+/// holds the heap lock and then the max_size list lock. The shrink callback
+/// is only called with no locks held, and never from free().
 class memory_manager
 {
 public:
 	using grow_callback = void (*)(void *start, size_t length);
+	using shrink_callback = void (*)(void *start, size_t length);
 
 	/// Default constructor. Creates an invalid manager.
 	memory_manager();
 
 	/// Constructor.
-	/// \arg start    Pointer to the start of the heap to be managed
-	/// \arg grow_cb  Function pointer to grow the heap size
-	memory_manager(void *start, grow_callback grow_cb);
+	/// \arg start      Pointer to the start of the heap to be managed
+	/// \arg grow_cb    Function pointer to grow the heap size
+	/// \arg shrink_cb  Function pointer to give memory back from the heap,
+	///                 or nullptr if the heap should never shrink
+	memory_manager(void *start, grow_callback grow_cb, shrink_callback shrink_cb = nullptr);
 
-	/// Allocate memory from the area managed.
+	/// Allocate memory from the area managed. Requests too big for a
+	/// max_size block are mapped as a run of pages at the end of the heap.
 	/// \arg length  The amount of memory to allocate, in bytes
 	/// \returns     A pointer to the allocated memory, or nullptr if
 	///              allocation failed.
 	void * allocate(size_t length);
 
+	/// Allocate memory aligned to a given boundary.
+	/// \arg length  The amount of memory to allocate, in bytes
+	/// \arg align   Alignment wanted, a power of two no more than (2^max_size)
+	/// \returns     A pointer to the allocated memory, or nullptr if
+	///              allocation failed.
+	void * allocate_aligned(size_t length, size_t align);
+
+	/// Change the size of an allocation. The block is grown in place if the
+	/// blocks after it are free buddies, and shrunk in place by splitting.
+	/// Otherwise the contents are copied to a new allocation, which only has
+	/// the default alignment.
+	/// \arg p       A pointer previously returned by allocate(), or nullptr
+	/// \arg length  The new size wanted, in bytes
+	/// \returns     A pointer to the resized memory, or nullptr if length
+	///              was 0.
+	void * reallocate(void *p, size_t length);
+
+	/// Get the number of bytes usable at an allocation, which may be more
+	/// than was asked for.
+	/// \arg p  A pointer previously returned by allocate()
+	/// \returns The usable size in bytes
+	size_t usable_size(void *p);
+
 	/// Free a previous allocation.
 	/// \arg p  A pointer previously retuned by allocate()
 	void free(void *p);
 
+	/// Allocate several blocks of the same size, taking the free list's
+	/// lock once for all of the blocks it already holds. Any more are cut
+	/// from one bigger block.
+	/// \arg length  The amount of memory for each block, in bytes. Must fit
+	///              in a max_size block.
+	/// \arg blocks  Array to store the pointers to the allocated memory in
+	/// \arg count   Number of blocks wanted
+	/// \returns     The number of blocks allocated, fewer than count if
+	///              allocation failed
+	size_t allocate_batch(size_t length, void **blocks, size_t count);
+
+	/// Free several blocks of the same size, taking the free list's lock
+	/// once for all of them. Blocks that merge with a buddy continue up the
+	/// bigger lists as free() would. The order of the array is changed.
+	/// \arg blocks  Pointers previously returned by allocate(), all with
+	///              the same block size and none of them large or aligned
+	/// \arg count   Number of pointers in the array
+	void free_batch(void **blocks, size_t count);
+
+	/// Give fully free max_size blocks back through the shrink callback.
+	/// Blocks at the end of the heap shrink it, others are remembered so
+	/// that growing the heap maps them again before extending it. Only one
+	/// trim runs at a time; others return 0 straight away.
+	/// \arg keep  Number of free max_size blocks to hold on to
+	/// \returns   The number of bytes given back
+	size_t trim(size_t keep = 0);
+
+	/// Trim the heap down to half the trim threshold, if free() has seen
+	/// more free max_size blocks than the threshold since the last trim.
+	/// \returns  The number of bytes given back
+	size_t trim_if_wanted();
+
+	/// Set the number of free max_size blocks above which free() asks for
+	/// the heap to be trimmed. free() never trims by itself, as it may be
+	/// called where the shrink callback is not safe to call.
+	/// \arg blocks  Number of free max_size blocks, or 0 to never trim
+	void set_trim_threshold(size_t blocks) { m_trim_threshold = blocks; }
+
+	/// Check if free() has asked for the heap to be trimmed.
+	bool trim_wanted() const { return __atomic_load_n(&m_trim_wanted, __ATOMIC_RELAXED); }
+
+	/// Get the number of free max_size blocks currently mapped.
+	size_t free_blocks() const { return __atomic_load_n(&m_free_max, __ATOMIC_RELAXED); }
+
+#ifdef KUTIL_HEAP_STATS
+	/// Get the heap's activity counters.
+	const heap_stats & stats() const { return m_stats; }
+#endif
+
+#ifdef KUTIL_LOCK_STATS
+	/// Get the counters of all the free list locks added together.
+	lock_stats list_lock_stats() const;
+
+	/// Get the counters of the lock for the heap's extent.
+	const lock_stats & heap_lock_stats() const { return m_heap_lock.stats(); }
+#endif
+
+	/// Check if a pointer is from the large allocation path. Large
+	/// allocations start on a max_size boundary, while blocks always
+	/// start `block_overhead` bytes past one.
+	/// \arg p  A pointer previously returned by allocate()
+	/// \returns True if p was a large allocation
+	static inline bool is_large(const void *p)
+	{
+		return (reinterpret_cast<addr_t>(p) & ((1ull << max_size) - 1)) == 0;
+	}
+
+	/// Get the size category of the block needed to hold a number of bytes.
+	/// \arg total  Number of bytes needed, including the block header
+	/// \returns    The smallest size with (2^size) >= total, but no
+	///              smaller than min_size
+	static inline unsigned size_for(size_t total)
+	{
+		// That is one more than the index of the highest bit of (total - 1)
+		if (total <= (1ull << min_size)) return min_size;
+		return 64 - __builtin_clzll(total - 1);
+	}
+
 	/// Minimum block size is (2^min_size). Must be at least 6.
 	static const unsigned min_size = 6;
 
 	/// Maximum block size is (2^max_size). Must be less than 64.
 	static const unsigned max_size = 16;
 
+	/// Bytes at the start of each block used for the allocator's own
+	/// bookkeeping. Blocks are aligned to their size, and pointers returned
+	/// by allocate() are this many bytes past the start of their block.
+	static const size_t block_overhead = 16;
+
+	/// Large allocations are requested from grow_callback in multiples
+	/// of this size.
+	static const size_t page_size = 0x1000;
+
+	/// Maximum number of given back blocks below the end of the heap that
+	/// are remembered. Once full, trim() only gives back blocks at the end.
+	static const size_t max_released = 32;
+
 protected:
 	class mem_header;
+	struct large_alloc;
 
-	/// Expand the size of memory
-	void grow_memory();
+	/// Allocate a run of pages at the end of the heap
+	/// \arg length  The amount of memory to allocate, in bytes
+	/// \returns     A pointer to the allocated memory
+	void * allocate_large(size_t length);
 
-	/// Ensure there is a block of a given size, recursively splitting
-	/// \arg size   Size category of the block we want
-	void ensure_block(unsigned size);
+	/// Find the side table entry of a large allocation
+	/// \arg p  A pointer previously returned by allocate_large()
+	/// \returns The entry's index in m_large
+	size_t find_large(const void *p) const;
+
+	/// Replace the large allocation table with a bigger one, unless
+	/// another CPU already has.
+	/// \arg capacity  Number of entries the new table should hold
+	void grow_large_table(size_t capacity);
+
+	/// Resize a large allocation in place, if it fits in its reserved
+	/// blocks or it is at the end of the heap.
+	/// \arg p       A pointer previously returned by allocate_large()
+	/// \arg length  The new size wanted, in bytes
+	/// \returns     True if the allocation was resized
+	bool resize_large(void *p, size_t length);
+
+	/// Get the header of the block holding a (non-large) allocation
+	/// \arg p  A pointer previously returned by allocate()
+	/// \returns The block's header
+	static mem_header * header_of(void *p);
+
+	/// Try to resize a block in place, splitting off or merging in buddies
+	/// \arg header  The block to resize
+	/// \arg size    Size category the block should become
+	/// \returns     True if the block was resized
+	bool resize_block(mem_header *header, unsigned size);
+
+	/// Free a detached block, merging it with its buddies
+	/// \arg header  The block to free, marked used
+	void free_block(mem_header *header);
+
+	/// Free a large allocation, returning its memory to the heap as
+	/// max_size blocks.
+	/// \arg p  A pointer previously returned by allocate_large()
+	void free_large(void *p);
+
+	/// Map memory into the heap through the grow callback
+	/// \arg start   Start of the memory to map
+	/// \arg length  Number of bytes to map
+	void grow(void *start, size_t length);
+
+	/// Give memory back from the heap through the shrink callback
+	/// \arg start   Start of the memory to give back
+	/// \arg length  Number of bytes to give back
+	void shrink(void *start, size_t length);
+
+	/// Expand the size of memory, preferring blocks given back by trim()
+	/// \returns  A new max_size block, marked used
+	mem_header * grow_memory();
+
+	/// Shrink the heap past any given back blocks at its end
+	void shrink_top();
+
+	/// Ask for a trim if free() has left too many free max_size blocks
+	void check_trim();
+
+	/// Check if a block is one given back below the end of the heap
+	/// \arg block  The start of the block
+	bool is_released(const void *block) const;
+
+	/// Put a block given back by trim() where it belongs: off the end of
+	/// the heap if it is there, otherwise with the remembered blocks. If
+	/// there is no room for it, it is mapped again and freed.
+	/// \arg block  The given back block
+	void place_released(mem_header *block);
 
 	/// Helper accessor for the list of blocks of a given size
 	/// \arg size   Size category of the block we want
 	/// \returns    A mutable reference to the head of the list
 	mem_header *& get_free(unsigned size)  { return m_free[size - min_size]; }
 
-	/// Helper to get a block of the given size, growing if necessary
+	/// Helper accessor for the lock of the list of blocks of a given size
+	/// \arg size   Size category of the list
+	/// \returns    The lock
+	spinlock & get_lock(unsigned size)  { return m_locks[size - min_size]; }
+
+	/// Helper to flag whether the list of blocks of a given size has any
+	/// blocks. The list's lock must be held.
+	/// \arg size      Size category of the list
+	/// \arg nonempty  True if the list has blocks
+	void set_nonempty(unsigned size, bool nonempty) {
+		const uint64_t bit = 1ull << (size - min_size);
+		if (nonempty)
+			__atomic_fetch_or(&m_nonempty, bit, __ATOMIC_RELAXED);
+		else
+			__atomic_fetch_and(&m_nonempty, ~bit, __ATOMIC_RELAXED);
+	}
+
+	/// Helper to take the smallest free block of at least the given size,
+	/// growing if there is none
+	/// \arg size   Smallest size category wanted
+	/// \returns    A detached block, marked used
+	mem_header * take_free(unsigned size);
+
+	/// Helper to get a block of the given size, splitting a bigger block
+	/// if necessary
 	/// \arg size   Size category of the block we want
-	/// \returns    A detached block of the given size
+	/// \returns    A detached block of the given size, marked used
 	mem_header * pop_free(unsigned size);
 
-	mem_header *m_free[max_size - min_size];
+	/// Helper to put a detached block at the head of its free list and
+	/// mark it free. The list's lock must be held.
+	/// \arg block  The block to add, with its size already set
+	void push_free(mem_header *block);
+
+	/// Helper to take a block out of the middle of its free list. The
+	/// list's lock must be held.
+	/// \arg block  The block to remove
+	void remove_free(mem_header *block);
+
+	mem_header *m_free[max_size - min_size + 1];
+	spinlock m_locks[max_size - min_size + 1];
+	spinlock m_heap_lock;     ///< Lock for the heap's extent and large table
+
 	void *m_start;
 	size_t m_length;
 
+	large_alloc *m_large;     ///< Side table of large allocations
+	size_t m_large_count;
+	size_t m_large_capacity;
+
+	void *m_released[max_released];  ///< Given back blocks below the end
+	size_t m_released_count;
+	size_t m_free_max;        ///< Free max_size blocks on the free list
+
+	/// One bit per size, set if that size's list has blocks, so the
+	/// smallest one is found with one load and a bit scan. Bits only change
+	/// when a list becomes empty or stops being empty.
+	uint64_t m_nonempty;
+
+	size_t m_trim_threshold;
+	bool m_trim_wanted;
+	bool m_trimming;
+
 	grow_callback m_grow;
+	shrink_callback m_shrink;
+
+#ifdef KUTIL_HEAP_STATS
+	heap_stats m_stats;
+#endif
 
 	memory_manager(const memory_manager &) = delete;
 };
@@ -0,0 +1,99 @@
+#pragma once
+/// \file mpsc_queue.h
+/// An intrusive queue many CPUs can add to and one CPU takes from.
+
+#include <stddef.h>
+
+namespace kutil {
+
+
+/// Link embedded in items that go on an mpsc_queue.
+struct mpsc_node
+{
+	mpsc_node *mpsc_next;
+};
+
+
+/// An unbounded, intrusive queue with many producers and a single
+/// consumer, after Dmitry Vyukov's design. Adding an item is one atomic
+/// exchange, and never waits. Taking one never takes a lock, but may see
+/// the queue as empty for a moment while a producer is between its two
+/// steps of adding.
+/// \tparam T  Type of items, which must derive from mpsc_node
+template <typename T>
+class mpsc_queue
+{
+public:
+	mpsc_queue() :
+		m_head(&m_stub),
+		m_tail(&m_stub)
+	{
+		m_stub.mpsc_next = nullptr;
+	}
+
+	/// Add an item to the queue. Safe to call from any CPU.
+	/// \arg item  The item to add. It must stay valid until it is popped.
+	void push(T *item)
+	{
+		push_node(static_cast<mpsc_node *>(item));
+	}
+
+	/// Take the oldest item from the queue. Only call from the consumer.
+	/// \returns  The item, or nullptr if the queue is empty
+	T * pop()
+	{
+		mpsc_node *tail = m_tail;
+		mpsc_node *next = __atomic_load_n(&tail->mpsc_next, __ATOMIC_ACQUIRE);
+
+		// Skip over the stub, which only keeps the list from being empty
+		if (tail == &m_stub) {
+			if (!next) return nullptr;
+			m_tail = next;
+			tail = next;
+			next = __atomic_load_n(&tail->mpsc_next, __ATOMIC_ACQUIRE);
+		}
+
+		if (next) {
+			m_tail = next;
+			return static_cast<T *>(tail);
+		}
+
+		// The tail is the last item, unless a producer has swapped in a new
+		// head but not yet linked it, in which case try again later.
+		if (tail != __atomic_load_n(&m_head, __ATOMIC_ACQUIRE))
+			return nullptr;
+
+		// Put the stub back behind the last item so it can be taken
+		push_node(&m_stub);
+		next = __atomic_load_n(&tail->mpsc_next, __ATOMIC_ACQUIRE);
+		if (next) {
+			m_tail = next;
+			return static_cast<T *>(tail);
+		}
+
+		return nullptr;
+	}
+
+	/// Check if the queue looks empty. Only call from the consumer.
+	bool empty() const
+	{
+		return m_tail == &m_stub &&
+			!__atomic_load_n(&m_stub.mpsc_next, __ATOMIC_ACQUIRE);
+	}
+
+private:
+	void push_node(mpsc_node *node)
+	{
+		__atomic_store_n(&node->mpsc_next, nullptr, __ATOMIC_RELAXED);
+		mpsc_node *prev = __atomic_exchange_n(&m_head, node, __ATOMIC_ACQ_REL);
+		__atomic_store_n(&prev->mpsc_next, node, __ATOMIC_RELEASE);
+	}
+
+	alignas(64) mpsc_node *m_head;   ///< Most recently added, producers swap this
+	alignas(64) mpsc_node *m_tail;   ///< Oldest item, consumer owned
+	mpsc_node m_stub;
+
+	mpsc_queue(const mpsc_queue &) = delete;
+};
+
+} // namespace kutil
@@ -0,0 +1,210 @@
+#pragma once
+/// \file radix_tree.h
+/// A radix tree mapping integer indices, like page numbers, to pointers.
+
+#include <stdint.h>
+#include "kutil/memory.h"
+
+namespace kutil {
+
+
+/// A sparse array of pointers indexed by a 64 bit integer, stored as a
+/// radix tree with 64 slots per node. Lookups take one step per six bits
+/// of the highest index stored, so dense runs of page-indexed data are
+/// cheap to find and to walk in order. The tree grows taller as larger
+/// indices are added, and frees nodes that become empty.
+/// \tparam T  Type of the items pointed to
+template <typename T>
+class radix_tree
+{
+public:
+	radix_tree() : m_root(nullptr), m_height(0), m_count(0) {}
+
+	~radix_tree() { clear(); }
+
+	/// Get the number of items in the tree.
+	inline size_t count() const { return m_count; }
+
+	/// Check if the tree has no items.
+	inline bool empty() const { return m_count == 0; }
+
+	/// Look up the item at an index.
+	/// \arg index  The index to look up
+	/// \returns    The item, or nullptr if there is none
+	T * find(uint64_t index) const
+	{
+		if (!covers(index)) return nullptr;
+
+		node *cur = m_root;
+		for (unsigned level = m_height; level > 1; --level) {
+			cur = static_cast<node *>(cur->slots[slot(index, level)]);
+			if (!cur) return nullptr;
+		}
+		return static_cast<T *>(cur->slots[slot(index, 1)]);
+	}
+
+	/// Set the item at an index.
+	/// \arg index  The index to set
+	/// \arg item   The item to store, which may not be nullptr
+	/// \returns    The item previously at that index, or nullptr
+	T * set(uint64_t index, T *item)
+	{
+		while (!covers(index)) grow();
+
+		node *cur = m_root;
+		for (unsigned level = m_height; level > 1; --level) {
+			void *&child = cur->slots[slot(index, level)];
+			if (!child) {
+				child = new_node();
+				++cur->used;
+			}
+			cur = static_cast<node *>(child);
+		}
+
+		void *&leaf = cur->slots[slot(index, 1)];
+		T *old = static_cast<T *>(leaf);
+		if (!old) {
+			++cur->used;
+			++m_count;
+		}
+		leaf = item;
+		return old;
+	}
+
+	/// Remove the item at an index.
+	/// \arg index  The index to clear
+	/// \returns    The item that was removed, or nullptr
+	T * remove(uint64_t index)
+	{
+		if (!covers(index)) return nullptr;
+
+		// Remember the path down, to free nodes that end up empty
+		node *path[max_height];
+		node *cur = m_root;
+		for (unsigned level = m_height; level > 1; --level) {
+			path[level - 1] = cur;
+			cur = static_cast<node *>(cur->slots[slot(index, level)]);
+			if (!cur) return nullptr;
+		}
+		path[0] = cur;
+
+		T *old = static_cast<T *>(cur->slots[slot(index, 1)]);
+		if (!old) return nullptr;
+
+		--m_count;
+		for (unsigned level = 1; level <= m_height; ++level) {
+			node *n = path[level - 1];
+			n->slots[slot(index, level)] = nullptr;
+			if (--n->used) break;
+
+			kutil::free(n);
+			if (level == m_height) {
+				m_root = nullptr;
+				m_height = 0;
+			}
+		}
+		return old;
+	}
+
+	/// Find the first item at or after an index, for walking the tree in
+	/// order.
+	/// \arg index  [in] Where to start looking, [out] the item's index
+	/// \returns    The item, or nullptr if there are none at or after index
+	T * next(uint64_t &index) const
+	{
+		if (!covers(index)) return nullptr;
+		return static_cast<T *>(next_in(m_root, m_height, index));
+	}
+
+	/// Remove all items from the tree, freeing its nodes. The items
+	/// themselves are not touched.
+	void clear()
+	{
+		if (m_root) free_node(m_root, m_height);
+		m_root = nullptr;
+		m_height = 0;
+		m_count = 0;
+	}
+
+private:
+	static const unsigned bits = 6;
+	static const unsigned fanout = 1 << bits;
+	static const unsigned max_height = (64 + bits - 1) / bits;
+
+	struct node
+	{
+		void *slots[fanout];
+		unsigned used;   ///< Number of non-null slots
+	};
+
+	static inline unsigned slot(uint64_t index, unsigned level)
+	{
+		const unsigned shift = (level - 1) * bits;
+		return shift < 64 ? (index >> shift) & (fanout - 1) : 0;
+	}
+
+	/// Check if the tree is tall enough to hold an index.
+	inline bool covers(uint64_t index) const
+	{
+		const unsigned shift = m_height * bits;
+		return m_height && (shift >= 64 || (index >> shift) == 0);
+	}
+
+	static node * new_node()
+	{
+		node *n = reinterpret_cast<node *>(kutil::malloc(sizeof(node)));
+		kutil::memset(n, 0, sizeof(node));
+		return n;
+	}
+
+	/// Add a level above the root, keeping the old root as its first slot.
+	void grow()
+	{
+		node *n = new_node();
+		if (m_root) {
+			n->slots[0] = m_root;
+			n->used = 1;
+		}
+		m_root = n;
+		++m_height;
+	}
+
+	static void free_node(node *n, unsigned level)
+	{
+		if (level > 1) {
+			for (unsigned i = 0; i < fanout; ++i)
+				if (n->slots[i]) free_node(static_cast<node *>(n->slots[i]), level - 1);
+		}
+		kutil::free(n);
+	}
+
+	/// Find the first non-null leaf slot at or after index under n.
+	static void * next_in(node *n, unsigned level, uint64_t &index)
+	{
+		const unsigned shift = (level - 1) * bits;
+		const uint64_t below = shift + bits >= 64 ? ~0ull : (1ull << (shift + bits)) - 1;
+
+		for (unsigned i = slot(index, level); i < fanout; ++i) {
+			void *child = n->slots[i];
+			if (child) {
+				if (level == 1) return child;
+				void *found = next_in(static_cast<node *>(child), level - 1, index);
+				if (found) return found;
+			}
+
+			// Move index to the start of the next slot at this level
+			if (i + 1 == fanout || (shift + bits > 64 && i + 1 == 1u << (64 - shift)))
+				break;
+			index = (index & ~below) | (uint64_t(i + 1) << shift);
+		}
+		return nullptr;
+	}
+
+	node *m_root;
+	unsigned m_height;   ///< Levels of nodes, 0 if the tree is empty
+	size_t m_count;
+
+	radix_tree(const radix_tree &) = delete;
+};
+
+} // namespace kutil
@@ -0,0 +1,129 @@
+#pragma once
+/// \file range_tree.h
+/// An intrusive tree of non-overlapping address ranges.
+
+#include <stdint.h>
+#include "kutil/rb_tree.h"
+
+namespace kutil {
+
+
+/// An intrusive, balanced tree of address ranges that do not overlap, such
+/// as blocks of pages or the areas of an address space. Finding the range
+/// that holds an address, or the first range after it, is O(log n).
+/// \tparam T  Type of items, which must derive from rb_node and provide
+///            `uint64_t range_start() const` and `uint64_t range_end() const`,
+///            where the end is one past the last address. Ranges must not be
+///            empty, and must not change while the item is in the tree.
+template <typename T>
+class range_tree :
+	private rb_tree
+{
+public:
+	class iterator
+	{
+	public:
+		iterator(T *item) : m_item(item) {}
+		inline T * operator*() const { return m_item; }
+		inline iterator & operator++() { m_item = range_tree::next(m_item); return *this; }
+		inline bool operator!=(const iterator &o) const { return m_item != o.m_item; }
+	private:
+		T *m_item;
+	};
+
+	using rb_tree::count;
+	using rb_tree::empty;
+	using rb_tree::root;
+
+	/// Add an item to the tree.
+	/// \arg item  The item to add
+	/// \returns   False, and the item is not added, if it overlaps an item
+	///            already in the tree
+	bool insert(T *item)
+	{
+		const uint64_t start = item->range_start();
+		if (find_overlap(start, item->range_end()))
+			return false;
+
+		rb_node *parent = nullptr;
+		rb_node *cur = root();
+		bool left = false;
+		while (cur) {
+			parent = cur;
+			left = start < get(cur)->range_start();
+			cur = left ? cur->rb_left : cur->rb_right;
+		}
+
+		link(item, parent, left);
+		return true;
+	}
+
+	/// Remove an item from the tree.
+	/// \arg item  An item currently in this tree
+	inline void remove(T *item) { unlink(item); }
+
+	/// Find the item whose range holds an address.
+	/// \arg addr  The address to look up
+	/// \returns   The item, or nullptr if no range holds the address
+	T * find(uint64_t addr) const
+	{
+		rb_node *cur = root();
+		while (cur) {
+			T *item = get(cur);
+			if (addr < item->range_start()) cur = cur->rb_left;
+			else if (addr >= item->range_end()) cur = cur->rb_right;
+			else return item;
+		}
+		return nullptr;
+	}
+
+	/// Find the first item whose range holds an address or comes after it.
+	/// \arg addr  The address to look up
+	/// \returns   The item, or nullptr if every range ends at or before addr
+	T * lower_bound(uint64_t addr) const
+	{
+		T *found = nullptr;
+		rb_node *cur = root();
+		while (cur) {
+			T *item = get(cur);
+			if (item->range_end() > addr) {
+				found = item;
+				cur = cur->rb_left;
+			} else {
+				cur = cur->rb_right;
+			}
+		}
+		return found;
+	}
+
+	/// Find the first item that overlaps a range. Later overlapping items
+	/// follow it in order.
+	/// \arg start  The first address of the range
+	/// \arg end    One past the last address of the range
+	/// \returns    The item, or nullptr if nothing overlaps
+	T * find_overlap(uint64_t start, uint64_t end) const
+	{
+		T *item = lower_bound(start);
+		return (item && item->range_start() < end) ? item : nullptr;
+	}
+
+	/// Get the lowest item in the tree, or nullptr if it is empty.
+	inline T * first() const { return get(rb_tree::first()); }
+
+	/// Get the highest item in the tree, or nullptr if it is empty.
+	inline T * last() const { return get(rb_tree::last()); }
+
+	/// Get the item after the given one, or nullptr if it is the last.
+	static inline T * next(T *item) { return get(rb_tree::next(item)); }
+
+	/// Get the item before the given one, or nullptr if it is the first.
+	static inline T * prev(T *item) { return get(rb_tree::prev(item)); }
+
+	inline iterator begin() const { return iterator(first()); }
+	inline iterator end() const { return iterator(nullptr); }
+
+private:
+	static inline T * get(rb_node *node) { return static_cast<T *>(node); }
+};
+
+} // namespace kutil
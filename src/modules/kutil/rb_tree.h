@@ -0,0 +1,301 @@
+#pragma once
+/// \file rb_tree.h
+/// The balancing part of an intrusive red-black tree, shared by the
+/// ordered containers built on it.
+
+#include <stddef.h>
+
+namespace kutil {
+
+
+/// Links embedded in items that go in an rb_tree.
+struct rb_node
+{
+	rb_node *rb_parent;
+	rb_node *rb_left;
+	rb_node *rb_right;
+	bool rb_red;
+};
+
+
+/// An intrusive red-black tree of `rb_node`s. This class only knows how to
+/// link, unlink, balance and walk nodes; containers built on it decide
+/// where a node goes and call `link` with the spot. Nothing is allocated,
+/// and every operation is O(log n).
+class rb_tree
+{
+public:
+	rb_tree() : m_root(nullptr), m_count(0) {}
+
+	/// Get the number of nodes in the tree.
+	inline size_t count() const { return m_count; }
+
+	/// Check if the tree has no nodes.
+	inline bool empty() const { return m_root == nullptr; }
+
+	/// Get the root of the tree, for walking it directly.
+	inline rb_node * root() const { return m_root; }
+
+	/// Get the leftmost (lowest) node in the tree.
+	/// \returns  The node, or nullptr if the tree is empty
+	rb_node * first() const { return m_root ? leftmost(m_root) : nullptr; }
+
+	/// Get the rightmost (highest) node in the tree.
+	/// \returns  The node, or nullptr if the tree is empty
+	rb_node * last() const { return m_root ? rightmost(m_root) : nullptr; }
+
+	/// Get the node after the given one in order.
+	/// \returns  The next node, or nullptr if this is the last
+	static rb_node * next(rb_node *node)
+	{
+		if (node->rb_right) return leftmost(node->rb_right);
+		rb_node *parent = node->rb_parent;
+		while (parent && node == parent->rb_right) {
+			node = parent;
+			parent = parent->rb_parent;
+		}
+		return parent;
+	}
+
+	/// Get the node before the given one in order.
+	/// \returns  The previous node, or nullptr if this is the first
+	static rb_node * prev(rb_node *node)
+	{
+		if (node->rb_left) return rightmost(node->rb_left);
+		rb_node *parent = node->rb_parent;
+		while (parent && node == parent->rb_left) {
+			node = parent;
+			parent = parent->rb_parent;
+		}
+		return parent;
+	}
+
+	/// Add a node to the tree and rebalance it.
+	/// \arg node    The node to add
+	/// \arg parent  The node to hang it from, or nullptr if the tree is empty
+	/// \arg left    Whether to make it the parent's left child. That spot
+	///              must be empty.
+	void link(rb_node *node, rb_node *parent, bool left)
+	{
+		node->rb_parent = parent;
+		node->rb_left = node->rb_right = nullptr;
+		node->rb_red = true;
+
+		if (!parent) m_root = node;
+		else if (left) parent->rb_left = node;
+		else parent->rb_right = node;
+
+		++m_count;
+		insert_fixup(node);
+	}
+
+	/// Remove a node from the tree and rebalance it.
+	/// \arg node  A node currently in this tree
+	void unlink(rb_node *node)
+	{
+		rb_node *moved = node;       // The node that leaves its spot
+		bool moved_red = node->rb_red;
+		rb_node *child;              // What takes moved's old spot
+		rb_node *child_parent;
+
+		if (!node->rb_left) {
+			child = node->rb_right;
+			child_parent = node->rb_parent;
+			replace(node, child);
+		} else if (!node->rb_right) {
+			child = node->rb_left;
+			child_parent = node->rb_parent;
+			replace(node, child);
+		} else {
+			// Two children: the successor takes the node's place
+			moved = leftmost(node->rb_right);
+			moved_red = moved->rb_red;
+			child = moved->rb_right;
+
+			if (moved->rb_parent == node) {
+				child_parent = moved;
+			} else {
+				child_parent = moved->rb_parent;
+				replace(moved, child);
+				moved->rb_right = node->rb_right;
+				moved->rb_right->rb_parent = moved;
+			}
+
+			replace(node, moved);
+			moved->rb_left = node->rb_left;
+			moved->rb_left->rb_parent = moved;
+			moved->rb_red = node->rb_red;
+		}
+
+		--m_count;
+		if (!moved_red)
+			erase_fixup(child, child_parent);
+	}
+
+protected:
+	static inline rb_node * leftmost(rb_node *node)
+	{
+		while (node->rb_left) node = node->rb_left;
+		return node;
+	}
+
+	static inline rb_node * rightmost(rb_node *node)
+	{
+		while (node->rb_right) node = node->rb_right;
+		return node;
+	}
+
+	static inline bool red(const rb_node *node) { return node && node->rb_red; }
+
+private:
+	/// Put `with` in `node`'s spot under its parent.
+	void replace(rb_node *node, rb_node *with)
+	{
+		rb_node *parent = node->rb_parent;
+		if (!parent) m_root = with;
+		else if (node == parent->rb_left) parent->rb_left = with;
+		else parent->rb_right = with;
+
+		if (with) with->rb_parent = parent;
+	}
+
+	void rotate_left(rb_node *node)
+	{
+		rb_node *right = node->rb_right;
+		node->rb_right = right->rb_left;
+		if (right->rb_left) right->rb_left->rb_parent = node;
+		replace(node, right);
+		right->rb_left = node;
+		node->rb_parent = right;
+	}
+
+	void rotate_right(rb_node *node)
+	{
+		rb_node *left = node->rb_left;
+		node->rb_left = left->rb_right;
+		if (left->rb_right) left->rb_right->rb_parent = node;
+		replace(node, left);
+		left->rb_right = node;
+		node->rb_parent = left;
+	}
+
+	void insert_fixup(rb_node *node)
+	{
+		rb_node *parent;
+		while ((parent = node->rb_parent) && parent->rb_red) {
+			// A red parent is never the root, so there is a grandparent
+			rb_node *grand = parent->rb_parent;
+
+			if (parent == grand->rb_left) {
+				rb_node *uncle = grand->rb_right;
+				if (red(uncle)) {
+					parent->rb_red = uncle->rb_red = false;
+					grand->rb_red = true;
+					node = grand;
+					continue;
+				}
+
+				if (node == parent->rb_right) {
+					rotate_left(parent);
+					parent = node;
+				}
+				parent->rb_red = false;
+				grand->rb_red = true;
+				rotate_right(grand);
+				break;
+			} else {
+				rb_node *uncle = grand->rb_left;
+				if (red(uncle)) {
+					parent->rb_red = uncle->rb_red = false;
+					grand->rb_red = true;
+					node = grand;
+					continue;
+				}
+
+				if (node == parent->rb_left) {
+					rotate_right(parent);
+					parent = node;
+				}
+				parent->rb_red = false;
+				grand->rb_red = true;
+				rotate_left(grand);
+				break;
+			}
+		}
+
+		m_root->rb_red = false;
+	}
+
+	/// Restore the black height after a black node was removed from above
+	/// `node`, which may be null, so its parent is passed separately.
+	void erase_fixup(rb_node *node, rb_node *parent)
+	{
+		while (node != m_root && !red(node)) {
+			if (node == parent->rb_left) {
+				rb_node *sibling = parent->rb_right;
+				if (sibling->rb_red) {
+					sibling->rb_red = false;
+					parent->rb_red = true;
+					rotate_left(parent);
+					sibling = parent->rb_right;
+				}
+
+				if (!red(sibling->rb_left) && !red(sibling->rb_right)) {
+					sibling->rb_red = true;
+					node = parent;
+					parent = node->rb_parent;
+					continue;
+				}
+
+				if (!red(sibling->rb_right)) {
+					sibling->rb_left->rb_red = false;
+					sibling->rb_red = true;
+					rotate_right(sibling);
+					sibling = parent->rb_right;
+				}
+				sibling->rb_red = parent->rb_red;
+				parent->rb_red = false;
+				sibling->rb_right->rb_red = false;
+				rotate_left(parent);
+			} else {
+				rb_node *sibling = parent->rb_left;
+				if (sibling->rb_red) {
+					sibling->rb_red = false;
+					parent->rb_red = true;
+					rotate_right(parent);
+					sibling = parent->rb_left;
+				}
+
+				if (!red(sibling->rb_left) && !red(sibling->rb_right)) {
+					sibling->rb_red = true;
+					node = parent;
+					parent = node->rb_parent;
+					continue;
+				}
+
+				if (!red(sibling->rb_left)) {
+					sibling->rb_right->rb_red = false;
+					sibling->rb_red = true;
+					rotate_left(sibling);
+					sibling = parent->rb_left;
+				}
+				sibling->rb_red = parent->rb_red;
+				parent->rb_red = false;
+				sibling->rb_left->rb_red = false;
+				rotate_right(parent);
+			}
+
+			node = m_root;
+			break;
+		}
+
+		if (node) node->rb_red = false;
+	}
+
+	rb_node *m_root;
+	size_t m_count;
+
+	rb_tree(const rb_tree &) = delete;
+};
+
+} // namespace kutil
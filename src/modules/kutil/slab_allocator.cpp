@@ -0,0 +1,264 @@
+#include "assert.h"
+#include "memory.h"
+#include "memory_manager.h"
+#include "slab_allocator.h"
+
+namespace kutil {
+
+
+struct slab_cache::slab
+{
+	slab *prev;
+	slab *next;
+	slab_cache *cache;
+	void *free;     ///< List of freed objects
+	size_t unused;  ///< Index of the first never-allocated object
+	size_t used;    ///< Count of objects in use
+
+	inline void remove(slab **list)
+	{
+		if (next) next->prev = prev;
+		if (prev) prev->next = next;
+		else *list = next;
+		prev = next = nullptr;
+	}
+
+	inline void push(slab **list)
+	{
+		prev = nullptr;
+		next = *list;
+		if (next) next->prev = this;
+		*list = this;
+	}
+};
+
+
+const unsigned slab_cache::min_objects;
+const unsigned slab_cache::default_order;
+
+
+static inline size_t
+align_up(size_t n, size_t align)
+{
+	return (n + align - 1) & ~(align - 1);
+}
+
+
+slab_cache::slab_cache() :
+	m_mm(nullptr),
+	m_object_size(0),
+	m_capacity(0),
+	m_first(0),
+	m_slab_order(0),
+	m_partial(nullptr),
+	m_full(nullptr),
+	m_empty(nullptr),
+	m_slabs(0),
+	m_used(0)
+{
+}
+
+slab_cache::slab_cache(memory_manager *mm, size_t object_size, unsigned slab_order) :
+	m_mm(mm),
+	m_object_size(align_up(object_size ? object_size : 1, sizeof(void *))),
+	m_capacity(0),
+	m_first(0),
+	m_slab_order(slab_order),
+	m_partial(nullptr),
+	m_full(nullptr),
+	m_empty(nullptr),
+	m_slabs(0),
+	m_used(0)
+{
+	// Objects that are a multiple of 16 bytes get 16 byte alignment,
+	// others only pointer alignment.
+	size_t align = (m_object_size % 16) ? sizeof(void *) : 16;
+	m_first = align_up(sizeof(slab) + memory_manager::block_overhead, align);
+
+	if (m_slab_order == 0) {
+		m_slab_order = default_order;
+		while ((1ull << m_slab_order) < m_first + min_objects * m_object_size &&
+				m_slab_order < memory_manager::max_size)
+			++m_slab_order;
+	}
+
+	kassert(m_slab_order >= memory_manager::min_size &&
+			m_slab_order <= memory_manager::max_size,
+			"Slab order out of the memory manager's range");
+
+	m_capacity = ((1ull << m_slab_order) - m_first) / m_object_size;
+	kassert(m_capacity > 0, "Slab cache object size is bigger than its slabs");
+}
+
+slab_cache::~slab_cache()
+{
+	slab *lists[] = {m_partial, m_full, m_empty};
+	for (slab *s : lists) {
+		while (s) {
+			slab *next = s->next;
+			m_mm->free(s);
+			s = next;
+		}
+	}
+}
+
+void *
+slab_cache::allocate()
+{
+	slab *s = m_partial;
+	if (!s) {
+		s = m_empty;
+		if (s) s->remove(&m_empty);
+		else s = new_slab();
+
+		if (!s) return nullptr;
+		s->push(&m_partial);
+	}
+
+	void *p = s->free;
+	if (p) {
+		s->free = *reinterpret_cast<void **>(p);
+	} else {
+		p = offset_pointer(mask_pointer(s, (1ull << m_slab_order) - 1),
+				m_first + s->unused * m_object_size);
+		s->unused += 1;
+	}
+
+	if (++s->used == m_capacity) {
+		s->remove(&m_partial);
+		s->push(&m_full);
+	}
+
+	++m_used;
+	return p;
+}
+
+void
+slab_cache::free(void *p)
+{
+	if (!p) return;
+
+	slab *s = slab_for(p);
+	kassert(s->cache == this, "Freed an object into the wrong slab cache");
+
+	*reinterpret_cast<void **>(p) = s->free;
+	s->free = p;
+
+	if (s->used-- == m_capacity) {
+		s->remove(&m_full);
+		s->push(&m_partial);
+	}
+
+	if (s->used == 0) {
+		s->remove(&m_partial);
+
+		// Keep one empty slab around to avoid thrashing the memory
+		// manager when a single object is repeatedly allocated and freed.
+		if (m_empty) {
+			m_mm->free(s);
+			--m_slabs;
+		} else {
+			s->free = nullptr;
+			s->unused = 0;
+			s->push(&m_empty);
+		}
+	}
+
+	--m_used;
+}
+
+void
+slab_cache::reap()
+{
+	while (m_empty) {
+		slab *s = m_empty;
+		s->remove(&m_empty);
+		m_mm->free(s);
+		--m_slabs;
+	}
+}
+
+slab_cache *
+slab_cache::owner(void *p, unsigned slab_order)
+{
+	slab *s = reinterpret_cast<slab *>(offset_pointer(
+			mask_pointer(p, (1ull << slab_order) - 1),
+			memory_manager::block_overhead));
+	return s->cache;
+}
+
+slab_cache::slab *
+slab_cache::new_slab()
+{
+	void *mem = m_mm->allocate((1ull << m_slab_order) - memory_manager::block_overhead);
+	if (!mem) return nullptr;
+
+	slab *s = reinterpret_cast<slab *>(mem);
+	s->prev = nullptr;
+	s->next = nullptr;
+	s->cache = this;
+	s->free = nullptr;
+	s->unused = 0;
+	s->used = 0;
+
+	++m_slabs;
+	return s;
+}
+
+slab_cache::slab *
+slab_cache::slab_for(void *p) const
+{
+	return reinterpret_cast<slab *>(offset_pointer(
+			mask_pointer(p, (1ull << m_slab_order) - 1),
+			memory_manager::block_overhead));
+}
+
+
+const size_t slab_allocator::max_object_size;
+const unsigned slab_allocator::slab_order;
+const unsigned slab_allocator::num_classes;
+const size_t slab_allocator::class_sizes[] = {
+	16, 32, 48, 64, 80, 96, 128, 160, 192, 256, 320, 384, 512 };
+
+slab_allocator::slab_allocator()
+{
+}
+
+slab_allocator::slab_allocator(memory_manager *mm)
+{
+	for (unsigned i = 0; i < num_classes; ++i)
+		new (&m_caches[i]) slab_cache(mm, class_sizes[i], slab_order);
+}
+
+slab_cache *
+slab_allocator::cache_for(size_t length)
+{
+	if (length > max_object_size) return nullptr;
+
+	unsigned i = 0;
+	while (class_sizes[i] < length) ++i;
+	return &m_caches[i];
+}
+
+void *
+slab_allocator::allocate(size_t length)
+{
+	slab_cache *cache = cache_for(length);
+	return cache ? cache->allocate() : nullptr;
+}
+
+void
+slab_allocator::free(void *p)
+{
+	if (!p) return;
+	slab_cache::owner(p, slab_order)->free(p);
+}
+
+void
+slab_allocator::reap()
+{
+	for (auto &cache : m_caches)
+		cache.reap();
+}
+
+} // namespace kutil
@@ -0,0 +1,185 @@
+#pragma once
+/// \file slab_allocator.h
+/// Slab caches of fixed-size objects, layered on the buddy allocator.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+#include "kutil/memory.h"
+
+namespace kutil {
+
+class memory_manager;
+
+
+/// A cache of fixed-size objects. Objects are carved out of slabs, each of
+/// which is a single block allocated from a `memory_manager`. Objects carry
+/// no header of their own: since buddy blocks are aligned to their size,
+/// the slab an object belongs to is found by masking the object's address.
+class slab_cache
+{
+public:
+	/// Default constructor. Creates an invalid cache.
+	slab_cache();
+
+	/// Constructor.
+	/// \arg mm           The memory manager to allocate slabs from
+	/// \arg object_size  Size of objects in this cache, in bytes
+	/// \arg slab_order   Each slab is a block of (2^slab_order) bytes, or
+	///                   pass 0 to pick a size that fits at least
+	///                   `min_objects` objects.
+	slab_cache(memory_manager *mm, size_t object_size, unsigned slab_order = 0);
+
+	/// Destructor. Returns all slabs to the memory manager.
+	~slab_cache();
+
+	/// Allocate an object from the cache.
+	/// \returns  A pointer to uninitialized memory of `object_size()` bytes
+	void * allocate();
+
+	/// Free an object previously allocated from this cache.
+	/// \arg p  A pointer previously returned by allocate()
+	void free(void *p);
+
+	/// Return all completely empty slabs to the memory manager.
+	void reap();
+
+	/// Get the size of objects in this cache.
+	/// \returns  The object size in bytes, including any alignment padding
+	inline size_t object_size() const { return m_object_size; }
+
+	/// Get the size of slabs in this cache.
+	/// \returns  The slab order: slabs are (2^slab_order) bytes
+	inline unsigned slab_order() const { return m_slab_order; }
+
+	/// Get the number of objects each slab holds.
+	inline size_t slab_capacity() const { return m_capacity; }
+
+	/// Get the number of slabs currently allocated by this cache.
+	inline size_t slab_count() const { return m_slabs; }
+
+	/// Get the number of objects currently allocated from this cache.
+	inline size_t objects_used() const { return m_used; }
+
+	/// Find the cache that owns an object.
+	/// \arg p           A pointer returned by some cache's allocate()
+	/// \arg slab_order  The slab order of the owning cache
+	/// \returns         The owning cache
+	static slab_cache * owner(void *p, unsigned slab_order);
+
+	/// Minimum number of objects a slab should fit when the cache picks
+	/// its own slab size.
+	static const unsigned min_objects = 8;
+
+	/// Smallest slab the cache will pick for itself is (2^default_order).
+	static const unsigned default_order = 12;
+
+private:
+	struct slab;
+
+	/// Allocate a new slab from the memory manager.
+	/// \returns  A new slab with no objects in use
+	slab * new_slab();
+
+	/// Get the slab that contains a given object.
+	slab * slab_for(void *p) const;
+
+	memory_manager *m_mm;
+	size_t m_object_size;
+	size_t m_capacity;
+	size_t m_first;     ///< Offset of the first object in a slab
+	unsigned m_slab_order;
+
+	slab *m_partial;    ///< Slabs with some free objects
+	slab *m_full;       ///< Slabs with no free objects
+	slab *m_empty;      ///< Cached slabs with no used objects
+
+	size_t m_slabs;
+	size_t m_used;
+
+	slab_cache(const slab_cache &) = delete;
+};
+
+
+/// A slab cache for objects of a particular type.
+template <typename T>
+class object_cache :
+	public slab_cache
+{
+public:
+	/// Constructor.
+	/// \arg mm          The memory manager to allocate slabs from
+	/// \arg slab_order  Slab size, see `slab_cache::slab_cache()`
+	object_cache(memory_manager *mm, unsigned slab_order = 0) :
+		slab_cache(mm, sizeof(T), slab_order)
+	{}
+
+	/// Allocate and construct an object.
+	/// \returns  The new object
+	template <typename... Args>
+	T * create(Args&&... args)
+	{
+		void *p = allocate();
+		return p ? new (p) T(std::forward<Args>(args)...) : nullptr;
+	}
+
+	/// Destroy and free an object.
+	/// \arg p  An object previously returned by create()
+	void destroy(T *p)
+	{
+		p->~T();
+		free(p);
+	}
+};
+
+
+/// A general-purpose allocator for small allocations, made up of slab
+/// caches for a set of size classes. All slabs are the same size, so
+/// free() needs no size argument.
+class slab_allocator
+{
+public:
+	/// Default constructor. Creates an invalid allocator.
+	slab_allocator();
+
+	/// Constructor.
+	/// \arg mm  The memory manager to allocate slabs from
+	slab_allocator(memory_manager *mm);
+
+	/// Allocate memory.
+	/// \arg length  The amount of memory to allocate, in bytes
+	/// \returns     A pointer to the allocated memory, or nullptr if
+	///              length is larger than `max_object_size`
+	void * allocate(size_t length);
+
+	/// Free a previous allocation.
+	/// \arg p  A pointer previously returned by allocate()
+	void free(void *p);
+
+	/// Return all completely empty slabs to the memory manager.
+	void reap();
+
+	/// Get the size class cache that would serve an allocation.
+	/// \arg length  The size of the allocation, in bytes
+	/// \returns     The cache, or nullptr if length is too large
+	slab_cache * cache_for(size_t length);
+
+	/// Largest allocation served by slab caches.
+	static const size_t max_object_size = 512;
+
+	/// Slabs for all size classes are (2^slab_order) bytes.
+	static const unsigned slab_order = 12;
+
+	/// Number of size classes.
+	static const unsigned num_classes = 13;
+
+	/// The object sizes of each size class.
+	static const size_t class_sizes[num_classes];
+
+private:
+	slab_cache m_caches[num_classes];
+
+	slab_allocator(const slab_allocator &) = delete;
+};
+
+} // namespace kutil
@@ -0,0 +1,15 @@
+#include "spinlock.h"
+
+namespace kutil {
+
+irq_save_callback __irq_save_p = nullptr;
+irq_restore_callback __irq_restore_p = nullptr;
+
+void
+irq_set_callbacks(irq_save_callback save, irq_restore_callback restore)
+{
+	__irq_save_p = save;
+	__irq_restore_p = restore;
+}
+
+} // namespace kutil
@@ -0,0 +1,394 @@
+#pragma once
+/// \file spinlock.h
+/// Spinning locks for short critical sections, and guards to hold them.
+///
+/// When kutil is built with `KUTIL_LOCK_STATS` defined, every lock keeps
+/// `lock_stats` counters, read with its `stats()` method.
+
+#include <stdint.h>
+#include "kutil/lock_stats.h"
+
+namespace kutil {
+
+/// Disable interrupts on the current CPU.
+/// \returns  True if interrupts were enabled before
+using irq_save_callback = bool (*)();
+
+/// Restore interrupts on the current CPU.
+/// \arg enabled  The value returned by the matching irq_save_callback
+using irq_restore_callback = void (*)(bool enabled);
+
+/// Set the callbacks the irq guards use to disable interrupts. The
+/// kernel sets these; without them, as on the host, interrupts are left
+/// alone.
+/// \arg save     Callback to disable interrupts
+/// \arg restore  Callback to restore interrupts
+void irq_set_callbacks(irq_save_callback save, irq_restore_callback restore);
+
+extern irq_save_callback __irq_save_p;
+extern irq_restore_callback __irq_restore_p;
+
+
+/// A test-and-test-and-set spinlock. Waiters spin on a plain read of the
+/// lock, and only try to take it once it looks free, so they don't keep
+/// pulling the cache line away from the holder. It is not fair: a CPU that
+/// just released the lock will often take it again first.
+class spinlock
+{
+public:
+	constexpr spinlock() : m_locked(false) {}
+
+	/// Take the lock, spinning until it is free.
+	inline void acquire()
+	{
+		uint64_t spins = 0;
+		while (__atomic_exchange_n(&m_locked, true, __ATOMIC_ACQUIRE)) {
+			while (__atomic_load_n(&m_locked, __ATOMIC_RELAXED)) {
+				__builtin_ia32_pause();
+				++spins;
+			}
+		}
+		count_acquire(spins);
+	}
+
+	/// Try to take the lock without spinning.
+	/// \returns  True if the lock was taken
+	inline bool try_acquire()
+	{
+		if (__atomic_exchange_n(&m_locked, true, __ATOMIC_ACQUIRE))
+			return false;
+		count_acquire(0);
+		return true;
+	}
+
+	/// Release the lock.
+	inline void release()
+	{
+		count_release();
+		__atomic_store_n(&m_locked, false, __ATOMIC_RELEASE);
+	}
+
+#ifdef KUTIL_LOCK_STATS
+	/// Get the lock's counters.
+	const lock_stats & stats() const { return m_stats; }
+
+private:
+	inline void count_acquire(uint64_t spins) { m_stats.acquired(spins); }
+	inline void count_release() { m_stats.released(); }
+	lock_stats m_stats;
+#else
+private:
+	inline void count_acquire(uint64_t) {}
+	inline void count_release() {}
+#endif
+
+	bool m_locked;
+
+	spinlock(const spinlock &) = delete;
+};
+
+
+/// A ticket lock. Each CPU takes a ticket and waits for its number to be
+/// served, so the lock is handed out in the order it was asked for and no
+/// CPU can starve. Waiters back off in proportion to how many are ahead of
+/// them. Prefer it to `spinlock` for locks that are often contended.
+class ticket_lock
+{
+public:
+	constexpr ticket_lock() : m_next(0), m_serving(0) {}
+
+	/// Take the lock, waiting for every CPU that asked for it earlier.
+	inline void acquire()
+	{
+		const uint32_t ticket = __atomic_fetch_add(&m_next, 1, __ATOMIC_RELAXED);
+
+		uint64_t spins = 0;
+		uint32_t serving;
+		while ((serving = __atomic_load_n(&m_serving, __ATOMIC_ACQUIRE)) != ticket) {
+			for (uint32_t i = ticket - serving; i; --i) {
+				__builtin_ia32_pause();
+				++spins;
+			}
+		}
+		count_acquire(spins);
+	}
+
+	/// Try to take the lock without waiting.
+	/// \returns  True if the lock was taken
+	inline bool try_acquire()
+	{
+		uint32_t serving = __atomic_load_n(&m_serving, __ATOMIC_ACQUIRE);
+		uint32_t next = serving;
+		if (!__atomic_compare_exchange_n(&m_next, &next, serving + 1, false,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return false;
+		count_acquire(0);
+		return true;
+	}
+
+	/// Release the lock to the next ticket.
+	inline void release()
+	{
+		count_release();
+		// Only the holder writes m_serving
+		__atomic_store_n(&m_serving, m_serving + 1, __ATOMIC_RELEASE);
+	}
+
+#ifdef KUTIL_LOCK_STATS
+	/// Get the lock's counters.
+	const lock_stats & stats() const { return m_stats; }
+
+private:
+	inline void count_acquire(uint64_t spins) { m_stats.acquired(spins); }
+	inline void count_release() { m_stats.released(); }
+	lock_stats m_stats;
+#else
+private:
+	inline void count_acquire(uint64_t) {}
+	inline void count_release() {}
+#endif
+
+	uint32_t m_next;     ///< Next ticket to hand out
+	uint32_t m_serving;  ///< Ticket that holds the lock
+
+	ticket_lock(const ticket_lock &) = delete;
+};
+
+
+/// A reader-writer spinlock. Any number of readers may hold it at once, or
+/// one writer. A waiting writer stops new readers from taking the lock, so
+/// a steady stream of readers can't starve it.
+class rwlock
+{
+public:
+	constexpr rwlock() : m_state(0) {}
+
+	/// Take the lock for writing, waiting for all readers to leave.
+	inline void acquire()
+	{
+		uint64_t spins = 0;
+		uint32_t state = __atomic_load_n(&m_state, __ATOMIC_RELAXED);
+		while (true) {
+			if ((state & ~writer_waiting) == 0) {
+				if (__atomic_compare_exchange_n(&m_state, &state, writer, true,
+						__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+					break;
+				continue;
+			}
+
+			if (!(state & writer_waiting))
+				__atomic_fetch_or(&m_state, writer_waiting, __ATOMIC_RELAXED);
+			__builtin_ia32_pause();
+			++spins;
+			state = __atomic_load_n(&m_state, __ATOMIC_RELAXED);
+		}
+		count_acquire(spins, true);
+	}
+
+	/// Try to take the lock for writing without waiting.
+	/// \returns  True if the lock was taken
+	inline bool try_acquire()
+	{
+		uint32_t state = __atomic_load_n(&m_state, __ATOMIC_RELAXED);
+		if ((state & ~writer_waiting) ||
+			!__atomic_compare_exchange_n(&m_state, &state, writer, false,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return false;
+		count_acquire(0, true);
+		return true;
+	}
+
+	/// Release the lock held for writing.
+	inline void release()
+	{
+		count_release();
+		// Keep any writer_waiting flag set by another writer
+		__atomic_fetch_and(&m_state, ~writer, __ATOMIC_RELEASE);
+	}
+
+	/// Take the lock for reading, waiting for any writer, running or
+	/// waiting, to finish.
+	inline void acquire_shared()
+	{
+		uint64_t spins = 0;
+		uint32_t state = __atomic_load_n(&m_state, __ATOMIC_RELAXED);
+		while (true) {
+			if (!(state & (writer | writer_waiting))) {
+				if (__atomic_compare_exchange_n(&m_state, &state, state + reader, true,
+						__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+					break;
+				continue;
+			}
+
+			__builtin_ia32_pause();
+			++spins;
+			state = __atomic_load_n(&m_state, __ATOMIC_RELAXED);
+		}
+		count_acquire(spins, false);
+	}
+
+	/// Try to take the lock for reading without waiting.
+	/// \returns  True if the lock was taken
+	inline bool try_acquire_shared()
+	{
+		uint32_t state = __atomic_load_n(&m_state, __ATOMIC_RELAXED);
+		if ((state & (writer | writer_waiting)) ||
+			!__atomic_compare_exchange_n(&m_state, &state, state + reader, false,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return false;
+		count_acquire(0, false);
+		return true;
+	}
+
+	/// Release the lock held for reading.
+	inline void release_shared()
+	{
+		__atomic_fetch_sub(&m_state, reader, __ATOMIC_RELEASE);
+	}
+
+#ifdef KUTIL_LOCK_STATS
+	/// Get the lock's counters. Hold times only count writers.
+	const lock_stats & stats() const { return m_stats; }
+
+private:
+	inline void count_acquire(uint64_t spins, bool exclusive) { m_stats.acquired(spins, exclusive); }
+	inline void count_release() { m_stats.released(); }
+	lock_stats m_stats;
+#else
+private:
+	inline void count_acquire(uint64_t, bool) {}
+	inline void count_release() {}
+#endif
+
+	static const uint32_t writer = 1;          ///< A writer holds the lock
+	static const uint32_t writer_waiting = 2;  ///< A writer is waiting
+	static const uint32_t reader = 4;          ///< One reader's share of m_state
+
+	uint32_t m_state;
+
+	rwlock(const rwlock &) = delete;
+};
+
+
+/// Holds a lock for the lifetime of the guard object.
+/// \tparam L  The lock type: spinlock, ticket_lock or rwlock
+template <typename L>
+class lock_guard
+{
+public:
+	/// Constructor. Takes the lock.
+	/// \arg lock  The lock to hold
+	lock_guard(L &lock) : m_lock(lock) { m_lock.acquire(); }
+
+	/// Destructor. Releases the lock.
+	~lock_guard() { m_lock.release(); }
+
+private:
+	L &m_lock;
+
+	lock_guard(const lock_guard &) = delete;
+};
+
+
+/// Holds a lock for the lifetime of the guard object, with interrupts
+/// disabled. Code that might run in an interrupt handler must only take a
+/// lock this way, or the handler could spin forever on a lock held by the
+/// code it interrupted.
+/// \tparam L  The lock type: spinlock, ticket_lock or rwlock
+template <typename L>
+class irq_lock_guard
+{
+public:
+	/// Constructor. Disables interrupts and takes the lock.
+	/// \arg lock  The lock to hold
+	irq_lock_guard(L &lock) :
+		m_lock(lock),
+		m_enabled(__irq_save_p ? __irq_save_p() : false)
+	{
+		m_lock.acquire();
+	}
+
+	/// Destructor. Releases the lock and restores interrupts.
+	~irq_lock_guard()
+	{
+		m_lock.release();
+		if (__irq_restore_p) __irq_restore_p(m_enabled);
+	}
+
+private:
+	L &m_lock;
+	bool m_enabled;
+
+	irq_lock_guard(const irq_lock_guard &) = delete;
+};
+
+
+/// Disables interrupts on the current CPU for the lifetime of the guard
+/// object, for per-CPU data that interrupt handlers also use.
+class irq_guard
+{
+public:
+	/// Constructor. Disables interrupts.
+	irq_guard() : m_enabled(__irq_save_p ? __irq_save_p() : false) {}
+
+	/// Destructor. Restores interrupts.
+	~irq_guard() { if (__irq_restore_p) __irq_restore_p(m_enabled); }
+
+private:
+	bool m_enabled;
+
+	irq_guard(const irq_guard &) = delete;
+};
+
+
+/// Holds an rwlock for reading for the lifetime of the guard object.
+class read_guard
+{
+public:
+	/// Constructor. Takes the lock for reading.
+	/// \arg lock  The lock to hold
+	read_guard(rwlock &lock) : m_lock(lock) { m_lock.acquire_shared(); }
+
+	/// Destructor. Releases the lock.
+	~read_guard() { m_lock.release_shared(); }
+
+private:
+	rwlock &m_lock;
+
+	read_guard(const read_guard &) = delete;
+};
+
+
+/// Holds an rwlock for reading for the lifetime of the guard object, with
+/// interrupts disabled.
+class read_irq_guard
+{
+public:
+	/// Constructor. Disables interrupts and takes the lock for reading.
+	/// \arg lock  The lock to hold
+	read_irq_guard(rwlock &lock) :
+		m_lock(lock),
+		m_enabled(__irq_save_p ? __irq_save_p() : false)
+	{
+		m_lock.acquire_shared();
+	}
+
+	/// Destructor. Releases the lock and restores interrupts.
+	~read_irq_guard()
+	{
+		m_lock.release_shared();
+		if (__irq_restore_p) __irq_restore_p(m_enabled);
+	}
+
+private:
+	rwlock &m_lock;
+	bool m_enabled;
+
+	read_irq_guard(const read_irq_guard &) = delete;
+};
+
+
+using spinlock_guard = lock_guard<spinlock>;
+using spinlock_irq_guard = irq_lock_guard<spinlock>;
+
+} // namespace kutil
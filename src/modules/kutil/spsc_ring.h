@@ -0,0 +1,92 @@
+#pragma once
+/// \file spsc_ring.h
+/// A fixed-size ring buffer for passing items from one CPU to another.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+
+namespace kutil {
+
+
+/// A bounded, lock-free queue with a single producer and a single
+/// consumer, such as an interrupt handler feeding a thread. Items are kept
+/// in the ring itself, so it never allocates. The producer and consumer
+/// indices are on their own cache lines, and each side keeps a copy of the
+/// other's index so it only reads the shared one when the ring looks full
+/// or empty.
+/// \tparam T  Type of items. Must be default constructible and movable.
+/// \tparam N  Number of slots, a power of two
+template <typename T, size_t N>
+class spsc_ring
+{
+public:
+	static_assert(N && (N & (N - 1)) == 0, "spsc_ring size must be a power of two");
+
+	spsc_ring() :
+		m_head(0),
+		m_tail_cache(0),
+		m_tail(0),
+		m_head_cache(0)
+	{}
+
+	/// Add an item to the ring. Only call from the producer.
+	/// \arg item  The item to add
+	/// \returns   False if the ring was full
+	bool push(T item)
+	{
+		size_t head = m_head;
+		if (head - m_tail_cache == N) {
+			m_tail_cache = __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE);
+			if (head - m_tail_cache == N) return false;
+		}
+
+		m_items[head & (N - 1)] = std::move(item);
+		__atomic_store_n(&m_head, head + 1, __ATOMIC_RELEASE);
+		return true;
+	}
+
+	/// Take the oldest item from the ring. Only call from the consumer.
+	/// \arg item  [out] The item taken
+	/// \returns   False if the ring was empty
+	bool pop(T &item)
+	{
+		size_t tail = m_tail;
+		if (tail == m_head_cache) {
+			m_head_cache = __atomic_load_n(&m_head, __ATOMIC_ACQUIRE);
+			if (tail == m_head_cache) return false;
+		}
+
+		item = std::move(m_items[tail & (N - 1)]);
+		__atomic_store_n(&m_tail, tail + 1, __ATOMIC_RELEASE);
+		return true;
+	}
+
+	/// Get the number of items in the ring. Exact only when called from
+	/// the producer or consumer while the other is idle.
+	size_t count() const
+	{
+		return __atomic_load_n(&m_head, __ATOMIC_ACQUIRE) -
+			__atomic_load_n(&m_tail, __ATOMIC_ACQUIRE);
+	}
+
+	/// Number of items the ring can hold.
+	static const size_t capacity = N;
+
+private:
+	static const size_t cache_line = 64;
+
+	alignas(cache_line) size_t m_head;   ///< Next slot to write, producer owned
+	size_t m_tail_cache;                 ///< Producer's copy of m_tail
+
+	alignas(cache_line) size_t m_tail;   ///< Next slot to read, consumer owned
+	size_t m_head_cache;                 ///< Consumer's copy of m_head
+
+	alignas(cache_line) T m_items[N];
+
+	spsc_ring(const spsc_ring &) = delete;
+};
+
+template <typename T, size_t N> const size_t spsc_ring<T, N>::capacity;
+
+} // namespace kutil
@@ -3,12 +3,16 @@
 /// Definition of a simple dynamic vector collection for use in kernel space
 
 #include <algorithm>
+#include <type_traits>
 #include <utility>
 #include "kutil/memory.h"
 
 namespace kutil {
 
-/// A dynamic array.
+/// A dynamic array. Elements are moved to new storage when the array
+/// grows, so they may own resources. Trivially copyable elements are
+/// moved as plain memory instead, and grown in place when the allocator
+/// can.
 template <typename T>
 class vector
 {
@@ -17,7 +21,8 @@ public:
 	vector() :
 		m_size(0),
 		m_capacity(0),
-		m_elements(nullptr)
+		m_elements(nullptr),
+		m_inline(false)
 	{}
 
 	/// Constructor. Creates an empty array with capacity.
@@ -25,7 +30,8 @@ public:
 	vector(size_t capacity) :
 		m_size(0),
 		m_capacity(0),
-		m_elements(nullptr)
+		m_elements(nullptr),
+		m_inline(false)
 	{
 		set_capacity(capacity);
 	}
@@ -34,35 +40,58 @@ public:
 	vector(const vector& other) :
 		m_size(0),
 		m_capacity(0),
-		m_elements(nullptr)
+		m_elements(nullptr),
+		m_inline(false)
 	{
-		set_capacity(other.m_capacity);
-		kutil::memcpy(m_elements, other.m_elements, other.m_size * sizeof(T));
-		m_size = other.m_size;
+		copy_from(other);
 	}
 
 	/// Move constructor. Takes ownership of the other's array.
 	vector(vector&& other) :
-		m_size(other.m_size),
-		m_capacity(other.m_capacity),
-		m_elements(other.m_elements)
+		m_size(0),
+		m_capacity(0),
+		m_elements(nullptr),
+		m_inline(false)
 	{
-		other.m_size = 0;
-		other.m_capacity = 0;
-		other.m_elements = nullptr;
+		take_from(other);
 	}
 
 	/// Destructor. Destroys any remaining items in the array.
 	~vector()
 	{
-		while (m_size) remove();
-		delete [] m_elements;
+		clear();
+		if (!m_inline)
+			kutil::free(m_elements);
+	}
+
+	/// Copy assignment. Replaces the contents with a copy of the other's.
+	vector & operator=(const vector& other)
+	{
+		if (&other != this) {
+			clear();
+			copy_from(other);
+		}
+		return *this;
+	}
+
+	/// Move assignment. Replaces the contents with the other's.
+	vector & operator=(vector&& other)
+	{
+		if (&other != this) {
+			clear();
+			take_from(other);
+		}
+		return *this;
 	}
 
 	/// Get the size of the array.
 	/// \returns  The number of elements in the array
 	inline size_t count() const { return m_size; }
 
+	/// Get the number of elements the array can hold without allocating.
+	/// \returns  The capacity of the array
+	inline size_t capacity() const { return m_capacity; }
+
 	/// Access an element in the array.
 	inline T & operator[] (size_t i) { return m_elements[i]; }
 
@@ -88,23 +117,71 @@ public:
 	/// Add an item onto the array by copying it.
 	/// \arg item  The item to add
 	/// \returns   A reference to the added item
-	T & append(const T& item)
-	{
-		ensure_capacity(m_size + 1);
-		m_elements[m_size] = item;
-		return m_elements[m_size++];
-	}
+	T & append(const T& item) { return emplace(item); }
+
+	/// Add an item onto the array by moving it.
+	/// \arg item  The item to add
+	/// \returns   A reference to the added item
+	T & append(T&& item) { return emplace(std::move(item)); }
 
 	/// Construct an item in place onto the end of the array.
 	/// \returns   A reference to the added item
 	template <typename... Args>
 	T & emplace(Args&&... args)
 	{
-		ensure_capacity(m_size + 1);
-		new (&m_elements[m_size]) T(std::forward<Args>(args)...);
+		if (m_size < m_capacity) {
+			new (&m_elements[m_size]) T(std::forward<Args>(args)...);
+		} else {
+			// The arguments may refer to elements that are about to move
+			T item(std::forward<Args>(args)...);
+			ensure_capacity(m_size + 1);
+			new (&m_elements[m_size]) T(std::move(item));
+		}
 		return m_elements[m_size++];
 	}
 
+	/// Insert an item into the array, moving later items up.
+	/// \arg index  Where to insert the item, no more than count()
+	/// \arg item   The item to insert
+	/// \returns    A reference to the inserted item
+	T & insert(size_t index, T item)
+	{
+		ensure_capacity(m_size + 1);
+
+		if (index == m_size) {
+			new (&m_elements[m_size]) T(std::move(item));
+		} else if (trivial) {
+			kutil::memmove(&m_elements[index + 1], &m_elements[index],
+					(m_size - index) * sizeof(T));
+			new (&m_elements[index]) T(std::move(item));
+		} else {
+			new (&m_elements[m_size]) T(std::move(m_elements[m_size - 1]));
+			for (size_t i = m_size - 1; i > index; --i)
+				m_elements[i] = std::move(m_elements[i - 1]);
+			m_elements[index] = std::move(item);
+		}
+
+		++m_size;
+		return m_elements[index];
+	}
+
+	/// Remove items from the array, moving later items down.
+	/// \arg index  The first item to remove
+	/// \arg count  The number of items to remove
+	void erase(size_t index, size_t count = 1)
+	{
+		if (trivial) {
+			kutil::memmove(&m_elements[index], &m_elements[index + count],
+					(m_size - index - count) * sizeof(T));
+			m_size -= count;
+			return;
+		}
+
+		for (size_t i = index; i + count < m_size; ++i)
+			m_elements[i] = std::move(m_elements[i + count]);
+		while (count--) remove();
+	}
+
 	/// Remove an item from the end of the array.
 	void remove()
 	{
@@ -112,12 +189,19 @@ public:
 		m_elements[m_size].~T();
 	}
 
+	/// Remove all items from the array, keeping its capacity.
+	void clear()
+	{
+		while (m_size) remove();
+	}
+
 	/// Set the size of the array. Any new items are default
 	/// constructed. The array is realloced if needed.
 	/// \arg size  The new size
 	void set_size(size_t size)
 	{
 		ensure_capacity(size);
+		while (m_size > size) remove();
 		for (size_t i = m_size; i < size; ++i)
 			new (&m_elements[i]) T;
 		m_size = size;
@@ -137,28 +221,165 @@ public:
 		set_capacity(capacity);
 	}
 
-	/// Reallocate the array. Copy over any old elements that will
-	/// fit into the new array. The rest are destroyed.
+	/// Ensure the array has room for exactly a given number of items,
+	/// without growing to the next power of two.
+	/// \arg capacity  Number of elements to make room for
+	void reserve(size_t capacity)
+	{
+		if (m_capacity < capacity)
+			set_capacity(capacity);
+	}
+
+	/// Give back any capacity not used by the array's items.
+	void shrink_to_fit()
+	{
+		if (!m_inline)
+			set_capacity(m_size);
+	}
+
+	/// Reallocate the array. Any old elements that will not fit into
+	/// the new array are destroyed. Trivially copyable elements are grown
+	/// in place if the allocator can, otherwise elements are moved over.
 	/// \arg capacity  Number of elements to allocate
 	void set_capacity(size_t capacity)
 	{
-		T *new_array = reinterpret_cast<T *>(malloc(capacity * sizeof(T)));
-		size_t size = std::min(capacity, m_size);
+		while (m_size > capacity) remove();
 
-		kutil::memcpy(new_array, m_elements, size * sizeof(T));
+		// Inline storage is never given back, only outgrown
+		if (m_inline && capacity <= m_capacity) return;
 
-		while (size < m_size) remove();
-		m_size = size;
-		m_capacity = capacity;
+		if (trivial && !m_inline) {
+			m_elements = reinterpret_cast<T *>(
+					kutil::realloc(m_elements, capacity * sizeof(T)));
+		} else {
+			T *elements = capacity ?
+				reinterpret_cast<T *>(kutil::malloc(capacity * sizeof(T))) :
+				nullptr;
+
+			move_to(elements);
+			if (!m_inline)
+				kutil::free(m_elements);
+			m_elements = elements;
+			m_inline = false;
+		}
 
-		delete [] m_elements;
-		m_elements = new_array;
+		m_capacity = capacity;
 	}
 
+protected:
+	/// Constructor for vectors with inline storage.
+	/// \arg storage   Memory for the first elements
+	/// \arg capacity  Number of elements that fit in storage
+	vector(T *storage, size_t capacity) :
+		m_size(0),
+		m_capacity(capacity),
+		m_elements(storage),
+		m_inline(true)
+	{}
+
 private:
+	static constexpr bool trivial = std::is_trivially_copyable<T>::value;
+
+	/// Move all elements to new storage, leaving the old storage
+	/// uninitialized.
+	/// \arg elements  Storage for at least m_size elements
+	void move_to(T *elements)
+	{
+		if (trivial) {
+			kutil::memcpy(elements, m_elements, m_size * sizeof(T));
+			return;
+		}
+
+		for (size_t i = 0; i < m_size; ++i) {
+			new (&elements[i]) T(std::move(m_elements[i]));
+			m_elements[i].~T();
+		}
+	}
+
+	/// Copy the other's elements into this empty array.
+	void copy_from(const vector& other)
+	{
+		ensure_capacity(other.m_size);
+		if (trivial) {
+			kutil::memcpy(m_elements, other.m_elements, other.m_size * sizeof(T));
+		} else {
+			for (size_t i = 0; i < other.m_size; ++i)
+				new (&m_elements[i]) T(other.m_elements[i]);
+		}
+		m_size = other.m_size;
+	}
+
+	/// Take the other's elements into this empty array. Heap storage is
+	/// taken whole, unless they would fit this array's inline storage.
+	void take_from(vector& other)
+	{
+		if (!other.m_inline && (!m_inline || other.m_size > m_capacity)) {
+			if (!m_inline)
+				kutil::free(m_elements);
+			m_size = other.m_size;
+			m_capacity = other.m_capacity;
+			m_elements = other.m_elements;
+			m_inline = false;
+
+			other.m_size = 0;
+			other.m_capacity = 0;
+			other.m_elements = nullptr;
+			return;
+		}
+
+		ensure_capacity(other.m_size);
+		other.move_to(m_elements);
+		m_size = other.m_size;
+		other.m_size = 0;
+	}
+
 	size_t m_size;
 	size_t m_capacity;
 	T *m_elements;
+	bool m_inline;   ///< m_elements is inline storage, not from the heap
+};
+
+
+/// A dynamic array that holds its first N elements inline, and only
+/// allocates once it grows past that.
+template <typename T, size_t N>
+class small_vector :
+	public vector<T>
+{
+public:
+	/// Default constructor. Creates an empty vector using inline storage.
+	small_vector() :
+		vector<T>(reinterpret_cast<T *>(m_storage), N)
+	{}
+
+	/// Copy constructor.
+	small_vector(const small_vector& other) : small_vector() { vector<T>::operator=(other); }
+
+	/// Move constructor.
+	small_vector(small_vector&& other) : small_vector() { vector<T>::operator=(std::move(other)); }
+
+	/// Copy constructor from any vector.
+	small_vector(const vector<T>& other) : small_vector() { vector<T>::operator=(other); }
+
+	/// Move constructor from any vector.
+	small_vector(vector<T>&& other) : small_vector() { vector<T>::operator=(std::move(other)); }
+
+	/// Copy assignment.
+	small_vector & operator=(const small_vector& other)
+	{
+		vector<T>::operator=(other);
+		return *this;
+	}
+
+	/// Move assignment.
+	small_vector & operator=(small_vector&& other)
+	{
+		vector<T>::operator=(std::move(other));
+		return *this;
+	}
+
+private:
+	alignas(T) uint8_t m_storage[N * sizeof(T)];
 };
 
 } // namespace kutil
@@ -0,0 +1,164 @@
+#include <chrono>
+#include <vector>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "kutil/arena.h"
+#include "catch.hpp"
+
+using namespace kutil;
+
+static size_t arena_chunks_out = 0;
+static size_t arena_chunk_allocs = 0;
+
+static void *
+arena_test_alloc(size_t length)
+{
+	++arena_chunks_out;
+	++arena_chunk_allocs;
+	return aligned_alloc(4096, length);
+}
+
+static void
+arena_test_free(void *start, size_t length)
+{
+	--arena_chunks_out;
+	::free(start);
+}
+
+TEST_CASE( "Arena over a fixed buffer", "[memory arena]" )
+{
+	alignas(64) uint8_t buffer[256];
+	arena a(buffer, sizeof(buffer));
+
+	void *p1 = a.allocate(3, 1);
+	CHECK( p1 == buffer );
+	CHECK( a.used() == 3 );
+
+	// Default alignment
+	void *p2 = a.allocate(8);
+	CHECK( p2 == buffer + 16 );
+	CHECK( a.used() == 24 );
+
+	uint64_t *p3 = a.create<uint64_t>(0x1234);
+	CHECK( reinterpret_cast<uintptr_t>(p3) % alignof(uint64_t) == 0 );
+	CHECK( *p3 == 0x1234 );
+
+	// Too big for the buffer, and no chunks to grow with
+	CHECK( a.allocate(sizeof(buffer)) == nullptr );
+	CHECK( a.allocate(a.remaining() + 1, 1) == nullptr );
+	CHECK( a.allocate(a.remaining(), 1) != nullptr );
+	CHECK( a.remaining() == 0 );
+	CHECK( a.used() == sizeof(buffer) );
+
+	a.reset();
+	CHECK( a.used() == 0 );
+	CHECK( a.allocate(3, 1) == buffer );
+
+	arena empty;
+	CHECK( empty.allocate(1) == nullptr );
+}
+
+TEST_CASE( "Arena marks and scopes", "[memory arena]" )
+{
+	arena_chunks_out = 0;
+	arena_chunk_allocs = 0;
+	{
+		arena a(arena_test_alloc, arena_test_free, 4096);
+		CHECK( a.allocate(100) != nullptr );
+		CHECK( a.chunk_count() == 1 );
+
+		arena::mark m = a.get_mark();
+		void *after = a.allocate(16);
+
+		for (int i = 0; i < 100; ++i)
+			REQUIRE( a.allocate(1000) != nullptr );
+		CHECK( a.chunk_count() > 20 );
+
+		// Resetting gives chunks back, and the arena picks up at the mark
+		a.reset(m);
+		CHECK( a.chunk_count() == 1 );
+		CHECK( arena_chunks_out == 2 ); // one in use, one spare
+		CHECK( a.allocate(16) == after );
+
+		{
+			arena_scope scope(a);
+			int *values = a.create_array<int>(10000);
+			REQUIRE( values != nullptr );
+			for (int i = 0; i < 10000; ++i) values[i] = i;
+			CHECK( values[9999] == 9999 );
+		}
+		CHECK( a.chunk_count() == 1 );
+
+		// An arena reset each round stops asking for chunks
+		size_t allocs = arena_chunk_allocs;
+		for (int round = 0; round < 100; ++round) {
+			arena_scope scope(a);
+			for (int i = 0; i < 5; ++i)
+				REQUIRE( a.allocate(1000) != nullptr );
+		}
+		CHECK( arena_chunk_allocs == allocs );
+	}
+	CHECK( arena_chunks_out == 0 );
+}
+
+TEST_CASE( "Arena buffer then chunks", "[memory arena]" )
+{
+	arena_chunks_out = 0;
+
+	uint8_t buffer[128];
+	arena a(arena_test_alloc, arena_test_free, 4096, buffer, sizeof(buffer));
+
+	void *p1 = a.allocate(100);
+	CHECK( p1 >= buffer );
+	CHECK( a.chunk_count() == 0 );
+
+	void *p2 = a.allocate(100);
+	CHECK( (p2 < buffer || p2 >= buffer + sizeof(buffer)) );
+	CHECK( a.chunk_count() == 1 );
+
+	// Huge allocations get a chunk of their own
+	uint8_t *big = reinterpret_cast<uint8_t *>(a.allocate(20000));
+	REQUIRE( big != nullptr );
+	memset(big, 0xaa, 20000);
+	CHECK( a.chunk_count() == 2 );
+
+	a.reset();
+	CHECK( a.chunk_count() == 0 );
+	CHECK( a.allocate(100) == p1 );
+	CHECK( arena_chunks_out == 1 ); // The spare
+}
+
+TEST_CASE( "Benchmark arena allocation", "[memory arena][!benchmark]" )
+{
+	using clock = std::chrono::high_resolution_clock;
+	const int rounds = 10000;
+	const int per_round = 64;
+
+	arena a(arena_test_alloc, arena_test_free);
+
+	auto start = clock::now();
+	for (int r = 0; r < rounds; ++r) {
+		arena_scope scope(a);
+		for (int i = 0; i < per_round; ++i)
+			a.allocate(24 + (i % 8) * 8);
+	}
+	auto arena_time = clock::now() - start;
+
+	std::vector<void *> ptrs(per_round);
+	start = clock::now();
+	for (int r = 0; r < rounds; ++r) {
+		for (int i = 0; i < per_round; ++i)
+			ptrs[i] = ::malloc(24 + (i % 8) * 8);
+		for (int i = 0; i < per_round; ++i)
+			::free(ptrs[i]);
+	}
+	auto malloc_time = clock::now() - start;
+
+	using ns = std::chrono::nanoseconds;
+	double n = rounds * per_round;
+	WARN( "arena: " << std::chrono::duration_cast<ns>(arena_time).count() / n << " ns/alloc, "
+		<< "malloc: " << std::chrono::duration_cast<ns>(malloc_time).count() / n << " ns/alloc" );
+}
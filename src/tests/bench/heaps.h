@@ -0,0 +1,103 @@
+#pragma once
+/// \file heaps.h
+/// Adapters giving each kutil allocator the same interface for replaying
+/// traces. Every heap is built on a region of host memory, and reports the
+/// memory it maps through bench::grow_callback and bench::shrink_callback.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "kutil/bitmap_memory_manager.h"
+#include "kutil/heap_cache.h"
+#include "kutil/memory_manager.h"
+#include "kutil/slab_allocator.h"
+
+namespace bench {
+
+extern size_t mapped_bytes;
+extern size_t peak_mapped_bytes;
+
+void grow_callback(void *start, size_t length);
+void shrink_callback(void *start, size_t length);
+
+
+/// The plain buddy allocator
+struct buddy_heap
+{
+	static constexpr const char *name = "buddy";
+
+	buddy_heap(void *memory, size_t length) :
+		mm(memory, grow_callback, shrink_callback) {}
+
+	void * allocate(size_t n, unsigned cpu) { return mm.allocate(n); }
+	void free(void *p, size_t n, unsigned cpu) { mm.free(p); }
+
+	kutil::memory_manager mm;
+};
+
+
+/// The buddy allocator with its block state in bitmaps
+struct bitmap_heap
+{
+	static constexpr const char *name = "bitmap buddy";
+
+	bitmap_heap(void *memory, size_t length) :
+		metadata(kutil::bitmap_memory_manager::metadata_size(length)),
+		mm(memory, length, metadata.data(), grow_callback) {}
+
+	void * allocate(size_t n, unsigned cpu) { return mm.allocate(n); }
+	void free(void *p, size_t n, unsigned cpu) { mm.free(p); }
+
+	std::vector<uint8_t> metadata;
+	kutil::bitmap_memory_manager mm;
+};
+
+
+/// Slab size classes for small allocations, the buddy allocator for the rest
+struct slab_heap
+{
+	static constexpr const char *name = "slab + buddy";
+
+	slab_heap(void *memory, size_t length) :
+		mm(memory, grow_callback, shrink_callback),
+		slabs(&mm) {}
+
+	void * allocate(size_t n, unsigned cpu)
+	{
+		if (n > kutil::slab_allocator::max_object_size)
+			return mm.allocate(n);
+		return slabs.allocate(n);
+	}
+
+	void free(void *p, size_t n, unsigned cpu)
+	{
+		if (n > kutil::slab_allocator::max_object_size)
+			mm.free(p);
+		else
+			slabs.free(p);
+	}
+
+	kutil::memory_manager mm;
+	kutil::slab_allocator slabs;
+};
+
+
+/// Per-CPU heap caches in front of the buddy allocator
+struct cached_heap
+{
+	static constexpr const char *name = "cpu cache + buddy";
+	static const unsigned cpus = 2;
+
+	cached_heap(void *memory, size_t length) :
+		mm(memory, grow_callback, shrink_callback),
+		caches {{&mm}, {&mm}} {}
+
+	void * allocate(size_t n, unsigned cpu) { return caches[cpu].allocate(n); }
+	void free(void *p, size_t n, unsigned cpu) { caches[cpu].free(p); }
+
+	kutil::memory_manager mm;
+	kutil::heap_cache caches[cpus];
+};
+
+} // namespace bench
@@ -0,0 +1,113 @@
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "heaps.h"
+#include "trace.h"
+
+// kutil malloc/free/realloc implementation for the host
+namespace kutil {
+	void * malloc(size_t n) { return ::malloc(n); }
+	void free(void *p) { ::free(p); }
+	void * realloc(void *p, size_t n) { return ::realloc(p, n); }
+}
+
+namespace bench {
+
+size_t mapped_bytes = 0;
+size_t peak_mapped_bytes = 0;
+
+void
+grow_callback(void *start, size_t length)
+{
+	mapped_bytes += length;
+	peak_mapped_bytes = std::max(peak_mapped_bytes, mapped_bytes);
+}
+
+void
+shrink_callback(void *start, size_t length)
+{
+	mapped_bytes -= length;
+}
+
+static const size_t max_block = 1 << 16;
+static const size_t heap_length = 8192 * max_block;
+
+
+/// Get the most bytes a trace ever asks to have live at once
+static size_t
+peak_live_bytes(const trace &t)
+{
+	size_t live = 0;
+	size_t peak = 0;
+	for (const op &o : t.ops) {
+		if (o.alloc) live += o.size;
+		else live -= o.size;
+		peak = std::max(peak, live);
+	}
+	return peak;
+}
+
+/// Replay a trace against a fresh heap and print its results.
+/// Fragmentation is the share of the peak memory mapped that was not
+/// needed for the peak bytes the trace had live.
+template <typename Heap>
+static void
+replay(const trace &t, size_t peak_live)
+{
+	void *memory = aligned_alloc(max_block, heap_length);
+	mapped_bytes = 0;
+	peak_mapped_bytes = 0;
+
+	Heap *heap = new Heap(memory, heap_length);
+	std::vector<void *> slots(t.slots);
+
+	auto start = std::chrono::steady_clock::now();
+	for (const op &o : t.ops) {
+		if (o.alloc) {
+			void *p = heap->allocate(o.size, o.cpu);
+			*reinterpret_cast<uint8_t *>(p) = o.cpu;
+			slots[o.slot] = p;
+		} else {
+			heap->free(slots[o.slot], o.size, o.cpu);
+		}
+	}
+	auto end = std::chrono::steady_clock::now();
+
+	double ns = std::chrono::duration<double, std::nano>(end - start).count();
+	double frag = 1.0 - double(peak_live) / double(peak_mapped_bytes);
+
+	printf("%-20s %-20s %10zu %8.1f %10zu %7.1f%%\n",
+			t.name, Heap::name, t.ops.size(),
+			ns / t.ops.size(),
+			peak_mapped_bytes / 1024,
+			frag * 100.0);
+
+	delete heap;
+	::free(memory);
+}
+
+} // namespace bench
+
+int
+main(int argc, char **argv)
+{
+	using namespace bench;
+
+	size_t count = 1000000;
+	if (argc > 1) count = strtoul(argv[1], nullptr, 0);
+
+	printf("%-20s %-20s %10s %8s %10s %8s\n",
+			"trace", "allocator", "ops", "ns/op", "peak KiB", "frag");
+
+	for (const trace &t : all_traces(count)) {
+		size_t peak_live = peak_live_bytes(t);
+		replay<buddy_heap>(t, peak_live);
+		replay<bitmap_heap>(t, peak_live);
+		replay<slab_heap>(t, peak_live);
+		replay<cached_heap>(t, peak_live);
+	}
+
+	return 0;
+}
@@ -0,0 +1,217 @@
+#include <random>
+#include "trace.h"
+
+namespace bench {
+
+static const size_t working_set = 4096;
+
+
+/// Keep track of which slots are in use while building a trace
+struct slot_set
+{
+	std::vector<uint32_t> sizes;  ///< Size allocated in each slot, or 0
+	std::vector<uint32_t> free_slots;
+
+	uint32_t take(uint32_t size)
+	{
+		uint32_t slot = 0;
+		if (free_slots.empty()) {
+			slot = sizes.size();
+			sizes.push_back(0);
+		} else {
+			slot = free_slots.back();
+			free_slots.pop_back();
+		}
+		sizes[slot] = size;
+		return slot;
+	}
+
+	uint32_t give(uint32_t slot)
+	{
+		uint32_t size = sizes[slot];
+		sizes[slot] = 0;
+		free_slots.push_back(slot);
+		return size;
+	}
+};
+
+static void
+alloc(trace &t, slot_set &slots, uint32_t size, uint8_t cpu = 0, uint32_t *slot_out = nullptr)
+{
+	uint32_t slot = slots.take(size);
+	t.ops.push_back({true, cpu, slot, size});
+	if (slot_out) *slot_out = slot;
+}
+
+static void
+release(trace &t, slot_set &slots, uint32_t slot, uint8_t cpu = 0)
+{
+	uint32_t size = slots.give(slot);
+	t.ops.push_back({false, cpu, slot, size});
+}
+
+/// Free everything still live, in slot order
+static void
+finish(trace &t, slot_set &slots)
+{
+	for (uint32_t slot = 0; slot < slots.sizes.size(); ++slot)
+		if (slots.sizes[slot]) release(t, slots, slot);
+	t.slots = slots.sizes.size();
+}
+
+template <typename SizeFn>
+static trace
+churn(const char *name, size_t count, SizeFn next_size)
+{
+	trace t {name, 0, {}};
+	slot_set slots;
+	std::default_random_engine rng(1);
+
+	std::vector<uint32_t> live;
+	for (size_t i = 0; i < working_set; ++i) {
+		uint32_t slot;
+		alloc(t, slots, next_size(rng), 0, &slot);
+		live.push_back(slot);
+	}
+
+	while (t.ops.size() < count) {
+		size_t i = std::uniform_int_distribution<size_t>(0, live.size() - 1)(rng);
+		release(t, slots, live[i]);
+		alloc(t, slots, next_size(rng), 0, &live[i]);
+	}
+
+	finish(t, slots);
+	return t;
+}
+
+trace
+fixed_churn(size_t count, uint32_t size)
+{
+	return churn("fixed churn", count,
+		[size](std::default_random_engine &) { return size; });
+}
+
+trace
+mixed_churn(size_t count, uint32_t max_size)
+{
+	std::uniform_real_distribution<double> exp_dist(4.0, __builtin_log2(max_size));
+	return churn("mixed churn", count,
+		[&exp_dist](std::default_random_engine &rng) {
+			return static_cast<uint32_t>(__builtin_exp2(exp_dist(rng)));
+		});
+}
+
+trace
+lifo(size_t count)
+{
+	trace t {"LIFO", 0, {}};
+	slot_set slots;
+	std::default_random_engine rng(2);
+	std::uniform_int_distribution<uint32_t> size_dist(16, 512);
+
+	std::vector<uint32_t> stack;
+	while (t.ops.size() < count) {
+		size_t depth = std::uniform_int_distribution<size_t>(1, working_set)(rng);
+		for (size_t i = 0; i < depth; ++i) {
+			uint32_t slot;
+			alloc(t, slots, size_dist(rng), 0, &slot);
+			stack.push_back(slot);
+		}
+
+		size_t pops = std::uniform_int_distribution<size_t>(1, stack.size())(rng);
+		for (size_t i = 0; i < pops; ++i) {
+			release(t, slots, stack.back());
+			stack.pop_back();
+		}
+	}
+
+	while (!stack.empty()) {
+		release(t, slots, stack.back());
+		stack.pop_back();
+	}
+
+	finish(t, slots);
+	return t;
+}
+
+trace
+fifo(size_t count)
+{
+	trace t {"FIFO", 0, {}};
+	slot_set slots;
+	std::default_random_engine rng(3);
+	std::uniform_int_distribution<uint32_t> size_dist(16, 512);
+
+	std::vector<uint32_t> queue;
+	size_t head = 0;
+	while (t.ops.size() < count) {
+		uint32_t slot;
+		alloc(t, slots, size_dist(rng), 0, &slot);
+		queue.push_back(slot);
+
+		if (queue.size() - head > working_set)
+			release(t, slots, queue[head++]);
+	}
+
+	while (head < queue.size())
+		release(t, slots, queue[head++]);
+
+	finish(t, slots);
+	return t;
+}
+
+trace
+small_bursts(size_t count)
+{
+	trace t {"small bursts", 0, {}};
+	slot_set slots;
+	std::default_random_engine rng(5);
+	std::uniform_int_distribution<uint32_t> size_dist(8, 48);
+
+	std::vector<uint32_t> batch(1024);
+	while (t.ops.size() < count) {
+		for (auto &slot : batch)
+			alloc(t, slots, size_dist(rng), 0, &slot);
+		for (auto slot : batch)
+			release(t, slots, slot);
+	}
+
+	finish(t, slots);
+	return t;
+}
+
+trace
+producer_consumer(size_t count)
+{
+	trace t {"producer/consumer", 0, {}};
+	slot_set slots;
+	std::default_random_engine rng(4);
+	std::uniform_int_distribution<uint32_t> size_dist(32, 256);
+
+	const size_t batch = 256;
+	std::vector<uint32_t> messages(batch);
+	while (t.ops.size() < count) {
+		for (auto &slot : messages)
+			alloc(t, slots, size_dist(rng), 0, &slot);
+		for (auto slot : messages)
+			release(t, slots, slot, 1);
+	}
+
+	finish(t, slots);
+	return t;
+}
+
+std::vector<trace>
+all_traces(size_t count)
+{
+	std::vector<trace> traces;
+	traces.push_back(fixed_churn(count, 64));
+	traces.push_back(mixed_churn(count, 4096));
+	traces.push_back(lifo(count));
+	traces.push_back(fifo(count));
+	traces.push_back(small_bursts(count));
+	traces.push_back(producer_consumer(count));
+	return traces;
+}
+
+} // namespace bench
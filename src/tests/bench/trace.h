@@ -0,0 +1,56 @@
+#pragma once
+/// \file trace.h
+/// Allocation traces for replaying against allocators.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace bench {
+
+
+/// One step of a trace: allocate into a slot, or free the slot.
+struct op
+{
+	bool alloc;
+	uint8_t cpu;     ///< Which CPU's front-end does the work
+	uint32_t slot;   ///< Index of the live allocation this refers to
+	uint32_t size;   ///< Size to allocate, or the size being freed
+};
+
+/// A named sequence of allocations and frees. Every allocation is freed
+/// by the end of the trace.
+struct trace
+{
+	const char *name;
+	size_t slots;    ///< Number of distinct slots used
+	std::vector<op> ops;
+};
+
+/// Fixed-size churn: a working set of same-sized objects where random
+/// objects are freed and replaced.
+trace fixed_churn(size_t count, uint32_t size);
+
+/// Mixed-size churn: like fixed_churn, with sizes spread log-uniformly
+/// between 16 bytes and max_size.
+trace mixed_churn(size_t count, uint32_t max_size);
+
+/// Stack-like: allocate a batch, then free it in reverse order.
+trace lifo(size_t count);
+
+/// Queue-like: a sliding window of allocations, freeing the oldest.
+trace fifo(size_t count);
+
+/// Small bursts: allocate a batch of small objects, then free all of it.
+/// Each batch starts from a heap of whole blocks, so nearly every
+/// allocation has to find and split a bigger block.
+trace small_bursts(size_t count);
+
+/// Producer/consumer: one CPU allocates batches of messages that another
+/// CPU frees, so memory moves between front-ends.
+trace producer_consumer(size_t count);
+
+/// Get every trace, each about `count` operations long.
+std::vector<trace> all_traces(size_t count);
+
+} // namespace bench
@@ -0,0 +1,151 @@
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "kutil/bitmap_memory_manager.h"
+#include "kutil/memory.h"
+#include "kutil/memory_manager.h"
+#include "catch.hpp"
+#include "test_heap.h"
+
+using namespace kutil;
+
+/// Heap memory and metadata for a bitmap_memory_manager
+struct bitmap_test_heap
+{
+	bitmap_test_heap(size_t length = test_heap_size) :
+		memory(test_heap_alloc(length)),
+		metadata(bitmap_memory_manager::metadata_size(length)),
+		mm(memory, length, metadata.data(), test_grow_callback)
+	{}
+
+	~bitmap_test_heap() { ::free(memory); }
+
+	void *memory;
+	std::vector<uint8_t> metadata;
+	bitmap_memory_manager mm;
+};
+
+
+TEST_CASE( "Bitmap buddy blocks tests", "[memory buddy bitmap]" )
+{
+	bitmap_test_heap heap(4 * test_max_block);
+	void *memory = heap.memory;
+	bitmap_memory_manager &mm = heap.mm;
+
+	// The ctor should have allocated an initial block
+	CHECK( test_heap_grown() == test_max_block );
+
+	// With no headers, a 64 byte allocation fits a 64 byte block, and
+	// blocks are handed out in address order
+	std::vector<void *> allocs(6);
+	for (int i = 0; i < 6; ++i) {
+		allocs[i] = mm.allocate(64);
+		CHECK( allocs[i] == offset_pointer(memory, i * 64) );
+	}
+
+	// Allocations are aligned to their block size
+	void *big = mm.allocate(4000);
+	CHECK( big == offset_pointer(memory, 4096) );
+	mm.free(big);
+
+	// Freeing two buddies joins them into a block that can be reused
+	mm.free(allocs[2]);
+	mm.free(allocs[3]);
+	big = mm.allocate(128);
+	CHECK( big == allocs[2] );
+	mm.free(big);
+
+	mm.free(allocs[0]);
+	mm.free(allocs[1]);
+	mm.free(allocs[4]);
+	mm.free(allocs[5]);
+	allocs.clear();
+
+	std::default_random_engine rng(
+			std::chrono::system_clock::now().time_since_epoch().count());
+
+	std::vector<size_t> sizes = {
+		16000, 8000, 4000, 4000, 1000, 1000, 1000, 1000, 1000, 1000, 1000, 150,
+		150, 150, 150, 150, 150, 150, 150, 150, 150, 150, 150, 48, 48, 48, 13 };
+	std::shuffle(sizes.begin(), sizes.end(), rng);
+
+	for (size_t size : sizes) {
+		void *p = mm.allocate(size);
+		size_t block = 64;
+		while (block < size) block *= 2;
+		CHECK( (reinterpret_cast<uintptr_t>(p) & (block - 1)) == 0 );
+		memset(p, 0xcc, size);
+		allocs.push_back(p);
+	}
+
+	std::shuffle(allocs.begin(), allocs.end(), rng);
+	for (void *p: allocs)
+		mm.free(p);
+	allocs.clear();
+
+	// If everything was freed / joined correctly, the whole first block
+	// is available again without growing
+	big = mm.allocate(test_max_block);
+	CHECK( big == memory );
+	CHECK( test_heap_grown() == test_max_block );
+
+	// Growing stops at the heap's maximum length
+	for (int i = 0; i < 3; ++i)
+		CHECK( mm.allocate(test_max_block) != nullptr );
+	CHECK( mm.allocate(64) == nullptr );
+	CHECK( test_heap_grown() == 4 * test_max_block );
+}
+
+TEST_CASE( "Bitmap buddy footprint", "[memory buddy bitmap]" )
+{
+	// 64 bytes fits a 64 byte block with no header, but needs a 128 byte
+	// block once the header-based allocator adds its 16 bytes.
+	const size_t object_size = 64;
+	const size_t count = 10000;
+
+	size_t header_grown = 0;
+	{
+		test_heap header;
+		for (size_t i = 0; i < count; ++i) header.mm.allocate(object_size);
+		header_grown = test_heap_grown();
+	}
+
+	bitmap_test_heap heap;
+	for (size_t i = 0; i < count; ++i) heap.mm.allocate(object_size);
+	size_t bitmap_grown = test_heap_grown();
+
+	INFO( "Header heap: " << header_grown << " bytes, bitmap heap: " << bitmap_grown << " bytes" );
+	CHECK( bitmap_grown * 2 <= header_grown );
+	CHECK( heap.metadata.size() * 64 < test_heap_size );
+}
+
+TEST_CASE( "Bitmap buddy benchmark", "[memory buddy bitmap][!benchmark]" )
+{
+	test_heap header;
+	memory_manager &header_mm = header.mm;
+	bitmap_test_heap heap;
+
+	const size_t batch = 1000;
+	std::vector<void *> objects(batch);
+
+	std::vector<size_t> sizes(batch);
+	std::default_random_engine rng(1);
+	std::uniform_int_distribution<size_t> dist(16, 2000);
+	for (auto &s : sizes) s = dist(rng);
+
+	BENCHMARK( "header buddy allocate/free 1000 mixed sizes" ) {
+		for (size_t i = 0; i < batch; ++i) objects[i] = header_mm.allocate(sizes[i]);
+		for (size_t i = 0; i < batch; ++i) header_mm.free(objects[i]);
+	}
+
+	BENCHMARK( "bitmap buddy allocate/free 1000 mixed sizes" ) {
+		for (size_t i = 0; i < batch; ++i) objects[i] = heap.mm.allocate(sizes[i]);
+		for (size_t i = 0; i < batch; ++i) heap.mm.free(objects[i]);
+	}
+}
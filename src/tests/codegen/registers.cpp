@@ -0,0 +1,51 @@
+/// \file registers.cpp
+/// Code generation checks for kutil/register.h. This file is compiled to
+/// assembly with optimization, and each `*_reg` function must compile to
+/// exactly the same instructions as its hand-written `*_raw` twin.
+
+#include <stdint.h>
+#include "kutil/register.h"
+
+using kutil::mmio_reg;
+using kutil::reg_field;
+using kutil::reg_flag;
+
+namespace {
+	constexpr reg_flag<uint32_t, 0> enable {};
+	constexpr reg_field<uint32_t, 4, 3> mode {};
+	constexpr reg_flag<uint32_t, 16> masked {};
+	constexpr reg_field<uint16_t, 8, 4> level {};
+	constexpr reg_field<uint64_t, 56, 8, uint8_t> dest {};
+}
+
+extern "C" {
+
+// A plain read is a single 32-bit load
+uint32_t read_reg(mmio_reg<uint32_t> *r) { return r->read(); }
+uint32_t read_raw(volatile uint32_t *r) { return *r; }
+
+// A 16-bit register is stored with a 16-bit store
+void write16_reg(mmio_reg<uint16_t> *r, uint16_t v) { r->write(v); }
+void write16_raw(volatile uint16_t *r, uint16_t v) { *r = v; }
+
+// Writing several fields is one store of a constant
+void write_fields_reg(mmio_reg<uint32_t> *r) { r->write(enable(true) | mode(5) | masked(true)); }
+void write_fields_raw(volatile uint32_t *r) { *r = 0x10051; }
+
+// Changing several fields is one load and one store
+void modify_reg(mmio_reg<uint32_t> *r) { r->modify(enable(true) | mode(3) | masked(false)); }
+void modify_raw(volatile uint32_t *r) { *r = (*r & ~0x10071u) | 0x31u; }
+
+// Changing a field to a runtime value
+void modify_var_reg(mmio_reg<uint16_t> *r, uint16_t v) { r->set(level, v); }
+void modify_var_raw(volatile uint16_t *r, uint16_t v) { *r = (*r & ~0xf00) | ((v << 8) & 0xf00); }
+
+// Reading a field is one load, a shift and a mask
+uint8_t get_reg(mmio_reg<uint64_t> *r) { return r->get(dest); }
+uint8_t get_raw(volatile uint64_t *r) { return *r >> 56; }
+
+// Testing several fields is one load
+bool test_reg(mmio_reg<uint32_t> *r) { return r->test(enable(true) | masked(false)); }
+bool test_raw(volatile uint32_t *r) { return (*r & 0x10001) == 1; }
+
+} // extern "C"
@@ -0,0 +1,231 @@
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <utility>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kutil/assert.h"
+#include "kutil/frame_allocator.h"
+#include "catch.hpp"
+
+using namespace kutil;
+
+static const addr_t frame_size = 1ull << frame_allocator::frame_shift;
+static const size_t frame_block = 1ull << frame_allocator::max_order;
+
+/// A frame allocator with its metadata
+struct frame_test_allocator
+{
+	frame_test_allocator(addr_t base, size_t frames) :
+		metadata(frame_allocator::metadata_size(frames) / sizeof(uint64_t)),
+		fa(base, frames, metadata.data())
+	{}
+
+	std::vector<uint64_t> metadata;
+	frame_allocator fa;
+};
+
+
+TEST_CASE( "Frame allocator blocks", "[memory frames]" )
+{
+	const addr_t base = 0x40000000;
+	frame_test_allocator fta(base, 4 * frame_block);
+	frame_allocator &fa = fta.fa;
+
+	// Everything starts out allocated
+	addr_t addr = 0;
+	CHECK( fa.free_frames() == 0 );
+	CHECK_FALSE( fa.allocate(1, &addr) );
+
+	// Give it two blocks, with a hole between them
+	fa.free(base, frame_block);
+	fa.free(base + 2 * frame_block * frame_size, frame_block);
+	CHECK( fa.free_frames() == 2 * frame_block );
+
+	// Single frames come out in address order
+	for (int i = 0; i < 4; ++i) {
+		REQUIRE( fa.allocate(1, &addr) );
+		CHECK( addr == base + i * frame_size );
+	}
+
+	// Runs are aligned to the next power of two, and the tail is left free
+	REQUIRE( fa.allocate(5, &addr) );
+	CHECK( addr == base + 8 * frame_size );
+	CHECK( fa.free_frames() == 2 * frame_block - 9 );
+	REQUIRE( fa.allocate(3, &addr) );
+	CHECK( addr == base + 4 * frame_size );
+	REQUIRE( fa.allocate(3, &addr) );
+	CHECK( addr == base + 16 * frame_size );
+
+	// Freeing it all merges the blocks back together, whatever pieces it
+	// was allocated in
+	fa.free(base, 7);
+	fa.free(base + 8 * frame_size, 5);
+	fa.free(base + 16 * frame_size, 3);
+	CHECK( fa.free_frames() == 2 * frame_block );
+	REQUIRE( fa.allocate(frame_block, &addr) );
+	CHECK( addr == base );
+	REQUIRE( fa.allocate(frame_block, &addr) );
+	CHECK( addr == base + 2 * frame_block * frame_size );
+	CHECK_FALSE( fa.allocate(1, &addr) );
+	CHECK( fa.allocate_some(10, &addr) == 0 );
+
+	// Too big for any run of free blocks
+	fa.free(base, frame_block);
+	CHECK_FALSE( fa.allocate(frame_block + 1, &addr) );
+	CHECK_FALSE( fa.allocate(0, &addr) );
+
+	// allocate_some takes what it can
+	REQUIRE( fa.allocate(1, &addr) );
+	CHECK( fa.allocate_some(frame_block, &addr) == frame_block / 2 );
+	CHECK( addr == base + (frame_block / 2) * frame_size );
+	CHECK( fa.allocate_some(3, &addr) == 3 );
+
+	CHECK( fa.contains(base) );
+	CHECK( fa.contains(base + 4 * frame_block * frame_size - 1) );
+	CHECK_FALSE( fa.contains(base + 4 * frame_block * frame_size) );
+	CHECK_FALSE( fa.contains(base - 1) );
+}
+
+TEST_CASE( "Frame allocator runs of blocks", "[memory frames]" )
+{
+	const addr_t base = 0x40000000;
+	frame_test_allocator fta(base, 4 * frame_block);
+	frame_allocator &fa = fta.fa;
+
+	// Blocks 0, 1 and 3 are free, with a hole at 2
+	fa.free(base, 2 * frame_block);
+	fa.free(base + 3 * frame_block * frame_size, frame_block);
+
+	// Runs bigger than a block take blocks next to each other, and the
+	// tail is left free
+	addr_t addr = 0;
+	REQUIRE( fa.allocate(frame_block + 5, &addr) );
+	CHECK( addr == base );
+	CHECK( fa.free_frames() == 2 * frame_block - 5 );
+
+	// No two free blocks are next to each other now
+	CHECK_FALSE( fa.allocate(2 * frame_block, &addr) );
+	CHECK_FALSE( fa.allocate(4 * frame_block, &addr) );
+
+	fa.free(base, frame_block + 5);
+	REQUIRE( fa.allocate(2 * frame_block, &addr) );
+	CHECK( addr == base );
+	CHECK( fa.free_frames() == frame_block );
+}
+
+static unsigned frame_test_asserts = 0;
+
+static void
+frame_test_assert(const char *file, unsigned line, const char *message)
+{
+	++frame_test_asserts;
+}
+
+TEST_CASE( "Frame allocator double frees", "[memory frames]" )
+{
+	const addr_t base = 0x40000000;
+	frame_test_allocator fta(base, frame_block);
+	frame_allocator &fa = fta.fa;
+	fa.free(base, 16);
+
+	frame_test_asserts = 0;
+	assert_callback old = assert_set_callback(frame_test_assert);
+
+	// The same block again
+	fa.free(base, 16);
+	CHECK( frame_test_asserts > 0 );
+
+	// A frame inside a bigger free block
+	frame_test_asserts = 0;
+	fa.free(base + 5 * frame_size, 1);
+	CHECK( frame_test_asserts > 0 );
+
+	assert_set_callback(old);
+}
+
+TEST_CASE( "Frame allocator random runs", "[memory frames]" )
+{
+	const size_t frames = 20 * frame_block + 37;
+	frame_test_allocator fta(0, frames);
+	frame_allocator &fa = fta.fa;
+
+	// Free memory with holes in it, like a real memory map
+	std::vector<bool> usable(frame_allocator::round_frames(frames), false);
+	std::vector<std::pair<size_t, size_t>> regions = {
+		{1, 158}, {256, 3000}, {3500, 8000}, {12345, 20 * frame_block + 37 - 12345}};
+	size_t total = 0;
+	for (auto &r : regions) {
+		fa.free(r.first * frame_size, r.second);
+		for (size_t i = 0; i < r.second; ++i) usable[r.first + i] = true;
+		total += r.second;
+	}
+	CHECK( fa.free_frames() == total );
+
+	std::default_random_engine rng(
+			std::chrono::system_clock::now().time_since_epoch().count());
+	std::uniform_int_distribution<size_t> size_dist(1, 40);
+
+	std::vector<bool> used(usable.size(), false);
+	std::vector<std::pair<addr_t, size_t>> allocs;
+
+	size_t mismatches = 0;
+	for (int round = 0; round < 4; ++round) {
+		// Allocate until it fails, checking no frame is handed out twice
+		while (true) {
+			size_t count = size_dist(rng);
+			addr_t addr = 0;
+			if (!fa.allocate(count, &addr)) break;
+
+			size_t first = addr / frame_size;
+			for (size_t i = first; i < first + count; ++i) {
+				if (!usable[i] || used[i]) ++mismatches;
+				used[i] = true;
+			}
+			allocs.emplace_back(addr, count);
+		}
+		CHECK( mismatches == 0 );
+
+		// Free a random half
+		std::shuffle(allocs.begin(), allocs.end(), rng);
+		size_t keep = allocs.size() / 2;
+		for (size_t i = keep; i < allocs.size(); ++i) {
+			fa.free(allocs[i].first, allocs[i].second);
+			size_t first = allocs[i].first / frame_size;
+			for (size_t j = first; j < first + allocs[i].second; ++j) used[j] = false;
+		}
+		allocs.resize(keep);
+	}
+
+	for (auto &a : allocs)
+		fa.free(a.first, a.second);
+	CHECK( fa.free_frames() == total );
+
+	// Everything merged back: the first whole largest block, which is in
+	// the second region, is available in one piece
+	addr_t addr = 0;
+	REQUIRE( fa.allocate(frame_block, &addr) );
+	CHECK( addr == frame_block * frame_size );
+}
+
+TEST_CASE( "Frame allocator benchmark", "[memory frames][!benchmark]" )
+{
+	const size_t frames = 256 * frame_block;
+	frame_test_allocator fta(0, frames);
+	fta.fa.free(0, frames);
+
+	const size_t batch = 1000;
+	std::vector<addr_t> addrs(batch);
+
+	BENCHMARK( "allocate/free 1000 single frames" ) {
+		for (size_t i = 0; i < batch; ++i) fta.fa.allocate(1, &addrs[i]);
+		for (size_t i = 0; i < batch; ++i) fta.fa.free(addrs[i], 1);
+	}
+
+	BENCHMARK( "allocate/free 1000 runs of 7 frames" ) {
+		for (size_t i = 0; i < batch; ++i) fta.fa.allocate(7, &addrs[i]);
+		for (size_t i = 0; i < batch; ++i) fta.fa.free(addrs[i], 7);
+	}
+}
@@ -0,0 +1,200 @@
+#include <random>
+#include <unordered_map>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kutil/hash_map.h"
+#include "kutil/vector.h"
+#include "catch.hpp"
+
+using namespace kutil;
+
+/// A value that owns memory, to check values are moved and destroyed
+struct owned
+{
+	static int live;
+
+	owned(int v = 0) : value(new int(v)) { ++live; }
+	owned(const owned &o) : value(new int(*o.value)) { ++live; }
+	owned(owned &&o) : value(o.value) { o.value = nullptr; ++live; }
+	~owned() { delete value; --live; }
+
+	owned & operator=(const owned &o) { *value = *o.value; return *this; }
+	owned & operator=(owned &&o) { std::swap(value, o.value); return *this; }
+
+	int *value;
+};
+
+int owned::live = 0;
+
+
+TEST_CASE( "Hash map basics", "[hash_map]" )
+{
+	{
+		hash_map<uint16_t, owned> map;
+		CHECK( map.count() == 0 );
+		CHECK( map.find(1) == nullptr );
+		CHECK( !map.remove(1) );
+
+		for (uint16_t i = 0; i < 1000; ++i)
+			REQUIRE( map.insert(i * 7, owned(i)) );
+		CHECK( map.count() == 1000 );
+		CHECK( map.capacity() >= 1000 );
+		CHECK( owned::live == 1000 );
+
+		size_t wrong = 0;
+		for (uint16_t i = 0; i < 1000; ++i) {
+			owned *o = map.find(i * 7);
+			if (!o || *o->value != i) ++wrong;
+			if (map.find(i * 7 + 1)) ++wrong;
+		}
+		CHECK( wrong == 0 );
+
+		// Replacing keeps one entry per key
+		CHECK( *map.insert(7, owned(-1))->value == -1 );
+		CHECK( map.count() == 1000 );
+
+		for (uint16_t i = 0; i < 1000; i += 2)
+			if (!map.remove(i * 7)) ++wrong;
+		CHECK( wrong == 0 );
+		CHECK( map.count() == 500 );
+		CHECK( owned::live == 500 );
+		CHECK( map.find(0) == nullptr );
+		CHECK( *map.find(7)->value == -1 );
+
+		size_t seen = 0;
+		for (auto &e : map) {
+			if (e.key % 14 != 7) ++wrong;
+			++seen;
+		}
+		CHECK( wrong == 0 );
+		CHECK( seen == 500 );
+
+		map.clear();
+		CHECK( map.count() == 0 );
+		CHECK( owned::live == 0 );
+		CHECK( map.insert(3, owned(3)) );
+	}
+
+	CHECK( owned::live == 0 );
+}
+
+TEST_CASE( "Fixed hash map", "[hash_map]" )
+{
+	fixed_hash_map<uint64_t, int, 100> map;
+	CHECK( map.capacity() >= 100 );
+
+	size_t added = 0;
+	while (map.insert(added << 32, added))
+		++added;
+
+	// It fills to capacity and then refuses, without allocating
+	CHECK( added == map.capacity() );
+	CHECK( map.count() == added );
+	CHECK( map.insert(0, 5) );
+	CHECK( *map.find(0) == 5 );
+
+	CHECK( map.remove(1ull << 32) );
+	CHECK( map.insert(1ull << 33 | 1, 7) );
+	CHECK( *map.find(1ull << 33 | 1) == 7 );
+	CHECK( map.find(1ull << 32) == nullptr );
+}
+
+TEST_CASE( "Hash sets", "[hash_map]" )
+{
+	hash_set<const void *> set;
+	fixed_hash_set<uint32_t, 16> fixed;
+	int objects[64];
+
+	for (auto &o : objects) CHECK( set.insert(&o) );
+	CHECK( set.insert(&objects[0]) );
+	CHECK( set.count() == 64 );
+	CHECK( set.contains(&objects[10]) );
+	CHECK( set.remove(&objects[10]) );
+	CHECK( !set.contains(&objects[10]) );
+	CHECK( !set.remove(&objects[10]) );
+
+	for (uint32_t i = 0; i < 16; ++i) CHECK( fixed.insert(i) );
+	CHECK( fixed.contains(15) );
+	CHECK( !fixed.contains(16) );
+}
+
+TEST_CASE( "Hash map against std::unordered_map", "[hash_map]" )
+{
+	std::mt19937_64 rng(4242);
+	std::unordered_map<uint32_t, uint64_t> model;
+	hash_map<uint32_t, uint64_t> map;
+	fixed_hash_map<uint32_t, uint64_t, 512> fixed;
+
+	size_t mismatches = 0;
+	for (unsigned round = 0; round < 200000; ++round) {
+		uint32_t key = rng() % 600;
+		uint64_t value = rng();
+
+		if (rng() % 3) {
+			bool room = model.count(key) || fixed.count() < fixed.capacity();
+			model[key] = value;
+			map.insert(key, value);
+			if ((fixed.insert(key, value) != nullptr) != room) ++mismatches;
+			if (!room) model.erase(key), map.remove(key);
+		} else {
+			bool had = model.erase(key);
+			if (map.remove(key) != had) ++mismatches;
+			if (fixed.remove(key) != had) ++mismatches;
+		}
+
+		uint32_t probe = rng() % 600;
+		auto it = model.find(probe);
+		uint64_t *found = map.find(probe);
+		uint64_t *found_fixed = fixed.find(probe);
+		if (it == model.end()) {
+			if (found || found_fixed) ++mismatches;
+		} else {
+			if (!found || *found != it->second) ++mismatches;
+			if (!found_fixed || *found_fixed != it->second) ++mismatches;
+		}
+	}
+
+	CHECK( mismatches == 0 );
+	CHECK( map.count() == model.size() );
+	CHECK( fixed.count() == model.size() );
+}
+
+TEST_CASE( "Hash map benchmark", "[hash_map][!benchmark]" )
+{
+	struct pair { uint16_t key; void *value; };
+
+	for (size_t n : {8, 32, 128, 1024}) {
+		kutil::vector<pair> list;
+		hash_map<uint16_t, void *> map;
+		std::vector<uint16_t> keys;
+
+		std::mt19937 rng(n);
+		for (size_t i = 0; i < n; ++i) {
+			uint16_t key = rng();
+			keys.push_back(key);
+			list.append({key, &keys});
+			map.insert(key, &keys);
+		}
+
+		const size_t lookups = 1 << 20;
+		const std::string size = std::to_string(n);
+		size_t found = 0;
+
+		BENCHMARK( "linear search " + size ) {
+			for (size_t i = 0; i < lookups; ++i) {
+				uint16_t key = keys[i % n];
+				for (auto &p : list)
+					if (p.key == key) { found += p.value != nullptr; break; }
+			}
+		}
+
+		BENCHMARK( "hash_map " + size ) {
+			for (size_t i = 0; i < lookups; ++i)
+				found += map.find(keys[i % n]) != nullptr;
+		}
+
+		CHECK( found == 2 * lookups );
+	}
+}
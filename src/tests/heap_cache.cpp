@@ -0,0 +1,239 @@
+#include <random>
+#include <thread>
+#include <vector>
+#include <signal.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "kutil/heap_cache.h"
+#include "kutil/memory.h"
+#include "kutil/memory_manager.h"
+#include "kutil/spinlock.h"
+#include "catch.hpp"
+#include "test_heap.h"
+
+using namespace kutil;
+
+static const size_t cache_heap_size = 1024 * test_max_block;
+
+
+TEST_CASE( "Heap cache", "[memory cache]" )
+{
+	test_heap heap(cache_heap_size);
+	memory_manager &mm = heap.mm;
+	heap_cache cache(&mm);
+
+	// The first allocation refills a batch, the rest come from the cache
+	void *p = cache.allocate(100);
+	CHECK( cache.cached() == heap_cache::batch_size - 1 );
+	CHECK( mm.usable_size(p) == 128 - memory_manager::block_overhead );
+
+	std::vector<void *> allocs;
+	for (size_t i = 1; i < heap_cache::batch_size; ++i)
+		allocs.push_back(cache.allocate(100));
+	CHECK( cache.cached() == 0 );
+
+	// Frees go to the cache, until a full magazine drains half
+	cache.free(p);
+	for (void *a : allocs) cache.free(a);
+	CHECK( cache.cached() == heap_cache::batch_size );
+
+	allocs.clear();
+	for (size_t i = 0; i < heap_cache::magazine_size * 2; ++i)
+		allocs.push_back(cache.allocate(20));
+	for (void *a : allocs) cache.free(a);
+	CHECK( cache.cached() <= heap_cache::batch_size + heap_cache::magazine_size );
+
+	// Large and aligned allocations pass through
+	void *big = cache.allocate(4000);
+	void *aligned = mm.allocate_aligned(100, 256);
+	size_t before = cache.cached();
+	cache.free(big);
+	cache.free(aligned);
+	CHECK( cache.cached() == before );
+
+	// Draining gives everything back to be coalesced
+	cache.drain();
+	CHECK( cache.cached() == 0 );
+	CHECK( mm.free_blocks() * test_max_block == test_heap_grown() );
+
+}
+
+TEST_CASE( "Heap cache threads", "[memory cache]" )
+{
+	test_heap heap(cache_heap_size);
+	memory_manager &mm = heap.mm;
+
+	const unsigned thread_count = 8;
+	const size_t rounds = 20000;
+
+	std::vector<heap_cache *> caches;
+	for (unsigned i = 0; i < thread_count; ++i)
+		caches.push_back(new heap_cache(&mm));
+
+	// Each thread frees half its blocks into the next thread's cache, to
+	// move blocks between caches like frees from another CPU would.
+	std::vector<std::vector<uint8_t *>> handoff(thread_count);
+	std::vector<spinlock> handoff_locks(thread_count);
+	std::vector<size_t> errors(thread_count, 0);
+
+	auto worker = [&](unsigned id) {
+		heap_cache &cache = *caches[id];
+		const uint8_t fill = id;
+		std::default_random_engine rng(id);
+		std::uniform_int_distribution<size_t> size_dist(1, 3000);
+
+		std::vector<std::pair<uint8_t *, size_t>> live;
+		for (size_t i = 0; i < rounds; ++i) {
+			if (live.size() < 64 && (rng() & 1)) {
+				size_t size = size_dist(rng);
+				uint8_t *p = reinterpret_cast<uint8_t *>(cache.allocate(size));
+				memset(p, fill, size);
+				live.emplace_back(p, size);
+				continue;
+			}
+
+			if (live.empty()) continue;
+			auto item = live.back();
+			live.pop_back();
+
+			for (size_t j = 0; j < item.second; ++j)
+				if (item.first[j] != fill) { ++errors[id]; break; }
+
+			if (i & 1) {
+				cache.free(item.first);
+			} else {
+				unsigned next = (id + 1) % thread_count;
+				spinlock_guard guard(handoff_locks[next]);
+				handoff[next].push_back(item.first);
+			}
+
+			spinlock_guard guard(handoff_locks[id]);
+			for (uint8_t *p : handoff[id]) cache.free(p);
+			handoff[id].clear();
+		}
+
+		for (auto &item : live) cache.free(item.first);
+	};
+
+	std::vector<std::thread> threads;
+	for (unsigned i = 0; i < thread_count; ++i)
+		threads.emplace_back(worker, i);
+	for (auto &t : threads)
+		t.join();
+
+	for (unsigned i = 0; i < thread_count; ++i) {
+		CHECK( errors[i] == 0 );
+		for (uint8_t *p : handoff[i]) caches[i]->free(p);
+		caches[i]->drain();
+		delete caches[i];
+	}
+
+	// With every block back, the heap should be whole blocks again
+	CHECK( test_heap_grown() <= cache_heap_size );
+	CHECK( mm.free_blocks() * test_max_block == test_heap_grown() );
+
+}
+
+// Interrupts are simulated with SIGALRM, which the irq callbacks block
+static sigset_t cache_irq_signals;
+static heap_cache *cache_irq_cache = nullptr;
+static size_t cache_irq_count = 0;
+static size_t cache_irq_errors = 0;
+
+static bool
+cache_irq_save()
+{
+	sigset_t old;
+	pthread_sigmask(SIG_BLOCK, &cache_irq_signals, &old);
+	return !sigismember(&old, SIGALRM);
+}
+
+static void
+cache_irq_restore(bool enabled)
+{
+	if (enabled)
+		pthread_sigmask(SIG_UNBLOCK, &cache_irq_signals, nullptr);
+}
+
+static void
+cache_irq_handler(int)
+{
+	// Allocate from the same cache as the code that was interrupted
+	uint8_t *blocks[8];
+	for (unsigned i = 0; i < 8; ++i) {
+		blocks[i] = reinterpret_cast<uint8_t *>(cache_irq_cache->allocate(24 + i * 40));
+		::memset(blocks[i], 0xee, 24 + i * 40);
+	}
+	for (unsigned i = 0; i < 8; ++i) {
+		for (size_t j = 0; j < 24 + i * 40; ++j)
+			if (blocks[i][j] != 0xee) { ++cache_irq_errors; break; }
+		cache_irq_cache->free(blocks[i]);
+	}
+	++cache_irq_count;
+}
+
+TEST_CASE( "Heap cache allocation from interrupts", "[memory cache]" )
+{
+	test_heap heap(cache_heap_size);
+	memory_manager &mm = heap.mm;
+	heap_cache cache(&mm);
+
+	cache_irq_cache = &cache;
+	cache_irq_count = 0;
+	cache_irq_errors = 0;
+	sigemptyset(&cache_irq_signals);
+	sigaddset(&cache_irq_signals, SIGALRM);
+	irq_set_callbacks(cache_irq_save, cache_irq_restore);
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = cache_irq_handler;
+	sigaction(SIGALRM, &action, nullptr);
+
+	itimerval timer = {{0, 50}, {0, 50}};
+	setitimer(ITIMER_REAL, &timer, nullptr);
+
+	std::default_random_engine rng(1);
+	std::uniform_int_distribution<size_t> size_dist(1, 1000);
+
+	std::vector<std::pair<uint8_t *, size_t>> live;
+	size_t errors = 0;
+	for (size_t i = 0; cache_irq_count < 2000 && i < 50000000; ++i) {
+		if (live.size() < 64 && (rng() & 1)) {
+			size_t size = size_dist(rng);
+			uint8_t *p = reinterpret_cast<uint8_t *>(cache.allocate(size));
+			::memset(p, i & 0x7f, size);
+			live.emplace_back(p, size);
+			continue;
+		}
+
+		if (live.empty()) continue;
+		size_t index = rng() % live.size();
+		auto item = live[index];
+		live[index] = live.back();
+		live.pop_back();
+
+		for (size_t j = 0; j < item.second; ++j)
+			if (item.first[j] != item.first[0] || item.first[0] == 0xee) { ++errors; break; }
+		cache.free(item.first);
+	}
+
+	itimerval stop = {{0, 0}, {0, 0}};
+	setitimer(ITIMER_REAL, &stop, nullptr);
+	signal(SIGALRM, SIG_DFL);
+	irq_set_callbacks(nullptr, nullptr);
+
+	CHECK( cache_irq_count >= 2000 );
+	CHECK( errors == 0 );
+	CHECK( cache_irq_errors == 0 );
+
+	// No block was lost or handed out twice
+	for (auto &item : live) cache.free(item.first);
+	cache.drain();
+	CHECK( mm.free_blocks() * test_max_block == test_heap_grown() );
+
+}
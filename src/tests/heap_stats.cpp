@@ -0,0 +1,117 @@
+#include <map>
+#include <random>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "kutil/heap_stats.h"
+#include "kutil/memory.h"
+#include "kutil/memory_manager.h"
+#include "catch.hpp"
+#include "test_heap.h"
+
+using namespace kutil;
+
+
+TEST_CASE( "Heap statistics", "[memory stats]" )
+{
+	test_heap heap(16 * test_max_block, test_shrink_callback);
+	memory_manager &mm = heap.mm;
+	const heap_stats &stats = mm.stats();
+
+	CHECK( stats.grows == 1 );
+	CHECK( stats.grown_bytes == test_max_block );
+	CHECK( stats.bytes_in_use == 0 );
+
+	void *a = mm.allocate(100);
+	void *b = mm.allocate(100);
+	void *c = mm.allocate(1000);
+	CHECK( stats.allocs[7] == 2 );
+	CHECK( stats.allocs[10] == 1 );
+	CHECK( stats.bytes_in_use == 2 * 128 + 1024 );
+
+	mm.free(a);
+	mm.free(c);
+	CHECK( stats.frees[7] == 1 );
+	CHECK( stats.frees[10] == 1 );
+	CHECK( stats.bytes_in_use == 128 );
+	CHECK( stats.peak_bytes == 2 * 128 + 1024 );
+
+	// Resizing leaves only the new size counted
+	b = mm.reallocate(b, 200);
+	CHECK( stats.bytes_in_use == 256 );
+
+	// The first large allocation also allocates the large allocation table
+	void *big = mm.allocate(3 * test_max_block);
+	CHECK( stats.large_allocs == 1 );
+	CHECK( stats.allocs[8] == 2 );
+	CHECK( stats.bytes_in_use == 2 * 256 + 3 * test_max_block );
+	CHECK( stats.grows == 2 );
+
+	mm.free(big);
+	CHECK( stats.large_frees == 1 );
+	CHECK( stats.bytes_in_use == 2 * 256 );
+
+	mm.trim();
+	CHECK( stats.shrinks == 3 );
+	CHECK( stats.shrunk_bytes == 3 * test_max_block );
+
+	// Impossible sizes fail instead of wrapping around
+	CHECK( mm.allocate(~size_t(0)) == nullptr );
+	CHECK( mm.allocate(~size_t(0) - 8) == nullptr );
+	CHECK( stats.failures == 2 );
+
+	mm.free(b);
+}
+
+TEST_CASE( "Heap tracker", "[memory stats]" )
+{
+	heap_tracker *tracker = new heap_tracker;
+	std::map<uintptr_t, size_t> live;
+
+	const void *site = reinterpret_cast<void *>(0x1234);
+
+	std::default_random_engine rng(1);
+	std::uniform_int_distribution<uintptr_t> addr_dist(1, 4096);
+
+	// Addresses are 16-byte aligned and packed closely together, to make
+	// plenty of collisions
+	for (int i = 0; i < 20000; ++i) {
+		uintptr_t addr = addr_dist(rng) * 16;
+		auto it = live.find(addr);
+		if (it != live.end()) {
+			tracker->remove(reinterpret_cast<void *>(addr));
+			live.erase(it);
+		} else if (live.size() < heap_tracker::capacity / 2) {
+			tracker->add(reinterpret_cast<void *>(addr), addr / 16, site);
+			live[addr] = addr / 16;
+		}
+	}
+
+	CHECK( tracker->count() == live.size() );
+	CHECK( tracker->dropped() == 0 );
+
+	size_t seen = 0;
+	bool all_match = true;
+	tracker->for_each([&](const heap_tracker::entry &e) {
+		auto it = live.find(reinterpret_cast<uintptr_t>(e.pointer));
+		if (it == live.end() || it->second != e.length || e.callers[0] != site)
+			all_match = false;
+		++seen;
+	});
+	CHECK( all_match );
+	CHECK( seen == live.size() );
+
+	// Freeing something never tracked is ignored
+	tracker->remove(reinterpret_cast<void *>(0x10));
+	tracker->remove(nullptr);
+	CHECK( tracker->count() == live.size() );
+
+	// A full table drops new allocations instead of growing
+	for (uintptr_t addr = 0x100000; tracker->count() < heap_tracker::capacity - 1; addr += 16)
+		tracker->add(reinterpret_cast<void *>(addr), 1, site);
+	tracker->add(reinterpret_cast<void *>(0x900000), 1, site);
+	CHECK( tracker->dropped() == 1 );
+
+	delete tracker;
+}
@@ -0,0 +1,126 @@
+#include <thread>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kutil/lockfree_stack.h"
+#include "catch.hpp"
+
+using namespace kutil;
+
+struct entry :
+	public stack_node
+{
+	uint64_t value;
+	uint64_t owner;
+};
+
+
+TEST_CASE( "Lock-free stack basics", "[lockfree_stack]" )
+{
+	lockfree_stack<entry> stack;
+	entry items[10];
+
+	CHECK( stack.empty() );
+	CHECK( stack.pop() == nullptr );
+
+	for (unsigned i = 0; i < 10; ++i)
+		stack.push(&items[i]);
+	CHECK( !stack.empty() );
+
+	for (unsigned i = 10; i > 5; --i)
+		CHECK( stack.pop() == &items[i - 1] );
+
+	entry *rest = stack.pop_all();
+	CHECK( stack.empty() );
+	unsigned length = 0;
+	for (stack_node *n = rest; n; n = n->stack_next) {
+		CHECK( n == &items[4 - length] );
+		++length;
+	}
+	CHECK( length == 5 );
+
+	stack.push(&items[3]);
+	CHECK( stack.pop() == &items[3] );
+	CHECK( stack.pop() == nullptr );
+}
+
+TEST_CASE( "Lock-free stack between threads", "[lockfree_stack]" )
+{
+	const unsigned thread_count = 8;
+	const unsigned per_thread = 64;
+	const unsigned rounds = 20000;
+
+	// Threads pop items and push them straight back, so the same items
+	// keep coming back to the top, which is what the tag guards against.
+	lockfree_stack<entry> stack;
+	std::vector<entry> items(thread_count * per_thread);
+	for (auto &e : items) {
+		e.owner = 0;
+		stack.push(&e);
+	}
+
+	std::vector<size_t> errors(thread_count, 0);
+	auto worker = [&](unsigned id) {
+		std::vector<entry *> held;
+		for (unsigned r = 0; r < rounds; ++r) {
+			for (unsigned i = 0; i < 4; ++i) {
+				entry *e = stack.pop();
+				if (!e) break;
+				// Nobody else may hold this item
+				if (__atomic_exchange_n(&e->owner, id + 1, __ATOMIC_RELAXED) != 0)
+					++errors[id];
+				held.push_back(e);
+			}
+			for (entry *e : held) {
+				__atomic_store_n(&e->owner, 0, __ATOMIC_RELAXED);
+				stack.push(e);
+			}
+			held.clear();
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (unsigned i = 0; i < thread_count; ++i)
+		threads.emplace_back(worker, i);
+	for (auto &t : threads)
+		t.join();
+
+	for (unsigned i = 0; i < thread_count; ++i)
+		CHECK( errors[i] == 0 );
+
+	// Every item is back on the stack exactly once
+	std::vector<unsigned> seen(items.size(), 0);
+	while (entry *e = stack.pop())
+		++seen[e - items.data()];
+
+	size_t wrong = 0;
+	for (unsigned s : seen)
+		if (s != 1) ++wrong;
+	CHECK( wrong == 0 );
+}
+
+TEST_CASE( "Lock-free stack benchmark", "[lockfree_stack][!benchmark]" )
+{
+	const unsigned thread_count = 4;
+	const unsigned rounds = 1 << 20;
+
+	lockfree_stack<entry> stack;
+	std::vector<entry> items(thread_count);
+	for (auto &e : items)
+		stack.push(&e);
+
+	BENCHMARK( "lockfree_stack 4 threads, 4M pop/push" ) {
+		std::vector<std::thread> threads;
+		for (unsigned i = 0; i < thread_count; ++i) {
+			threads.emplace_back([&]() {
+				for (unsigned r = 0; r < rounds; ++r) {
+					entry *e = stack.pop();
+					if (e) stack.push(e);
+				}
+			});
+		}
+		for (auto &t : threads)
+			t.join();
+	}
+}
@@ -1,2 +1,11 @@
 #define CATCH_CONFIG_MAIN
 #include "catch.hpp"
+
+#include <stdlib.h>
+
+// kutil malloc/free/realloc implementation for the host
+namespace kutil {
+	void * malloc(size_t n) { return ::malloc(n); }
+	void free(void *p) { ::free(p); }
+	void * realloc(void *p, size_t n) { return ::realloc(p, n); }
+}
@@ -0,0 +1,203 @@
+#include <random>
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "kutil/memory.h"
+#include "catch.hpp"
+
+using namespace kutil;
+
+static const size_t buffer_size = 4096;
+
+/// Run a test under each combination of CPU features
+template <typename Fn>
+static void
+each_feature_set(Fn test)
+{
+	for (int features = 0; features < 3; ++features) {
+		INFO( "features " << features );
+		memory_set_features(features > 0, features > 1);
+		test();
+	}
+	memory_set_features(false, false);
+}
+
+static std::vector<size_t>
+test_sizes()
+{
+	std::vector<size_t> sizes;
+	for (size_t n = 0; n <= 80; ++n) sizes.push_back(n);
+	for (size_t n : {127, 128, 129, 255, 1023, 1024, 1025, 2000, 3000})
+		sizes.push_back(n);
+	return sizes;
+}
+
+
+TEST_CASE( "Memory set and copy", "[memory]" )
+{
+	std::vector<uint8_t> src(buffer_size + 64);
+	std::vector<uint8_t> dest(buffer_size + 64);
+	std::vector<uint8_t> expect(buffer_size + 64);
+
+	std::default_random_engine rng(1);
+	for (auto &b : src) b = rng();
+
+	each_feature_set([&]() {
+		size_t wrong = 0;
+		for (size_t n : test_sizes()) {
+			for (size_t offset : {0, 1, 7, 8, 15}) {
+				::memset(dest.data(), 0x5a, dest.size());
+				::memcpy(expect.data(), dest.data(), dest.size());
+
+				::memset(expect.data() + offset, 0xc3, n);
+				kutil::memset(dest.data() + offset, 0xc3, n);
+				if (::memcmp(dest.data(), expect.data(), dest.size())) ++wrong;
+
+				::memcpy(expect.data() + offset, src.data() + 3, n);
+				kutil::memcpy(dest.data() + offset, src.data() + 3, n);
+				if (::memcmp(dest.data(), expect.data(), dest.size())) ++wrong;
+			}
+		}
+		CHECK( wrong == 0 );
+	});
+}
+
+TEST_CASE( "Memory move", "[memory]" )
+{
+	std::vector<uint8_t> buffer(buffer_size + 64);
+	std::vector<uint8_t> expect(buffer_size + 64);
+
+	std::default_random_engine rng(2);
+
+	each_feature_set([&]() {
+		size_t wrong = 0;
+		for (size_t n : test_sizes()) {
+			for (size_t from : {0, 1, 16, 33}) {
+				for (size_t to : {0, 1, 5, 16, 40}) {
+					for (auto &b : buffer) b = rng();
+					::memcpy(expect.data(), buffer.data(), buffer.size());
+
+					::memmove(expect.data() + to, expect.data() + from, n);
+					kutil::memmove(buffer.data() + to, buffer.data() + from, n);
+					if (::memcmp(buffer.data(), expect.data(), buffer.size())) ++wrong;
+				}
+			}
+		}
+		CHECK( wrong == 0 );
+	});
+}
+
+TEST_CASE( "Memory compare", "[memory]" )
+{
+	std::vector<uint8_t> a(256);
+	std::vector<uint8_t> b(256);
+	for (size_t i = 0; i < a.size(); ++i) a[i] = b[i] = i / 2 + 1;
+
+	CHECK( kutil::memcmp(a.data(), b.data(), 0) == 0 );
+	CHECK( kutil::memcmp(a.data(), b.data(), a.size()) == 0 );
+
+	// The first differing byte decides, whatever comes after it
+	for (size_t i : {0, 3, 7, 8, 9, 100, 255}) {
+		b[i] = a[i] + 1;
+		if (i + 1 < b.size()) b[i + 1] = a[i + 1] - 1;
+
+		CHECK( kutil::memcmp(a.data(), b.data(), a.size()) < 0 );
+		CHECK( kutil::memcmp(b.data(), a.data(), a.size()) > 0 );
+		CHECK( kutil::memcmp(a.data(), b.data(), i) == 0 );
+
+		b[i] = a[i];
+		if (i + 1 < b.size()) b[i + 1] = a[i + 1];
+	}
+
+	// Bytes compare as unsigned
+	a[0] = 0x80;
+	b[0] = 0x01;
+	CHECK( kutil::memcmp(a.data(), b.data(), 1) > 0 );
+}
+
+TEST_CASE( "Streaming fill and copy", "[memory]" )
+{
+	std::vector<uint8_t> src(buffer_size + 64);
+	std::vector<uint8_t> dest(buffer_size + 64);
+	std::vector<uint8_t> expect(buffer_size + 64);
+
+	std::default_random_engine rng(3);
+	for (auto &b : src) b = rng();
+
+	const uint64_t pattern = 0x0807060504030201ull;
+
+	size_t wrong = 0;
+	for (size_t n : test_sizes()) {
+		for (size_t offset : {0, 1, 4, 7, 8, 13}) {
+			::memset(dest.data(), 0x5a, dest.size());
+			::memcpy(expect.data(), dest.data(), dest.size());
+
+			// The pattern starts at the first byte, wherever that is
+			for (size_t i = 0; i < n; ++i)
+				expect[offset + i] = (i % 8) + 1;
+			stream_fill(dest.data() + offset, pattern, n);
+			if (::memcmp(dest.data(), expect.data(), dest.size())) ++wrong;
+
+			::memset(expect.data() + offset, 0, n);
+			stream_zero(dest.data() + offset, n);
+			if (::memcmp(dest.data(), expect.data(), dest.size())) ++wrong;
+
+			::memcpy(expect.data() + offset, src.data() + 5, n);
+			stream_copy(dest.data() + offset, src.data() + 5, n);
+			if (::memcmp(dest.data(), expect.data(), dest.size())) ++wrong;
+		}
+	}
+	CHECK( wrong == 0 );
+}
+
+TEST_CASE( "Memory benchmark", "[memory][!benchmark]" )
+{
+	std::vector<uint8_t> src(1 << 16);
+	std::vector<uint8_t> dest(1 << 16);
+
+	// What memcpy and memset used to do
+	auto byte_copy = [](uint8_t *d, const uint8_t *s, size_t n) {
+		for (size_t i = 0; i < n; ++i) d[i] = s[i];
+	};
+	auto byte_fill = [](uint8_t *d, uint8_t v, size_t n) {
+		for (size_t i = 0; i < n; ++i) d[i] = v;
+	};
+
+	memory_set_features(true, false);
+
+	for (size_t n : {16, 256, 4096, 65536}) {
+		const size_t reps = (1 << 20) / n;
+		const std::string size = std::to_string(n);
+
+		BENCHMARK( "byte loop copy " + size ) {
+			for (size_t i = 0; i < reps; ++i) byte_copy(dest.data(), src.data(), n);
+		}
+
+		BENCHMARK( "kutil::memcpy " + size ) {
+			for (size_t i = 0; i < reps; ++i) kutil::memcpy(dest.data(), src.data(), n);
+		}
+
+		BENCHMARK( "byte loop fill " + size ) {
+			for (size_t i = 0; i < reps; ++i) byte_fill(dest.data(), i, n);
+		}
+
+		BENCHMARK( "kutil::memset " + size ) {
+			for (size_t i = 0; i < reps; ++i) kutil::memset(dest.data(), i, n);
+		}
+	}
+
+	// Streaming only pays off for regions bigger than the cache, and for
+	// whatever else was in the cache
+	std::vector<uint8_t> big(64 << 20);
+	BENCHMARK( "kutil::memset 64MiB" ) {
+		kutil::memset(big.data(), 1, big.size());
+	}
+	BENCHMARK( "kutil::stream_fill 64MiB" ) {
+		kutil::stream_fill(big.data(), 2, big.size());
+	}
+
+	memory_set_features(false, false);
+}
@@ -4,6 +4,8 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <thread>
 
 #include "kutil/memory.h"
 #include "kutil/memory_manager.h"
@@ -112,3 +114,417 @@ TEST_CASE( "Buddy blocks tests", "[memory buddy]" )
 	// And we should have gotten back the start of memory
 	CHECK( big == offset_pointer(memory, hs) );
 }
+
+TEST_CASE( "Size classes", "[memory buddy]" )
+{
+	CHECK( memory_manager::size_for(1) == memory_manager::min_size );
+	CHECK( memory_manager::size_for(64) == 6 );
+	CHECK( memory_manager::size_for(65) == 7 );
+	CHECK( memory_manager::size_for(128) == 7 );
+	CHECK( memory_manager::size_for(max_block - 1) == memory_manager::max_size );
+	CHECK( memory_manager::size_for(max_block) == memory_manager::max_size );
+
+	size_t wrong = 0;
+	for (size_t total = 1; total <= max_block; ++total) {
+		unsigned size = memory_manager::min_size;
+		while (total > (1ull << size)) size++;
+		if (memory_manager::size_for(total) != size) ++wrong;
+	}
+	CHECK( wrong == 0 );
+}
+
+TEST_CASE( "Large allocations", "[memory buddy]" )
+{
+	const size_t heap_blocks = 16;
+	void *heap = aligned_alloc(max_block, heap_blocks * max_block);
+	total_alloc_size = 0;
+	total_alloc_calls = 0;
+
+	memory_manager mm(heap, grow_callback);
+	CHECK( total_alloc_size == max_block );
+
+	// Anything that doesn't fit in a max-size block goes to the large path,
+	// which maps just the pages needed at the end of the heap
+	const size_t big_size = 3 * max_block + 100;
+	void *big = mm.allocate(big_size);
+	CHECK( memory_manager::is_large(big) );
+	CHECK( total_alloc_size == max_block + 3 * max_block + memory_manager::page_size );
+	memset(big, 0xaa, big_size);
+
+	// Small allocations still come from the first block, and later growth
+	// goes after the reserved large run
+	void *small = mm.allocate(100);
+	CHECK_FALSE( memory_manager::is_large(small) );
+	CHECK( small < big );
+
+	void *block = mm.allocate(64000);
+	CHECK( block == offset_pointer(heap, 5 * max_block + hs) );
+
+	void *big2 = mm.allocate(2 * max_block);
+	CHECK( big2 == offset_pointer(heap, 6 * max_block) );
+
+	// Freeing a large allocation maps the rest of its last block and gives
+	// the blocks back to the buddy allocator
+	mm.free(big);
+	const size_t grown = total_alloc_size;
+	CHECK( grown == 8 * max_block );
+
+	std::vector<void *> blocks;
+	for (int i = 0; i < 4; ++i) {
+		void *p = mm.allocate(64000);
+		CHECK( p >= offset_pointer(heap, max_block) );
+		CHECK( p < offset_pointer(heap, 5 * max_block) );
+		blocks.push_back(p);
+	}
+	CHECK( total_alloc_size == grown );
+
+	for (void *p : blocks) mm.free(p);
+	mm.free(big2);
+	mm.free(block);
+	mm.free(small);
+	mm.free(nullptr);
+
+	::free(heap);
+}
+
+size_t total_free_size = 0;
+
+void shrink_callback(void *start, size_t length)
+{
+	total_free_size += length;
+}
+
+TEST_CASE( "Heap trim", "[memory buddy]" )
+{
+	const size_t heap_blocks = 16;
+	void *heap = aligned_alloc(max_block, heap_blocks * max_block);
+	total_alloc_size = 0;
+	total_free_size = 0;
+
+	memory_manager mm(heap, grow_callback, shrink_callback);
+
+	std::vector<void *> blocks;
+	for (int i = 0; i < 6; ++i) {
+		void *p = mm.allocate(64000);
+		CHECK( p == offset_pointer(heap, i * max_block + hs) );
+		blocks.push_back(p);
+	}
+	CHECK( total_alloc_size == 6 * max_block );
+	CHECK( mm.free_blocks() == 0 );
+
+	// Nothing is given back without a trim or threshold
+	mm.free(blocks[1]);
+	mm.free(blocks[2]);
+	mm.free(blocks[5]);
+	CHECK( mm.free_blocks() == 3 );
+	CHECK( total_free_size == 0 );
+
+	CHECK( mm.trim(1) == 2 * max_block );
+	CHECK( mm.free_blocks() == 1 );
+	CHECK( mm.trim() == max_block );
+	CHECK( mm.free_blocks() == 0 );
+	CHECK( total_free_size == 3 * max_block );
+
+	// Given back holes are mapped again before the heap is extended
+	void *p1 = mm.allocate(64000);
+	void *p2 = mm.allocate(64000);
+	CHECK( p1 != p2 );
+	CHECK( (p1 == blocks[1] || p1 == blocks[2]) );
+	CHECK( (p2 == blocks[1] || p2 == blocks[2]) );
+	blocks[1] = p1;
+	blocks[2] = p2;
+
+	// The top block came off the end of the heap, so it's next
+	blocks[5] = mm.allocate(64000);
+	CHECK( blocks[5] == offset_pointer(heap, 5 * max_block + hs) );
+	CHECK( total_alloc_size == 9 * max_block );
+
+	// With a threshold, freeing only asks for a trim, which is then done
+	// down to half the threshold
+	mm.set_trim_threshold(4);
+	for (int i = 6; i < 12; ++i)
+		blocks.push_back(mm.allocate(64000));
+	const size_t freed_before = total_free_size;
+	for (void *p : blocks)
+		mm.free(p);
+
+	CHECK( mm.free_blocks() == 12 );
+	CHECK( total_free_size == freed_before );
+	CHECK( mm.trim_wanted() );
+
+	CHECK( mm.trim_if_wanted() == 10 * max_block );
+	CHECK( !mm.trim_wanted() );
+	CHECK( mm.trim_if_wanted() == 0 );
+	CHECK( mm.free_blocks() == 2 );
+	CHECK( total_alloc_size - total_free_size == 2 * max_block );
+
+	// Large allocations freed at the end of the heap are given back too.
+	// The first one also allocates the large allocation table.
+	mm.set_trim_threshold(0);
+	mm.free(mm.allocate(3 * max_block));
+	mm.trim();
+	const size_t mapped = total_alloc_size - total_free_size;
+	CHECK( mapped == max_block );
+
+	void *big = mm.allocate(3 * max_block);
+	mm.free(big);
+	CHECK( mm.trim() == 3 * max_block );
+	CHECK( total_alloc_size - total_free_size == mapped );
+	CHECK( mm.free_blocks() == 0 );
+
+	// Everything still works after giving it all back
+	void *p = mm.allocate(100);
+	CHECK( p != nullptr );
+	memset(p, 0xcc, 100);
+	mm.free(p);
+
+	::free(heap);
+}
+
+memory_manager *reentrant_mm = nullptr;
+size_t reentrant_calls = 0;
+
+void reentrant_shrink_callback(void *start, size_t length)
+{
+	// Would deadlock if the manager still held its locks
+	total_free_size += length;
+	reentrant_mm->free(reentrant_mm->allocate(100));
+	++reentrant_calls;
+}
+
+TEST_CASE( "Heap trim without locks held", "[memory buddy]" )
+{
+	const size_t heap_blocks = 16;
+	void *heap = aligned_alloc(max_block, heap_blocks * max_block);
+	total_alloc_size = 0;
+	total_free_size = 0;
+	reentrant_calls = 0;
+
+	memory_manager mm(heap, grow_callback, reentrant_shrink_callback);
+	reentrant_mm = &mm;
+
+	std::vector<void *> blocks;
+	for (int i = 0; i < 8; ++i)
+		blocks.push_back(mm.allocate(64000));
+	for (void *p : blocks)
+		mm.free(p);
+
+	// Keep one block for the callback's allocations to come from
+	CHECK( mm.trim(1) == 7 * max_block );
+	CHECK( reentrant_calls == 7 );
+	CHECK( mm.free_blocks() == 1 );
+	CHECK( total_alloc_size - total_free_size == max_block );
+
+	// The blocks all came off the end, so the heap grows from there again
+	void *p = mm.allocate(64000);
+	void *q = mm.allocate(64000);
+	CHECK( p == offset_pointer(heap, hs) );
+	CHECK( q == offset_pointer(heap, max_block + hs) );
+
+	reentrant_mm = nullptr;
+	::free(heap);
+}
+
+TEST_CASE( "Aligned allocations and resizing", "[memory buddy]" )
+{
+	const size_t heap_blocks = 16;
+	void *heap = aligned_alloc(max_block, heap_blocks * max_block);
+	total_alloc_size = 0;
+
+	memory_manager mm(heap, grow_callback);
+
+	// Growing into free buddies happens in place
+	void *p = mm.allocate(100);
+	CHECK( p == offset_pointer(heap, hs) );
+	CHECK( mm.usable_size(p) == 128 - hs );
+	memset(p, 0x11, 100);
+
+	void *q = mm.reallocate(p, 1000);
+	CHECK( q == p );
+	CHECK( mm.usable_size(q) == 1024 - hs );
+	CHECK( reinterpret_cast<uint8_t *>(q)[99] == 0x11 );
+
+	// Shrinking splits off the unused blocks
+	q = mm.reallocate(q, 200);
+	CHECK( q == p );
+	CHECK( mm.usable_size(q) == 256 - hs );
+
+	void *after = mm.allocate(200);
+	CHECK( after == offset_pointer(p, 256) );
+
+	// Growing past a used buddy moves the allocation
+	q = mm.reallocate(p, 300);
+	CHECK( q != p );
+	CHECK( mm.usable_size(q) >= 300 );
+	CHECK( reinterpret_cast<uint8_t *>(q)[99] == 0x11 );
+	mm.free(after);
+
+	// Large allocations grow in place at the end of the heap
+	void *big = mm.allocate(2 * max_block);
+	memset(big, 0x22, 2 * max_block);
+	void *bigger = mm.reallocate(big, 5 * max_block);
+	CHECK( bigger == big );
+	CHECK( mm.usable_size(bigger) == 5 * max_block );
+	CHECK( reinterpret_cast<uint8_t *>(bigger)[2 * max_block - 1] == 0x22 );
+
+	// Shrinking a large allocation stays in place, but growing a block
+	// onto the large path copies it
+	void *small = mm.reallocate(bigger, 100);
+	CHECK( small == bigger );
+	mm.free(small);
+
+	q = mm.reallocate(q, 3 * max_block);
+	CHECK( memory_manager::is_large(q) );
+	CHECK( reinterpret_cast<uint8_t *>(q)[99] == 0x11 );
+	CHECK( mm.reallocate(q, 0) == nullptr );
+
+	// Aligned allocations are aligned, and can be written to the end of
+	// their usable size
+	std::vector<void *> allocs;
+	for (size_t align = 1; align <= max_block; align *= 2) {
+		void *a = mm.allocate_aligned(100, align);
+		CHECK( (reinterpret_cast<uintptr_t>(a) & (align - 1)) == 0 );
+		CHECK( mm.usable_size(a) >= 100 );
+		memset(a, 0xaa, mm.usable_size(a));
+		allocs.push_back(a);
+	}
+	for (void *a : allocs) mm.free(a);
+
+	::free(heap);
+}
+
+TEST_CASE( "Batch allocations", "[memory buddy]" )
+{
+	const size_t heap_blocks = 16;
+	void *heap = aligned_alloc(max_block, heap_blocks * max_block);
+	total_alloc_size = 0;
+
+	memory_manager mm(heap, grow_callback);
+
+	// With nothing on the list, the batch is cut from the front of one
+	// block, and the rest of it goes back as the biggest blocks it can
+	void *blocks[32];
+	REQUIRE( mm.allocate_batch(100, blocks, 16) == 16 );
+	for (int i = 0; i < 16; ++i) {
+		CHECK( blocks[i] == offset_pointer(heap, i * 128 + hs) );
+		CHECK( mm.usable_size(blocks[i]) == 128 - hs );
+		memset(blocks[i], 0x33, 128 - hs);
+	}
+
+	void *after = mm.allocate(2000);
+	CHECK( after == offset_pointer(heap, 2048 + hs) );
+
+	// Freed blocks merge back, both with each other and with the blocks
+	// the batch was cut from
+	std::swap(blocks[3], blocks[12]);
+	mm.free_batch(blocks, 16);
+	mm.free(after);
+	void *whole = mm.allocate(64000);
+	CHECK( whole == offset_pointer(heap, hs) );
+	mm.free(whole);
+
+	// Blocks already on the list are used first
+	void *singles[4];
+	for (auto &p : singles) p = mm.allocate(100);
+	for (auto &p : singles) mm.free(p);
+	REQUIRE( mm.allocate_batch(100, blocks, 32) == 32 );
+	for (int i = 0; i < 32; ++i)
+		memset(blocks[i], 0x44, 128 - hs);
+	mm.free_batch(blocks, 32);
+
+	// Batches bigger than one block take more than one
+	REQUIRE( mm.allocate_batch(60000, blocks, 3) == 3 );
+	CHECK( total_alloc_size == 3 * max_block );
+	mm.free_batch(blocks, 3);
+	CHECK( mm.free_blocks() == 3 );
+
+	::free(heap);
+}
+
+TEST_CASE( "Concurrent allocations", "[memory buddy]" )
+{
+	const size_t heap_blocks = 4096;
+	void *heap = aligned_alloc(max_block, heap_blocks * max_block);
+	total_alloc_size = 0;
+
+	memory_manager mm(heap, grow_callback);
+
+	const unsigned thread_count = 16;
+	const size_t rounds = 10000;
+	std::vector<size_t> errors(thread_count, 0);
+
+	struct live_alloc { uint8_t *p; size_t size; uint8_t fill; };
+
+	auto check = [](const live_alloc &a) {
+		for (size_t j = 0; j < a.size; ++j)
+			if (a.p[j] != a.fill) return false;
+		return true;
+	};
+
+	auto worker = [&](unsigned id) {
+		std::default_random_engine rng(id);
+		std::uniform_int_distribution<size_t> size_dist(1, 4000);
+		std::uniform_int_distribution<unsigned> op_dist(0, 99);
+
+		std::vector<live_alloc> live;
+		for (size_t i = 0; i < rounds; ++i) {
+			unsigned op = op_dist(rng);
+			uint8_t fill = id * 16 + (i & 0xf);
+
+			if (live.size() < 64 && op < 50) {
+				size_t size = size_dist(rng);
+				void *p = nullptr;
+				if (op == 0)
+					p = mm.allocate(max_block + size * 32);
+				else if (op < 10)
+					p = mm.allocate_aligned(size, 1 << (op + 3));
+				else
+					p = mm.allocate(size);
+
+				live_alloc a {reinterpret_cast<uint8_t *>(p), size, fill};
+				if (op == 0) a.size = max_block + size * 32;
+				memset(a.p, fill, a.size);
+				live.push_back(a);
+				continue;
+			}
+
+			if (live.empty()) continue;
+			size_t index = rng() % live.size();
+			live_alloc &a = live[index];
+			if (!check(a)) ++errors[id];
+
+			if (op < 60) {
+				size_t size = size_dist(rng);
+				a.p = reinterpret_cast<uint8_t *>(mm.reallocate(a.p, size));
+				a.size = size;
+				a.fill = fill;
+				memset(a.p, fill, size);
+			} else {
+				mm.free(a.p);
+				live[index] = live.back();
+				live.pop_back();
+			}
+		}
+
+		for (auto &a : live) {
+			if (!check(a)) ++errors[id];
+			mm.free(a.p);
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (unsigned i = 0; i < thread_count; ++i)
+		threads.emplace_back(worker, i);
+	for (auto &t : threads)
+		t.join();
+
+	for (unsigned i = 0; i < thread_count; ++i)
+		CHECK( errors[i] == 0 );
+
+	// With everything freed, only the block holding the large allocation
+	// table is still in use
+	CHECK( total_alloc_size <= heap_blocks * max_block );
+	CHECK( (mm.free_blocks() + 1) * max_block == total_alloc_size );
+
+	::free(heap);
+}
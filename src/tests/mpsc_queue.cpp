@@ -0,0 +1,111 @@
+#include <thread>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kutil/mpsc_queue.h"
+#include "catch.hpp"
+
+using namespace kutil;
+
+struct message :
+	public mpsc_node
+{
+	unsigned producer;
+	uint64_t sequence;
+};
+
+
+TEST_CASE( "MPSC queue basics", "[mpsc_queue]" )
+{
+	mpsc_queue<message> queue;
+	message items[10];
+
+	CHECK( queue.empty() );
+	CHECK( queue.pop() == nullptr );
+
+	for (unsigned i = 0; i < 10; ++i) {
+		items[i].sequence = i;
+		queue.push(&items[i]);
+	}
+	CHECK( !queue.empty() );
+
+	for (unsigned i = 0; i < 5; ++i)
+		CHECK( queue.pop() == &items[i] );
+
+	// Drain to empty, then use the queue again
+	queue.push(&items[0]);
+	for (unsigned i = 5; i < 10; ++i)
+		CHECK( queue.pop() == &items[i] );
+	CHECK( queue.pop() == &items[0] );
+	CHECK( queue.pop() == nullptr );
+	CHECK( queue.empty() );
+
+	queue.push(&items[1]);
+	CHECK( queue.pop() == &items[1] );
+	CHECK( queue.pop() == nullptr );
+}
+
+static void
+run_producers(mpsc_queue<message> &queue, unsigned producers, uint64_t per_producer,
+		std::vector<message> &items, std::vector<uint64_t> &next)
+{
+	std::vector<std::thread> threads;
+	for (unsigned p = 0; p < producers; ++p) {
+		threads.emplace_back([&, p]() {
+			for (uint64_t i = 0; i < per_producer; ++i) {
+				message &m = items[p * per_producer + i];
+				m.producer = p;
+				m.sequence = i;
+				queue.push(&m);
+			}
+		});
+	}
+
+	// Every item arrives once, in order for each producer
+	uint64_t received = 0;
+	size_t out_of_order = 0;
+	while (received < producers * per_producer) {
+		message *m = queue.pop();
+		if (!m) {
+			std::this_thread::yield();
+			continue;
+		}
+		if (m->sequence != next[m->producer]++) ++out_of_order;
+		++received;
+	}
+
+	for (auto &t : threads)
+		t.join();
+
+	CHECK( out_of_order == 0 );
+	CHECK( queue.pop() == nullptr );
+}
+
+TEST_CASE( "MPSC queue between threads", "[mpsc_queue]" )
+{
+	const unsigned producers = 8;
+	const uint64_t per_producer = 100000;
+
+	mpsc_queue<message> queue;
+	std::vector<message> items(producers * per_producer);
+	std::vector<uint64_t> next(producers, 0);
+
+	run_producers(queue, producers, per_producer, items, next);
+	for (unsigned p = 0; p < producers; ++p)
+		CHECK( next[p] == per_producer );
+}
+
+TEST_CASE( "MPSC queue benchmark", "[mpsc_queue][!benchmark]" )
+{
+	const unsigned producers = 4;
+	const uint64_t per_producer = 1 << 20;
+
+	mpsc_queue<message> queue;
+	std::vector<message> items(producers * per_producer);
+
+	BENCHMARK( "mpsc_queue 4 producers, 4M items" ) {
+		std::vector<uint64_t> next(producers, 0);
+		run_producers(queue, producers, per_producer, items, next);
+	}
+}
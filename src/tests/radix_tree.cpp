@@ -0,0 +1,120 @@
+#include <map>
+#include <random>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kutil/radix_tree.h"
+#include "catch.hpp"
+
+using namespace kutil;
+
+
+TEST_CASE( "Radix tree basics", "[radix_tree]" )
+{
+	int items[4];
+	radix_tree<int> tree;
+
+	CHECK( tree.empty() );
+	CHECK( tree.find(0) == nullptr );
+	CHECK( tree.remove(0) == nullptr );
+
+	CHECK( tree.set(5, &items[0]) == nullptr );
+	CHECK( tree.find(5) == &items[0] );
+	CHECK( tree.find(4) == nullptr );
+	CHECK( tree.find(1 << 20) == nullptr );
+
+	// Growing taller keeps lower indices
+	CHECK( tree.set(0x123456789, &items[1]) == nullptr );
+	CHECK( tree.set(~0ull, &items[2]) == nullptr );
+	CHECK( tree.find(5) == &items[0] );
+	CHECK( tree.find(0x123456789) == &items[1] );
+	CHECK( tree.find(~0ull) == &items[2] );
+	CHECK( tree.count() == 3 );
+
+	CHECK( tree.set(5, &items[3]) == &items[0] );
+	CHECK( tree.count() == 3 );
+
+	uint64_t index = 0;
+	CHECK( tree.next(index) == &items[3] );
+	CHECK( index == 5 );
+	index = 6;
+	CHECK( tree.next(index) == &items[1] );
+	CHECK( index == 0x123456789 );
+	index = 0x12345678a;
+	CHECK( tree.next(index) == &items[2] );
+	CHECK( index == ~0ull );
+
+	CHECK( tree.remove(~0ull) == &items[2] );
+	index = 0x12345678a;
+	CHECK( tree.next(index) == nullptr );
+
+	CHECK( tree.remove(5) == &items[3] );
+	CHECK( tree.remove(0x123456789) == &items[1] );
+	CHECK( tree.empty() );
+	CHECK( tree.find(5) == nullptr );
+
+	CHECK( tree.set(7, &items[0]) == nullptr );
+	CHECK( tree.find(7) == &items[0] );
+}
+
+TEST_CASE( "Radix tree against std::map", "[radix_tree]" )
+{
+	std::mt19937_64 rng(54321);
+	std::vector<int> items(1024);
+	std::map<uint64_t, int *> model;
+	radix_tree<int> tree;
+
+	size_t mismatches = 0;
+	for (unsigned round = 0; round < 100000; ++round) {
+		// Mostly dense page numbers, with some far away
+		uint64_t index = rng() % 8192;
+		if (round % 16 == 0) index = rng() >> (rng() % 64);
+
+		int *item = &items[rng() % items.size()];
+		switch (rng() % 3) {
+		case 0:
+		case 1: {
+			auto it = model.find(index);
+			int *expect = it == model.end() ? nullptr : it->second;
+			if (tree.set(index, item) != expect) ++mismatches;
+			model[index] = item;
+			break;
+		}
+
+		case 2: {
+			auto it = model.lower_bound(index);
+			if (it == model.end()) {
+				if (tree.remove(index) != nullptr) ++mismatches;
+				break;
+			}
+			if (tree.remove(it->first) != it->second) ++mismatches;
+			model.erase(it);
+			break;
+		}
+		}
+
+		uint64_t probe = rng() % 8192;
+		auto it = model.lower_bound(probe);
+		int *expect = it == model.end() ? nullptr : it->second;
+		if (tree.next(probe) != expect) ++mismatches;
+		if (expect && probe != it->first) ++mismatches;
+	}
+
+	CHECK( mismatches == 0 );
+	CHECK( tree.count() == model.size() );
+
+	size_t order = 0;
+	uint64_t index = 0;
+	auto it = model.begin();
+	while (int *item = tree.next(index)) {
+		if (it == model.end() || index != it->first || item != it->second) ++order;
+		++it;
+		if (++index == 0) break;
+	}
+	CHECK( order == 0 );
+	CHECK( it == model.end() );
+
+	tree.clear();
+	CHECK( tree.empty() );
+}
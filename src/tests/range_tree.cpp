@@ -0,0 +1,170 @@
+#include <algorithm>
+#include <map>
+#include <random>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kutil/range_tree.h"
+#include "catch.hpp"
+
+using namespace kutil;
+
+struct area :
+	public rb_node
+{
+	area(uint64_t s = 0, uint64_t l = 0) : start(s), length(l) {}
+
+	uint64_t start;
+	uint64_t length;
+
+	uint64_t range_start() const { return start; }
+	uint64_t range_end() const { return start + length; }
+};
+
+/// Check the red-black rules below a node, and count the nodes.
+/// \returns  The black height, or -1 if a rule is broken
+static int
+check_node(const rb_node *n, const rb_node *parent, size_t &count)
+{
+	if (!n) return 1;
+	++count;
+
+	if (n->rb_parent != parent) return -1;
+	if (n->rb_red && (!parent || parent->rb_red)) return -1;
+
+	int left = check_node(n->rb_left, n, count);
+	int right = check_node(n->rb_right, n, count);
+	if (left < 0 || left != right) return -1;
+	return left + (n->rb_red ? 0 : 1);
+}
+
+static bool
+check_tree(const range_tree<area> &tree)
+{
+	size_t count = 0;
+	if (check_node(tree.root(), nullptr, count) < 0) return false;
+	if (count != tree.count()) return false;
+
+	uint64_t last_end = 0;
+	for (area *a : tree) {
+		if (a->start < last_end) return false;
+		last_end = a->range_end();
+	}
+	return true;
+}
+
+
+TEST_CASE( "Range tree lookups", "[range_tree]" )
+{
+	range_tree<area> tree;
+	area areas[] = {
+		{0x3000, 0x1000},
+		{0x1000, 0x1000},
+		{0x8000, 0x4000},
+		{0x5000, 0x2000},
+	};
+
+	CHECK( tree.empty() );
+	CHECK( tree.first() == nullptr );
+	CHECK( tree.find(0x1000) == nullptr );
+
+	for (auto &a : areas)
+		CHECK( tree.insert(&a) );
+	CHECK( tree.count() == 4 );
+	CHECK( check_tree(tree) );
+
+	// Overlapping ranges are refused
+	area overlap {0x6fff, 0x1000};
+	area inside {0x9000, 0x10};
+	CHECK( !tree.insert(&overlap) );
+	CHECK( !tree.insert(&inside) );
+	CHECK( tree.count() == 4 );
+
+	CHECK( tree.find(0x0fff) == nullptr );
+	CHECK( tree.find(0x1000) == &areas[1] );
+	CHECK( tree.find(0x1fff) == &areas[1] );
+	CHECK( tree.find(0x2000) == nullptr );
+	CHECK( tree.find(0x6000) == &areas[3] );
+	CHECK( tree.find(0xbfff) == &areas[2] );
+	CHECK( tree.find(0xc000) == nullptr );
+
+	CHECK( tree.lower_bound(0) == &areas[1] );
+	CHECK( tree.lower_bound(0x2000) == &areas[0] );
+	CHECK( tree.lower_bound(0x3800) == &areas[0] );
+	CHECK( tree.lower_bound(0x7000) == &areas[2] );
+	CHECK( tree.lower_bound(0xc000) == nullptr );
+
+	CHECK( tree.find_overlap(0x2000, 0x3000) == nullptr );
+	CHECK( tree.find_overlap(0x2000, 0x3001) == &areas[0] );
+	CHECK( tree.find_overlap(0x4000, 0x9000) == &areas[3] );
+
+	CHECK( tree.first() == &areas[1] );
+	CHECK( tree.last() == &areas[2] );
+	CHECK( range_tree<area>::next(&areas[0]) == &areas[3] );
+	CHECK( range_tree<area>::prev(&areas[0]) == &areas[1] );
+
+	tree.remove(&areas[3]);
+	CHECK( tree.find(0x6000) == nullptr );
+	CHECK( tree.insert(&overlap) );
+	CHECK( tree.find(0x6000) == nullptr );
+	CHECK( tree.find(0x7000) == &overlap );
+	CHECK( check_tree(tree) );
+}
+
+TEST_CASE( "Range tree against std::map", "[range_tree]" )
+{
+	const size_t slots = 4096;
+	const uint64_t slot_size = 0x10000;
+
+	std::vector<area> areas(slots);
+	std::vector<bool> present(slots, false);
+	std::map<uint64_t, area *> model;
+	range_tree<area> tree;
+
+	std::mt19937_64 rng(12345);
+	for (size_t i = 0; i < slots; ++i) {
+		// Each area lives somewhere inside its own slot, so none overlap
+		areas[i].length = 1 + rng() % (slot_size / 2);
+		areas[i].start = i * slot_size + rng() % (slot_size - areas[i].length);
+	}
+
+	size_t mismatches = 0;
+	for (unsigned round = 0; round < 50000; ++round) {
+		size_t i = rng() % slots;
+		if (present[i]) {
+			tree.remove(&areas[i]);
+			model.erase(areas[i].start);
+		} else {
+			if (!tree.insert(&areas[i])) ++mismatches;
+			model[areas[i].start] = &areas[i];
+		}
+		present[i] = !present[i];
+
+		uint64_t addr = rng() % (slots * slot_size);
+		auto it = model.upper_bound(addr);
+		area *expect = nullptr;
+		if (it != model.begin()) {
+			auto prev = std::prev(it);
+			if (addr < prev->second->range_end()) expect = prev->second;
+		}
+		if (tree.find(addr) != expect) ++mismatches;
+
+		area *bound = expect ? expect : (it == model.end() ? nullptr : it->second);
+		if (tree.lower_bound(addr) != bound) ++mismatches;
+
+		if (round % 1000 == 0 && !check_tree(tree)) ++mismatches;
+	}
+
+	CHECK( mismatches == 0 );
+	CHECK( tree.count() == model.size() );
+	CHECK( check_tree(tree) );
+
+	size_t order = 0;
+	auto it = model.begin();
+	for (area *a : tree) {
+		if (a != it->second) ++order;
+		++it;
+	}
+	CHECK( order == 0 );
+}
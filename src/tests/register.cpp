@@ -0,0 +1,69 @@
+#include <stdint.h>
+
+#include "kutil/register.h"
+#include "catch.hpp"
+
+using namespace kutil;
+
+namespace {
+
+enum class test_mode : uint8_t { off, slow, fast, turbo };
+
+namespace ctl {
+	constexpr reg_flag<uint32_t, 0> enable {};
+	constexpr reg_field<uint32_t, 4, 2, test_mode> mode {};
+	constexpr reg_field<uint32_t, 8, 8, uint8_t> vector {};
+	constexpr reg_flag<uint32_t, 31> busy {};
+}
+
+struct test_regs
+{
+	mmio_reg<uint32_t> control;
+	mmio_reg<uint16_t> small;
+	mmio_reg<uint16_t> other;
+	mmio_reg<uint64_t> wide;
+};
+
+} // namespace
+
+static_assert(sizeof(test_regs) == 16, "Registers should have no padding");
+static_assert(ctl::mode.mask == 0x30, "Wrong field mask");
+static_assert(ctl::busy.mask == 0x80000000, "Wrong field mask");
+static_assert(reg_field<uint64_t, 0, 64>::mask == ~0ull, "Wrong full-width mask");
+static_assert(reg_field<uint8_t, 3, 5>::mask == 0xf8, "Wrong 8-bit mask");
+static_assert(reg_field<uint16_t, 8, 4, uint16_t>::encode(0x1f) == 0x0f00, "Encoded value not masked");
+
+TEST_CASE( "Register fields", "[register]" )
+{
+	test_regs regs;
+	regs.control.write(0);
+	regs.small.write(0xffff);
+	regs.other.write(0x1234);
+	regs.wide.write(0);
+
+	regs.control.write(ctl::enable(true) | ctl::vector(0x42));
+	CHECK( regs.control.read() == 0x4201 );
+
+	regs.control.modify(ctl::mode(test_mode::fast) | ctl::enable(false));
+	CHECK( regs.control.read() == 0x4220 );
+	CHECK( regs.control.get(ctl::mode) == test_mode::fast );
+	CHECK( regs.control.get(ctl::vector) == 0x42 );
+	CHECK_FALSE( regs.control.get(ctl::enable) );
+
+	regs.control.set(ctl::busy, true);
+	CHECK( regs.control.read() == 0x80004220 );
+	CHECK( regs.control.test(ctl::busy(true) | ctl::mode(test_mode::fast)) );
+	CHECK_FALSE( regs.control.test(ctl::busy(true) | ctl::enable(true)) );
+
+	// Neighbouring registers are untouched
+	CHECK( regs.small.read() == 0xffff );
+	CHECK( regs.other.read() == 0x1234 );
+
+	regs.wide.modify(reg_field<uint64_t, 56, 8>{}(0xab));
+	CHECK( regs.wide.read() == 0xab00000000000000ull );
+
+	uint32_t raw[4] = {0, 0x5a, 0, 0};
+	CHECK( mmio_at<uint32_t>(raw, 4).read() == 0x5a );
+	mmio_at<uint32_t>(raw, 8).write(7);
+	CHECK( raw[2] == 7 );
+}
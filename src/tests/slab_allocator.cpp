@@ -0,0 +1,203 @@
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "kutil/memory.h"
+#include "kutil/memory_manager.h"
+#include "kutil/slab_allocator.h"
+#include "catch.hpp"
+#include "test_heap.h"
+
+using namespace kutil;
+
+struct slab_test_object
+{
+	static int live;
+	slab_test_object(int v) : value(v) { ++live; }
+	~slab_test_object() { --live; }
+	int value;
+	char pad[20];
+};
+int slab_test_object::live = 0;
+
+
+TEST_CASE( "Slab cache tests", "[memory slab]" )
+{
+	test_heap heap;
+	const size_t hs = memory_manager::block_overhead;
+
+	slab_cache cache(&heap.mm, 40);
+	CHECK( cache.object_size() == 40 );
+	CHECK( cache.slab_order() == slab_cache::default_order );
+	CHECK( cache.slab_capacity() >= slab_cache::min_objects );
+	CHECK( cache.slab_count() == 0 );
+
+	const size_t count = cache.slab_capacity() * 3 + 1;
+	std::vector<void *> objects;
+	for (size_t i = 0; i < count; ++i) {
+		void *p = cache.allocate();
+		REQUIRE( p != nullptr );
+		CHECK( (reinterpret_cast<uintptr_t>(p) % sizeof(void *)) == 0 );
+		CHECK( slab_cache::owner(p, cache.slab_order()) == &cache );
+		memset(p, 0xaa, cache.object_size());
+		objects.push_back(p);
+	}
+
+	CHECK( cache.slab_count() == 4 );
+	CHECK( cache.objects_used() == count );
+
+	// Objects should be packed with no per-object header
+	CHECK( objects[1] == offset_pointer(objects[0], 40) );
+
+	std::sort(objects.begin(), objects.end());
+	for (size_t i = 1; i < count; ++i)
+		CHECK( objects[i] >= offset_pointer(objects[i-1], 40) );
+
+	std::default_random_engine rng(
+			std::chrono::system_clock::now().time_since_epoch().count());
+	std::shuffle(objects.begin(), objects.end(), rng);
+
+	for (void *p : objects)
+		cache.free(p);
+	objects.clear();
+
+	// One empty slab is kept around as a cache
+	CHECK( cache.objects_used() == 0 );
+	CHECK( cache.slab_count() == 1 );
+
+	// Reusing the cached slab should not allocate
+	void *p = cache.allocate();
+	CHECK( cache.slab_count() == 1 );
+	cache.free(p);
+
+	cache.reap();
+	CHECK( cache.slab_count() == 0 );
+
+	// Everything should have been returned to the buddy allocator
+	void *big = heap.mm.allocate(64000);
+	CHECK( big == offset_pointer(heap.memory, hs) );
+	CHECK( test_heap_grown() == test_max_block );
+	heap.mm.free(big);
+}
+
+TEST_CASE( "Slab object cache tests", "[memory slab]" )
+{
+	test_heap heap;
+	object_cache<slab_test_object> cache(&heap.mm);
+
+	std::vector<slab_test_object *> objects;
+	for (int i = 0; i < 100; ++i)
+		objects.push_back(cache.create(i));
+
+	CHECK( slab_test_object::live == 100 );
+	for (int i = 0; i < 100; ++i)
+		CHECK( objects[i]->value == i );
+
+	for (auto *o : objects)
+		cache.destroy(o);
+
+	CHECK( slab_test_object::live == 0 );
+	CHECK( cache.objects_used() == 0 );
+}
+
+TEST_CASE( "Slab allocator size classes", "[memory slab]" )
+{
+	test_heap heap;
+	slab_allocator slabs(&heap.mm);
+
+	CHECK( slabs.allocate(slab_allocator::max_object_size + 1) == nullptr );
+	CHECK( slabs.cache_for(1)->object_size() == 16 );
+	CHECK( slabs.cache_for(17)->object_size() == 32 );
+	CHECK( slabs.cache_for(512)->object_size() == 512 );
+
+	std::default_random_engine rng(
+			std::chrono::system_clock::now().time_since_epoch().count());
+	std::uniform_int_distribution<size_t> sizes(1, slab_allocator::max_object_size);
+
+	struct alloc { uint8_t *p; size_t n; };
+	std::vector<alloc> allocs;
+	for (int i = 0; i < 2000; ++i) {
+		size_t n = sizes(rng);
+		uint8_t *p = reinterpret_cast<uint8_t *>(slabs.allocate(n));
+		REQUIRE( p != nullptr );
+		memset(p, i & 0xff, n);
+		allocs.push_back({p, n});
+	}
+
+	// Check nothing overlapped
+	for (size_t i = 0; i < allocs.size(); ++i) {
+		for (size_t j = 0; j < allocs[i].n; ++j) {
+			if (allocs[i].p[j] != (i & 0xff)) {
+				FAIL( "Slab allocation " << i << " was overwritten" );
+			}
+		}
+	}
+
+	std::shuffle(allocs.begin(), allocs.end(), rng);
+	for (auto &a : allocs)
+		slabs.free(a.p);
+
+	slabs.reap();
+
+	// Every max-size block should have been returned and joined
+	const size_t grown = test_heap_grown();
+	for (size_t i = 0; i < grown / test_max_block; ++i)
+		heap.mm.allocate(64000);
+	CHECK( test_heap_grown() == grown );
+}
+
+TEST_CASE( "Slab allocator fragmentation", "[memory slab]" )
+{
+	// 150 bytes plus the buddy header rounds up to a 256 byte block,
+	// while the slab allocator packs them into its 160 byte size class.
+	const size_t object_size = 150;
+	const size_t count = 4000;
+
+	size_t buddy_grown = 0;
+	{
+		test_heap heap;
+		std::vector<void *> objects;
+		for (size_t i = 0; i < count; ++i)
+			objects.push_back(heap.mm.allocate(object_size));
+		buddy_grown = test_heap_grown();
+		for (void *p : objects) heap.mm.free(p);
+	}
+
+	size_t slab_grown = 0;
+	{
+		test_heap heap;
+		slab_allocator slabs(&heap.mm);
+		std::vector<void *> objects;
+		for (size_t i = 0; i < count; ++i)
+			objects.push_back(slabs.allocate(object_size));
+		slab_grown = test_heap_grown();
+		for (void *p : objects) slabs.free(p);
+	}
+
+	INFO( "Buddy heap: " << buddy_grown << " bytes, slab heap: " << slab_grown << " bytes" );
+	CHECK( slab_grown * 4 < buddy_grown * 3 );
+}
+
+TEST_CASE( "Slab allocator benchmark", "[memory slab][!benchmark]" )
+{
+	test_heap heap;
+	slab_allocator slabs(&heap.mm);
+
+	const size_t batch = 1000;
+	std::vector<void *> objects(batch);
+
+	BENCHMARK( "buddy allocate/free 1000 x 100 bytes" ) {
+		for (size_t i = 0; i < batch; ++i) objects[i] = heap.mm.allocate(100);
+		for (size_t i = 0; i < batch; ++i) heap.mm.free(objects[i]);
+	}
+
+	BENCHMARK( "slab allocate/free 1000 x 100 bytes" ) {
+		for (size_t i = 0; i < batch; ++i) objects[i] = slabs.allocate(100);
+		for (size_t i = 0; i < batch; ++i) slabs.free(objects[i]);
+	}
+}
@@ -0,0 +1,232 @@
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kutil/spinlock.h"
+#include "catch.hpp"
+
+using namespace kutil;
+
+static bool irq_enabled = true;
+static unsigned irq_saves = 0;
+
+static bool
+test_irq_save()
+{
+	bool was = irq_enabled;
+	irq_enabled = false;
+	++irq_saves;
+	return was;
+}
+
+static void
+test_irq_restore(bool enabled)
+{
+	irq_enabled = enabled;
+}
+
+/// Have threads bump a plain counter under a lock. Any lost update means
+/// two threads held the lock at once.
+/// \arg lock    The lock to test
+/// \arg rounds  Times each thread takes the lock
+template <typename L>
+static void
+check_exclusion(L &lock, unsigned rounds = 20000)
+{
+	const unsigned thread_count = 4;
+	uint64_t counter = 0;
+
+	std::vector<std::thread> threads;
+	for (unsigned i = 0; i < thread_count; ++i) {
+		threads.emplace_back([&]() {
+			for (unsigned r = 0; r < rounds; ++r) {
+				lock_guard<L> guard(lock);
+				counter = counter + 1;
+			}
+		});
+	}
+	for (auto &t : threads)
+		t.join();
+
+	CHECK( counter == thread_count * rounds );
+	CHECK( lock.stats().acquires >= thread_count * rounds );
+	CHECK( lock.stats().contended <= lock.stats().acquires );
+}
+
+
+TEST_CASE( "Spinlock", "[lock]" )
+{
+	spinlock lock;
+	CHECK( lock.try_acquire() );
+	CHECK( !lock.try_acquire() );
+	lock.release();
+	CHECK( lock.try_acquire() );
+	lock.release();
+
+	CHECK( lock.stats().acquires == 2 );
+	CHECK( lock.stats().contended == 0 );
+
+	check_exclusion(lock);
+}
+
+TEST_CASE( "Ticket lock", "[lock]" )
+{
+	ticket_lock lock;
+	CHECK( lock.try_acquire() );
+	CHECK( !lock.try_acquire() );
+	lock.release();
+	CHECK( lock.try_acquire() );
+	lock.release();
+	CHECK( lock.stats().acquires == 2 );
+
+	// The lock is handed out in order, so a waiter whose thread isn't
+	// running holds up everyone behind it. Kernel code holds locks with
+	// interrupts off, but host threads share too few CPUs.
+	const bool oversubscribed = std::thread::hardware_concurrency() < 4;
+	check_exclusion(lock, oversubscribed ? 100 : 20000);
+}
+
+TEST_CASE( "Reader-writer lock", "[lock]" )
+{
+	rwlock lock;
+
+	// Readers share the lock, and keep writers out
+	CHECK( lock.try_acquire_shared() );
+	CHECK( lock.try_acquire_shared() );
+	CHECK( !lock.try_acquire() );
+	lock.release_shared();
+	lock.release_shared();
+
+	// A writer keeps everyone out
+	CHECK( lock.try_acquire() );
+	CHECK( !lock.try_acquire() );
+	CHECK( !lock.try_acquire_shared() );
+	lock.release();
+
+	check_exclusion(lock);
+
+	// Readers see a pair of values that writers always change together
+	const unsigned reader_count = 6;
+	const unsigned writer_count = 2;
+	const unsigned rounds = 20000;
+	uint64_t a = 0, b = 0;
+	std::vector<size_t> torn(reader_count, 0);
+
+	std::vector<std::thread> threads;
+	for (unsigned i = 0; i < writer_count; ++i) {
+		threads.emplace_back([&]() {
+			for (unsigned r = 0; r < rounds; ++r) {
+				lock_guard<rwlock> guard(lock);
+				a = a + 1;
+				b = b + 1;
+			}
+		});
+	}
+	for (unsigned i = 0; i < reader_count; ++i) {
+		threads.emplace_back([&, i]() {
+			for (unsigned r = 0; r < rounds; ++r) {
+				read_guard guard(lock);
+				if (a != b) ++torn[i];
+			}
+		});
+	}
+	for (auto &t : threads)
+		t.join();
+
+	for (unsigned i = 0; i < reader_count; ++i)
+		CHECK( torn[i] == 0 );
+	CHECK( a == writer_count * rounds );
+	CHECK( b == writer_count * rounds );
+}
+
+TEST_CASE( "Lock guards disable interrupts", "[lock]" )
+{
+	irq_set_callbacks(test_irq_save, test_irq_restore);
+	irq_saves = 0;
+
+	spinlock spin;
+	ticket_lock ticket;
+	rwlock rw;
+	{
+		spinlock_irq_guard g1(spin);
+		CHECK( !irq_enabled );
+		{
+			irq_lock_guard<ticket_lock> g2(ticket);
+			read_irq_guard g3(rw);
+			CHECK( !irq_enabled );
+		}
+		// Nested guards leave interrupts off until the outermost ends
+		CHECK( !irq_enabled );
+	}
+	CHECK( irq_enabled );
+	CHECK( irq_saves == 3 );
+
+	irq_set_callbacks(nullptr, nullptr);
+}
+
+TEST_CASE( "Lock stats", "[lock]" )
+{
+	spinlock lock;
+	lock.acquire();
+
+	// Make a second thread wait for the lock
+	bool started = false;
+	std::thread waiter([&]() {
+		__atomic_store_n(&started, true, __ATOMIC_RELAXED);
+		lock.acquire();
+		lock.release();
+	});
+	while (!__atomic_load_n(&started, __ATOMIC_RELAXED))
+		std::this_thread::yield();
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	lock.release();
+	waiter.join();
+
+	const lock_stats &stats = lock.stats();
+	CHECK( stats.acquires == 2 );
+	CHECK( stats.contended == 1 );
+	CHECK( stats.spins > 0 );
+	CHECK( stats.hold_cycles > 0 );
+	CHECK( stats.max_hold <= stats.hold_cycles );
+
+	lock_stats total;
+	total.merge(stats);
+	total.merge(stats);
+	CHECK( total.acquires == 4 );
+	CHECK( total.max_hold == stats.max_hold );
+}
+
+TEST_CASE( "Lock benchmark", "[lock][!benchmark]" )
+{
+	// More threads than CPUs only measures the scheduler
+	const unsigned thread_count = std::max(1u, std::min(4u, std::thread::hardware_concurrency()));
+	const unsigned rounds = 1 << 18;
+
+	spinlock spin;
+	ticket_lock ticket;
+	rwlock rw;
+
+	auto run = [&](auto &lock) {
+		uint64_t counter = 0;
+		std::vector<std::thread> threads;
+		for (unsigned i = 0; i < thread_count; ++i) {
+			threads.emplace_back([&]() {
+				for (unsigned r = 0; r < rounds; ++r) {
+					lock.acquire();
+					++counter;
+					lock.release();
+				}
+			});
+		}
+		for (auto &t : threads)
+			t.join();
+		return counter;
+	};
+
+	BENCHMARK( "spinlock" ) { run(spin); }
+	BENCHMARK( "ticket_lock" ) { run(ticket); }
+	BENCHMARK( "rwlock, writing" ) { run(rw); }
+}
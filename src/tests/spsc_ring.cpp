@@ -0,0 +1,79 @@
+#include <thread>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kutil/spsc_ring.h"
+#include "catch.hpp"
+
+using namespace kutil;
+
+
+TEST_CASE( "SPSC ring basics", "[spsc_ring]" )
+{
+	spsc_ring<int, 8> ring;
+	int value = 0;
+
+	CHECK( !ring.pop(value) );
+	CHECK( ring.count() == 0 );
+
+	for (int i = 0; i < 8; ++i)
+		CHECK( ring.push(i) );
+	CHECK( !ring.push(8) );
+	CHECK( ring.count() == 8 );
+
+	// Wrap around the end of the ring a few times
+	for (int i = 8; i < 40; ++i) {
+		REQUIRE( ring.pop(value) );
+		CHECK( value == i - 8 );
+		CHECK( ring.push(i) );
+	}
+
+	for (int i = 32; i < 40; ++i) {
+		REQUIRE( ring.pop(value) );
+		CHECK( value == i );
+	}
+	CHECK( !ring.pop(value) );
+}
+
+TEST_CASE( "SPSC ring between threads", "[spsc_ring]" )
+{
+	const uint64_t count = 1000000;
+	static spsc_ring<uint64_t, 256> ring;
+
+	std::thread producer([&]() {
+		for (uint64_t i = 0; i < count; ++i)
+			while (!ring.push(i)) std::this_thread::yield();
+	});
+
+	uint64_t value = 0;
+	size_t out_of_order = 0;
+	for (uint64_t i = 0; i < count; ++i) {
+		while (!ring.pop(value)) std::this_thread::yield();
+		if (value != i) ++out_of_order;
+	}
+
+	producer.join();
+	CHECK( out_of_order == 0 );
+	CHECK( !ring.pop(value) );
+}
+
+TEST_CASE( "SPSC ring benchmark", "[spsc_ring][!benchmark]" )
+{
+	const uint64_t count = 1 << 22;
+	static spsc_ring<uint64_t, 1024> ring;
+
+	BENCHMARK( "spsc_ring 4M items" ) {
+		std::thread producer([&]() {
+			for (uint64_t i = 0; i < count; ++i)
+				while (!ring.push(i)) std::this_thread::yield();
+		});
+
+		uint64_t value, sum = 0;
+		for (uint64_t i = 0; i < count; ++i) {
+			while (!ring.pop(value)) std::this_thread::yield();
+			sum += value;
+		}
+		producer.join();
+		CHECK( sum == count * (count - 1) / 2 );
+	}
+}
@@ -0,0 +1,64 @@
+#pragma once
+/// \file test_heap.h
+/// Host-allocated heaps for the allocator tests.
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "kutil/memory_manager.h"
+#include "catch.hpp"
+
+/// Test heaps are aligned to the biggest memory_manager block.
+const size_t test_max_block = 1ull << kutil::memory_manager::max_size;
+
+/// Default size of a test heap.
+const size_t test_heap_size = 256 * test_max_block;
+
+/// Bytes the current test heap has grown by, less what it has given back.
+inline size_t & test_heap_grown() { static size_t grown = 0; return grown; }
+
+/// Size of the current test heap, which it must not grow past.
+inline size_t & test_heap_limit() { static size_t limit = 0; return limit; }
+
+/// Grow callback for managers over a test heap. Managers call it with their
+/// heap lock held, so it needs no lock of its own.
+inline void
+test_grow_callback(void *start, size_t length)
+{
+	test_heap_grown() += length;
+	if (test_heap_grown() > test_heap_limit())
+		FAIL( "Test heap grew past its end" );
+}
+
+/// Shrink callback for managers over a test heap.
+inline void
+test_shrink_callback(void *start, size_t length)
+{
+	test_heap_grown() -= length;
+}
+
+/// Allocate memory for a new test heap, and make it the current one.
+/// \arg length  Size of the heap in bytes
+/// \returns     The heap's memory, to be freed with ::free()
+inline void *
+test_heap_alloc(size_t length)
+{
+	test_heap_grown() = 0;
+	test_heap_limit() = length;
+	return aligned_alloc(test_max_block, length);
+}
+
+/// A memory_manager over a fresh host-allocated heap
+struct test_heap
+{
+	test_heap(size_t length = test_heap_size,
+			kutil::memory_manager::shrink_callback shrink_cb = nullptr) :
+		memory(test_heap_alloc(length)),
+		mm(memory, test_grow_callback, shrink_cb)
+	{}
+
+	~test_heap() { ::free(memory); }
+
+	void *memory;
+	kutil::memory_manager mm;
+};
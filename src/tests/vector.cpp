@@ -0,0 +1,179 @@
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kutil/vector.h"
+#include "catch.hpp"
+
+using namespace kutil;
+
+/// An element that owns memory, and counts how it is handled
+struct tracked
+{
+	static int live;
+	static int copies;
+	static int moves;
+
+	tracked(int v = 0) : value(new int(v)) { ++live; }
+	tracked(const tracked &o) : value(new int(*o.value)) { ++live; ++copies; }
+	tracked(tracked &&o) : value(o.value) { o.value = nullptr; ++live; ++moves; }
+	~tracked() { delete value; --live; }
+
+	tracked & operator=(const tracked &o) { *value = *o.value; ++copies; return *this; }
+	tracked & operator=(tracked &&o) { std::swap(value, o.value); ++moves; return *this; }
+
+	int get() const { return value ? *value : -1; }
+
+	static void reset() { copies = moves = 0; }
+
+	int *value;
+};
+
+int tracked::live = 0;
+int tracked::copies = 0;
+int tracked::moves = 0;
+
+template <typename V>
+static std::vector<int>
+values(const V &v)
+{
+	std::vector<int> out;
+	for (auto &item : v) out.push_back(item.get());
+	return out;
+}
+
+struct plain { int value; int get() const { return value; } };
+
+
+TEST_CASE( "Vector growth moves elements", "[vector]" )
+{
+	{
+		vector<tracked> v;
+		for (int i = 0; i < 100; ++i)
+			v.emplace(i);
+
+		CHECK( v.count() == 100 );
+		CHECK( tracked::live == 100 );
+		CHECK( tracked::copies == 0 );
+		for (int i = 0; i < 100; ++i)
+			CHECK( v[i].get() == i );
+
+		// Appending an element of the array itself while it grows
+		tracked::reset();
+		v.shrink_to_fit();
+		CHECK( v.capacity() == 100 );
+		v.append(v[0]);
+		CHECK( v[100].get() == 0 );
+		CHECK( tracked::copies == 1 );
+
+		vector<tracked> copy(v);
+		CHECK( values(copy) == values(v) );
+		CHECK( tracked::live == 202 );
+
+		vector<tracked> moved(std::move(copy));
+		CHECK( copy.count() == 0 );
+		CHECK( moved.count() == 101 );
+		CHECK( tracked::live == 202 );
+
+		moved = v;
+		CHECK( values(moved) == values(v) );
+		v = std::move(moved);
+		CHECK( tracked::live == 101 );
+	}
+
+	CHECK( tracked::live == 0 );
+}
+
+TEST_CASE( "Vector insert and erase", "[vector]" )
+{
+	{
+		vector<tracked> v;
+		for (int i = 0; i < 5; ++i) v.emplace(i);
+
+		v.insert(0, tracked(10));
+		v.insert(3, tracked(11));
+		v.insert(v.count(), tracked(12));
+		CHECK( values(v) == std::vector<int>({10, 0, 1, 11, 2, 3, 4, 12}) );
+
+		v.erase(1);
+		v.erase(3, 3);
+		CHECK( values(v) == std::vector<int>({10, 1, 11, 12}) );
+		CHECK( tracked::live == 4 );
+
+		v.set_size(2);
+		CHECK( values(v) == std::vector<int>({10, 1}) );
+		CHECK( tracked::live == 2 );
+	}
+
+	CHECK( tracked::live == 0 );
+
+	vector<plain> p;
+	for (int i = 0; i < 5; ++i) p.append({i});
+	p.insert(2, {20});
+	p.erase(0, 2);
+	CHECK( values(p) == std::vector<int>({20, 2, 3, 4}) );
+}
+
+TEST_CASE( "Vector capacity", "[vector]" )
+{
+	vector<plain> v;
+	v.reserve(10);
+	CHECK( v.capacity() == 10 );
+	v.ensure_capacity(11);
+	CHECK( v.capacity() == 20 );
+
+	for (int i = 0; i < 5; ++i) v.append({i});
+	v.shrink_to_fit();
+	CHECK( v.capacity() == 5 );
+	CHECK( values(v) == std::vector<int>({0, 1, 2, 3, 4}) );
+
+	v.clear();
+	v.shrink_to_fit();
+	CHECK( v.capacity() == 0 );
+	CHECK( v.begin() == nullptr );
+}
+
+TEST_CASE( "Small vector", "[vector]" )
+{
+	{
+		small_vector<tracked, 4> v;
+		auto inline_storage = [&v]() {
+			const uint8_t *p = reinterpret_cast<const uint8_t *>(v.begin());
+			const uint8_t *start = reinterpret_cast<const uint8_t *>(&v);
+			return p >= start && p < start + sizeof(v);
+		};
+
+		CHECK( v.capacity() == 4 );
+		for (int i = 0; i < 4; ++i) v.emplace(i);
+		CHECK( inline_storage() );
+
+		// Shrinking never gives back the inline storage
+		v.shrink_to_fit();
+		CHECK( inline_storage() );
+
+		// Copies and moves of a small array stay inline
+		small_vector<tracked, 4> copy(v);
+		CHECK( values(copy) == values(v) );
+		small_vector<tracked, 4> moved(std::move(copy));
+		CHECK( values(moved) == values(v) );
+		CHECK( copy.count() == 0 );
+		CHECK( tracked::live == 8 );
+
+		// Growing past N moves to the heap
+		v.emplace(4);
+		CHECK( !inline_storage() );
+		CHECK( values(v) == std::vector<int>({0, 1, 2, 3, 4}) );
+
+		// Moving a heap array takes its storage
+		tracked::reset();
+		vector<tracked> plain_vector(std::move(v));
+		CHECK( tracked::moves == 0 );
+		CHECK( plain_vector.count() == 5 );
+
+		small_vector<tracked, 4> back(std::move(plain_vector));
+		CHECK( values(back) == std::vector<int>({0, 1, 2, 3, 4}) );
+		CHECK( tracked::live == 9 );
+	}
+
+	CHECK( tracked::live == 0 );
+}